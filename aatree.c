@@ -21,6 +21,11 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "aatree.h"
 
+/* Links are written with release stores: a reader traversing the tree without
+ * the lock (see aatree_rcu.h) sees every node it reaches fully initialized. On
+ * the common targets this is a plain store the compiler may not reorder. */
+#define publish(link, node) __atomic_store_n(&(link), (node), __ATOMIC_RELEASE)
+
 aatree_node_t *aatree_prev_node(aatree_node_t *node)
 {
   if (node->left)
@@ -216,19 +221,19 @@ aatree_search(const aatree_t *tree, const void *key, aatree_keys_order order)
  * Skew is a right rotation to replace a subtree containing a left horizontal
  * link with one containing a right horizontal link instead.
  **/
-static __inline__ __nonnull((1)) void skew(aatree_t *tree, aatree_node_t *node)
+static __inline__ __nonnull((1)) int skew(aatree_t *tree, aatree_node_t *node)
 {
   if (node && node->left && (node->left->level == node->level))
   {
     aatree_node_t *left = node->left;
-    node->left          = left->right;
+    publish(node->left, left->right);
 
     if (node->left)
     {
       node->left->parent = node;
     }
 
-    left->right  = node;
+    publish(left->right, node);
     left->parent = node->parent;
     node->parent = left;
 
@@ -236,20 +241,28 @@ static __inline__ __nonnull((1)) void skew(aatree_t *tree, aatree_node_t *node)
     {
       if (left->parent->left == node)
       {
-        left->parent->left = left;
+        publish(left->parent->left, left);
       }
       else
       {
-        left->parent->right = left;
+        publish(left->parent->right, left);
       }
     }
     else
     {
-      tree->root = left;
+      publish(tree->root, left);
+    }
+
+    if (tree->update)
+    {
+      tree->update(tree, node);
+      tree->update(tree, left);
     }
 
-    node = left;
+    return 1;
   }
+
+  return 0;
 } /* skew */
 
 /* 
@@ -263,18 +276,18 @@ static __inline__ __nonnull((1)) void skew(aatree_t *tree, aatree_node_t *node)
  * two or more consecutive right horizontal links with one containing two
  * fewer consecutive right horizontal links.
  **/
-static __inline__ __nonnull((1)) void split(aatree_t *tree, aatree_node_t *node)
+static __inline__ __nonnull((1)) int split(aatree_t *tree, aatree_node_t *node)
 {
   if (node && node->right && node->right->right
       && (node->level == node->right->right->level))
   {
     aatree_node_t *right = node->right;
-    node->right          = right->left;
+    publish(node->right, right->left);
 
     if (node->right)
       node->right->parent = node;
 
-    right->left   = node;
+    publish(right->left, node);
     right->parent = node->parent;
     node->parent  = right;
 
@@ -284,24 +297,32 @@ static __inline__ __nonnull((1)) void split(aatree_t *tree, aatree_node_t *node)
     {
       if (right->parent->left == node)
       {
-        right->parent->left = right;
+        publish(right->parent->left, right);
       }
       else
       {
-        right->parent->right = right;
+        publish(right->parent->right, right);
       }
     }
     else
     {
-      tree->root = right;
+      publish(tree->root, right);
     }
 
-    node = right;
+    if (tree->update)
+    {
+      tree->update(tree, node);
+      tree->update(tree, right);
+    }
+
+    return 1;
   }
+
+  return 0;
 } /* split */
 
 /* Adjust node level */
-static __inline__ __nonnull((1)) void decrease_level(aatree_node_t *node)
+static __inline__ __nonnull((1)) int decrease_level(aatree_node_t *node)
 {
   int should_be = aatree_node_level(node);
 
@@ -313,21 +334,108 @@ static __inline__ __nonnull((1)) void decrease_level(aatree_node_t *node)
     {
       node->right->level = should_be;
     }
+
+    return 1;
   }
+
+  return 0;
 } /* decrease_level */
 
+/* Restore the AA tree properties of a node after one of its subtrees has
+ * lost a level. Returns the new root of the subtree, changed is set to non-zero
+ * if anything had to be adjusted. */
+static __inline__ __nonnull((1, 2, 3)) aatree_node_t *
+rebalance(aatree_t *tree, aatree_node_t *node, int *changed)
+{
+  *changed = decrease_level(node);
+
+  if (skew(tree, node))
+  {
+    node     = node->parent;
+    *changed = 1;
+  }
+
+  *changed |= skew(tree, node->right);
+
+  if (node->right)
+  {
+    *changed |= skew(tree, node->right->right);
+  }
+
+  if (split(tree, node))
+  {
+    node     = node->parent;
+    *changed = 1;
+  }
+
+  *changed |= split(tree, node->right);
+
+  return node;
+} /* rebalance */
+
+/* Reset links of the removed node, readers still standing on it see the end
+ * of the path */
+static __inline__ __nonnull((1)) void detach_node(aatree_node_t *node)
+{
+  publish(node->left, NULL);
+  publish(node->right, NULL);
+
+  node->parent = NULL;
+  node->level  = 0;
+} /* detach_node */
+
+/* Perform skew and then split on the way up from a new leaf. The
+ * conditionals that determine whether or not a rotation will occur or not are
+ * inside of the procedures, as given above. A rotation changes the level or
+ * the right son of one place, which only its parent and grandparent look at,
+ * so the climb stops after three nodes in a row no rotation touches, which
+ * takes amortized constant time. Augmented data still has to be refreshed all
+ * the way up. */
+static __nonnull((1)) void insert_fixup(aatree_t      *tree,
+                                        aatree_node_t *parent_node)
+{
+  int intact = 0;
+
+  for (; parent_node; parent_node = parent_node->parent)
+  {
+    int changed = skew(tree, parent_node);
+
+    changed |= split(tree, parent_node);
+
+    if (tree->update)
+    {
+      tree->update(tree, parent_node);
+    }
+
+    if (changed)
+      intact = 0;
+    else if (++intact == 3)
+      break;
+  }
+
+  if (parent_node && parent_node->parent && tree->update)
+  {
+    aatree_refresh(tree, parent_node->parent);
+  }
+} /* insert_fixup */
+
 void *aatree_insert(aatree_t *tree, aatree_node_t *node)
 {
   aatree_node_t *parent_node = NULL;
 
   node->level = 1;
 
+  if (tree->update)
+  {
+    tree->update(tree, node);
+  }
+
   if (!tree->root)
   {
     /* Tree is empty, so insert at root. */
-    tree->root  = node;
-    tree->first = node;
-    tree->last  = node;
+    publish(tree->root, node);
+    publish(tree->first, node);
+    publish(tree->last, node);
     return NULL;
   }
 
@@ -343,11 +451,11 @@ void *aatree_insert(aatree_t *tree, aatree_node_t *node)
       if (!parent_node->right) /* Subtree is empty, so insert here. */
       {
         node->parent       = parent_node;
-        parent_node->right = node;
+        publish(parent_node->right, node);
 
         if (parent_node == tree->last)
         {
-          tree->last = node;
+          publish(tree->last, node);
         }
 
         break;
@@ -362,11 +470,11 @@ void *aatree_insert(aatree_t *tree, aatree_node_t *node)
       if (!parent_node->left) /* Subtree is empty, so insert here. */
       {
         node->parent      = parent_node;
-        parent_node->left = node;
+        publish(parent_node->left, node);
 
         if (parent_node == tree->first)
         {
-          tree->first = node;
+          publish(tree->first, node);
         }
 
         break;
@@ -382,17 +490,78 @@ void *aatree_insert(aatree_t *tree, aatree_node_t *node)
     }
   }
 
-  /* Perform skew and then split. The conditionals that determine whether or
-   * not a rotation will occur or not are inside of the procedures, as given
-   * above. */
-  for (; parent_node; parent_node = parent_node->parent)
+  insert_fixup(tree, parent_node);
+
+  return NULL;
+} /* aatree_insert */
+
+void *aatree_insert_hint(aatree_t      *tree,
+                         aatree_node_t *node,
+                         aatree_node_t *hint)
+{
+  aatree_node_t *next   = NULL;
+  int            result = 0;
+
+  /* The node goes right after the hint if its key is between the ones of
+   * the hint and its successor, anything else takes the usual way. */
+  if (!hint
+      || (result = tree->cmp(aatree_node_key(tree, node),
+                             aatree_node_key(tree, hint)))
+             < 0)
   {
-    skew(tree, parent_node);
-    split(tree, parent_node);
+    return aatree_insert(tree, node);
   }
 
+  if (!result)
+  {
+    return aatree_node_entry(tree, hint);
+  }
+
+  if ((next = aatree_next_node(hint)))
+  {
+    result = tree->cmp(aatree_node_key(tree, node),
+                       aatree_node_key(tree, next));
+
+    if (result > 0)
+    {
+      return aatree_insert(tree, node);
+    }
+
+    if (!result)
+    {
+      return aatree_node_entry(tree, next);
+    }
+  }
+
+  node->level = 1;
+
+  if (tree->update)
+  {
+    tree->update(tree, node);
+  }
+
+  /* Either the hint has no right son, or the successor is the leftmost node
+   * of its right subtree and has no left one. */
+  if (!hint->right)
+  {
+    node->parent = hint;
+    publish(hint->right, node);
+
+    if (hint == tree->last)
+    {
+      publish(tree->last, node);
+    }
+  }
+  else
+  {
+    node->parent = next;
+    publish(next->left, node);
+  }
+
+  insert_fixup(tree, node->parent);
+
   return NULL;
-} /* aatree_insert */
+} /* aatree_insert_hint */
 
 void aatree_delete(aatree_t *tree, aatree_node_t *node)
 {
@@ -406,9 +575,9 @@ void aatree_delete(aatree_t *tree, aatree_node_t *node)
       /* In this case last node is to be deleted and the tree becomes empty. */
       if (tree->root == node)
       {
-        tree->root  = NULL;
-        tree->first = NULL;
-        tree->last  = NULL;
+        publish(tree->root, NULL);
+        publish(tree->first, NULL);
+        publish(tree->last, NULL);
         node->level = 0;
       }
     }
@@ -416,21 +585,21 @@ void aatree_delete(aatree_t *tree, aatree_node_t *node)
     {
       if (tree->last == node)
       {
-        tree->last = node->parent;
+        publish(tree->last, node->parent);
       }
 
       parent_node        = node->parent;
-      parent_node->right = NULL;
+      publish(parent_node->right, NULL);
     }
     else
     {
       if (tree->first == node)
       {
-        tree->first = node->parent;
+        publish(tree->first, node->parent);
       }
 
       parent_node       = node->parent;
-      parent_node->left = NULL;
+      publish(parent_node->left, NULL);
     }
   }
   /* Case II. Node has only one son. */
@@ -440,22 +609,22 @@ void aatree_delete(aatree_t *tree, aatree_node_t *node)
     {
       /* If the node to be deleted has only one son and no parent -
        * the tree has only one node remaining. */
-      tree->root  = node->right;
-      tree->first = node->right;
-      tree->last  = node->right;
+      publish(tree->root, node->right);
+      publish(tree->first, node->right);
+      publish(tree->last, node->right);
     }
     else if (node->parent->right == node)
     {
-      node->parent->right = node->right;
+      publish(node->parent->right, node->right);
     }
     else
     {
       if (tree->first == node)
       {
-        tree->first = node->right;
+        publish(tree->first, node->right);
       }
 
-      node->parent->left = node->right;
+      publish(node->parent->left, node->right);
     }
 
     parent_node         = node->right;
@@ -469,21 +638,21 @@ void aatree_delete(aatree_t *tree, aatree_node_t *node)
     if (!successor->left)
     {
       parent_node        = successor;
-      parent_node->left  = node->left;
+      publish(parent_node->left, node->left);
       node->left->parent = parent_node;
 
       if (!node->parent)
       {
         /* Node must be a root! */
-        tree->root = parent_node;
+        publish(tree->root, parent_node);
       }
       else if (node->parent->right == node)
       {
-        node->parent->right = parent_node;
+        publish(node->parent->right, parent_node);
       }
       else
       {
-        node->parent->left = parent_node;
+        publish(node->parent->left, parent_node);
       }
 
       parent_node->parent = node->parent;
@@ -497,55 +666,597 @@ void aatree_delete(aatree_t *tree, aatree_node_t *node)
       }
 
       parent_node       = successor->parent;
-      parent_node->left = successor->right;
+      publish(parent_node->left, successor->right);
 
       if (successor->right)
       {
         successor->right->parent = parent_node;
       }
 
-      successor->left    = node->left;
+      publish(successor->left, node->left);
       node->left->parent = successor;
 
-      successor->right    = node->right;
+      publish(successor->right, node->right);
       node->right->parent = successor;
 
       if (!node->parent)
       {
         /* Node must be a root! */
-        tree->root = successor;
+        publish(tree->root, successor);
       }
       else if (node->parent->right == node)
       {
-        node->parent->right = successor;
+        publish(node->parent->right, successor);
       }
       else
       {
-        node->parent->left = successor;
+        publish(node->parent->left, successor);
       }
 
       successor->parent = node->parent;
       successor->level  = node->level;
     }
+
+    /* The left subtree itself is intact, but the successor of its right
+     * spine is another node now, which matters to an update function
+     * tracking key ranges. */
+    if (tree->update)
+    {
+      aatree_node_t *spine = node->left;
+
+      for (; spine; spine = spine->right)
+      {
+        tree->update(tree, spine);
+      }
+    }
   }
 
   /* Rebalance the tree. Decrease the level of all nodes in this level if
    * necessary, and then skew and split all nodes in the new level. */
   for (; parent_node; parent_node = parent_node->parent)
   {
-    decrease_level(parent_node);
-    skew(tree, parent_node);
-    skew(tree, parent_node->right);
+    int changed = 0;
+
+    parent_node = rebalance(tree, parent_node, &changed);
 
-    if (parent_node->right)
+    if (tree->update)
     {
-      skew(tree, parent_node->right->right);
+      tree->update(tree, parent_node);
     }
-
-    split(tree, parent_node);
-    split(tree, parent_node->right);
   }
 
   /* Unlink deleted node. */
-  aatree_init_node(node);
+  detach_node(node);
 } /* aatree_delete */
+
+/* Rebalance the tree after one of the extreme nodes has been unlinked. Only
+ * the spine the node was hanging from is affected, so the climb stops at the
+ * first ancestor which is left intact: everything above it has seen neither
+ * level nor shape changes. Augmented data still has to be refreshed all the
+ * way up. */
+static __nonnull((1)) void rebalance_spine(aatree_t      *tree,
+                                           aatree_node_t *parent_node)
+{
+  for (; parent_node; parent_node = parent_node->parent)
+  {
+    int changed = 0;
+
+    parent_node = rebalance(tree, parent_node, &changed);
+
+    if (!changed)
+    {
+      break;
+    }
+
+    if (tree->update)
+    {
+      tree->update(tree, parent_node);
+    }
+  }
+
+  if (parent_node && tree->update)
+  {
+    aatree_refresh(tree, parent_node);
+  }
+} /* rebalance_spine */
+
+void *aatree_pop_first(aatree_t *tree)
+{
+  aatree_node_t *node = tree->first;
+
+  if (!node)
+  {
+    return NULL;
+  }
+
+  /* The leftmost node is on level 1 and has no left son. Its right son, if
+   * any, is a horizontally linked leaf that simply takes its place. */
+  if (node->right)
+  {
+    node->right->parent = node->parent;
+    publish(tree->first, node->right);
+
+    if (!node->parent)
+    {
+      publish(tree->root, node->right);
+    }
+    else
+    {
+      publish(node->parent->left, node->right);
+
+      if (tree->update)
+      {
+        aatree_refresh(tree, node->parent);
+      }
+    }
+  }
+  else if (!node->parent)
+  {
+    publish(tree->root, NULL);
+    publish(tree->first, NULL);
+    publish(tree->last, NULL);
+  }
+  else
+  {
+    publish(tree->first, node->parent);
+    publish(node->parent->left, NULL);
+
+    rebalance_spine(tree, node->parent);
+  }
+
+  detach_node(node);
+
+  return aatree_node_entry(tree, node);
+} /* aatree_pop_first */
+
+void *aatree_pop_last(aatree_t *tree)
+{
+  aatree_node_t *node = tree->last;
+
+  if (!node)
+  {
+    return NULL;
+  }
+
+  /* The rightmost node is always a leaf: having no right son it is on
+   * level 1, so it can not have a left son either. */
+  if (!node->parent)
+  {
+    publish(tree->root, NULL);
+    publish(tree->first, NULL);
+    publish(tree->last, NULL);
+  }
+  else
+  {
+    publish(tree->last, node->parent);
+    publish(node->parent->right, NULL);
+
+    rebalance_spine(tree, node->parent);
+  }
+
+  detach_node(node);
+
+  return aatree_node_entry(tree, node);
+} /* aatree_pop_last */
+
+void *aatree_reinsert(aatree_t *tree, aatree_node_t *node)
+{
+  aatree_node_t *prev = aatree_prev_node(node);
+  aatree_node_t *next = aatree_next_node(node);
+  const void    *key  = aatree_node_key(tree, node);
+  void          *entry = NULL;
+
+  /* The new key still falls between the neighbours: the node stays put. */
+  if ((!prev || tree->cmp(aatree_node_key(tree, prev), key) < 0)
+      && (!next || tree->cmp(key, aatree_node_key(tree, next)) < 0))
+  {
+    if (tree->update)
+    {
+      aatree_refresh(tree, node);
+    }
+
+    return NULL;
+  }
+
+  aatree_delete(tree, node);
+
+  if ((entry = aatree_insert(tree, node)))
+  {
+    aatree_init_node(node);
+  }
+
+  return entry;
+} /* aatree_reinsert */
+
+void aatree_replace(aatree_t *tree, aatree_node_t *node, aatree_node_t *with)
+{
+  with->parent = node->parent;
+  with->level  = node->level;
+  publish(with->left, node->left);
+  publish(with->right, node->right);
+
+  if (node->left)
+  {
+    node->left->parent = with;
+  }
+
+  if (node->right)
+  {
+    node->right->parent = with;
+  }
+
+  if (!node->parent)
+  {
+    publish(tree->root, with);
+  }
+  else if (node->parent->left == node)
+  {
+    publish(node->parent->left, with);
+  }
+  else
+  {
+    publish(node->parent->right, with);
+  }
+
+  if (tree->first == node)
+  {
+    publish(tree->first, with);
+  }
+
+  if (tree->last == node)
+  {
+    publish(tree->last, with);
+  }
+
+  detach_node(node);
+
+  if (tree->update)
+  {
+    aatree_refresh(tree, with);
+  }
+} /* aatree_replace */
+
+void aatree_refresh(aatree_t *tree, aatree_node_t *node)
+{
+  if (!tree->update)
+  {
+    return;
+  }
+
+  for (; node; node = node->parent)
+  {
+    tree->update(tree, node);
+  }
+} /* aatree_refresh */
+
+/* Link a balanced subtree of the sorted nodes. A subtree of n nodes gets the
+ * level floor(log2(n + 1)): the left half is never larger than the right one,
+ * so the left son is always one level down, and the right son is on the same
+ * level only when its own subtree is perfect. */
+static __nonnull((1, 2)) aatree_node_t *build_subtree(aatree_t      *tree,
+                                                      aatree_node_t **nodes,
+                                                      size_t         count,
+                                                      aatree_node_t *parent)
+{
+  aatree_node_t *node  = NULL;
+  size_t         half  = 0;
+  size_t         width = 0;
+
+  if (!count)
+  {
+    return NULL;
+  }
+
+  half         = (count - 1) / 2;
+  node         = nodes[half];
+  node->parent = parent;
+  node->level  = 0;
+
+  for (width = count + 1; width > 1; width >>= 1)
+  {
+    node->level++;
+  }
+
+  node->left  = build_subtree(tree, nodes, half, node);
+  node->right = build_subtree(tree, nodes + half + 1, count - half - 1, node);
+
+  if (tree->update)
+  {
+    tree->update(tree, node);
+  }
+
+  return node;
+} /* build_subtree */
+
+int aatree_build_sorted(aatree_t *tree, aatree_node_t **nodes, size_t count)
+{
+  size_t i;
+
+  if (tree->root)
+  {
+    return -1;
+  }
+
+  for (i = 1; i < count; i++)
+  {
+    if (tree->cmp(aatree_node_key(tree, nodes[i - 1]),
+                  aatree_node_key(tree, nodes[i]))
+        >= 0)
+    {
+      return -1;
+    }
+  }
+
+  if (!count)
+  {
+    return 0;
+  }
+
+  /* Everything is linked before the root is published. */
+  tree->first = nodes[0];
+  tree->last  = nodes[count - 1];
+  publish(tree->root, build_subtree(tree, nodes, count, NULL));
+
+  return 0;
+} /* aatree_build_sorted */
+
+void aatree_append(aatree_t *tree, aatree_node_t *node)
+{
+  aatree_node_t *parent_node = tree->last;
+
+  node->level = 1;
+  publish(tree->last, node);
+
+  if (!parent_node)
+  {
+    publish(tree->first, node);
+    publish(tree->root, node);
+
+    if (tree->update)
+    {
+      tree->update(tree, node);
+    }
+
+    return;
+  }
+
+  node->parent = parent_node;
+  publish(parent_node->right, node);
+
+  /* Only the right spine changes: the grandparent of a node which went up a
+   * level may have two horizontal links in a row. Splits are as rare as
+   * carries of a binary counter, so the climb is constant on average. */
+  for (; node->parent && split(tree, node->parent->parent);
+       node = node->parent)
+  {
+  }
+
+  if (tree->update)
+  {
+    aatree_refresh(tree, tree->last);
+  }
+} /* aatree_append */
+
+aatree_node_t *aatree_join_subtrees(const aatree_t *tree,
+                                    aatree_node_t  *left,
+                                    aatree_node_t  *node,
+                                    aatree_node_t  *right)
+{
+  aatree_t       subtree     = *tree;
+  aatree_node_t *parent_node = NULL;
+  aatree_node_t *child       = NULL;
+  int            level_left  = left ? left->level : 0;
+  int            level_right = right ? right->level : 0;
+
+  node->parent = NULL;
+
+  if (level_left == level_right)
+  {
+    publish(node->left, left);
+    publish(node->right, right);
+
+    if (left)
+      left->parent = node;
+
+    if (right)
+      right->parent = node;
+
+    node->level = level_left + 1;
+
+    if (tree->update)
+    {
+      tree->update(tree, node);
+    }
+
+    return node;
+  }
+
+  /* The node goes down the spine of the higher subtree facing the other one,
+   * down to the first node as high as the lower subtree. It takes that node
+   * as a son and the lower subtree as the other one, so it is exactly one
+   * level above both, and the rest is fixed on the way up as by an insert. */
+  if (level_left > level_right)
+  {
+    subtree.root = left;
+
+    for (child = left; child && child->level > level_right;
+         child = child->right)
+    {
+      parent_node = child;
+    }
+
+    publish(node->left, child);
+    publish(node->right, right);
+    node->level = level_right + 1;
+    publish(parent_node->right, node);
+  }
+  else
+  {
+    subtree.root = right;
+
+    for (child = right; child && child->level > level_left;
+         child = child->left)
+    {
+      parent_node = child;
+    }
+
+    publish(node->left, left);
+    publish(node->right, child);
+    node->level = level_left + 1;
+    publish(parent_node->left, node);
+  }
+
+  node->parent = parent_node;
+
+  if (node->left)
+    node->left->parent = node;
+
+  if (node->right)
+    node->right->parent = node;
+
+  if (tree->update)
+  {
+    tree->update(tree, node);
+  }
+
+  for (; parent_node; parent_node = parent_node->parent)
+  {
+    skew(&subtree, parent_node);
+    split(&subtree, parent_node);
+
+    if (tree->update)
+    {
+      tree->update(tree, parent_node);
+    }
+  }
+
+  return subtree.root;
+} /* aatree_join_subtrees */
+
+aatree_node_t *aatree_split_subtree(const aatree_t *tree,
+                                    aatree_node_t  *root,
+                                    const void     *key,
+                                    aatree_node_t **left,
+                                    aatree_node_t **right)
+{
+  aatree_node_t *root_left  = NULL;
+  aatree_node_t *root_right = NULL;
+  aatree_node_t *middle     = NULL;
+  aatree_node_t *found      = NULL;
+  int            result     = 0;
+
+  if (!root)
+  {
+    *left  = NULL;
+    *right = NULL;
+    return NULL;
+  }
+
+  root_left  = root->left;
+  root_right = root->right;
+
+  if (root_left)
+    root_left->parent = NULL;
+
+  if (root_right)
+    root_right->parent = NULL;
+
+  result = tree->cmp(key, aatree_node_key(tree, root));
+
+  /* Split the side the key falls in and join the root back to the rest. */
+  if (result < 0)
+  {
+    found  = aatree_split_subtree(tree, root_left, key, left, &middle);
+    *right = aatree_join_subtrees(tree, middle, root, root_right);
+  }
+  else if (result > 0)
+  {
+    found = aatree_split_subtree(tree, root_right, key, &middle, right);
+    *left = aatree_join_subtrees(tree, root_left, root, middle);
+  }
+  else
+  {
+    *left  = root_left;
+    *right = root_right;
+    found  = root;
+
+    detach_node(root);
+  }
+
+  return found;
+} /* aatree_split_subtree */
+
+/* Leftmost and rightmost nodes of a subtree */
+static __inline__ aatree_node_t *leftmost(aatree_node_t *node)
+{
+  for (; node && node->left; node = node->left)
+  {
+  }
+
+  return node;
+} /* leftmost */
+
+static __inline__ aatree_node_t *rightmost(aatree_node_t *node)
+{
+  for (; node && node->right; node = node->right)
+  {
+  }
+
+  return node;
+} /* rightmost */
+
+void aatree_join(aatree_t      *tree,
+                 aatree_t      *left,
+                 aatree_node_t *node,
+                 aatree_t      *right)
+{
+  aatree_node_t *first = left->root ? left->first : node;
+  aatree_node_t *last  = right->root ? right->last : node;
+  aatree_node_t *root  = aatree_join_subtrees(tree, left->root, node,
+                                             right->root);
+
+  /* Either tree may be the one joined into. */
+  left->root  = NULL;
+  left->first = NULL;
+  left->last  = NULL;
+
+  right->root  = NULL;
+  right->first = NULL;
+  right->last  = NULL;
+
+  publish(tree->first, first);
+  publish(tree->last, last);
+  publish(tree->root, root);
+} /* aatree_join */
+
+void *aatree_split(aatree_t   *tree,
+                   const void *key,
+                   aatree_t   *left,
+                   aatree_t   *right)
+{
+  aatree_node_t *root_left  = NULL;
+  aatree_node_t *root_right = NULL;
+  aatree_node_t *found      = NULL;
+  aatree_t       source     = *tree;
+
+  found = aatree_split_subtree(&source, source.root, key, &root_left,
+                               &root_right);
+
+  /* The source may be one of the halves. */
+  tree->root  = NULL;
+  tree->first = NULL;
+  tree->last  = NULL;
+
+  *left  = source;
+  *right = source;
+
+  left->root  = root_left;
+  left->first = leftmost(root_left);
+  left->last  = rightmost(root_left);
+
+  right->root  = root_right;
+  right->first = leftmost(root_right);
+  right->last  = rightmost(root_right);
+
+  return aatree_node_entry(&source, found);
+} /* aatree_split */
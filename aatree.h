@@ -25,6 +25,11 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <stddef.h>
 #include <stdint.h>
 
+/* Cache line size assumed by the concurrent containers */
+#ifndef AATREE_CACHE_LINE
+#define AATREE_CACHE_LINE 64
+#endif
+
 typedef enum aatree_keys_order_e
 {
   AATREE_KEY_EQ,
@@ -40,6 +45,15 @@ typedef enum aatree_keys_order_e
  */
 typedef int(aatree_keys_compare)(const void *, const void *);
 
+struct aatree;
+struct aatree_node;
+
+/* Node update function of an augmented tree. It must recompute the data the
+ * entry keeps about its subtree (counts, sums, maximums) from the node itself
+ * and its sons, which are already up to date when it is called.
+ */
+typedef void(aatree_node_update)(const struct aatree *, struct aatree_node *);
+
 /* AA tree node. */
 typedef struct aatree_node
 {
@@ -67,6 +81,9 @@ typedef struct aatree
 
   /* Keys comparison function */
   aatree_keys_compare *cmp;
+
+  /* Subtree data update function, NULL unless the tree is augmented */
+  aatree_node_update *update;
 } aatree_t;
 
 /* Init empty AA tree */
@@ -82,9 +99,19 @@ static __inline__ __nonnull((1)) void aatree_init_tree(aatree_t *tree,
   tree->offset.node = node_offset;
   tree->offset.key  = key_offset;
 
-  tree->cmp = cmp;
+  tree->cmp    = cmp;
+  tree->update = NULL;
 } /* aatree_init_tree */
 
+/* Make the tree augmented: the update function is invoked on every node whose
+ * subtree changes, and on the right spine of a subtree getting another
+ * successor by a delete. Must be set while the tree is empty. */
+static __inline__ __nonnull((1)) void
+aatree_augment(aatree_t *tree, aatree_node_update *update)
+{
+  tree->update = update;
+} /* aatree_augment */
+
 /* Init AA tree node */
 static __inline__ __nonnull((1)) void aatree_init_node(aatree_node_t *node)
 {
@@ -186,9 +213,85 @@ void *aatree_search(const aatree_t   *tree,
 /* Try to insert node into tree or return an existing entry */
 void *aatree_insert(aatree_t *tree, aatree_node_t *node) __nonnull((1, 2));
 
+/* Insert like aatree_insert(), starting from the hint node. A key between
+ * the ones of the hint and its successor, e.g. the next one of an ascending
+ * run, is linked without descending the tree, in amortized constant time
+ * unless the tree is augmented. */
+void *aatree_insert_hint(aatree_t      *tree,
+                         aatree_node_t *node,
+                         aatree_node_t *hint) __nonnull((1, 2));
+
 /* Delete specified node from tree */
 void aatree_delete(aatree_t *tree, aatree_node_t *node) __nonnull((1, 2));
 
+/* Remove the first node from the tree and return its entry. Unlike
+ * aatree_delete() the rebalancing stops as soon as the tree is repaired. */
+void *aatree_pop_first(aatree_t *tree) __nonnull((1));
+
+/* Remove the last node from the tree and return its entry */
+void *aatree_pop_last(aatree_t *tree) __nonnull((1));
+
+/* Reposition a node after its key has been changed in place (decrease-key,
+ * reschedule). Returns NULL on success, or an existing entry with the same key,
+ * in which case the node is left unlinked. */
+void *aatree_reinsert(aatree_t *tree, aatree_node_t *node) __nonnull((1, 2));
+
+/* Link the node with in place of the node, which is unlinked. Both must have
+ * the same key. Takes constant time unless the tree is augmented. */
+void aatree_replace(aatree_t *tree, aatree_node_t *node, aatree_node_t *with)
+    __nonnull((1, 2, 3));
+
+/* Recompute augmented data of a node and all of its ancestors, after the
+ * entry's own data has been changed in place */
+void aatree_refresh(aatree_t *tree, aatree_node_t *node) __nonnull((1, 2));
+
+/* Link an array of nodes sorted by strictly ascending keys into an empty tree
+ * in linear time. Returns zero on success, or -1 if the tree is not empty or
+ * the keys are out of order. */
+int aatree_build_sorted(aatree_t *tree, aatree_node_t **nodes, size_t count)
+    __nonnull((1));
+
+/* Link a node with a key greater than all keys of the tree as its last node,
+ * without comparing keys, in amortized constant time */
+void aatree_append(aatree_t *tree, aatree_node_t *node) __nonnull((1, 2));
+
+/* Join two detached subtrees, all keys of the left one less than the key of
+ * the node and all keys of the right one greater, with the node between them.
+ * Either subtree may be NULL. The tree only provides the key layout and the
+ * update function. Returns the root of the joined subtree, in time
+ * proportional to the difference of the subtree levels. */
+aatree_node_t *aatree_join_subtrees(const aatree_t *tree,
+                                    aatree_node_t  *left,
+                                    aatree_node_t  *node,
+                                    aatree_node_t  *right) __nonnull((1, 3));
+
+/* Split a detached subtree into the subtrees of keys less and greater than
+ * the key, in logarithmic time. Returns the unlinked node with an equal key,
+ * or NULL if there is none. */
+aatree_node_t *aatree_split_subtree(const aatree_t *tree,
+                                    aatree_node_t  *root,
+                                    const void     *key,
+                                    aatree_node_t **left,
+                                    aatree_node_t **right)
+    __nonnull((1, 3, 4, 5));
+
+/* Join the trees with the node between them, all keys of the left tree less
+ * than the key of the node and all keys of the right one greater. The result
+ * goes to the tree, which may be one of the joined ones, the others are left
+ * empty. */
+void aatree_join(aatree_t      *tree,
+                 aatree_t      *left,
+                 aatree_node_t *node,
+                 aatree_t      *right) __nonnull((1, 2, 3, 4));
+
+/* Split the tree into the trees of keys less and greater than the key, the
+ * tree is left empty unless it is one of them. Returns the entry with an
+ * equal key, which is unlinked, or NULL. */
+void *aatree_split(aatree_t   *tree,
+                   const void *key,
+                   aatree_t   *left,
+                   aatree_t   *right) __nonnull((1, 2, 3, 4));
+
 /* Verify AA tree sructure */
 int aatree_verify(aatree_t *tree);
 
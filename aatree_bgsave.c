@@ -0,0 +1,289 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "aatree_bgsave.h"
+
+/* Report of the child, small enough to be written atomically */
+typedef struct report
+{
+  uint64_t written;
+  int32_t  error;
+  int32_t  last;
+} report_t;
+
+/* State of the child */
+typedef struct child
+{
+  int             fd;
+  int             pipe;
+  uint64_t        written;
+  uint64_t        rate;
+  struct timespec start;
+
+  aatree_io_serialize_fn *serialize;
+  void                   *arg;
+} child_t;
+
+/* Write all of the data, retrying short writes */
+static int write_all(int fd, const uint8_t *data, size_t size)
+{
+  while (size)
+  {
+    ssize_t n = write(fd, data, size);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return errno;
+    }
+
+    data += n;
+    size -= n;
+  }
+
+  return 0;
+} /* write_all */
+
+/* Send a report, the last one waits for room in the pipe */
+static void send_report(child_t *child, int error, int last)
+{
+  report_t report;
+
+  memset(&report, 0, sizeof(report));
+  report.written = child->written;
+  report.error   = error;
+  report.last    = last;
+
+  if (last)
+  {
+    fcntl(child->pipe, F_SETFL, 0);
+  }
+
+  while (write(child->pipe, &report, sizeof(report)) < 0 && errno == EINTR)
+  {
+  }
+} /* send_report */
+
+/* Sleep until the time the bytes written so far are due at the rate */
+static void throttle(child_t *child)
+{
+  struct timespec due = child->start;
+  uint64_t        ns  = 0;
+
+  if (!child->rate)
+  {
+    return;
+  }
+
+  ns = child->written / child->rate * UINT64_C(1000000000)
+       + child->written % child->rate * UINT64_C(1000000000) / child->rate;
+
+  due.tv_sec  += ns / 1000000000;
+  due.tv_nsec += ns % 1000000000;
+
+  if (due.tv_nsec >= 1000000000)
+  {
+    due.tv_sec++;
+    due.tv_nsec -= 1000000000;
+  }
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+  {
+  }
+} /* throttle */
+
+static int child_write(const void *data, size_t size, void *arg)
+{
+  child_t *child = arg;
+  int      error = 0;
+
+  if ((error = write_all(child->fd, data, size)))
+  {
+    return error;
+  }
+
+  child->written += size;
+
+  send_report(child, 0, 0);
+  throttle(child);
+
+  return 0;
+} /* child_write */
+
+static size_t child_serialize(const void *entry,
+                              void       *data,
+                              size_t      size,
+                              void       *arg)
+{
+  child_t *child = arg;
+
+  return child->serialize(entry, data, size, child->arg);
+} /* child_serialize */
+
+int aatree_snapshot_async(aatree_bgsave_t        *save,
+                          const aatree_t         *tree,
+                          int                     fd,
+                          aatree_io_serialize_fn *serialize,
+                          void                   *arg,
+                          void                   *buffer,
+                          size_t                  size,
+                          unsigned                flags,
+                          uint64_t                rate)
+{
+  int   pipes[2];
+  pid_t pid   = 0;
+  int   error = 0;
+
+  memset(save, 0, sizeof(*save));
+
+  if (pipe2(pipes, O_CLOEXEC))
+  {
+    return errno;
+  }
+
+  if ((pid = fork()) < 0)
+  {
+    error = errno;
+
+    close(pipes[0]);
+    close(pipes[1]);
+
+    return error;
+  }
+
+  if (!pid)
+  {
+    child_t child;
+
+    close(pipes[0]);
+    fcntl(pipes[1], F_SETFL, O_NONBLOCK);
+
+    child.fd        = fd;
+    child.pipe      = pipes[1];
+    child.written   = 0;
+    child.rate      = rate;
+    child.serialize = serialize;
+    child.arg       = arg;
+    clock_gettime(CLOCK_MONOTONIC, &child.start);
+
+    error = aatree_dump(tree, child_write, child_serialize, &child, buffer,
+                        size, flags);
+
+    if (!error && fdatasync(fd))
+    {
+      error = errno;
+    }
+
+    send_report(&child, error, 1);
+
+    /* The exit handlers and the stdio buffers are the parent's. */
+    _exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  close(pipes[1]);
+  fcntl(pipes[0], F_SETFL, O_NONBLOCK);
+
+  save->pid      = pid;
+  save->progress = pipes[0];
+
+  return 0;
+} /* aatree_snapshot_async */
+
+int aatree_snapshot_poll(aatree_bgsave_t *save)
+{
+  report_t report;
+
+  if (!save->pid)
+  {
+    return save->error;
+  }
+
+  while (!save->done)
+  {
+    ssize_t n = read(save->progress, &report, sizeof(report));
+
+    if (n == (ssize_t)sizeof(report))
+    {
+      save->written = report.written;
+
+      if (report.last)
+      {
+        save->error = report.error;
+        save->done  = 1;
+      }
+    }
+    else if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (n < 0 && errno == EAGAIN)
+    {
+      return EAGAIN;
+    }
+    else
+    {
+      /* The pipe is closed without the last report. */
+      save->error = EIO;
+      save->done  = 1;
+    }
+  }
+
+  close(save->progress);
+
+  while (waitpid(save->pid, NULL, 0) < 0 && errno == EINTR)
+  {
+  }
+
+  save->pid      = 0;
+  save->progress = -1;
+
+  return save->error;
+} /* aatree_snapshot_poll */
+
+int aatree_snapshot_wait(aatree_bgsave_t *save)
+{
+  struct pollfd ready;
+  int           error = 0;
+
+  while ((error = aatree_snapshot_poll(save)) == EAGAIN)
+  {
+    ready.fd      = save->progress;
+    ready.events  = POLLIN;
+    ready.revents = 0;
+
+    poll(&ready, 1, -1);
+  }
+
+  return error;
+} /* aatree_snapshot_wait */
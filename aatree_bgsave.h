@@ -0,0 +1,89 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#ifndef AATREE_BGSAVE_H
+#define AATREE_BGSAVE_H
+
+#include <sys/types.h>
+#include "aatree_io.h"
+
+/* Background snapshots of a tree by a forked child.
+ *
+ * The child gets the address space of the parent as of the fork, shared
+ * copy-on-write by the kernel: it dumps the tree it sees with aatree_dump()
+ * while the parent goes on changing its own copy, paying only for the pages
+ * it writes to meanwhile. The writers are paused for the fork alone.
+ *
+ * The child reports the bytes written through a pipe after each block, and
+ * a last time with the outcome once the file is synced. The write rate may
+ * be capped to leave the disk to the log. Reports are dropped while the pipe
+ * is full, except the last one, so a parent polling rarely just sees fewer
+ * of them.
+ *
+ * The fork is taken with the tree locked against the writers, if any. The
+ * child runs a single thread: the serialize callback must not take locks or
+ * allocate memory, which other threads of the parent may have held at the
+ * fork.
+ */
+
+typedef struct aatree_bgsave
+{
+  pid_t pid;
+
+  /* Read end of the report pipe, non-blocking, to poll() for */
+  int progress;
+
+  /* Bytes written as of the last report */
+  uint64_t written;
+
+  /* Outcome once the child is reaped */
+  int done;
+  int error;
+} aatree_bgsave_t;
+
+/* Fork a child dumping the tree into the file, open for writing at its
+ * current offset, with the buffer of size bytes and flags of aatree_dump(),
+ * at most rate bytes per second unless it is zero. The file must not be
+ * used by the parent until the save is done. Returns zero, or the errno
+ * value of pipe() or fork(). */
+int aatree_snapshot_async(aatree_bgsave_t        *save,
+                          const aatree_t         *tree,
+                          int                     fd,
+                          aatree_io_serialize_fn *serialize,
+                          void                   *arg,
+                          void                   *buffer,
+                          size_t                  size,
+                          unsigned                flags,
+                          uint64_t                rate)
+    __nonnull((1, 2, 4, 6));
+
+/* Collect the reports without blocking. Returns EAGAIN while the child is
+ * at work; otherwise the child is reaped and the outcome is returned: zero,
+ * the error of the dump or the sync, or EIO if the child died. */
+int aatree_snapshot_poll(aatree_bgsave_t *save) __nonnull((1));
+
+/* Wait for the child, returns the outcome like aatree_snapshot_poll() */
+int aatree_snapshot_wait(aatree_bgsave_t *save) __nonnull((1));
+
+#endif /* AATREE_BGSAVE_H */
@@ -0,0 +1,259 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "aatree_cache.h"
+
+/* Compare (expiry, seq) keys */
+static int cache_order_compare(const void *a, const void *b)
+{
+  const struct aatree_cache_order *order_a = a;
+  const struct aatree_cache_order *order_b = b;
+
+  if (order_a->expiry != order_b->expiry)
+    return order_a->expiry < order_b->expiry ? -1 : 1;
+
+  if (order_a->seq != order_b->seq)
+    return order_a->seq < order_b->seq ? -1 : 1;
+
+  return 0;
+} /* cache_order_compare */
+
+/* Get object from its cache entry */
+static __inline__ void *entry_object(const aatree_cache_t *cache,
+                                     aatree_cache_entry_t *entry)
+{
+  return (uint8_t *)entry - cache->entry_offset;
+} /* entry_object */
+
+/* Get object key from its cache entry */
+static __inline__ const void *entry_key(const aatree_cache_t *cache,
+                                        aatree_cache_entry_t *entry)
+{
+  return (uint8_t *)entry - cache->entry_offset + cache->key_offset;
+} /* entry_key */
+
+/* Find the slot holding the key or the empty slot terminating its probe
+ * sequence */
+static size_t find_slot(const aatree_cache_t *cache,
+                        const void           *key,
+                        uint64_t              hash)
+{
+  size_t i = hash & cache->mask;
+
+  for (; cache->slots[i]; i = (i + 1) & cache->mask)
+  {
+    aatree_cache_entry_t *entry = cache->slots[i];
+
+    if (entry->hash == hash && cache->equal(key, entry_key(cache, entry)))
+    {
+      break;
+    }
+  }
+
+  return i;
+} /* find_slot */
+
+/* Empty the slot and shift the following entries of the cluster back, so no
+ * tombstones are needed. */
+static void clear_slot(aatree_cache_t *cache, size_t i)
+{
+  size_t j = i;
+
+  for (;;)
+  {
+    size_t home;
+
+    cache->slots[i] = NULL;
+
+    /* Skip entries whose home slot lies cyclically in (i, j]: moving them
+     * back would break their probe sequence. */
+    do
+    {
+      j = (j + 1) & cache->mask;
+
+      if (!cache->slots[j])
+        return;
+
+      home = cache->slots[j]->hash & cache->mask;
+    } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+    cache->slots[i] = cache->slots[j];
+    i               = j;
+  }
+} /* clear_slot */
+
+int aatree_cache_init(aatree_cache_t        *cache,
+                      aatree_cache_entry_t **slots,
+                      size_t                 nslots,
+                      size_t                 entry_offset,
+                      size_t                 key_offset,
+                      aatree_cache_hash_fn  *hash,
+                      aatree_cache_equal_fn *equal)
+{
+  size_t i;
+
+  if (!nslots || (nslots & (nslots - 1)))
+    return -1;
+
+  /* The tree keeps the offsets of the node and the order in 16 bits. */
+  if (entry_offset > UINT16_MAX - sizeof(aatree_cache_entry_t))
+    return -1;
+
+  aatree_init_tree(&cache->order,
+                   entry_offset + offsetof(aatree_cache_entry_t, node),
+                   entry_offset + offsetof(aatree_cache_entry_t, order),
+                   cache_order_compare);
+
+  for (i = 0; i < nslots; i++)
+  {
+    slots[i] = NULL;
+  }
+
+  cache->slots        = slots;
+  cache->mask         = nslots - 1;
+  cache->count        = 0;
+  cache->seq          = 0;
+  cache->entry_offset = entry_offset;
+  cache->key_offset   = key_offset;
+  cache->hash         = hash;
+  cache->equal        = equal;
+
+  return 0;
+} /* aatree_cache_init */
+
+void *aatree_cache_get(const aatree_cache_t *cache, const void *key)
+{
+  size_t                i     = find_slot(cache, key, cache->hash(key));
+  aatree_cache_entry_t *entry = cache->slots[i];
+
+  return entry ? entry_object(cache, entry) : NULL;
+} /* aatree_cache_get */
+
+int aatree_cache_put(aatree_cache_t *cache,
+                     void           *obj,
+                     uint64_t        expiry,
+                     void          **old)
+{
+  aatree_cache_entry_t *entry = aatree_cache_entry(cache, obj);
+  const void           *key   = (uint8_t *)obj + cache->key_offset;
+  size_t                i;
+
+  entry->hash = cache->hash(key);
+  i           = find_slot(cache, key, entry->hash);
+
+  if (old)
+    *old = NULL;
+
+  if (cache->slots[i])
+  {
+    aatree_cache_entry_t *prev = cache->slots[i];
+
+    aatree_delete(&cache->order, &prev->node);
+
+    if (old)
+      *old = entry_object(cache, prev);
+  }
+  else
+  {
+    /* Keep the load factor at 7/8 at most, so probe sequences stay short. */
+    if (cache->count >= cache->mask + 1 - (cache->mask + 1) / 8)
+      return -1;
+
+    cache->count++;
+  }
+
+  cache->slots[i] = entry;
+
+  aatree_init_node(&entry->node);
+  entry->order.expiry = expiry;
+  entry->order.seq    = cache->seq++;
+
+  aatree_insert(&cache->order, &entry->node);
+
+  return 0;
+} /* aatree_cache_put */
+
+void aatree_cache_touch(aatree_cache_t *cache, void *obj, uint64_t expiry)
+{
+  aatree_cache_entry_t *entry = aatree_cache_entry(cache, obj);
+
+  entry->order.expiry = expiry;
+  entry->order.seq    = cache->seq++;
+
+  aatree_reinsert(&cache->order, &entry->node);
+} /* aatree_cache_touch */
+
+/* Remove entry from the hash index only */
+static void unindex(aatree_cache_t *cache, aatree_cache_entry_t *entry)
+{
+  size_t i = entry->hash & cache->mask;
+
+  for (; cache->slots[i] != entry; i = (i + 1) & cache->mask)
+  {
+  }
+
+  clear_slot(cache, i);
+  cache->count--;
+} /* unindex */
+
+void aatree_cache_remove(aatree_cache_t *cache, void *obj)
+{
+  aatree_cache_entry_t *entry = aatree_cache_entry(cache, obj);
+
+  aatree_delete(&cache->order, &entry->node);
+  unindex(cache, entry);
+} /* aatree_cache_remove */
+
+void *aatree_cache_evict_first(aatree_cache_t *cache)
+{
+  void *obj = aatree_pop_first(&cache->order);
+
+  if (obj)
+  {
+    unindex(cache, aatree_cache_entry(cache, obj));
+  }
+
+  return obj;
+} /* aatree_cache_evict_first */
+
+size_t aatree_cache_evict_expired(aatree_cache_t        *cache,
+                                  uint64_t               now,
+                                  aatree_cache_evict_fn *evict,
+                                  void                  *arg)
+{
+  size_t evicted = 0;
+  void  *obj     = NULL;
+
+  /* Expired entries form a prefix of the expiry order: peel it off the
+   * front of the tree. */
+  while ((obj = aatree_first(&cache->order))
+         && aatree_cache_entry(cache, obj)->order.expiry <= now)
+  {
+    aatree_pop_first(&cache->order);
+    unindex(cache, aatree_cache_entry(cache, obj));
+    evicted++;
+
+    if (evict)
+      evict(obj, arg);
+  }
+
+  return evicted;
+} /* aatree_cache_evict_expired */
@@ -0,0 +1,134 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef AATREE_CACHE_H
+#define AATREE_CACHE_H
+
+#include "aatree.h"
+
+/* TTL/LRU cache engine.
+ *
+ * Every cached object embeds aatree_cache_entry_t. Exact key lookups go
+ * through an open addressing hash index (linear probing, backward shift
+ * deletion), while the AA tree keeps entries ordered by (expiry, seq). Using
+ * the expiry time gives a TTL cache, using the last access time gives LRU.
+ *
+ * The hash index slots are supplied by the caller, no memory is allocated.
+ */
+
+/* Hash function of a key */
+typedef uint64_t(aatree_cache_hash_fn)(const void *);
+
+/* Keys equality, returns non-zero if keys are equal */
+typedef int(aatree_cache_equal_fn)(const void *, const void *);
+
+/* Eviction callback, the object is already removed from the cache */
+typedef void(aatree_cache_evict_fn)(void *, void *);
+
+/* Cache entry */
+typedef struct aatree_cache_entry
+{
+  aatree_node_t node;
+
+  struct aatree_cache_order
+  {
+    uint64_t expiry;
+    uint64_t seq;
+  } order;
+
+  uint64_t hash;
+} aatree_cache_entry_t;
+
+/* Cache */
+typedef struct aatree_cache
+{
+  aatree_t order;
+
+  /* Hash index */
+  aatree_cache_entry_t **slots;
+  size_t                 mask;
+  size_t                 count;
+
+  uint64_t seq;
+
+  /* Offsets to cache entry and key within the object */
+  size_t entry_offset;
+  size_t key_offset;
+
+  aatree_cache_hash_fn  *hash;
+  aatree_cache_equal_fn *equal;
+} aatree_cache_t;
+
+/* Init cache with nslots hash index slots, nslots must be a power of two. The
+ * cache holds at most nslots - nslots / 8 objects. Returns -1 if nslots is not
+ * a power of two or the entry is too far into the object for the tree. */
+int aatree_cache_init(aatree_cache_t        *cache,
+                      aatree_cache_entry_t **slots,
+                      size_t                 nslots,
+                      size_t                 entry_offset,
+                      size_t                 key_offset,
+                      aatree_cache_hash_fn  *hash,
+                      aatree_cache_equal_fn *equal) __nonnull((1, 2, 6, 7));
+
+/* Get the cache entry of an object */
+static __inline__ __nonnull((1, 2)) aatree_cache_entry_t *
+aatree_cache_entry(const aatree_cache_t *cache, void *obj)
+{
+  return (aatree_cache_entry_t *)((uint8_t *)obj + cache->entry_offset);
+} /* aatree_cache_entry */
+
+/* Number of cached objects */
+static __inline__ __nonnull((1)) size_t
+aatree_cache_count(const aatree_cache_t *cache)
+{
+  return cache->count;
+} /* aatree_cache_count */
+
+/* Find object by key */
+void *aatree_cache_get(const aatree_cache_t *cache, const void *key)
+    __nonnull((1, 2));
+
+/* Put object into cache. An object with the same key is replaced and returned
+ * through old, so the caller can release it. Returns -1 if the cache is
+ * full. */
+int aatree_cache_put(aatree_cache_t *cache,
+                     void           *obj,
+                     uint64_t        expiry,
+                     void          **old) __nonnull((1, 2));
+
+/* Move object to a new expiry (or access) time */
+void aatree_cache_touch(aatree_cache_t *cache, void *obj, uint64_t expiry)
+    __nonnull((1, 2));
+
+/* Remove object from cache */
+void aatree_cache_remove(aatree_cache_t *cache, void *obj) __nonnull((1, 2));
+
+/* Remove the object with the earliest expiry (least recently used) */
+void *aatree_cache_evict_first(aatree_cache_t *cache) __nonnull((1));
+
+/* Remove all objects expired by now, invoking evict for each of them. Returns
+ * number of objects evicted. */
+size_t aatree_cache_evict_expired(aatree_cache_t        *cache,
+                                  uint64_t               now,
+                                  aatree_cache_evict_fn *evict,
+                                  void                  *arg) __nonnull((1));
+
+#endif /* AATREE_CACHE_H */
@@ -0,0 +1,245 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#include <pthread.h>
+#include <string.h>
+#include "aatree_check.h"
+
+/* Subtrees are checked by a new thread from this level on */
+#define AATREE_CHECK_GRAIN_LEVEL 12
+
+/* Check of a subtree */
+typedef struct check_task
+{
+  const aatree_t      *tree;
+  const aatree_node_t *node;
+  const aatree_node_t *parent;
+  unsigned             nthreads;
+
+  /* Extreme nodes of the subtree */
+  const aatree_node_t *first;
+  const aatree_node_t *last;
+
+  aatree_check_report_t report;
+} check_task_t;
+
+/* Check the links and levels of a node alone */
+static aatree_check_error check_node(const aatree_node_t *node,
+                                     const aatree_node_t *parent)
+{
+  int level_left  = node->left ? node->left->level : 0;
+  int level_right = node->right ? node->right->level : 0;
+
+  if (node->parent != parent)
+    return AATREE_CHECK_PARENT;
+
+  if (level_left != node->level - 1)
+    return AATREE_CHECK_LEVEL_LEFT;
+
+  if (level_right != node->level && level_right != node->level - 1)
+    return AATREE_CHECK_LEVEL_RIGHT;
+
+  if (node->right && node->right->right
+      && node->right->right->level >= node->level)
+    return AATREE_CHECK_HORIZONTAL;
+
+  return AATREE_CHECK_OK;
+} /* check_node */
+
+/* Record the error unless an earlier one is already there */
+static __inline__ void set_error(aatree_check_report_t *report,
+                                 aatree_check_error     error,
+                                 const aatree_node_t   *node)
+{
+  if (!report->error)
+  {
+    report->error = error;
+    report->node  = node;
+  }
+} /* set_error */
+
+/* Add up the report of a son */
+static void add_report(aatree_check_report_t       *report,
+                       const aatree_check_report_t *son)
+{
+  set_error(report, son->error, son->node);
+
+  report->nodes    += son->nodes;
+  report->compares += son->compares;
+
+  if (son->height >= report->height)
+  {
+    report->height = son->height + 1;
+  }
+} /* add_report */
+
+static __inline__ int compare_nodes(const aatree_t      *tree,
+                                   const aatree_node_t *a,
+                                   const aatree_node_t *b)
+{
+  return tree->cmp(aatree_node_key(tree, (aatree_node_t *)a),
+                   aatree_node_key(tree, (aatree_node_t *)b));
+} /* compare_nodes */
+
+static void *check_subtree(void *arg)
+{
+  check_task_t        *task  = arg;
+  check_task_t         left  = *task;
+  check_task_t         right = *task;
+  const aatree_node_t *node  = task->node;
+  pthread_t            thread;
+  int                  forked = 0;
+
+  memset(&task->report, 0, sizeof(task->report));
+
+  task->first         = node;
+  task->last          = node;
+  task->report.nodes  = 1;
+  task->report.height = 1;
+
+  /* Sons of a broken node may be anything, even the node itself. */
+  if ((task->report.error = check_node(node, task->parent)))
+  {
+    task->report.node = node;
+    return NULL;
+  }
+
+  left.node      = node->left;
+  left.parent    = node;
+  left.nthreads  = task->nthreads / 2;
+  right.node     = node->right;
+  right.parent   = node;
+  right.nthreads = task->nthreads - left.nthreads;
+
+  if (left.node && right.node && task->nthreads > 1
+      && node->level >= AATREE_CHECK_GRAIN_LEVEL)
+  {
+    forked = !pthread_create(&thread, NULL, check_subtree, &left);
+  }
+
+  if (left.node && !forked)
+    check_subtree(&left);
+
+  if (right.node)
+    check_subtree(&right);
+
+  if (forked)
+    pthread_join(thread, NULL);
+
+  /* Errors are taken in key order: the left subtree, the node and its
+   * neighbours, the right subtree. */
+  if (left.node)
+  {
+    add_report(&task->report, &left.report);
+    task->first = left.first;
+
+    if (!left.report.error)
+    {
+      task->report.compares++;
+
+      if (compare_nodes(task->tree, left.last, node) >= 0)
+        set_error(&task->report, AATREE_CHECK_ORDER, node);
+    }
+  }
+
+  if (right.node)
+  {
+    if (!right.report.error)
+    {
+      task->report.compares++;
+
+      if (compare_nodes(task->tree, node, right.first) >= 0)
+        set_error(&task->report, AATREE_CHECK_ORDER, right.first);
+    }
+
+    add_report(&task->report, &right.report);
+    task->last = right.last;
+  }
+
+  return NULL;
+} /* check_subtree */
+
+int aatree_check(const aatree_t        *tree,
+                 aatree_check_report_t *report,
+                 unsigned               nthreads)
+{
+  check_task_t task;
+
+  memset(report, 0, sizeof(*report));
+
+  if (tree->root)
+  {
+    task.tree     = tree;
+    task.node     = tree->root;
+    task.parent   = NULL;
+    task.nthreads = nthreads;
+
+    check_subtree(&task);
+
+    *report = task.report;
+  }
+  else
+  {
+    task.first = NULL;
+    task.last  = NULL;
+  }
+
+  /* The extreme nodes are only known for an intact tree. */
+  if (!report->error && task.first != tree->first)
+  {
+    report->error = AATREE_CHECK_FIRST;
+    report->node  = tree->first;
+  }
+  else if (!report->error && task.last != tree->last)
+  {
+    report->error = AATREE_CHECK_LAST;
+    report->node  = tree->last;
+  }
+
+  return report->error ? -1 : 0;
+} /* aatree_check */
+
+const char *aatree_check_message(aatree_check_error error)
+{
+  switch (error)
+  {
+    case AATREE_CHECK_OK:
+      return "valid tree";
+    case AATREE_CHECK_PARENT:
+      return "parent link does not point to the parent";
+    case AATREE_CHECK_LEVEL_LEFT:
+      return "left son is not one level below";
+    case AATREE_CHECK_LEVEL_RIGHT:
+      return "right son is not on the same level or one below";
+    case AATREE_CHECK_HORIZONTAL:
+      return "two consecutive right horizontal links";
+    case AATREE_CHECK_ORDER:
+      return "key is not greater than the previous one";
+    case AATREE_CHECK_FIRST:
+      return "first node is not the leftmost one";
+    case AATREE_CHECK_LAST:
+      return "last node is not the rightmost one";
+  }
+
+  return "unknown error";
+} /* aatree_check_message */
@@ -0,0 +1,87 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#ifndef AATREE_CHECK_H
+#define AATREE_CHECK_H
+
+#include "aatree.h"
+
+/* Structural check of an AA tree for production use.
+ *
+ * Unlike aatree_verify() the check never asserts: it reports the violated
+ * invariant and the node it was found at. Parent links, levels and key order
+ * are checked in a single traversal with one comparison per node, each node
+ * against its in-order neighbours at the boundaries of its subtrees, and the
+ * subtrees of a large tree are checked by different threads. A node breaking
+ * a link or level invariant is not descended into, so the check terminates
+ * on a corrupted tree as well, e.g. with a cycle.
+ */
+
+typedef enum aatree_check_error
+{
+  AATREE_CHECK_OK,
+
+  /* The parent link of the node does not point to its actual parent */
+  AATREE_CHECK_PARENT,
+
+  /* The left son is not exactly one level below the node */
+  AATREE_CHECK_LEVEL_LEFT,
+
+  /* The right son is neither on the level of the node nor one below */
+  AATREE_CHECK_LEVEL_RIGHT,
+
+  /* Two consecutive horizontal links to the right of the node */
+  AATREE_CHECK_HORIZONTAL,
+
+  /* The key of the node is not greater than the one of its predecessor */
+  AATREE_CHECK_ORDER,
+
+  /* The first or the last node of the tree is not the one recorded */
+  AATREE_CHECK_FIRST,
+  AATREE_CHECK_LAST
+} aatree_check_error;
+
+/* Outcome of a check */
+typedef struct aatree_check_report
+{
+  aatree_check_error   error;
+  const aatree_node_t *node;
+
+  /* Nodes visited, key comparisons made and the height of the tree */
+  size_t nodes;
+  size_t compares;
+  int    height;
+} aatree_check_report_t;
+
+/* Check the tree with up to nthreads threads, filling the report. If there
+ * are several violations, the one reported is the first in the traversal,
+ * which does not depend on the threads. Returns zero if the tree is valid,
+ * or -1 otherwise. */
+int aatree_check(const aatree_t        *tree,
+                 aatree_check_report_t *report,
+                 unsigned               nthreads) __nonnull((1, 2));
+
+/* Description of the error */
+const char *aatree_check_message(aatree_check_error error);
+
+#endif /* AATREE_CHECK_H */
@@ -0,0 +1,767 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#include <errno.h>
+#include <string.h>
+#include "aatree_ckpt.h"
+
+/* Flags of the bounds of a range, a missing bound is infinite */
+#define RANGE_LO 0x1
+#define RANGE_LO_EQ 0x2
+#define RANGE_HI 0x4
+#define RANGE_HI_EQ 0x8
+#define RANGE_END 0x10
+
+#define ckpt_node(n) ((aatree_ckpt_node_t *)(n))
+
+/* Range records being written */
+typedef struct range_out
+{
+  aatree_io_write_fn *write;
+  void               *arg;
+  uint8_t            *buffer;
+  size_t              capacity;
+  size_t              count;
+  unsigned            flags;
+  size_t              entry_size;
+  size_t              key_size;
+  size_t              key_offset;
+} range_out_t;
+
+/* Range records being read */
+typedef struct range_in
+{
+  aatree_io_read_fn *read;
+  void              *arg;
+  size_t             entry_size;
+  size_t             key_size;
+
+  /* Bounds of the record, not kept if NULL */
+  uint8_t           *lo;
+  uint8_t           *hi;
+  uint32_t           count;
+  uint32_t           flags;
+  uint32_t           crc;
+  uint32_t           expected;
+} range_in_t;
+
+static __inline__ void store_u32(uint8_t *out, uint32_t value)
+{
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+  out[2] = (uint8_t)(value >> 16);
+  out[3] = (uint8_t)(value >> 24);
+} /* store_u32 */
+
+static __inline__ uint32_t load_u32(const uint8_t *in)
+{
+  return in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16
+         | (uint32_t)in[3] << 24;
+} /* load_u32 */
+
+/* Set a node dirty along with its ancestors, which are updated as well */
+static void mark_dirty(const aatree_t *tree, aatree_node_t *node)
+{
+  (void)tree;
+
+  ckpt_node(node)->dirty = 1;
+} /* mark_dirty */
+
+void aatree_ckpt_init(aatree_ckpt_t      *ckpt,
+                      uint16_t            node_offset,
+                      uint16_t            key_offset,
+                      aatree_keys_compare cmp,
+                      size_t              entry_size,
+                      size_t              key_size)
+{
+  aatree_init_tree(&ckpt->tree, node_offset, key_offset, cmp);
+  aatree_augment(&ckpt->tree, mark_dirty);
+
+  ckpt->generation = 0;
+  ckpt->entry_size = entry_size;
+  ckpt->key_size   = key_size;
+} /* aatree_ckpt_init */
+
+static int write_header(aatree_io_write_fn *write,
+                        void               *arg,
+                        uint64_t            generation,
+                        uint64_t            base)
+{
+  uint8_t header[AATREE_CKPT_HEADER];
+
+  store_u32(header, AATREE_CKPT_MAGIC);
+  store_u32(header + 4, AATREE_CKPT_VERSION);
+  store_u32(header + 8, (uint32_t)generation);
+  store_u32(header + 12, (uint32_t)(generation >> 32));
+  store_u32(header + 16, (uint32_t)base);
+  store_u32(header + 20, (uint32_t)(base >> 32));
+
+  return write(header, sizeof(header), arg);
+} /* write_header */
+
+static int read_header(aatree_io_read_fn *read,
+                       void              *arg,
+                       uint64_t          *generation,
+                       uint64_t          *base)
+{
+  uint8_t header[AATREE_CKPT_HEADER];
+  int     error = 0;
+
+  if ((error = read(header, sizeof(header), arg)))
+  {
+    return error;
+  }
+
+  if (load_u32(header) != AATREE_CKPT_MAGIC
+      || load_u32(header + 4) != AATREE_CKPT_VERSION)
+  {
+    return EINVAL;
+  }
+
+  *generation = load_u32(header + 8) | (uint64_t)load_u32(header + 12) << 32;
+  *base       = load_u32(header + 16) | (uint64_t)load_u32(header + 20) << 32;
+
+  return 0;
+} /* read_header */
+
+/* Bound of the record in the buffer */
+static __inline__ uint8_t *out_key(range_out_t *out, int hi)
+{
+  return out->buffer + AATREE_CKPT_RECORD + hi * out->key_size;
+} /* out_key */
+
+/* Entry of the record in the buffer */
+static __inline__ uint8_t *out_entry(range_out_t *out, size_t i)
+{
+  return out->buffer + AATREE_CKPT_RECORD + 2 * out->key_size
+         + i * out->entry_size;
+} /* out_entry */
+
+static int out_init(range_out_t         *out,
+                    const aatree_ckpt_t *ckpt,
+                    aatree_io_write_fn  *write,
+                    void                *arg,
+                    void                *buffer,
+                    size_t               size)
+{
+  size_t framing = AATREE_CKPT_RECORD + 2 * ckpt->key_size;
+
+  out->write      = write;
+  out->arg        = arg;
+  out->buffer     = buffer;
+  out->capacity   = size > framing ? (size - framing) / ckpt->entry_size : 0;
+  out->count      = 0;
+  out->flags      = 0;
+  out->entry_size = ckpt->entry_size;
+  out->key_size   = ckpt->key_size;
+  out->key_offset = ckpt->tree.offset.key;
+
+  return out->capacity ? 0 : EINVAL;
+} /* out_init */
+
+/* Write the record out */
+static int out_flush(range_out_t *out)
+{
+  uint8_t *end = out_entry(out, out->count);
+
+  store_u32(out->buffer + 4, (uint32_t)out->count);
+  store_u32(out->buffer + 8, out->flags);
+  store_u32(out->buffer + 12, 0);
+  store_u32(out->buffer,
+            aatree_io_crc32(0, out->buffer + 4, end - out->buffer - 4));
+
+  return out->write(out->buffer, end - out->buffer, out->arg);
+} /* out_flush */
+
+/* Start a range after the key, or from the lowest one if it is NULL */
+static void out_begin(range_out_t *out, const void *lo, unsigned flags)
+{
+  out->count = 0;
+  out->flags = lo ? RANGE_LO | flags : 0;
+
+  memset(out_key(out, 0), 0, 2 * out->key_size);
+
+  if (lo)
+  {
+    memcpy(out_key(out, 0), lo, out->key_size);
+  }
+} /* out_begin */
+
+/* Slot of the next entry of the range. A full record is closed at its last
+ * key and the range goes on in the next one. */
+static int out_slot(range_out_t *out, uint8_t **slot)
+{
+  int error = 0;
+
+  if (out->count == out->capacity)
+  {
+    uint8_t *last = out_entry(out, out->count - 1) + out->key_offset;
+
+    memcpy(out_key(out, 1), last, out->key_size);
+    out->flags |= RANGE_HI | RANGE_HI_EQ;
+
+    if ((error = out_flush(out)))
+    {
+      return error;
+    }
+
+    memcpy(out_key(out, 0), out_key(out, 1), out->key_size);
+    memset(out_key(out, 1), 0, out->key_size);
+    out->flags = RANGE_LO;
+    out->count = 0;
+  }
+
+  *slot = out_entry(out, out->count++);
+
+  return 0;
+} /* out_slot */
+
+static int out_add(range_out_t *out, const void *entry)
+{
+  uint8_t *slot  = NULL;
+  int      error = 0;
+
+  if (!(error = out_slot(out, &slot)))
+  {
+    memcpy(slot, entry, out->entry_size);
+  }
+
+  return error;
+} /* out_add */
+
+/* End the range before the key, or after the highest one if it is NULL */
+static int out_end(range_out_t *out, const void *hi, unsigned flags)
+{
+  if (hi)
+  {
+    memcpy(out_key(out, 1), hi, out->key_size);
+    out->flags |= RANGE_HI | flags;
+  }
+
+  return out_flush(out);
+} /* out_end */
+
+/* Mark the end of the file */
+static int out_finish(range_out_t *out)
+{
+  out_begin(out, NULL, 0);
+  out->flags = RANGE_END;
+
+  return out_flush(out);
+} /* out_finish */
+
+/* Save the whole subtree as the range between the bounds */
+static int write_range(aatree_ckpt_t  *ckpt,
+                       range_out_t    *out,
+                       aatree_node_t  *node,
+                       aatree_node_t  *lo,
+                       aatree_node_t  *hi)
+{
+  aatree_t      *tree  = &ckpt->tree;
+  aatree_node_t *last  = node;
+  int            error = 0;
+
+  out_begin(out, lo ? aatree_node_key(tree, lo) : NULL, 0);
+
+  if (node)
+  {
+    for (; last->right; last = last->right)
+    {
+    }
+
+    for (; node->left; node = node->left)
+    {
+    }
+
+    for (;; node = aatree_next_node(node))
+    {
+      if ((error = out_add(out, aatree_node_entry(tree, node))))
+      {
+        return error;
+      }
+
+      if (node == last)
+      {
+        break;
+      }
+    }
+  }
+
+  return out_end(out, hi ? aatree_node_key(tree, hi) : NULL, 0);
+} /* write_range */
+
+/* Save the dirty ranges of the subtree between the bounds */
+static int write_dirty(aatree_ckpt_t  *ckpt,
+                       range_out_t    *out,
+                       aatree_node_t  *node,
+                       aatree_node_t  *lo,
+                       aatree_node_t  *hi)
+{
+  aatree_t *tree  = &ckpt->tree;
+  int       error = 0;
+
+  if (node && !ckpt_node(node)->dirty)
+  {
+    return 0;
+  }
+
+  if (!node || node->level <= AATREE_CKPT_GRAIN_LEVEL)
+  {
+    return write_range(ckpt, out, node, lo, hi);
+  }
+
+  /* The node itself goes as a range of its key alone. */
+  if ((error = write_dirty(ckpt, out, node->left, lo, node)))
+  {
+    return error;
+  }
+
+  out_begin(out, aatree_node_key(tree, node), RANGE_LO_EQ);
+
+  if ((error = out_add(out, aatree_node_entry(tree, node)))
+      || (error = out_end(out, aatree_node_key(tree, node), RANGE_HI_EQ)))
+  {
+    return error;
+  }
+
+  return write_dirty(ckpt, out, node->right, node, hi);
+} /* write_dirty */
+
+/* Clear the marks of the dirty nodes */
+static void clear_dirty(aatree_node_t *node)
+{
+  if (node && ckpt_node(node)->dirty)
+  {
+    ckpt_node(node)->dirty = 0;
+
+    clear_dirty(node->left);
+    clear_dirty(node->right);
+  }
+} /* clear_dirty */
+
+int aatree_ckpt_write(aatree_ckpt_t      *ckpt,
+                      int                 full,
+                      aatree_io_write_fn *write,
+                      void               *arg,
+                      void               *buffer,
+                      size_t              size)
+{
+  range_out_t out;
+  int         error = 0;
+
+  if ((error = out_init(&out, ckpt, write, arg, buffer, size)))
+  {
+    return error;
+  }
+
+  if ((error = write_header(write, arg, ckpt->generation + 1,
+                            full ? 0 : ckpt->generation)))
+  {
+    return error;
+  }
+
+  /* An empty tree is saved as an empty range, whatever was deleted. */
+  if (full || !ckpt->tree.root)
+    error = write_range(ckpt, &out, ckpt->tree.root, NULL, NULL);
+  else
+    error = write_dirty(ckpt, &out, ckpt->tree.root, NULL, NULL);
+
+  if (error || (error = out_finish(&out)))
+  {
+    return error;
+  }
+
+  clear_dirty(ckpt->tree.root);
+  ckpt->generation++;
+
+  return 0;
+} /* aatree_ckpt_write */
+
+/* Read the header and bounds of the next record */
+static int in_record(range_in_t *in)
+{
+  uint8_t header[AATREE_CKPT_RECORD];
+  uint8_t skip[64];
+  size_t  left  = 2 * in->key_size;
+  int     error = 0;
+
+  if ((error = in->read(header, sizeof(header), in->arg)))
+  {
+    return error;
+  }
+
+  in->expected = load_u32(header);
+  in->count    = load_u32(header + 4);
+  in->flags    = load_u32(header + 8);
+  in->crc      = aatree_io_crc32(0, header + 4, sizeof(header) - 4);
+
+  /* Without room for the bounds they are only checked. */
+  if (in->lo)
+  {
+    if ((error = in->read(in->lo, in->key_size, in->arg))
+        || (error = in->read(in->hi, in->key_size, in->arg)))
+    {
+      return error;
+    }
+
+    in->crc = aatree_io_crc32(in->crc, in->lo, in->key_size);
+    in->crc = aatree_io_crc32(in->crc, in->hi, in->key_size);
+  }
+
+  for (; !in->lo && left; left -= left < sizeof(skip) ? left : sizeof(skip))
+  {
+    size_t part = left < sizeof(skip) ? left : sizeof(skip);
+
+    if ((error = in->read(skip, part, in->arg)))
+    {
+      return error;
+    }
+
+    in->crc = aatree_io_crc32(in->crc, skip, part);
+  }
+
+  if (!in->count && in->crc != in->expected)
+  {
+    return EBADMSG;
+  }
+
+  return 0;
+} /* in_record */
+
+/* Read the next entry of the record */
+static int in_entry(range_in_t *in, void *entry)
+{
+  int error = 0;
+
+  if ((error = in->read(entry, in->entry_size, in->arg)))
+  {
+    return error;
+  }
+
+  in->crc = aatree_io_crc32(in->crc, entry, in->entry_size);
+
+  if (!--in->count && in->crc != in->expected)
+  {
+    return EBADMSG;
+  }
+
+  return 0;
+} /* in_entry */
+
+/* Read the next entry of the file, across the records. Sets more
+ * to zero at the end of the file. */
+static int in_next(range_in_t *in, void *entry, int *more)
+{
+  int error = 0;
+
+  while (!in->count)
+  {
+    if ((error = in_record(in)))
+    {
+      return error;
+    }
+
+    if (in->flags & RANGE_END)
+    {
+      *more = 0;
+      return 0;
+    }
+  }
+
+  *more = 1;
+
+  return in_entry(in, entry);
+} /* in_next */
+
+/* Position of the key against the range of the record: negative if it is
+ * below, zero if it is in, positive if it is above */
+static int in_compare(const range_in_t    *in,
+                      const aatree_ckpt_t *ckpt,
+                      const void          *key)
+{
+  int result = 0;
+
+  if (in->flags & RANGE_LO)
+  {
+    result = ckpt->tree.cmp(key, in->lo);
+
+    if (result < 0 || (!result && !(in->flags & RANGE_LO_EQ)))
+    {
+      return -1;
+    }
+  }
+
+  if (in->flags & RANGE_HI)
+  {
+    result = ckpt->tree.cmp(key, in->hi);
+
+    if (result > 0 || (!result && !(in->flags & RANGE_HI_EQ)))
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+} /* in_compare */
+
+int aatree_ckpt_compact(const aatree_ckpt_t *ckpt,
+                        aatree_io_read_fn   *base,
+                        void                *base_arg,
+                        aatree_io_read_fn   *delta,
+                        void                *delta_arg,
+                        aatree_io_write_fn  *write,
+                        void                *write_arg,
+                        void                *buffer,
+                        size_t               size,
+                        void                *scratch)
+{
+  range_out_t out;
+  range_in_t  old;
+  range_in_t  new;
+  uint8_t    *entry = scratch;
+  uint64_t    generation[2];
+  uint64_t    parent[2];
+  int         more  = 0;
+  int         error = 0;
+
+  if ((error = out_init(&out, ckpt, write, write_arg, buffer, size)))
+  {
+    return error;
+  }
+
+  memset(&old, 0, sizeof(old));
+  old.read       = base;
+  old.arg        = base_arg;
+  old.entry_size = ckpt->entry_size;
+  old.key_size   = ckpt->key_size;
+
+  new      = old;
+  new.read = delta;
+  new.arg  = delta_arg;
+  new.lo   = entry + ckpt->entry_size;
+  new.hi   = new.lo + ckpt->key_size;
+
+  if ((error = read_header(base, base_arg, &generation[0], &parent[0]))
+      || (error = read_header(delta, delta_arg, &generation[1], &parent[1])))
+  {
+    return error;
+  }
+
+  if (parent[0] || parent[1] != generation[0])
+  {
+    return EINVAL;
+  }
+
+  if ((error = write_header(write, write_arg, generation[1], 0))
+      || (error = in_next(&old, entry, &more)))
+  {
+    return error;
+  }
+
+  out_begin(&out, NULL, 0);
+
+  for (;;)
+  {
+    uint8_t *slot = NULL;
+
+    if ((error = in_record(&new)))
+    {
+      return error;
+    }
+
+    if (new.flags & RANGE_END)
+    {
+      break;
+    }
+
+    /* Entries of the base below the range are kept, the ones in it are
+     * replaced by the entries of the increment. */
+    for (; more && in_compare(&new, ckpt, entry + out.key_offset) < 0;)
+    {
+      if ((error = out_add(&out, entry))
+          || (error = in_next(&old, entry, &more)))
+      {
+        return error;
+      }
+    }
+
+    for (; more && !in_compare(&new, ckpt, entry + out.key_offset);)
+    {
+      if ((error = in_next(&old, entry, &more)))
+      {
+        return error;
+      }
+    }
+
+    while (new.count)
+    {
+      if ((error = out_slot(&out, &slot)) || (error = in_entry(&new, slot)))
+      {
+        return error;
+      }
+    }
+  }
+
+  for (; more;)
+  {
+    if ((error = out_add(&out, entry)) || (error = in_next(&old, entry, &more)))
+    {
+      return error;
+    }
+  }
+
+  if ((error = out_end(&out, NULL, 0)))
+  {
+    return error;
+  }
+
+  return out_finish(&out);
+} /* aatree_ckpt_compact */
+
+/* Link the entries of a record read in full, chained through the right
+ * links, unless they do not follow the tree in key order */
+static int link_record(aatree_ckpt_t *ckpt, aatree_node_t **pending)
+{
+  aatree_t      *tree = &ckpt->tree;
+  aatree_node_t *prev = tree->last;
+  aatree_node_t *node = *pending;
+  aatree_node_t *next = NULL;
+
+  for (; node; prev = node, node = node->right)
+  {
+    if (prev
+        && tree->cmp(aatree_node_key(tree, node), aatree_node_key(tree, prev))
+               <= 0)
+    {
+      return EBADMSG;
+    }
+  }
+
+  for (node = *pending; node; node = next)
+  {
+    next        = node->right;
+    node->right = NULL;
+    aatree_append(tree, node);
+  }
+
+  *pending = NULL;
+
+  return 0;
+} /* link_record */
+
+int aatree_ckpt_load(aatree_ckpt_t        *ckpt,
+                     aatree_io_read_fn    *read,
+                     void                 *read_arg,
+                     aatree_io_alloc_fn   *alloc,
+                     aatree_io_release_fn *release,
+                     void                 *alloc_arg)
+{
+  range_in_t     in;
+  aatree_node_t *pending    = NULL;
+  aatree_node_t *last       = NULL;
+  uint64_t       generation = 0;
+  uint64_t       parent     = 0;
+  int            error      = 0;
+
+  if (ckpt->tree.root)
+  {
+    return EINVAL;
+  }
+
+  if ((error = read_header(read, read_arg, &generation, &parent)))
+  {
+    return error;
+  }
+
+  if (parent)
+  {
+    return EINVAL;
+  }
+
+  memset(&in, 0, sizeof(in));
+  in.read       = read;
+  in.arg        = read_arg;
+  in.entry_size = ckpt->entry_size;
+  in.key_size   = ckpt->key_size;
+
+  for (;;)
+  {
+    void          *entry = NULL;
+    aatree_node_t *node  = NULL;
+
+    if (!in.count)
+    {
+      if ((error = in_record(&in)))
+        break;
+
+      if (in.flags & RANGE_END)
+        break;
+
+      continue;
+    }
+
+    if (!(entry = alloc(alloc_arg)))
+    {
+      error = ENOMEM;
+      break;
+    }
+
+    if ((error = in_entry(&in, entry)))
+    {
+      release(entry, alloc_arg);
+      break;
+    }
+
+    /* The entries wait for the CRC at the end of the record. */
+    node = aatree_entry_node(&ckpt->tree, entry);
+    aatree_init_node(node);
+
+    if (pending)
+      last->right = node;
+    else
+      pending = node;
+
+    last = node;
+
+    if (!in.count && (error = link_record(ckpt, &pending)))
+    {
+      break;
+    }
+  }
+
+  for (; pending; pending = last)
+  {
+    last = pending->right;
+    release(aatree_node_entry(&ckpt->tree, pending), alloc_arg);
+  }
+
+  if (error)
+  {
+    return error;
+  }
+
+  clear_dirty(ckpt->tree.root);
+  ckpt->generation = generation;
+
+  return 0;
+} /* aatree_ckpt_load */
@@ -0,0 +1,139 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#ifndef AATREE_CKPT_H
+#define AATREE_CKPT_H
+
+#include "aatree_io.h"
+
+/* Incremental checkpoints of a tree of fixed size entries.
+ *
+ * The tree is augmented with a dirty mark per node: the update function is
+ * called on every node whose subtree changes, by inserts, deletes and
+ * rotations alike, and on every node whose bounding keys change, so a clean
+ * node roots a subtree untouched since the last checkpoint, between the same
+ * keys. A checkpoint descends the dirty nodes only and saves the key ranges
+ * of the low dirty subtrees as a whole, their entries replacing whatever a
+ * previous checkpoint had in the range, deleted keys included. Its work is
+ * proportional to the changes, not to the size of the tree.
+ *
+ * A file is a header, then range records in key order: a CRC-32 of the rest,
+ * the entry count, flags of the bounds, the bounds and the entries, copied as
+ * plain bytes. A full checkpoint tiles the whole key space. Compaction applies
+ * an increment to the full checkpoint it was taken after, making the next
+ * full one without the tree.
+ *
+ * The tree must only be changed by the functions which call the update
+ * function with the tree itself, not the set operations nor the parallel
+ * builds, and must not be changed during a checkpoint.
+ */
+
+#define AATREE_CKPT_MAGIC 0x4b434141
+#define AATREE_CKPT_VERSION 1
+
+/* Dirty subtrees of this level or lower are saved whole */
+#define AATREE_CKPT_GRAIN_LEVEL 4
+
+/* Framing of the file and of a range record, with the bounds */
+#define AATREE_CKPT_HEADER 24
+#define AATREE_CKPT_RECORD 16
+
+/* Node of a tracked tree, in place of aatree_node_t */
+typedef struct aatree_ckpt_node
+{
+  aatree_node_t node;
+  uint8_t       dirty;
+} aatree_ckpt_node_t;
+
+typedef struct aatree_ckpt
+{
+  aatree_t tree;
+
+  /* Number of the last checkpoint, increments refer to it */
+  uint64_t generation;
+
+  size_t entry_size;
+  size_t key_size;
+} aatree_ckpt_t;
+
+/* Init an empty tracked tree. The node offset is the one of an
+ * aatree_ckpt_node_t. */
+void aatree_ckpt_init(aatree_ckpt_t      *ckpt,
+                      uint16_t            node_offset,
+                      uint16_t            key_offset,
+                      aatree_keys_compare cmp,
+                      size_t              entry_size,
+                      size_t              key_size) __nonnull((1, 4));
+
+/* Mark an entry changed in place */
+static __inline__ __nonnull((1, 2)) void aatree_ckpt_touch(aatree_ckpt_t *ckpt,
+                                                          void *entry)
+{
+  aatree_refresh(&ckpt->tree, aatree_entry_node(&ckpt->tree, entry));
+} /* aatree_ckpt_touch */
+
+/* Save all entries, or only the ranges changed since the last checkpoint,
+ * through the write callback, framing the records in the buffer of size
+ * bytes, which must hold the bounds and an entry at least. The marks are
+ * cleared and the generation advanced on success only. Returns zero, EINVAL
+ * if the buffer is too small, or the error of the write callback. */
+int aatree_ckpt_write(aatree_ckpt_t      *ckpt,
+                      int                 full,
+                      aatree_io_write_fn *write,
+                      void               *arg,
+                      void               *buffer,
+                      size_t              size) __nonnull((1, 3, 5));
+
+/* Apply the increment read by delta to the full checkpoint read by base and
+ * write the next full checkpoint, framing the records in the buffer of size
+ * bytes. The scratch memory holds an entry and two keys, in this order, and
+ * must be aligned for them. Only the layout of the tree is used. Returns zero,
+ * EINVAL if the increment does not follow the base or the buffer is too
+ * small, EBADMSG if a record is corrupted, or the error of a callback. */
+int aatree_ckpt_compact(const aatree_ckpt_t *ckpt,
+                        aatree_io_read_fn   *base,
+                        void                *base_arg,
+                        aatree_io_read_fn   *delta,
+                        void                *delta_arg,
+                        aatree_io_write_fn  *write,
+                        void                *write_arg,
+                        void                *buffer,
+                        size_t               size,
+                        void                *scratch)
+    __nonnull((1, 2, 4, 6, 8, 10));
+
+/* Load a full checkpoint into the empty tree, entries being taken from the
+ * alloc callback, and make it the last checkpoint. A record is checked as a
+ * whole before its entries are linked, those of a bad one are handed back to
+ * release. Returns zero, EINVAL if the tree is not empty or the file is not a
+ * full checkpoint, EBADMSG if a record is corrupted, ENOMEM if alloc fails,
+ * or the read error. The entries of the records loaded before an error are
+ * left in the tree, which is valid but not taken for the last checkpoint. */
+int aatree_ckpt_load(aatree_ckpt_t        *ckpt,
+                     aatree_io_read_fn    *read,
+                     void                 *read_arg,
+                     aatree_io_alloc_fn   *alloc,
+                     aatree_io_release_fn *release,
+                     void                 *alloc_arg) __nonnull((1, 2, 4, 5));
+
+#endif /* AATREE_CKPT_H */
@@ -0,0 +1,244 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#include "aatree_diff.h"
+
+#define entry_key(tree, entry) ((const uint8_t *)(entry) + (tree)->key_offset)
+
+/* Pending items of a version in order, the next one on top: subtrees yet to
+ * be expanded and entries of the nodes expanded. An expansion replaces a
+ * subtree with up to three items. */
+typedef struct diff_stack
+{
+  struct diff_item
+  {
+    const aatree_pnode_t *node;
+    int                   whole;
+  } items[2 * AATREE_PERSIST_MAX_DEPTH + 1];
+
+  int top;
+} diff_stack_t;
+
+/* Next node of the walk within the upper bound, or NULL */
+static __inline__ aatree_node_t *
+walk_next(const aatree_t *tree, aatree_node_t *node, const void *hi)
+{
+  node = aatree_next_node(node);
+
+  if (!node || (hi && tree->cmp(aatree_node_key(tree, node), hi) > 0))
+  {
+    return NULL;
+  }
+
+  /* The walk goes down the right son of the node next, its line is loaded
+   * while the keys are being compared. */
+  if (node->right)
+  {
+    __builtin_prefetch(node->right);
+  }
+
+  return node;
+} /* walk_next */
+
+/* First node of the walk within the bounds, or NULL */
+static aatree_node_t *
+walk_first(const aatree_t *tree, const void *lo, const void *hi)
+{
+  aatree_node_t *node = tree->first;
+
+  if (lo)
+  {
+    node = aatree_entry_node(tree, aatree_search(tree, lo, AATREE_KEY_GE));
+  }
+
+  if (node && hi && tree->cmp(aatree_node_key(tree, node), hi) > 0)
+  {
+    return NULL;
+  }
+
+  return node;
+} /* walk_first */
+
+int aatree_diff(const aatree_t         *a,
+                const aatree_t         *b,
+                const void             *lo,
+                const void             *hi,
+                aatree_diff_fn         *added,
+                aatree_diff_fn         *removed,
+                aatree_diff_changed_fn *changed,
+                void                   *arg)
+{
+  aatree_node_t *x      = walk_first(a, lo, hi);
+  aatree_node_t *y      = walk_first(b, lo, hi);
+  int            result = 0;
+
+  while (x || y)
+  {
+    int order = !x ? 1 : !y ? -1
+                            : a->cmp(aatree_node_key(a, x),
+                                     aatree_node_key(b, y));
+
+    if (order < 0)
+    {
+      if (removed && (result = removed(aatree_node_entry(a, x), arg)))
+        return result;
+    }
+    else if (order > 0)
+    {
+      if (added && (result = added(aatree_node_entry(b, y), arg)))
+        return result;
+    }
+    else if (changed
+             && (result = changed(aatree_node_entry(a, x),
+                                  aatree_node_entry(b, y), arg)))
+    {
+      return result;
+    }
+
+    if (order <= 0)
+      x = walk_next(a, x, hi);
+
+    if (order >= 0)
+      y = walk_next(b, y, hi);
+  }
+
+  return 0;
+} /* aatree_diff */
+
+static __inline__ void push(diff_stack_t *stack, const aatree_pnode_t *node,
+                            int whole)
+{
+  if (node)
+  {
+    stack->items[stack->top].node  = node;
+    stack->items[stack->top].whole = whole;
+    stack->top++;
+  }
+} /* push */
+
+/* Replace the subtree on top with its parts within the bounds */
+static void expand(const aatree_persist_t *tree,
+                   diff_stack_t           *stack,
+                   const void             *lo,
+                   const void             *hi)
+{
+  const aatree_pnode_t *node = stack->items[--stack->top].node;
+  const void           *key  = entry_key(tree, node->entry);
+
+  if (lo && tree->cmp(key, lo) < 0)
+  {
+    push(stack, node->right, 1);
+  }
+  else if (hi && tree->cmp(key, hi) > 0)
+  {
+    push(stack, node->left, 1);
+  }
+  else
+  {
+    push(stack, node->right, 1);
+    push(stack, node, 0);
+    push(stack, node->left, 1);
+  }
+} /* expand */
+
+int aatree_persist_diff(const aatree_persist_t *tree,
+                        const aatree_pnode_t   *a,
+                        const aatree_pnode_t   *b,
+                        const void             *lo,
+                        const void             *hi,
+                        aatree_diff_fn         *added,
+                        aatree_diff_fn         *removed,
+                        aatree_diff_changed_fn *changed,
+                        void                   *arg)
+{
+  diff_stack_t x;
+  diff_stack_t y;
+  int          result = 0;
+
+  x.top = 0;
+  y.top = 0;
+
+  if (a != b)
+  {
+    push(&x, a, 1);
+    push(&y, b, 1);
+  }
+
+  while (x.top || y.top)
+  {
+    struct diff_item *p     = x.top ? &x.items[x.top - 1] : NULL;
+    struct diff_item *q     = y.top ? &y.items[y.top - 1] : NULL;
+    int               order = 0;
+
+    /* Everything before the tops has been reported, a subtree shared by
+     * both holds the same keys next on both sides. */
+    if (p && q && p->whole && q->whole && p->node == q->node)
+    {
+      x.top--;
+      y.top--;
+      continue;
+    }
+
+    /* The higher subtree is expanded first, it may hold the other one. */
+    if (p && p->whole
+        && (!q || !q->whole || p->node->level >= q->node->level))
+    {
+      expand(tree, &x, lo, hi);
+      continue;
+    }
+
+    if (q && q->whole)
+    {
+      expand(tree, &y, lo, hi);
+      continue;
+    }
+
+    order = !p ? 1 : !q ? -1
+                        : tree->cmp(entry_key(tree, p->node->entry),
+                                    entry_key(tree, q->node->entry));
+
+    if (order < 0)
+    {
+      if (removed && (result = removed(p->node->entry, arg)))
+        return result;
+    }
+    else if (order > 0)
+    {
+      if (added && (result = added(q->node->entry, arg)))
+        return result;
+    }
+    else if (changed && p->node->entry != q->node->entry
+             && (result = changed(p->node->entry, q->node->entry, arg)))
+    {
+      return result;
+    }
+
+    if (order <= 0)
+      x.top--;
+
+    if (order >= 0)
+      y.top--;
+  }
+
+  return 0;
+} /* aatree_persist_diff */
@@ -0,0 +1,79 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#ifndef AATREE_DIFF_H
+#define AATREE_DIFF_H
+
+#include "aatree.h"
+#include "aatree_persist.h"
+
+/* Ordered delta between two trees with the same keys.
+ *
+ * Both trees are walked together in key order, like a merge of two sorted
+ * lists, and every key found in one of them only is reported, the keys of
+ * the first tree as removed and the ones of the second as added. The keys
+ * found in both go to the changed visitor, which tells whether the entries
+ * differ.
+ *
+ * Two versions of a persistent tree share all the subtrees no update has
+ * touched since the older one was taken. Their walk expands the subtrees
+ * from the roots down, the higher one first, and passes over a subtree the
+ * two have in common in constant time, so it takes time proportional to the
+ * updates times the height of the tree rather than to its size.
+ */
+
+/* Visitor of an entry of one tree only, a non-zero result stops the diff */
+typedef int(aatree_diff_fn)(void *entry, void *arg);
+
+/* Visitor of the entries with the same key, the old one from the first tree,
+ * a non-zero result stops the diff */
+typedef int(aatree_diff_changed_fn)(void *old, void *entry, void *arg);
+
+/* Report the difference of the trees, ordered by the comparison function of
+ * the first one, for the keys from lo to hi inclusive; either bound is open if
+ * NULL. Any visitor may be NULL. The visitors must not update the trees.
+ * Every pair of entries with the same key goes to changed. Returns zero or the
+ * non-zero result of a visitor. */
+int aatree_diff(const aatree_t         *a,
+                const aatree_t         *b,
+                const void             *lo,
+                const void             *hi,
+                aatree_diff_fn         *added,
+                aatree_diff_fn         *removed,
+                aatree_diff_changed_fn *changed,
+                void                   *arg) __nonnull((1, 2));
+
+/* Report the difference of two versions of the tree like aatree_diff(). The
+ * keys of both versions are passed to changed only if their entries are not
+ * the same, the shared subtrees are skipped. */
+int aatree_persist_diff(const aatree_persist_t *tree,
+                        const aatree_pnode_t   *a,
+                        const aatree_pnode_t   *b,
+                        const void             *lo,
+                        const void             *hi,
+                        aatree_diff_fn         *added,
+                        aatree_diff_fn         *removed,
+                        aatree_diff_changed_fn *changed,
+                        void                   *arg) __nonnull((1));
+
+#endif /* AATREE_DIFF_H */
@@ -0,0 +1,147 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include "aatree_epoch.h"
+
+/* Retired objects piling up before the epoch is advanced */
+#define AATREE_EPOCH_BATCH 32
+
+void aatree_epoch_init(aatree_epoch_t          *epoch,
+                       aatree_epoch_reclaim_fn *reclaim,
+                       void                    *arg)
+{
+  int i;
+
+  epoch->epoch   = 0;
+  epoch->records = NULL;
+  epoch->pending = 0;
+  epoch->reclaim = reclaim;
+  epoch->arg     = arg;
+
+  for (i = 0; i < AATREE_EPOCH_LISTS; i++)
+  {
+    epoch->limbo[i] = NULL;
+  }
+} /* aatree_epoch_init */
+
+void aatree_epoch_register(aatree_epoch_t        *epoch,
+                           aatree_epoch_record_t *record)
+{
+  record->state = 0;
+  record->next  = __atomic_load_n(&epoch->records, __ATOMIC_RELAXED);
+
+  while (!__atomic_compare_exchange_n(&epoch->records, &record->next, record,
+                                      1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+  {
+  }
+} /* aatree_epoch_register */
+
+void aatree_epoch_unregister(aatree_epoch_t        *epoch,
+                             aatree_epoch_record_t *record)
+{
+  aatree_epoch_record_t *prev = record;
+
+  /* New records are only ever pushed in front of the list. */
+  if (__atomic_compare_exchange_n(&epoch->records, &prev, record->next, 0,
+                                  __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+  {
+    return;
+  }
+
+  for (; prev->next != record; prev = prev->next)
+  {
+  }
+
+  prev->next = record->next;
+} /* aatree_epoch_unregister */
+
+void aatree_epoch_retire(aatree_epoch_t *epoch, aatree_epoch_entry_t *entry)
+{
+  aatree_epoch_entry_t **limbo =
+      &epoch->limbo[epoch->epoch % AATREE_EPOCH_LISTS];
+
+  entry->next = *limbo;
+  *limbo      = entry;
+
+  if (++epoch->pending >= AATREE_EPOCH_BATCH)
+  {
+    aatree_epoch_collect(epoch);
+  }
+} /* aatree_epoch_retire */
+
+size_t aatree_epoch_collect(aatree_epoch_t *epoch)
+{
+  aatree_epoch_record_t *record    = NULL;
+  aatree_epoch_entry_t  *entry     = NULL;
+  uint64_t               current   = epoch->epoch;
+  size_t                 reclaimed = 0;
+
+  /* Stores unlinking the retired objects must be ordered before the
+   * records are inspected. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  record = __atomic_load_n(&epoch->records, __ATOMIC_ACQUIRE);
+
+  for (; record; record = record->next)
+  {
+    uint64_t state = __atomic_load_n(&record->state, __ATOMIC_ACQUIRE);
+
+    if ((state & 1) && (state >> 1) != current)
+    {
+      return 0;
+    }
+  }
+
+  current++;
+  __atomic_store_n(&epoch->epoch, current, __ATOMIC_RELEASE);
+
+  /* The list being reused for the new epoch holds objects retired two
+   * epochs before the current one: no reader can still reach them. */
+  entry = epoch->limbo[current % AATREE_EPOCH_LISTS];
+  epoch->limbo[current % AATREE_EPOCH_LISTS] = NULL;
+
+  while (entry)
+  {
+    aatree_epoch_entry_t *next = entry->next;
+
+    epoch->reclaim(entry, epoch->arg);
+    entry = next;
+    reclaimed++;
+  }
+
+  epoch->pending -= reclaimed;
+
+  return reclaimed;
+} /* aatree_epoch_collect */
+
+void aatree_epoch_synchronize(aatree_epoch_t *epoch)
+{
+  while (epoch->pending)
+  {
+    if (!aatree_epoch_collect(epoch))
+    {
+      sched_yield();
+    }
+  }
+} /* aatree_epoch_synchronize */
@@ -0,0 +1,127 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AATREE_EPOCH_H
+#define AATREE_EPOCH_H
+
+#include "aatree.h"
+
+/* Epoch based reclamation.
+ *
+ * Readers announce the global epoch they observed while inside a critical
+ * section. An object removed from a shared structure is retired into the limbo
+ * list of the current epoch, and the epoch is only advanced once every active
+ * reader has observed it. Objects retired two epochs ago can not be reachable
+ * by any reader anymore, so they are handed to the reclaim function.
+ *
+ * Readers are wait-free. Retiring and collecting must be serialized by the
+ * caller, e.g. by the writers' lock. No memory is allocated: the retire link
+ * and the reader records are embedded into the caller's objects.
+ */
+
+#define AATREE_EPOCH_LISTS 3
+
+/* Link of a retired object */
+typedef struct aatree_epoch_entry
+{
+  struct aatree_epoch_entry *next;
+} aatree_epoch_entry_t;
+
+/* Reclaim function, called once the retired object is unreachable */
+typedef void(aatree_epoch_reclaim_fn)(aatree_epoch_entry_t *, void *);
+
+/* Reader record, one per thread. Records are padded to a cache line, so the
+ * readers never write to a shared one. */
+typedef struct aatree_epoch_record
+{
+  /* observed epoch shifted left by one, the low bit is set while active */
+  uint64_t state;
+
+  struct aatree_epoch_record *next;
+
+  uint8_t pad[AATREE_CACHE_LINE - sizeof(uint64_t) - sizeof(void *)];
+} aatree_epoch_record_t;
+
+/* Reclamation domain */
+typedef struct aatree_epoch
+{
+  /* Global epoch, the only field the readers load */
+  uint64_t epoch;
+  uint8_t  pad[AATREE_CACHE_LINE - sizeof(uint64_t)];
+
+  aatree_epoch_record_t *records;
+
+  /* Retired objects by epoch modulo AATREE_EPOCH_LISTS */
+  aatree_epoch_entry_t *limbo[AATREE_EPOCH_LISTS];
+  size_t                pending;
+
+  aatree_epoch_reclaim_fn *reclaim;
+  void                    *arg;
+} aatree_epoch_t;
+
+/* Init reclamation domain */
+void aatree_epoch_init(aatree_epoch_t          *epoch,
+                       aatree_epoch_reclaim_fn *reclaim,
+                       void                    *arg) __nonnull((1, 2));
+
+/* Register a reader record. An idle record never holds the epoch back.
+ * Thread-safe. */
+void aatree_epoch_register(aatree_epoch_t        *epoch,
+                           aatree_epoch_record_t *record) __nonnull((1, 2));
+
+/* Unregister an idle reader record, so its memory can be released. Must be
+ * serialized with retiring and collecting. */
+void aatree_epoch_unregister(aatree_epoch_t        *epoch,
+                             aatree_epoch_record_t *record) __nonnull((1, 2));
+
+/* Enter read-side critical section. Sections do not nest. */
+static __inline__ __nonnull((1, 2)) void
+aatree_epoch_enter(aatree_epoch_t *epoch, aatree_epoch_record_t *record)
+{
+  uint64_t observed = __atomic_load_n(&epoch->epoch, __ATOMIC_ACQUIRE);
+
+  __atomic_store_n(&record->state, (observed << 1) | 1, __ATOMIC_RELAXED);
+
+  /* The announcement must be visible before any shared pointer is loaded. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+} /* aatree_epoch_enter */
+
+/* Leave read-side critical section */
+static __inline__ __nonnull((1)) void
+aatree_epoch_exit(aatree_epoch_record_t *record)
+{
+  __atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+} /* aatree_epoch_exit */
+
+/* Retire an object which has been made unreachable for new readers, and try
+ * to reclaim older ones */
+void aatree_epoch_retire(aatree_epoch_t       *epoch,
+                         aatree_epoch_entry_t *entry) __nonnull((1, 2));
+
+/* Try to advance the epoch. Returns number of objects reclaimed. */
+size_t aatree_epoch_collect(aatree_epoch_t *epoch) __nonnull((1));
+
+/* Wait until every retired object is reclaimed. Must not be called from a
+ * read-side critical section. */
+void aatree_epoch_synchronize(aatree_epoch_t *epoch) __nonnull((1));
+
+#endif /* AATREE_EPOCH_H */
@@ -0,0 +1,205 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include "aatree_fc.h"
+
+int aatree_fc_init(aatree_fc_t        *fc,
+                   uint16_t            node_offset,
+                   uint16_t            key_offset,
+                   aatree_keys_compare cmp)
+{
+  aatree_init_tree(&fc->tree, node_offset, key_offset, cmp);
+
+  fc->slots     = NULL;
+  fc->combining = 0;
+  fc->passes    = 0;
+  fc->combined  = 0;
+
+  return pthread_mutex_init(&fc->lock, NULL);
+} /* aatree_fc_init */
+
+void aatree_fc_destroy(aatree_fc_t *fc)
+{
+  pthread_mutex_destroy(&fc->lock);
+} /* aatree_fc_destroy */
+
+void aatree_fc_register(aatree_fc_t *fc, aatree_fc_slot_t *slot)
+{
+  slot->pending = 0;
+  slot->next    = __atomic_load_n(&fc->slots, __ATOMIC_RELAXED);
+
+  while (!__atomic_compare_exchange_n(&fc->slots, &slot->next, slot, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+  {
+  }
+} /* aatree_fc_register */
+
+void aatree_fc_unregister(aatree_fc_t *fc, aatree_fc_slot_t *slot)
+{
+  aatree_fc_slot_t *prev = slot;
+
+  /* The combiner walks the list under the lock, so unlink under it too. New
+   * slots are only ever pushed in front of the list. */
+  pthread_mutex_lock(&fc->lock);
+
+  if (!__atomic_compare_exchange_n(&fc->slots, &prev, slot->next, 0,
+                                   __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+  {
+    for (; prev->next != slot; prev = prev->next)
+    {
+    }
+
+    prev->next = slot->next;
+  }
+
+  pthread_mutex_unlock(&fc->lock);
+} /* aatree_fc_unregister */
+
+/* Sort the batch by key, it is short and usually nearly sorted */
+static void sort_batch(const aatree_t *tree, aatree_fc_slot_t **batch, int n)
+{
+  int i, j;
+
+  for (i = 1; i < n; i++)
+  {
+    aatree_fc_slot_t *slot = batch[i];
+
+    for (j = i; j > 0 && tree->cmp(slot->key, batch[j - 1]->key) < 0; j--)
+    {
+      batch[j] = batch[j - 1];
+    }
+
+    batch[j] = slot;
+  }
+} /* sort_batch */
+
+/* Serve the pending requests, the lock must be held */
+static void combine(aatree_fc_t *fc)
+{
+  aatree_fc_slot_t *batch[AATREE_FC_BATCH];
+  aatree_fc_slot_t *slot = __atomic_load_n(&fc->slots, __ATOMIC_ACQUIRE);
+  int               n    = 0;
+  int               i;
+
+  for (; slot && n < AATREE_FC_BATCH; slot = slot->next)
+  {
+    if (__atomic_load_n(&slot->pending, __ATOMIC_ACQUIRE))
+    {
+      batch[n++] = slot;
+    }
+  }
+
+  sort_batch(&fc->tree, batch, n);
+
+  for (i = 0; i < n; i++)
+  {
+    slot = batch[i];
+
+    switch (slot->op)
+    {
+      case AATREE_FC_INSERT:
+        slot->result = aatree_insert(&fc->tree, slot->node);
+        break;
+
+      case AATREE_FC_DELETE:
+        aatree_delete(&fc->tree, slot->node);
+        slot->result = NULL;
+        break;
+
+      case AATREE_FC_SEARCH:
+      default:
+        slot->result =
+            aatree_search(&fc->tree, slot->key, (aatree_keys_order)slot->order);
+    }
+
+    __atomic_store_n(&slot->pending, 0, __ATOMIC_RELEASE);
+  }
+
+  fc->passes++;
+  fc->combined += n;
+} /* combine */
+
+/* Publish the request and wait until some combiner, possibly this thread,
+ * has served it */
+static void *submit(aatree_fc_t *fc, aatree_fc_slot_t *slot)
+{
+  int spins = 0;
+
+  __atomic_store_n(&slot->pending, 1, __ATOMIC_RELEASE);
+
+  while (__atomic_load_n(&slot->pending, __ATOMIC_ACQUIRE))
+  {
+    /* A trylock writes to the line of the lock, a load of the flag does not
+     * while the combiner is at work. */
+    if (!__atomic_load_n(&fc->combining, __ATOMIC_RELAXED)
+        && !pthread_mutex_trylock(&fc->lock))
+    {
+      __atomic_store_n(&fc->combining, 1, __ATOMIC_RELAXED);
+      combine(fc);
+      __atomic_store_n(&fc->combining, 0, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&fc->lock);
+    }
+    else if (++spins == AATREE_FC_SPINS)
+    {
+      spins = 0;
+      sched_yield();
+    }
+  }
+
+  return slot->result;
+} /* submit */
+
+void *aatree_fc_insert(aatree_fc_t      *fc,
+                       aatree_fc_slot_t *slot,
+                       aatree_node_t    *node)
+{
+  slot->op   = AATREE_FC_INSERT;
+  slot->node = node;
+  slot->key  = aatree_node_key(&fc->tree, node);
+
+  return submit(fc, slot);
+} /* aatree_fc_insert */
+
+void aatree_fc_delete(aatree_fc_t      *fc,
+                      aatree_fc_slot_t *slot,
+                      aatree_node_t    *node)
+{
+  slot->op   = AATREE_FC_DELETE;
+  slot->node = node;
+  slot->key  = aatree_node_key(&fc->tree, node);
+
+  submit(fc, slot);
+} /* aatree_fc_delete */
+
+void *aatree_fc_search(aatree_fc_t      *fc,
+                       aatree_fc_slot_t *slot,
+                       const void       *key,
+                       aatree_keys_order order)
+{
+  slot->op    = AATREE_FC_SEARCH;
+  slot->order = (uint8_t)order;
+  slot->key   = key;
+
+  return submit(fc, slot);
+} /* aatree_fc_search */
@@ -0,0 +1,116 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AATREE_FC_H
+#define AATREE_FC_H
+
+#include <pthread.h>
+#include "aatree.h"
+
+/* Flat combining front end of an AA tree.
+ *
+ * Instead of queueing on the lock, every thread publishes its request in a
+ * slot of its own. Whichever thread gets the lock becomes the combiner: it
+ * collects the pending requests, sorts them by key so that consecutive
+ * operations descend along the same, cache-hot paths, applies them in one
+ * pass and hands the results back. Waiting threads spin on their own slot
+ * and try the lock only once no combiner is seen at work, so the lock changes
+ * hands once per batch instead of once per operation.
+ */
+
+/* Requests applied by one combining pass at most */
+#define AATREE_FC_BATCH 256
+
+/* Spins on the slot before yielding the processor */
+#define AATREE_FC_SPINS 128
+
+typedef enum aatree_fc_op_e
+{
+  AATREE_FC_INSERT,
+  AATREE_FC_DELETE,
+  AATREE_FC_SEARCH
+} aatree_fc_op;
+
+/* Request slot, one per thread, padded to a cache line */
+typedef struct aatree_fc_slot
+{
+  /* set by the owner when the request is published, cleared when served */
+  int pending;
+
+  uint8_t        op;
+  uint8_t        order;
+  const void    *key;
+  aatree_node_t *node;
+  void          *result;
+
+  struct aatree_fc_slot *next;
+} __attribute__((aligned(AATREE_CACHE_LINE))) aatree_fc_slot_t;
+
+typedef struct aatree_fc
+{
+  aatree_t tree;
+
+  pthread_mutex_t   lock;
+  aatree_fc_slot_t *slots;
+
+  /* Set while a combiner holds the lock, waiters only load it */
+  int combining;
+
+  /* Combining passes and requests served by them */
+  uint64_t passes;
+  uint64_t combined;
+} aatree_fc_t;
+
+/* Init empty tree. Returns zero on success or an error number. */
+int aatree_fc_init(aatree_fc_t        *fc,
+                   uint16_t            node_offset,
+                   uint16_t            key_offset,
+                   aatree_keys_compare cmp) __nonnull((1, 4));
+
+/* Release the lock */
+void aatree_fc_destroy(aatree_fc_t *fc) __nonnull((1));
+
+/* Register the request slot of the calling thread. Thread-safe. */
+void aatree_fc_register(aatree_fc_t *fc, aatree_fc_slot_t *slot)
+    __nonnull((1, 2));
+
+/* Unregister the slot before its thread exits */
+void aatree_fc_unregister(aatree_fc_t *fc, aatree_fc_slot_t *slot)
+    __nonnull((1, 2));
+
+/* Try to insert node into tree or return an existing entry */
+void *aatree_fc_insert(aatree_fc_t      *fc,
+                       aatree_fc_slot_t *slot,
+                       aatree_node_t    *node) __nonnull((1, 2, 3));
+
+/* Delete node from the tree */
+void aatree_fc_delete(aatree_fc_t      *fc,
+                      aatree_fc_slot_t *slot,
+                      aatree_node_t    *node) __nonnull((1, 2, 3));
+
+/* Search entry like aatree_search() */
+void *aatree_fc_search(aatree_fc_t      *fc,
+                       aatree_fc_slot_t *slot,
+                       const void       *key,
+                       aatree_keys_order order) __nonnull((1, 2));
+
+#endif /* AATREE_FC_H */
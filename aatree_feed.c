@@ -0,0 +1,492 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#include <errno.h>
+#include <string.h>
+#include "aatree_feed.h"
+
+/* Longest varint of a size and of a key */
+#define VARINT_SIZE 5
+#define VARINT_KEY 10
+
+static __inline__ void store_u32(uint8_t *out, uint32_t value)
+{
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+  out[2] = (uint8_t)(value >> 16);
+  out[3] = (uint8_t)(value >> 24);
+} /* store_u32 */
+
+static __inline__ uint32_t load_u32(const uint8_t *in)
+{
+  return in[0] | (uint32_t)in[1] << 8 | (uint32_t)in[2] << 16
+         | (uint32_t)in[3] << 24;
+} /* load_u32 */
+
+/* Store the value in 7 bit groups, low ones first. Returns number of bytes
+ * used. */
+static size_t store_varint(uint8_t *out, uint64_t value)
+{
+  size_t n = 0;
+
+  for (; value >= 0x80; value >>= 7)
+  {
+    out[n++] = (uint8_t)(value | 0x80);
+  }
+
+  out[n++] = (uint8_t)value;
+
+  return n;
+} /* store_varint */
+
+/* Returns number of bytes read, or zero if the varint is cut or too long */
+static size_t load_varint(const uint8_t *in, size_t size, uint64_t *value)
+{
+  size_t n = 0;
+
+  for (*value = 0; n < size && n < VARINT_KEY; n++)
+  {
+    *value |= (uint64_t)(in[n] & 0x7f) << (7 * n);
+
+    if (!(in[n] & 0x80))
+    {
+      return n + 1;
+    }
+  }
+
+  return 0;
+} /* load_varint */
+
+/* Checksum of a block past the checksum itself */
+static __inline__ uint32_t block_crc(const uint8_t *block, size_t payload)
+{
+  return aatree_io_crc32(0, block + 4, AATREE_FEED_BLOCK_HEADER - 4 + payload);
+} /* block_crc */
+
+/* Difference of the keys with the sign in the low bit, small either way */
+static __inline__ uint64_t zigzag(uint64_t delta)
+{
+  return delta << 1 ^ (0 - (delta >> 63));
+} /* zigzag */
+
+static __inline__ uint64_t unzigzag(uint64_t value)
+{
+  return value >> 1 ^ (0 - (value & 1));
+} /* unzigzag */
+
+void aatree_feed_init(aatree_feed_t      *feed,
+                      uint16_t            node_offset,
+                      uint16_t            key_offset,
+                      aatree_keys_compare cmp)
+{
+  memset(feed, 0, sizeof(*feed));
+  aatree_init_tree(&feed->tree, node_offset, key_offset, cmp);
+} /* aatree_feed_init */
+
+int aatree_feed_observe(aatree_feed_t *feed, aatree_observer_fn *fn, void *arg)
+{
+  if (feed->count == AATREE_FEED_OBSERVERS)
+  {
+    return ENOSPC;
+  }
+
+  feed->observers[feed->count].fn  = fn;
+  feed->observers[feed->count].arg = arg;
+  feed->count++;
+
+  return 0;
+} /* aatree_feed_observe */
+
+void aatree_feed_unobserve(aatree_feed_t      *feed,
+                           aatree_observer_fn *fn,
+                           void               *arg)
+{
+  size_t i = 0;
+
+  for (; i < feed->count; i++)
+  {
+    if (feed->observers[i].fn == fn && feed->observers[i].arg == arg)
+    {
+      memmove(&feed->observers[i], &feed->observers[i + 1],
+              (feed->count - i - 1) * sizeof(feed->observers[0]));
+      feed->count--;
+      return;
+    }
+  }
+} /* aatree_feed_unobserve */
+
+/* Pass the change to the observers in the order they were added */
+static void notify(const aatree_feed_t *feed,
+                   int                  op,
+                   aatree_node_t       *node,
+                   aatree_node_t       *old,
+                   aatree_node_t       *prev,
+                   aatree_node_t       *next)
+{
+  aatree_change_t change;
+  size_t          i = 0;
+
+  change.tree  = &feed->tree;
+  change.op    = op;
+  change.entry = aatree_node_entry(&feed->tree, node);
+  change.old   = aatree_node_entry(&feed->tree, old);
+  change.prev  = aatree_node_entry(&feed->tree, prev);
+  change.next  = aatree_node_entry(&feed->tree, next);
+
+  for (; i < feed->count; i++)
+  {
+    feed->observers[i].fn(&change, feed->observers[i].arg);
+  }
+} /* notify */
+
+void *aatree_feed_insert(aatree_feed_t *feed, aatree_node_t *node)
+{
+  void *existing = aatree_insert(&feed->tree, node);
+
+  if (!existing && feed->count)
+  {
+    notify(feed, AATREE_FEED_INSERT, node, NULL, aatree_prev_node(node),
+           aatree_next_node(node));
+  }
+
+  return existing;
+} /* aatree_feed_insert */
+
+void aatree_feed_delete(aatree_feed_t *feed, aatree_node_t *node)
+{
+  aatree_node_t *prev = NULL;
+  aatree_node_t *next = NULL;
+
+  if (feed->count)
+  {
+    prev = aatree_prev_node(node);
+    next = aatree_next_node(node);
+  }
+
+  aatree_delete(&feed->tree, node);
+
+  if (feed->count)
+  {
+    notify(feed, AATREE_FEED_DELETE, node, NULL, prev, next);
+  }
+} /* aatree_feed_delete */
+
+void aatree_feed_replace(aatree_feed_t *feed,
+                         aatree_node_t *node,
+                         aatree_node_t *with)
+{
+  aatree_replace(&feed->tree, node, with);
+
+  if (feed->count)
+  {
+    notify(feed, AATREE_FEED_REPLACE, with, node, aatree_prev_node(with),
+           aatree_next_node(with));
+  }
+} /* aatree_feed_replace */
+
+void aatree_feed_writer_init(aatree_feed_writer_t   *writer,
+                             aatree_io_write_fn     *write,
+                             aatree_io_serialize_fn *serialize,
+                             void                   *arg,
+                             void                   *buffer,
+                             size_t                  size,
+                             unsigned                flags,
+                             uint64_t                seq)
+{
+  memset(writer, 0, sizeof(*writer));
+
+  writer->write     = write;
+  writer->serialize = serialize;
+  writer->arg       = arg;
+  writer->buffer    = buffer;
+  writer->size      = size;
+  writer->used      = AATREE_FEED_BLOCK_HEADER;
+  writer->seq       = seq;
+  writer->flags     = flags;
+} /* aatree_feed_writer_init */
+
+int aatree_feed_flush(aatree_feed_writer_t *writer)
+{
+  uint8_t *block   = writer->buffer;
+  size_t   payload = writer->used - AATREE_FEED_BLOCK_HEADER;
+  uint64_t first   = writer->seq - writer->count;
+
+  if (writer->error || !writer->count)
+  {
+    return writer->error;
+  }
+
+  store_u32(block + 4, (uint32_t)payload);
+  store_u32(block + 8, writer->count);
+  store_u32(block + 12, (uint32_t)first);
+  store_u32(block + 16, (uint32_t)(first >> 32));
+  store_u32(block, block_crc(block, payload));
+
+  writer->error    = writer->write(block, writer->used, writer->arg);
+  writer->used     = AATREE_FEED_BLOCK_HEADER;
+  writer->count    = 0;
+  writer->previous = 0;
+
+  return writer->error;
+} /* aatree_feed_flush */
+
+void aatree_feed_record(const aatree_change_t *change, void *arg)
+{
+  aatree_feed_writer_t *writer   = arg;
+  uint8_t              *block    = writer->buffer;
+  size_t                reserved = 1 + VARINT_SIZE + VARINT_KEY;
+  int                   int_keys = writer->flags & AATREE_IO_INT_KEYS;
+
+  while (!writer->error)
+  {
+    uint8_t  delta[VARINT_KEY];
+    uint8_t *data      = block + writer->used + reserved;
+    size_t   key_size  = 0;
+    size_t   data_size = 0;
+    uint64_t key       = 0;
+
+    /* The data goes after the room for the operation and the varints and is
+     * moved down to them once its size is known. A delete of an integer key
+     * carries no data. */
+    if (writer->size < writer->used + reserved)
+      data_size = AATREE_IO_NO_ROOM;
+    else if (!int_keys || change->op != AATREE_FEED_DELETE)
+      data_size = writer->serialize(change->entry, data,
+                                    writer->size - writer->used - reserved,
+                                    writer->arg);
+
+    if (data_size == AATREE_IO_NO_ROOM)
+    {
+      if (!writer->count)
+      {
+        writer->error = EMSGSIZE;
+      }
+
+      aatree_feed_flush(writer);
+      continue;
+    }
+
+    if (int_keys)
+    {
+      memcpy(&key, aatree_entry_key(change->tree, change->entry), sizeof(key));
+      key_size = store_varint(delta, zigzag(key - writer->previous));
+      writer->previous = key;
+    }
+
+    block[writer->used++] = (uint8_t)change->op;
+    writer->used += store_varint(block + writer->used, key_size + data_size);
+    memcpy(block + writer->used, delta, key_size);
+    writer->used += key_size;
+    memmove(block + writer->used, data, data_size);
+    writer->used += data_size;
+
+    writer->count++;
+    writer->seq++;
+    return;
+  }
+} /* aatree_feed_record */
+
+/* Apply a record of the data and the key, NULL unless it is kept apart, hint
+ * is the node of the previous insert */
+static int apply(aatree_t                 *tree,
+                 aatree_io_deserialize_fn *deserialize,
+                 aatree_io_alloc_fn       *alloc,
+                 aatree_feed_release_fn   *release,
+                 void                     *arg,
+                 int                       op,
+                 const uint8_t            *data,
+                 size_t                    size,
+                 const uint64_t           *key,
+                 aatree_node_t           **hint)
+{
+  void          *entry = NULL;
+  void          *found = NULL;
+  aatree_node_t *node  = NULL;
+  int            error = 0;
+
+  if (op == AATREE_FEED_DELETE && key)
+  {
+    found = aatree_search(tree, key, AATREE_KEY_EQ);
+  }
+  else
+  {
+    if (!(entry = alloc(arg)))
+    {
+      return ENOMEM;
+    }
+
+    if ((error = deserialize(entry, data, size, arg)))
+    {
+      release(entry, arg);
+      return error;
+    }
+
+    if (key)
+    {
+      memcpy(aatree_entry_key(tree, entry), key, sizeof(*key));
+    }
+
+    /* The entry of a delete only carries the key to search for. */
+    if (op == AATREE_FEED_DELETE)
+    {
+      found = aatree_search(tree, aatree_entry_key(tree, entry), AATREE_KEY_EQ);
+      release(entry, arg);
+    }
+  }
+
+  if (op == AATREE_FEED_DELETE)
+  {
+    *hint = NULL;
+
+    if (found)
+    {
+      aatree_delete(tree, aatree_entry_node(tree, found));
+      release(found, arg);
+    }
+
+    return 0;
+  }
+
+  node = aatree_entry_node(tree, entry);
+  aatree_init_node(node);
+
+  if ((found = aatree_insert_hint(tree, node, *hint)))
+  {
+    aatree_replace(tree, aatree_entry_node(tree, found), node);
+    release(found, arg);
+  }
+
+  *hint = node;
+
+  return 0;
+} /* apply */
+
+int aatree_feed_apply(aatree_t                 *tree,
+                      aatree_io_read_fn        *read,
+                      aatree_io_deserialize_fn *deserialize,
+                      aatree_io_alloc_fn       *alloc,
+                      aatree_feed_release_fn   *release,
+                      void                     *arg,
+                      void                     *buffer,
+                      size_t                    size,
+                      unsigned                  flags,
+                      uint64_t                 *seq)
+{
+  uint8_t       *block    = buffer;
+  const uint8_t *data     = block + AATREE_FEED_BLOCK_HEADER;
+  const uint8_t *end      = data;
+  aatree_node_t *hint     = NULL;
+  uint64_t       previous = 0;
+  uint64_t       first    = 0;
+  uint32_t       payload  = 0;
+  uint32_t       count    = 0;
+  int            error    = 0;
+
+  if (size < AATREE_FEED_BLOCK_HEADER)
+  {
+    return EINVAL;
+  }
+
+  if ((error = read(block, AATREE_FEED_BLOCK_HEADER, arg)))
+  {
+    return error;
+  }
+
+  payload = load_u32(block + 4);
+  count   = load_u32(block + 8);
+
+  if (payload > size - AATREE_FEED_BLOCK_HEADER)
+  {
+    return EMSGSIZE;
+  }
+
+  if ((error = read(block + AATREE_FEED_BLOCK_HEADER, payload, arg)))
+  {
+    return error;
+  }
+
+  if (block_crc(block, payload) != load_u32(block))
+  {
+    return EBADMSG;
+  }
+
+  first = load_u32(block + 12) | (uint64_t)load_u32(block + 16) << 32;
+  end   = data + payload;
+
+  if (first > *seq)
+  {
+    return ERANGE;
+  }
+
+  for (; count; count--, first++)
+  {
+    uint64_t length = 0;
+    uint64_t delta  = 0;
+    size_t   n      = 0;
+    int      op     = 0;
+
+    if (data == end)
+    {
+      return EBADMSG;
+    }
+
+    op = *data++;
+    n  = load_varint(data, end - data, &length);
+
+    if (!n || length > (uint64_t)(end - data - n)
+        || op < AATREE_FEED_INSERT || op > AATREE_FEED_REPLACE)
+    {
+      return EBADMSG;
+    }
+
+    data += n;
+
+    if (flags & AATREE_IO_INT_KEYS)
+    {
+      if (!(n = load_varint(data, length, &delta)))
+      {
+        return EBADMSG;
+      }
+
+      data     += n;
+      length   -= n;
+      previous += unzigzag(delta);
+    }
+
+    if (first >= *seq)
+    {
+      if ((error = apply(tree, deserialize, alloc, release, arg, op, data,
+                         length, flags & AATREE_IO_INT_KEYS ? &previous : NULL,
+                         &hint)))
+      {
+        return error;
+      }
+
+      *seq = first + 1;
+    }
+
+    data += length;
+  }
+
+  return data == end ? 0 : EBADMSG;
+} /* aatree_feed_apply */
@@ -0,0 +1,191 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#ifndef AATREE_FEED_H
+#define AATREE_FEED_H
+
+#include "aatree_io.h"
+
+/* Change feed of a tree, for replicas and caches.
+ *
+ * Updates of a feed tree are passed to its observers once they are done,
+ * with the entry and the entries around it: the ones it got between on an
+ * insert or had on a delete. A cache drops the entry or the range, a replica
+ * gets the change as a record.
+ *
+ * The writer is an observer encoding the changes into checksummed blocks of
+ * the buffer size, one write per block, numbered by the sequence of the first
+ * record. A follower applies a block at a time: a run of inserts goes through
+ * aatree_insert_hint(), each one after the previous, and the records up to
+ * the sequence it has already applied are skipped, so blocks written again
+ * after a reconnect do no harm.
+ *
+ * Layout, all integers little endian:
+ *
+ *   block:   u32 CRC-32 of the rest of the block, u32 payload size,
+ *            u32 records, u64 sequence of the first record,
+ *            payload of records: u8 operation, varint size, body
+ *   body:    zigzag varint key delta, data
+ *
+ * With AATREE_IO_INT_KEYS the key is kept apart from the data as the
+ * difference with the key of the previous record of the block, and a delete
+ * carries the key only. Otherwise the body is the data of the entry, which
+ * must hold its key.
+ */
+
+/* Recorded operations */
+#define AATREE_FEED_INSERT 1
+#define AATREE_FEED_DELETE 2
+#define AATREE_FEED_REPLACE 3
+
+/* Observers of a tree at most */
+#define AATREE_FEED_OBSERVERS 4
+
+/* Size of the framing of a block */
+#define AATREE_FEED_BLOCK_HEADER 20
+
+/* Change of a tree: the entry inserted, deleted or replacing the old one, and
+ * the previous and next entries, NULL at the ends */
+typedef struct aatree_change
+{
+  const aatree_t *tree;
+  int             op;
+  void           *entry;
+  void           *old;
+  void           *prev;
+  void           *next;
+} aatree_change_t;
+
+/* Observer of the changes, called after the tree is updated. It must not
+ * update the tree. */
+typedef void(aatree_observer_fn)(const aatree_change_t *change, void *arg);
+
+/* Release an entry replaced or deleted by a follower */
+typedef void(aatree_feed_release_fn)(void *entry, void *arg);
+
+typedef struct aatree_feed
+{
+  aatree_t tree;
+
+  struct aatree_observer
+  {
+    aatree_observer_fn *fn;
+    void               *arg;
+  } observers[AATREE_FEED_OBSERVERS];
+
+  size_t count;
+} aatree_feed_t;
+
+/* Encoder of the changes into blocks */
+typedef struct aatree_feed_writer
+{
+  aatree_io_write_fn     *write;
+  aatree_io_serialize_fn *serialize;
+  void                   *arg;
+
+  uint8_t *buffer;
+  size_t   size;
+  size_t   used;
+  uint32_t count;
+
+  /* Sequence of the next record, key of the previous record of the block */
+  uint64_t seq;
+  uint64_t previous;
+
+  unsigned flags;
+
+  /* First error, the changes after it are not recorded */
+  int error;
+} aatree_feed_writer_t;
+
+/* Init an empty tree with no observers */
+void aatree_feed_init(aatree_feed_t      *feed,
+                      uint16_t            node_offset,
+                      uint16_t            key_offset,
+                      aatree_keys_compare cmp) __nonnull((1, 4));
+
+/* Add an observer. Returns zero, or ENOSPC if there are
+ * AATREE_FEED_OBSERVERS already. */
+int aatree_feed_observe(aatree_feed_t *feed, aatree_observer_fn *fn, void *arg)
+    __nonnull((1, 2));
+
+/* Remove an observer added with the same arguments */
+void aatree_feed_unobserve(aatree_feed_t      *feed,
+                           aatree_observer_fn *fn,
+                           void               *arg) __nonnull((1, 2));
+
+/* Insert like aatree_insert(), nothing is observed if the key is there */
+void *aatree_feed_insert(aatree_feed_t *feed, aatree_node_t *node)
+    __nonnull((1, 2));
+
+/* Delete like aatree_delete() */
+void aatree_feed_delete(aatree_feed_t *feed, aatree_node_t *node)
+    __nonnull((1, 2));
+
+/* Replace like aatree_replace() */
+void aatree_feed_replace(aatree_feed_t *feed,
+                         aatree_node_t *node,
+                         aatree_node_t *with) __nonnull((1, 2, 3));
+
+/* Init the writer, numbering the records from seq, with the buffer of size
+ * bytes for the blocks */
+void aatree_feed_writer_init(aatree_feed_writer_t   *writer,
+                             aatree_io_write_fn     *write,
+                             aatree_io_serialize_fn *serialize,
+                             void                   *arg,
+                             void                   *buffer,
+                             size_t                  size,
+                             unsigned                flags,
+                             uint64_t                seq)
+    __nonnull((1, 2, 3, 5));
+
+/* Observer appending the change to the writer, a block is written once it is
+ * full. A record which does not fit into a block sets the error to EMSGSIZE,
+ * a failed write to the error of the callback. */
+void aatree_feed_record(const aatree_change_t *change, void *writer)
+    __nonnull((1, 2));
+
+/* Write out the records appended so far. Returns zero or the error of the
+ * writer. */
+int aatree_feed_flush(aatree_feed_writer_t *writer) __nonnull((1));
+
+/* Apply the next block to the tree of a follower, entries being taken from
+ * the alloc callback and those replaced or deleted handed to release. The
+ * records before seq are skipped, seq is moved past the block. The buffer
+ * must be as large as the one of the writer. Returns zero, EINVAL if it is
+ * smaller than the framing of a block, EBADMSG if the block is corrupted,
+ * EMSGSIZE if it does not fit into the buffer, ERANGE if the records before
+ * it are missing, ENOMEM if alloc fails, or the error of a callback. */
+int aatree_feed_apply(aatree_t                 *tree,
+                      aatree_io_read_fn        *read,
+                      aatree_io_deserialize_fn *deserialize,
+                      aatree_io_alloc_fn       *alloc,
+                      aatree_feed_release_fn   *release,
+                      void                     *arg,
+                      void                     *buffer,
+                      size_t                    size,
+                      unsigned                  flags,
+                      uint64_t                 *seq)
+    __nonnull((1, 2, 3, 4, 5, 7, 10));
+
+#endif /* AATREE_FEED_H */
@@ -0,0 +1,352 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#include <errno.h>
+#include <string.h>
+#include "aatree_io.h"
+
+/* Longest varint of a size and of a key */
+#define VARINT_SIZE 5
+#define VARINT_KEY 10
+
+/* CRC-32 of the nibbles */
+static const uint32_t crc_table[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+    0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+
+uint32_t aatree_io_crc32(uint32_t crc, const void *data, size_t size)
+{
+  const uint8_t *byte = data;
+
+  crc = ~crc;
+
+  for (; size; size--, byte++)
+  {
+    crc = crc_table[(crc ^ *byte) & 0x0f] ^ (crc >> 4);
+    crc = crc_table[(crc ^ (*byte >> 4)) & 0x0f] ^ (crc >> 4);
+  }
+
+  return ~crc;
+} /* aatree_io_crc32 */
+
+static __inline__ void store_u16(uint8_t *out, uint16_t value)
+{
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+} /* store_u16 */
+
+static __inline__ void store_u32(uint8_t *out, uint32_t value)
+{
+  store_u16(out, (uint16_t)value);
+  store_u16(out + 2, (uint16_t)(value >> 16));
+} /* store_u32 */
+
+static __inline__ uint16_t load_u16(const uint8_t *in)
+{
+  return (uint16_t)(in[0] | in[1] << 8);
+} /* load_u16 */
+
+static __inline__ uint32_t load_u32(const uint8_t *in)
+{
+  return load_u16(in) | (uint32_t)load_u16(in + 2) << 16;
+} /* load_u32 */
+
+/* Store the value in 7 bit groups, low ones first. Returns number of bytes
+ * used. */
+static size_t store_varint(uint8_t *out, uint64_t value)
+{
+  size_t n = 0;
+
+  for (; value >= 0x80; value >>= 7)
+  {
+    out[n++] = (uint8_t)(value | 0x80);
+  }
+
+  out[n++] = (uint8_t)value;
+
+  return n;
+} /* store_varint */
+
+/* Returns number of bytes read, or zero if the varint is cut or too long */
+static size_t load_varint(const uint8_t *in, size_t size, uint64_t *value)
+{
+  size_t n = 0;
+
+  for (*value = 0; n < size && n < VARINT_KEY; n++)
+  {
+    *value |= (uint64_t)(in[n] & 0x7f) << (7 * n);
+
+    if (!(in[n] & 0x80))
+    {
+      return n + 1;
+    }
+  }
+
+  return 0;
+} /* load_varint */
+
+/* Frame the entries in the buffer and write them out */
+static int write_block(aatree_io_write_fn *write,
+                       void               *arg,
+                       uint8_t            *block,
+                       size_t              used,
+                       uint32_t            count)
+{
+  size_t payload = used - AATREE_IO_BLOCK_HEADER;
+
+  store_u32(block, (uint32_t)payload);
+  store_u32(block + 4, count);
+  store_u32(block + 8,
+            aatree_io_crc32(0, block + AATREE_IO_BLOCK_HEADER, payload));
+
+  return write(block, used, arg);
+} /* write_block */
+
+int aatree_dump(const aatree_t         *tree,
+                aatree_io_write_fn     *write,
+                aatree_io_serialize_fn *serialize,
+                void                   *arg,
+                void                   *buffer,
+                size_t                  size,
+                unsigned                flags)
+{
+  uint8_t        header[8];
+  uint8_t        delta[VARINT_KEY];
+  uint8_t       *block    = buffer;
+  aatree_node_t *node     = tree->first;
+  size_t         used     = AATREE_IO_BLOCK_HEADER;
+  size_t         reserved = VARINT_SIZE + VARINT_KEY;
+  uint32_t       count    = 0;
+  uint64_t       previous = 0;
+  int            error    = 0;
+
+  store_u32(header, AATREE_IO_MAGIC);
+  store_u16(header + 4, AATREE_IO_VERSION);
+  store_u16(header + 6, (uint16_t)flags);
+
+  if ((error = write(header, sizeof(header), arg)))
+  {
+    return error;
+  }
+
+  while (node)
+  {
+    void    *entry     = aatree_node_entry(tree, node);
+    uint8_t *data      = NULL;
+    size_t   key_size  = 0;
+    size_t   data_size = AATREE_IO_NO_ROOM;
+    uint64_t key       = 0;
+
+    /* The data goes after the room for the varints and is moved down to
+     * them once its size is known. */
+    if (size > used + reserved)
+    {
+      data_size = serialize(entry, block + used + reserved,
+                            size - used - reserved, arg);
+    }
+
+    if (data_size == AATREE_IO_NO_ROOM)
+    {
+      if (!count)
+      {
+        return EMSGSIZE;
+      }
+
+      if ((error = write_block(write, arg, block, used, count)))
+      {
+        return error;
+      }
+
+      used  = AATREE_IO_BLOCK_HEADER;
+      count = 0;
+      continue;
+    }
+
+    if (flags & AATREE_IO_INT_KEYS)
+    {
+      memcpy(&key, aatree_node_key(tree, node), sizeof(key));
+      key_size = store_varint(delta, key - previous);
+      previous = key;
+    }
+
+    data   = block + used + reserved;
+    used  += store_varint(block + used, key_size + data_size);
+    memcpy(block + used, delta, key_size);
+    used  += key_size;
+    memmove(block + used, data, data_size);
+    used  += data_size;
+    count++;
+
+    node = aatree_next_node(node);
+  }
+
+  if (count && (error = write_block(write, arg, block, used, count)))
+  {
+    return error;
+  }
+
+  return write_block(write, arg, block, AATREE_IO_BLOCK_HEADER, 0);
+} /* aatree_dump */
+
+/* Link the entries of a block into the tree */
+static int load_block(aatree_t                 *tree,
+                      aatree_io_deserialize_fn *deserialize,
+                      aatree_io_alloc_fn       *alloc,
+                      aatree_io_release_fn     *release,
+                      void                     *arg,
+                      const uint8_t            *data,
+                      size_t                    size,
+                      uint32_t                  count,
+                      unsigned                  flags,
+                      uint64_t                 *previous)
+{
+  const uint8_t *end   = data + size;
+  int            error = 0;
+
+  for (; count; count--)
+  {
+    void    *entry  = NULL;
+    uint64_t length = 0;
+    uint64_t delta  = 0;
+    size_t   n      = load_varint(data, end - data, &length);
+
+    if (!n || length > (uint64_t)(end - data - n))
+    {
+      return EBADMSG;
+    }
+
+    data += n;
+
+    if (flags & AATREE_IO_INT_KEYS)
+    {
+      if (!(n = load_varint(data, length, &delta)))
+      {
+        return EBADMSG;
+      }
+
+      data      += n;
+      length    -= n;
+      *previous += delta;
+    }
+
+    if (!(entry = alloc(arg)))
+    {
+      return ENOMEM;
+    }
+
+    if ((error = deserialize(entry, data, length, arg)))
+    {
+      release(entry, arg);
+      return error;
+    }
+
+    if (flags & AATREE_IO_INT_KEYS)
+    {
+      memcpy(aatree_entry_key(tree, entry), previous, sizeof(*previous));
+    }
+
+    aatree_init_node(aatree_entry_node(tree, entry));
+    aatree_append(tree, aatree_entry_node(tree, entry));
+
+    data += length;
+  }
+
+  return data == end ? 0 : EBADMSG;
+} /* load_block */
+
+int aatree_load(aatree_t                 *tree,
+                aatree_io_read_fn        *read,
+                aatree_io_deserialize_fn *deserialize,
+                aatree_io_alloc_fn       *alloc,
+                aatree_io_release_fn     *release,
+                void                     *arg,
+                void                     *buffer,
+                size_t                    size)
+{
+  uint8_t  header[8];
+  uint8_t *block    = buffer;
+  uint64_t previous = 0;
+  unsigned flags    = 0;
+  int      error    = 0;
+
+  if (tree->root || size < AATREE_IO_BLOCK_HEADER)
+  {
+    return EINVAL;
+  }
+
+  if ((error = read(header, sizeof(header), arg)))
+  {
+    return error;
+  }
+
+  if (load_u32(header) != AATREE_IO_MAGIC
+      || load_u16(header + 4) != AATREE_IO_VERSION)
+  {
+    return EINVAL;
+  }
+
+  flags = load_u16(header + 6);
+
+  for (;;)
+  {
+    uint32_t payload = 0;
+    uint32_t count   = 0;
+
+    if ((error = read(block, AATREE_IO_BLOCK_HEADER, arg)))
+    {
+      return error;
+    }
+
+    payload = load_u32(block);
+    count   = load_u32(block + 4);
+
+    if (!payload)
+    {
+      return count ? EBADMSG : 0;
+    }
+
+    if (payload > size - AATREE_IO_BLOCK_HEADER)
+    {
+      return EMSGSIZE;
+    }
+
+    if ((error = read(block + AATREE_IO_BLOCK_HEADER, payload, arg)))
+    {
+      return error;
+    }
+
+    if (aatree_io_crc32(0, block + AATREE_IO_BLOCK_HEADER, payload)
+        != load_u32(block + 8))
+    {
+      return EBADMSG;
+    }
+
+    if ((error = load_block(tree, deserialize, alloc, release, arg,
+                            block + AATREE_IO_BLOCK_HEADER, payload, count,
+                            flags, &previous)))
+    {
+      return error;
+    }
+  }
+} /* aatree_load */
@@ -0,0 +1,115 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#ifndef AATREE_IO_H
+#define AATREE_IO_H
+
+#include "aatree.h"
+
+/* Snapshot files of AA trees.
+ *
+ * A dump streams the entries in key order, packed into checksummed blocks of
+ * the buffer size, one write per block. A load reads the blocks back and
+ * links the entries with aatree_append(), which takes linear time and never
+ * compares keys: the order is the one of the file, guarded by the checksums.
+ *
+ * Layout, all integers little endian:
+ *
+ *   header:  magic "AATR", u16 version, u16 flags
+ *   block:   u32 payload size, u32 entries, u32 CRC-32 of the payload,
+ *            payload of entries: varint size, varint key delta, data
+ *   end:     a block of no entries and no payload
+ *
+ * With AATREE_IO_INT_KEYS the key is an uint64_t kept apart from the data as
+ * a varint of the difference with the previous key, which takes a byte or two
+ * for dense keys. The library writes it, the entry callbacks skip it.
+ */
+
+#define AATREE_IO_MAGIC 0x52544141
+#define AATREE_IO_VERSION 1
+
+/* Keys are uint64_t in ascending order, delta coded */
+#define AATREE_IO_INT_KEYS 0x1
+
+/* Size of the framing of a block, a good buffer size is around 64 KB */
+#define AATREE_IO_BLOCK_HEADER 12
+
+#define AATREE_IO_NO_ROOM ((size_t)-1)
+
+/* Write size bytes, returns zero or an errno value */
+typedef int(aatree_io_write_fn)(const void *data, size_t size, void *arg);
+
+/* Read exactly size bytes, returns zero or an errno value */
+typedef int(aatree_io_read_fn)(void *data, size_t size, void *arg);
+
+/* Serialize the entry into at most size bytes. Returns number of bytes used,
+ * or AATREE_IO_NO_ROOM if they are not enough. */
+typedef size_t(aatree_io_serialize_fn)(const void *entry,
+                                       void       *data,
+                                       size_t      size,
+                                       void       *arg);
+
+/* Fill the entry from the data of size bytes. Returns zero or an errno value,
+ * which stops the load. */
+typedef int(aatree_io_deserialize_fn)(void       *entry,
+                                      const void *data,
+                                      size_t      size,
+                                      void       *arg);
+
+/* Memory of a new entry, or NULL */
+typedef void *(aatree_io_alloc_fn)(void *arg);
+
+/* Release an entry taken from alloc which is not linked into the tree */
+typedef void(aatree_io_release_fn)(void *entry, void *arg);
+
+/* Dump the tree through the write callback, using the buffer of size bytes
+ * for the blocks. Returns zero on success, EMSGSIZE if an entry does not fit
+ * into a block, or the error of the write callback. */
+int aatree_dump(const aatree_t         *tree,
+                aatree_io_write_fn     *write,
+                aatree_io_serialize_fn *serialize,
+                void                   *arg,
+                void                   *buffer,
+                size_t                  size,
+                unsigned                flags) __nonnull((1, 2, 3, 5));
+
+/* Load a dump into the empty tree, entries being taken from the alloc
+ * callback and handed back to release if they fail to deserialize. The
+ * buffer must be as large as the one of the dump. Returns zero
+ * on success, EINVAL if the tree is not empty or the header is not the one of
+ * a known version, EBADMSG if a block is corrupted, EMSGSIZE if it does not
+ * fit into the buffer, ENOMEM if alloc fails, or the error of a callback. The
+ * entries loaded before an error are left in the tree, which is valid. */
+int aatree_load(aatree_t                 *tree,
+                aatree_io_read_fn        *read,
+                aatree_io_deserialize_fn *deserialize,
+                aatree_io_alloc_fn       *alloc,
+                aatree_io_release_fn     *release,
+                void                     *arg,
+                void                     *buffer,
+                size_t                    size) __nonnull((1, 2, 3, 4, 5, 7));
+
+/* CRC-32 (IEEE 802.3) of the data, crc is zero to start */
+uint32_t aatree_io_crc32(uint32_t crc, const void *data, size_t size);
+
+#endif /* AATREE_IO_H */
@@ -0,0 +1,280 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#include "aatree_lsm.h"
+
+#define lsm_node(node) ((aatree_lsm_node_t *)(node))
+
+void aatree_lsm_init(aatree_lsm_t          *lsm,
+                     uint16_t               node_offset,
+                     uint16_t               key_offset,
+                     aatree_keys_compare    cmp,
+                     size_t                 capacity,
+                     aatree_lsm_release_fn *release,
+                     void                  *arg)
+{
+  aatree_init_tree(&lsm->tree, node_offset, key_offset, cmp);
+  aatree_init_tree(&lsm->buffer, node_offset, key_offset, cmp);
+
+  lsm->count    = 0;
+  lsm->capacity = capacity;
+  lsm->release  = release;
+  lsm->arg      = arg;
+  lsm->merges   = 0;
+} /* aatree_lsm_init */
+
+/* Buffer the update, replacing the one of the key if any */
+static void buffer(aatree_lsm_t *lsm, void *entry, uint8_t tombstone)
+{
+  aatree_node_t *node = aatree_entry_node(&lsm->buffer, entry);
+  void          *old  = NULL;
+
+  aatree_init_node(node);
+  lsm_node(node)->tombstone = tombstone;
+
+  if ((old = aatree_insert(&lsm->buffer, node)))
+  {
+    aatree_replace(&lsm->buffer, aatree_entry_node(&lsm->buffer, old), node);
+    lsm->release(old, lsm->arg);
+    return;
+  }
+
+  if (++lsm->count >= lsm->capacity)
+  {
+    aatree_lsm_merge(lsm);
+  }
+} /* buffer */
+
+void aatree_lsm_insert(aatree_lsm_t *lsm, void *entry)
+{
+  buffer(lsm, entry, 0);
+} /* aatree_lsm_insert */
+
+void aatree_lsm_delete(aatree_lsm_t *lsm, void *tombstone)
+{
+  buffer(lsm, tombstone, 1);
+} /* aatree_lsm_delete */
+
+/* Find the last node with a key less than or equal to the key, which is
+ * greater than the one of the node, climbing from the node only as far as
+ * the subtree which has the key in its range */
+static aatree_node_t *finger(const aatree_t *tree,
+                             aatree_node_t  *node,
+                             const void     *key)
+{
+  aatree_node_t *best = NULL;
+  int            result;
+
+  for (; node->parent; node = node->parent)
+  {
+    if (node->parent->left == node
+        && tree->cmp(key, aatree_node_key(tree, node->parent)) < 0)
+      break;
+  }
+
+  for (best = node, node = node->right; node;)
+  {
+    result = tree->cmp(key, aatree_node_key(tree, node));
+
+    if (result < 0)
+    {
+      node = node->left;
+      continue;
+    }
+
+    best = node;
+
+    if (!result)
+      break;
+
+    node = node->right;
+  }
+
+  return best;
+} /* finger */
+
+void aatree_lsm_merge(aatree_lsm_t *lsm)
+{
+  aatree_t      *tree = &lsm->tree;
+  aatree_node_t *hint = NULL;
+  void          *entry;
+
+  while ((entry = aatree_pop_first(&lsm->buffer)))
+  {
+    aatree_node_t *node   = aatree_entry_node(tree, entry);
+    const void    *key    = aatree_node_key(tree, node);
+    aatree_node_t *next   = hint ? aatree_next_node(hint) : tree->first;
+    aatree_node_t *old    = NULL;
+    int            result = next ? tree->cmp(key, aatree_node_key(tree, next))
+                                 : -1;
+
+    /* The key is right after the hint, at the successor, or further on,
+     * where a search finds it or the node to link it after. */
+    if (!result)
+    {
+      old = next;
+    }
+    else if (result > 0)
+    {
+      hint = finger(tree, hint ? hint : tree->first, key);
+
+      if (!tree->cmp(key, aatree_node_key(tree, hint)))
+      {
+        old  = hint;
+        hint = NULL;
+      }
+    }
+
+    if (lsm_node(node)->tombstone)
+    {
+      if (old)
+      {
+        if (!hint)
+          hint = aatree_prev_node(old);
+
+        aatree_delete(tree, old);
+        lsm->release(aatree_node_entry(tree, old), lsm->arg);
+      }
+
+      lsm->release(entry, lsm->arg);
+      continue;
+    }
+
+    if (old)
+    {
+      aatree_replace(tree, old, node);
+      lsm->release(aatree_node_entry(tree, old), lsm->arg);
+    }
+    else
+    {
+      aatree_insert_hint(tree, node, hint);
+    }
+
+    hint = node;
+  }
+
+  lsm->count = 0;
+  lsm->merges++;
+} /* aatree_lsm_merge */
+
+/* Step in the direction of the search order */
+static __inline__ aatree_node_t *step(aatree_node_t *node, int forward)
+{
+  return forward ? aatree_next_node(node) : aatree_prev_node(node);
+} /* step */
+
+void *aatree_lsm_search(const aatree_lsm_t *lsm,
+                        const void         *key,
+                        aatree_keys_order   order)
+{
+  const aatree_t *tree    = &lsm->tree;
+  const aatree_t *buffer  = &lsm->buffer;
+  aatree_node_t  *newer   = NULL;
+  aatree_node_t  *older   = NULL;
+  int             forward = order == AATREE_KEY_GT || order == AATREE_KEY_GE;
+  int             result  = 0;
+
+  newer = aatree_entry_node(buffer, aatree_search(buffer, key, order));
+
+  if (order == AATREE_KEY_EQ && newer)
+  {
+    return lsm_node(newer)->tombstone ? NULL
+                                      : aatree_node_entry(buffer, newer);
+  }
+
+  /* Tombstones are skipped, and so are the entries of the tree with a key
+   * in the buffer, which is either a tombstone or newer. */
+  for (; newer && lsm_node(newer)->tombstone; newer = step(newer, forward))
+  {
+  }
+
+  for (older = aatree_entry_node(tree, aatree_search(tree, key, order));
+       older && aatree_search(buffer, aatree_node_key(tree, older),
+                              AATREE_KEY_EQ);
+       older = step(older, forward))
+  {
+  }
+
+  if (!newer || !older)
+  {
+    return aatree_node_entry(tree, newer ? newer : older);
+  }
+
+  result = tree->cmp(aatree_node_key(tree, newer),
+                     aatree_node_key(tree, older));
+
+  return aatree_node_entry(tree, (result < 0) == forward ? newer : older);
+} /* aatree_lsm_search */
+
+int aatree_lsm_scan(const aatree_lsm_t  *lsm,
+                    const void          *lo,
+                    const void          *hi,
+                    aatree_lsm_visit_fn *visit,
+                    void                *arg)
+{
+  const aatree_t *tree   = &lsm->tree;
+  aatree_node_t  *newer  = lsm->buffer.first;
+  aatree_node_t  *older  = tree->first;
+  aatree_node_t  *node   = NULL;
+  int             result = 0;
+
+  if (lo)
+  {
+    newer = aatree_entry_node(tree, aatree_search(&lsm->buffer, lo,
+                                                  AATREE_KEY_GE));
+    older = aatree_entry_node(tree, aatree_search(tree, lo, AATREE_KEY_GE));
+  }
+
+  /* Both levels are walked in step, the buffer wins a tie. */
+  while (newer || older)
+  {
+    result = !newer ? 1
+             : !older
+                 ? -1
+                 : tree->cmp(aatree_node_key(tree, newer),
+                             aatree_node_key(tree, older));
+
+    node = result <= 0 ? newer : older;
+
+    if (hi && tree->cmp(aatree_node_key(tree, node), hi) > 0)
+    {
+      break;
+    }
+
+    if (result <= 0)
+      newer = aatree_next_node(newer);
+
+    if (result >= 0)
+      older = aatree_next_node(older);
+
+    if (result <= 0 && lsm_node(node)->tombstone)
+      continue;
+
+    if ((result = visit(aatree_node_entry(tree, node), arg)))
+    {
+      return result;
+    }
+  }
+
+  return 0;
+} /* aatree_lsm_scan */
@@ -0,0 +1,115 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#ifndef AATREE_LSM_H
+#define AATREE_LSM_H
+
+#include "aatree.h"
+
+/* Write buffer in front of a large tree, for bursts of updates.
+ *
+ * Inserts and deletes go to a small tree which stays in the cache, deletes
+ * as tombstones: entries carrying the key only, marked as such. A later
+ * update of a buffered key replaces the buffered entry. Once the buffer holds
+ * capacity entries it is merged into the tree in key order: the search for
+ * the place of an entry climbs from the one before it only as far as the
+ * subtree which has the key in its range, and the entry is linked with
+ * aatree_insert_hint(), so a batch walks the tree once from left to right
+ * instead of descending it from the root for every key.
+ *
+ * The walk saves the most when the keys of a batch are close in the tree:
+ * a buffer of a few percent of the tree, clustered keys, or the same keys
+ * updated over and over, which the buffer absorbs. Random keys spread over a
+ * tree much larger than the buffer miss the cache at the lower levels either
+ * way.
+ *
+ * An insert of a key the tree already has replaces the entry, a tombstone
+ * deletes it; the replaced and deleted entries and the tombstones themselves
+ * are handed to the release callback. Searches and scans see both levels, the
+ * buffered entries first.
+ */
+
+/* Node of a buffered tree, in place of aatree_node_t */
+typedef struct aatree_lsm_node
+{
+  aatree_node_t node;
+  uint8_t       tombstone;
+} aatree_lsm_node_t;
+
+/* Release an entry replaced, deleted or a tombstone applied */
+typedef void(aatree_lsm_release_fn)(void *entry, void *arg);
+
+/* Visitor of a scan, a non-zero result stops the scan */
+typedef int(aatree_lsm_visit_fn)(void *entry, void *arg);
+
+typedef struct aatree_lsm
+{
+  /* The tree and the buffer, with the same layout */
+  aatree_t tree;
+  aatree_t buffer;
+
+  size_t count;
+  size_t capacity;
+
+  aatree_lsm_release_fn *release;
+  void                  *arg;
+
+  /* Buffers merged so far */
+  uint64_t merges;
+} aatree_lsm_t;
+
+/* Init an empty tree buffering up to capacity updates. The node offset is the
+ * one of an aatree_lsm_node_t. */
+void aatree_lsm_init(aatree_lsm_t          *lsm,
+                     uint16_t               node_offset,
+                     uint16_t               key_offset,
+                     aatree_keys_compare    cmp,
+                     size_t                 capacity,
+                     aatree_lsm_release_fn *release,
+                     void                  *arg) __nonnull((1, 4, 6));
+
+/* Buffer an insert of the entry, which replaces any entry with the key */
+void aatree_lsm_insert(aatree_lsm_t *lsm, void *entry) __nonnull((1, 2));
+
+/* Buffer a delete of the key of the tombstone entry */
+void aatree_lsm_delete(aatree_lsm_t *lsm, void *tombstone) __nonnull((1, 2));
+
+/* Merge the buffer into the tree */
+void aatree_lsm_merge(aatree_lsm_t *lsm) __nonnull((1));
+
+/* Search entry like aatree_search() across both levels */
+void *aatree_lsm_search(const aatree_lsm_t *lsm,
+                        const void         *key,
+                        aatree_keys_order   order) __nonnull((1, 2));
+
+/* Visit the entries with keys from lo to hi inclusive in order, either bound
+ * is open if NULL. The visitor must not update the tree. Returns zero or the
+ * non-zero result of the visitor. */
+int aatree_lsm_scan(const aatree_lsm_t  *lsm,
+                    const void          *lo,
+                    const void          *hi,
+                    aatree_lsm_visit_fn *visit,
+                    void                *arg) __nonnull((1, 4));
+
+#endif /* AATREE_LSM_H */
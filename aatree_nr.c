@@ -0,0 +1,344 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "aatree_nr.h"
+
+/* Logged operations */
+enum
+{
+  AATREE_NR_INSERT = 1,
+  AATREE_NR_DELETE
+};
+
+/* Record: the operation, then the entry to insert or the key to delete */
+static __inline__ size_t record_size(size_t entry_size)
+{
+  return sizeof(uint64_t) + ((entry_size + 7) & ~(size_t)7);
+} /* record_size */
+
+static __inline__ uint8_t *record_at(const aatree_nr_t *nr, uint64_t pos)
+{
+  return nr->log + (size_t)(pos % nr->log_capacity) * nr->record_size;
+} /* record_at */
+
+size_t aatree_nr_log_size(size_t entry_size, size_t records)
+{
+  return record_size(entry_size) * records;
+} /* aatree_nr_log_size */
+
+int aatree_nr_init(aatree_nr_t        *nr,
+                   void               *log,
+                   size_t              log_capacity,
+                   size_t              entry_size,
+                   size_t              key_size,
+                   size_t              capacity,
+                   uint16_t            node_offset,
+                   uint16_t            key_offset,
+                   aatree_keys_compare cmp)
+{
+  if (!log_capacity || key_size > entry_size)
+  {
+    return EINVAL;
+  }
+
+  nr->tail         = 0;
+  nr->log          = log;
+  nr->log_capacity = log_capacity;
+  nr->record_size  = record_size(entry_size);
+  nr->count        = 0;
+  nr->entry_size   = entry_size;
+  nr->key_size     = key_size;
+  nr->capacity     = capacity;
+  nr->node_offset  = node_offset;
+  nr->key_offset   = key_offset;
+  nr->cmp          = cmp;
+
+  return pthread_mutex_init(&nr->lock, NULL);
+} /* aatree_nr_init */
+
+void aatree_nr_destroy(aatree_nr_t *nr)
+{
+  size_t i;
+
+  for (i = 0; i < nr->count; i++)
+  {
+    pthread_rwlock_destroy(&nr->replicas[i]->lock);
+  }
+
+  pthread_mutex_destroy(&nr->lock);
+} /* aatree_nr_destroy */
+
+int aatree_nr_add_replica(aatree_nr_t         *nr,
+                          aatree_nr_replica_t *replica,
+                          void                *pool)
+{
+  size_t i;
+  int    error = 0;
+
+  if (nr->count == AATREE_NR_MAX_REPLICAS)
+  {
+    return ENOSPC;
+  }
+
+  if ((error = pthread_rwlock_init(&replica->lock, NULL)))
+  {
+    return error;
+  }
+
+  aatree_init_tree(&replica->tree, nr->node_offset, nr->key_offset, nr->cmp);
+
+  replica->applied = 0;
+  replica->pool    = pool;
+  replica->free    = NULL;
+
+  /* Building the free list is the first touch of the pool pages. */
+  for (i = nr->capacity; i > 0; i--)
+  {
+    aatree_node_t *node = NULL;
+
+    node = aatree_entry_node(&replica->tree,
+                             replica->pool + (i - 1) * nr->entry_size);
+    aatree_init_node(node);
+    node->parent  = replica->free;
+    replica->free = node;
+  }
+
+  nr->replicas[nr->count++] = replica;
+
+  return 0;
+} /* aatree_nr_add_replica */
+
+aatree_nr_replica_t *aatree_nr_local(aatree_nr_t *nr)
+{
+  unsigned cpu  = 0;
+  unsigned node = 0;
+
+  /* Without the system call every thread is on node zero. */
+  if (syscall(SYS_getcpu, &cpu, &node, NULL))
+  {
+    node = 0;
+  }
+
+  return nr->replicas[node % nr->count];
+} /* aatree_nr_local */
+
+/* Apply a logged operation to the replica, the write lock must be held */
+static int apply(aatree_nr_t *nr, aatree_nr_replica_t *replica, uint8_t *record)
+{
+  aatree_t      *tree    = &replica->tree;
+  aatree_node_t *node    = NULL;
+  uint8_t       *payload = record + sizeof(uint64_t);
+  void          *entry   = NULL;
+
+  if (*(uint64_t *)record == AATREE_NR_INSERT)
+  {
+    if (!(node = replica->free))
+    {
+      return aatree_search(tree, payload + nr->key_offset, AATREE_KEY_EQ)
+                 ? EEXIST
+                 : ENOMEM;
+    }
+
+    replica->free = node->parent;
+    entry         = aatree_node_entry(tree, node);
+
+    memcpy(entry, payload, nr->entry_size);
+    aatree_init_node(node);
+
+    if (aatree_insert(tree, node))
+    {
+      node->parent  = replica->free;
+      replica->free = node;
+      return EEXIST;
+    }
+
+    return 0;
+  }
+
+  if (!(entry = aatree_search(tree, payload, AATREE_KEY_EQ)))
+  {
+    return ENOENT;
+  }
+
+  node = aatree_entry_node(tree, entry);
+  aatree_delete(tree, node);
+
+  node->parent  = replica->free;
+  replica->free = node;
+
+  return 0;
+} /* apply */
+
+/* Replay the log into the replica up to the position, returning the result of
+ * the operation at the given one. The write lock must be held. */
+static int replay(aatree_nr_t         *nr,
+                  aatree_nr_replica_t *replica,
+                  uint64_t             upto,
+                  uint64_t             mine)
+{
+  int result = 0;
+
+  while (replica->applied < upto)
+  {
+    int error = apply(nr, replica, record_at(nr, replica->applied));
+
+    if (replica->applied == mine)
+      result = error;
+
+    /* Appenders check the position to reuse the records. */
+    __atomic_store_n(&replica->applied, replica->applied + 1,
+                     __ATOMIC_RELEASE);
+  }
+
+  return result;
+} /* replay */
+
+/* Log an operation for the replica, whose write lock is held by the caller.
+ * Returns its position. */
+static uint64_t append(aatree_nr_t         *nr,
+                       aatree_nr_replica_t *replica,
+                       uint64_t             op,
+                       const void          *payload,
+                       size_t               size)
+{
+  uint64_t pos = 0;
+
+  for (;;)
+  {
+    int    blocked = 0;
+    size_t i;
+
+    pthread_mutex_lock(&nr->lock);
+    pos = nr->tail;
+
+    /* The oldest record is reused once every replica has replayed it. The
+     * appender catches up the lagging replicas, but never waits for a lock
+     * with the log locked: the owner may be a writer waiting to append. */
+    for (i = 0; i < nr->count; i++)
+    {
+      aatree_nr_replica_t *lagging = nr->replicas[i];
+
+      if (pos - __atomic_load_n(&lagging->applied, __ATOMIC_ACQUIRE)
+          < nr->log_capacity)
+        continue;
+
+      if (lagging == replica)
+      {
+        replay(nr, replica, pos, pos);
+      }
+      else if (!pthread_rwlock_trywrlock(&lagging->lock))
+      {
+        replay(nr, lagging, pos, pos);
+        pthread_rwlock_unlock(&lagging->lock);
+      }
+      else
+      {
+        blocked = 1;
+      }
+    }
+
+    if (!blocked)
+      break;
+
+    pthread_mutex_unlock(&nr->lock);
+    sched_yield();
+  }
+
+  *(uint64_t *)record_at(nr, pos) = op;
+  memcpy(record_at(nr, pos) + sizeof(uint64_t), payload, size);
+
+  __atomic_store_n(&nr->tail, pos + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&nr->lock);
+
+  return pos;
+} /* append */
+
+int aatree_nr_insert(aatree_nr_t         *nr,
+                     aatree_nr_replica_t *replica,
+                     const void          *entry)
+{
+  uint64_t pos;
+  int      result;
+
+  /* The replica stays locked until the operation is replayed, so the result
+   * is the one of this very thread. */
+  pthread_rwlock_wrlock(&replica->lock);
+
+  pos    = append(nr, replica, AATREE_NR_INSERT, entry, nr->entry_size);
+  result = replay(nr, replica, pos + 1, pos);
+
+  pthread_rwlock_unlock(&replica->lock);
+
+  return result;
+} /* aatree_nr_insert */
+
+int aatree_nr_delete(aatree_nr_t         *nr,
+                     aatree_nr_replica_t *replica,
+                     const void          *key)
+{
+  uint64_t pos;
+  int      result;
+
+  pthread_rwlock_wrlock(&replica->lock);
+
+  pos    = append(nr, replica, AATREE_NR_DELETE, key, nr->key_size);
+  result = replay(nr, replica, pos + 1, pos);
+
+  pthread_rwlock_unlock(&replica->lock);
+
+  return result;
+} /* aatree_nr_delete */
+
+int aatree_nr_search(aatree_nr_t         *nr,
+                     aatree_nr_replica_t *replica,
+                     const void          *key,
+                     aatree_keys_order    order,
+                     void                *out)
+{
+  uint64_t tail  = __atomic_load_n(&nr->tail, __ATOMIC_ACQUIRE);
+  void    *entry = NULL;
+
+  /* Catch up with the log first, so the read sees every completed update. */
+  if (__atomic_load_n(&replica->applied, __ATOMIC_ACQUIRE) < tail)
+  {
+    pthread_rwlock_wrlock(&replica->lock);
+    replay(nr, replica, tail, tail);
+    pthread_rwlock_unlock(&replica->lock);
+  }
+
+  pthread_rwlock_rdlock(&replica->lock);
+
+  if ((entry = aatree_search(&replica->tree, key, order)))
+  {
+    memcpy(out, entry, nr->entry_size);
+  }
+
+  pthread_rwlock_unlock(&replica->lock);
+
+  return entry != NULL;
+} /* aatree_nr_search */
@@ -0,0 +1,139 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AATREE_NR_H
+#define AATREE_NR_H
+
+#include <pthread.h>
+#include "aatree.h"
+
+/* Replicated AA tree, one replica per NUMA node (node replication).
+ *
+ * Every replica is a complete tree of its own entries. Updates are appended
+ * to a shared operation log and replayed by each replica in log order, so all
+ * the replicas go through the same states. Writers replay their local
+ * replica up to their own operation, which gives them its result; the other
+ * replicas catch up lazily, when they are read next. Reads only ever touch
+ * the local replica and the log tail.
+ *
+ * Memory is supplied by the caller: the log, and a replica with its pool of
+ * entries for every node. A replica added from a thread running on its node
+ * touches its pool first, so the pages are allocated locally under the
+ * default policy. On a machine with a single node all the threads share one
+ * replica.
+ *
+ * Entries and keys are copied into the log and the replica pools, all of the
+ * same capacity, so a pool overflow is the same on every replica. Keys must
+ * be plain bytes of a fixed size.
+ */
+
+#define AATREE_NR_MAX_REPLICAS 16
+
+typedef struct aatree_nr_replica
+{
+  pthread_rwlock_t lock;
+  aatree_t         tree;
+
+  /* Log position up to which the operations are replayed */
+  uint64_t applied;
+
+  /* Pool of entries, free ones linked through node parents */
+  uint8_t       *pool;
+  aatree_node_t *free;
+} __attribute__((aligned(AATREE_CACHE_LINE))) aatree_nr_replica_t;
+
+typedef struct aatree_nr
+{
+  /* Position of the next operation, the only field the readers load */
+  uint64_t tail;
+  uint8_t  pad[AATREE_CACHE_LINE - sizeof(uint64_t)];
+
+  /* Serializes appends */
+  pthread_mutex_t lock;
+
+  /* Ring of operations */
+  uint8_t *log;
+  size_t   log_capacity;
+  size_t   record_size;
+
+  aatree_nr_replica_t *replicas[AATREE_NR_MAX_REPLICAS];
+  size_t               count;
+
+  size_t               entry_size;
+  size_t               key_size;
+  size_t               capacity;
+  uint16_t             node_offset;
+  uint16_t             key_offset;
+  aatree_keys_compare *cmp;
+} aatree_nr_t;
+
+/* Size of a log for records operations on entries of entry_size bytes */
+size_t aatree_nr_log_size(size_t entry_size, size_t records);
+
+/* Init replicated tree with the log of log_capacity records. Every replica
+ * pool will hold capacity entries of entry_size bytes, with keys of key_size
+ * bytes inside. Returns zero on success or an error number. */
+int aatree_nr_init(aatree_nr_t        *nr,
+                   void               *log,
+                   size_t              log_capacity,
+                   size_t              entry_size,
+                   size_t              key_size,
+                   size_t              capacity,
+                   uint16_t            node_offset,
+                   uint16_t            key_offset,
+                   aatree_keys_compare cmp) __nonnull((1, 2, 9));
+
+/* Release the locks. The memory is left to the caller. */
+void aatree_nr_destroy(aatree_nr_t *nr) __nonnull((1));
+
+/* Add replica of the next node with its pool of capacity entries. All the
+ * replicas must be added before the first operation. Returns zero on
+ * success, ENOSPC if there are too many replicas, or an error number. */
+int aatree_nr_add_replica(aatree_nr_t         *nr,
+                          aatree_nr_replica_t *replica,
+                          void                *pool) __nonnull((1, 2, 3));
+
+/* Replica of the node the calling thread runs on */
+aatree_nr_replica_t *aatree_nr_local(aatree_nr_t *nr) __nonnull((1));
+
+/* Copy entry into every replica. Returns zero on success, EEXIST if an entry
+ * with the key is there, or ENOMEM if the pools are full. */
+int aatree_nr_insert(aatree_nr_t         *nr,
+                     aatree_nr_replica_t *replica,
+                     const void          *entry) __nonnull((1, 2, 3));
+
+/* Delete entry with the key from every replica. Returns zero on success or
+ * ENOENT if there is no such entry. */
+int aatree_nr_delete(aatree_nr_t         *nr,
+                     aatree_nr_replica_t *replica,
+                     const void          *key) __nonnull((1, 2, 3));
+
+/* Search entry in the replica like aatree_search() and copy it out, after
+ * replaying the operations logged so far. Returns non-zero if the entry is
+ * found. */
+int aatree_nr_search(aatree_nr_t         *nr,
+                     aatree_nr_replica_t *replica,
+                     const void          *key,
+                     aatree_keys_order    order,
+                     void                *out) __nonnull((1, 2, 3, 5));
+
+#endif /* AATREE_NR_H */
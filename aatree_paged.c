@@ -0,0 +1,895 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "aatree_paged.h"
+
+/* A reference is the page number and the slot in it */
+#define ref_page(ref) ((ref) >> 16)
+#define ref_slot(ref) ((ref)&0xffff)
+#define make_ref(page, slot) ((uint64_t)(page) << 16 | (slot))
+
+/* Pages start at the first cache line past the frames and the hash */
+static __inline__ size_t pages_offset(size_t frames)
+{
+  return ((frames + 1) * sizeof(aatree_paged_frame_t)
+          + frames * sizeof(uint32_t) + AATREE_CACHE_LINE - 1)
+         & ~(size_t)(AATREE_CACHE_LINE - 1);
+} /* pages_offset */
+
+size_t aatree_paged_memory_size(size_t page_size, size_t frames)
+{
+  return pages_offset(frames) + (frames + 1) * page_size;
+} /* aatree_paged_memory_size */
+
+static __inline__ size_t slot_size(size_t entry_size)
+{
+  return (sizeof(aatree_paged_node_t) + entry_size + 7) & ~(size_t)7;
+} /* slot_size */
+
+/* Keep the first error, the tree is not updated after it */
+static __inline__ void fail(aatree_paged_t *tree, int error)
+{
+  if (!tree->error)
+    tree->error = error;
+} /* fail */
+
+/* Read or write a whole page, reading zeroes past the end of the file */
+static int page_io(aatree_paged_t *tree, uint64_t page, uint8_t *data,
+                   int write)
+{
+  size_t left = tree->header.page_size;
+  off_t  off  = (off_t)(page * left);
+
+  while (left)
+  {
+    ssize_t n = write ? pwrite(tree->fd, data, left, off)
+                      : pread(tree->fd, data, left, off);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return errno;
+    }
+
+    if (!n)
+    {
+      if (write)
+        return EIO;
+
+      memset(data, 0, left);
+      break;
+    }
+
+    data += n;
+    off  += n;
+    left -= n;
+  }
+
+  return 0;
+} /* page_io */
+
+static __inline__ uint32_t *bucket(aatree_paged_t *tree, uint64_t page)
+{
+  return &tree->buckets[page % tree->capacity];
+} /* bucket */
+
+/* Frame of the page if it is in the pool, or NULL */
+static aatree_paged_frame_t *find_frame(aatree_paged_t *tree, uint64_t page)
+{
+  aatree_paged_frame_t *frame = NULL;
+  uint32_t              i;
+
+  for (i = *bucket(tree, page); i; i = frame->next)
+  {
+    frame = &tree->frames[i - 1];
+
+    if (frame->page == page)
+      return frame;
+  }
+
+  return NULL;
+} /* find_frame */
+
+static void unhash(aatree_paged_t *tree, aatree_paged_frame_t *frame)
+{
+  uint32_t *link = bucket(tree, frame->page);
+  uint32_t  i    = (uint32_t)(frame - tree->frames) + 1;
+
+  for (; *link != i; link = &tree->frames[*link - 1].next)
+  {
+  }
+
+  *link = frame->next;
+} /* unhash */
+
+/* Take the first frame the clock hand finds neither pinned nor referenced
+ * since its last sweep, writing its page back if it is dirty */
+static aatree_paged_frame_t *evict(aatree_paged_t *tree)
+{
+  aatree_paged_frame_t *frame = NULL;
+  size_t                n;
+  int                   error = 0;
+
+  for (n = 0; n <= 2 * tree->capacity; n++)
+  {
+    frame      = &tree->frames[tree->hand];
+    tree->hand = (tree->hand + 1) % tree->capacity;
+
+    if (frame->pinned)
+      continue;
+
+    if (frame->referenced)
+    {
+      frame->referenced = 0;
+      continue;
+    }
+
+    if (frame->page)
+    {
+      if (frame->dirty && !tree->error)
+      {
+        tree->writes++;
+
+        if ((error = page_io(tree, frame->page, frame->data, 1)))
+          fail(tree, error);
+      }
+
+      unhash(tree, frame);
+    }
+
+    frame->page  = 0;
+    frame->dirty = 0;
+
+    return frame;
+  }
+
+  return NULL;
+} /* evict */
+
+/* Read the page into a frame taken from the pool, unless it is a fresh one */
+static aatree_paged_frame_t *load(aatree_paged_t *tree, uint64_t page,
+                                  int fresh)
+{
+  aatree_paged_frame_t *frame = evict(tree);
+  uint32_t             *link  = bucket(tree, page);
+  int                   error = 0;
+
+  if (!frame)
+  {
+    return NULL;
+  }
+
+  frame->page  = page;
+  frame->dirty = (uint8_t)fresh;
+  frame->next  = *link;
+  *link        = (uint32_t)(frame - tree->frames) + 1;
+
+  if (fresh)
+  {
+    memset(frame->data, 0, tree->header.page_size);
+  }
+  else
+  {
+    tree->reads++;
+
+    if ((error = page_io(tree, page, frame->data, 0)))
+    {
+      fail(tree, error);
+      memset(frame->data, 0, tree->header.page_size);
+    }
+  }
+
+  return frame;
+} /* load */
+
+/* Pin the page for the operation */
+static aatree_paged_frame_t *pin(aatree_paged_t *tree, uint64_t page,
+                                 int fresh)
+{
+  aatree_paged_frame_t *frame = find_frame(tree, page);
+
+  if (frame && frame->pinned)
+  {
+    tree->hits++;
+    return frame;
+  }
+
+  if (frame)
+  {
+    tree->hits++;
+  }
+
+  /* Out of frames, which the height bound rules out: the error stops the
+   * tree and the spare stands for the page. */
+  if (tree->pinned == AATREE_PAGED_MIN_FRAMES
+      || (!frame && !(frame = load(tree, page, fresh))))
+  {
+    fail(tree, ENOBUFS);
+
+    frame = &tree->frames[tree->capacity];
+    memset(frame->data, 0, tree->header.page_size);
+
+    return frame;
+  }
+
+  frame->referenced          = 1;
+  frame->pinned              = 1;
+  tree->pins[tree->pinned++] = (uint32_t)(frame - tree->frames);
+
+  return frame;
+} /* pin */
+
+/* End of an operation */
+static void unpin_all(aatree_paged_t *tree)
+{
+  while (tree->pinned)
+  {
+    tree->frames[tree->pins[--tree->pinned]].pinned = 0;
+  }
+} /* unpin_all */
+
+static __inline__ aatree_paged_page_t *page_at(aatree_paged_t *tree,
+                                               uint64_t        page,
+                                               int             write)
+{
+  aatree_paged_frame_t *frame = pin(tree, page, 0);
+
+  frame->dirty |= (uint8_t)write;
+
+  return (aatree_paged_page_t *)frame->data;
+} /* page_at */
+
+/* Node of the reference, the page is marked dirty to write to it */
+static __inline__ aatree_paged_node_t *node_at(aatree_paged_t *tree,
+                                               uint64_t        ref,
+                                               int             write)
+{
+  aatree_paged_frame_t *frame = pin(tree, ref_page(ref), 0);
+
+  frame->dirty |= (uint8_t)write;
+
+  return (aatree_paged_node_t *)(frame->data + sizeof(aatree_paged_page_t)
+                                 + ref_slot(ref) * tree->header.slot_size);
+} /* node_at */
+
+static __inline__ uint8_t *node_entry(aatree_paged_node_t *node)
+{
+  return (uint8_t *)(node + 1);
+} /* node_entry */
+
+static __inline__ const void *node_key(const aatree_paged_t *tree,
+                                       aatree_paged_node_t  *node)
+{
+  return node_entry(node) + tree->header.key_offset;
+} /* node_key */
+
+static __inline__ uint8_t node_level(aatree_paged_t *tree, uint64_t ref)
+{
+  return ref ? node_at(tree, ref, 0)->level : 0;
+} /* node_level */
+
+/* Store the links, writing to the page only if they change */
+static __inline__ void set_left(aatree_paged_t *tree, uint64_t ref,
+                                uint64_t left)
+{
+  if (node_at(tree, ref, 0)->left != left)
+    node_at(tree, ref, 1)->left = left;
+} /* set_left */
+
+static __inline__ void set_right(aatree_paged_t *tree, uint64_t ref,
+                                 uint64_t right)
+{
+  if (node_at(tree, ref, 0)->right != right)
+    node_at(tree, ref, 1)->right = right;
+} /* set_right */
+
+/* Take the first free slot of the page */
+static uint64_t take_slot(aatree_paged_t *tree, uint64_t number)
+{
+  aatree_paged_page_t *page = page_at(tree, number, 1);
+  uint64_t             ref  = make_ref(number, page->free - 1);
+  aatree_paged_node_t *node = node_at(tree, ref, 1);
+
+  page->free = (uint16_t)node->right;
+  page->used++;
+
+  node->left  = 0;
+  node->right = 0;
+  node->level = 1;
+  node->used  = 1;
+
+  return ref;
+} /* take_slot */
+
+/* Allocate a slot in the page of the node near if it has room, in a page
+ * with free slots otherwise, or in a new page at the end of the file */
+static uint64_t alloc_slot(aatree_paged_t *tree, uint64_t near)
+{
+  aatree_paged_header_t *header = &tree->header;
+  aatree_paged_page_t   *page   = NULL;
+  uint64_t               number = 0;
+  uint64_t               i;
+
+  if (near && page_at(tree, ref_page(near), 0)->free)
+  {
+    return take_slot(tree, ref_page(near));
+  }
+
+  /* Pages filled up while listed are dropped from the list lazily. */
+  while ((number = header->partial))
+  {
+    page = page_at(tree, number, 0);
+
+    if (page->free)
+      return take_slot(tree, number);
+
+    page            = page_at(tree, number, 1);
+    header->partial = page->next;
+    page->next      = 0;
+    page->listed    = 0;
+  }
+
+  number = header->pages++;
+  page   = (aatree_paged_page_t *)pin(tree, number, 1)->data;
+
+  for (i = 0; i + 1 < header->slots; i++)
+  {
+    node_at(tree, make_ref(number, i), 1)->right = i + 2;
+  }
+
+  page->free      = 1;
+  page->listed    = 1;
+  page->next      = header->partial;
+  header->partial = number;
+
+  return take_slot(tree, number);
+} /* alloc_slot */
+
+static void free_slot(aatree_paged_t *tree, uint64_t ref)
+{
+  aatree_paged_header_t *header = &tree->header;
+  aatree_paged_page_t   *page   = page_at(tree, ref_page(ref), 1);
+  aatree_paged_node_t   *node   = node_at(tree, ref, 1);
+
+  node->left  = 0;
+  node->level = 0;
+  node->used  = 0;
+  node->right = page->free;
+  page->free  = (uint16_t)(ref_slot(ref) + 1);
+  page->used--;
+
+  if (!page->listed)
+  {
+    page->listed    = 1;
+    page->next      = header->partial;
+    header->partial = ref_page(ref);
+  }
+} /* free_slot */
+
+/*
+ *     N        L
+ *    / \      / \
+ *   L   R -> A   N
+ *  / \          / \
+ * A   B        B   R
+ */
+static uint64_t skew(aatree_paged_t *tree, uint64_t ref)
+{
+  aatree_paged_node_t *node = NULL;
+  aatree_paged_node_t *left = NULL;
+  uint64_t             off  = 0;
+
+  if (!ref)
+    return ref;
+
+  node = node_at(tree, ref, 0);
+
+  if (!(off = node->left) || node_at(tree, off, 0)->level != node->level)
+    return ref;
+
+  node = node_at(tree, ref, 1);
+  left = node_at(tree, off, 1);
+
+  node->left  = left->right;
+  left->right = ref;
+
+  return off;
+} /* skew */
+
+/*
+ *   N            R
+ *  / \          / \
+ * A   R   ->   N   X
+ *    / \      / \
+ *   B   X    A   B
+ */
+static uint64_t split(aatree_paged_t *tree, uint64_t ref)
+{
+  aatree_paged_node_t *node  = NULL;
+  aatree_paged_node_t *right = NULL;
+  uint64_t             off   = 0;
+
+  if (!ref)
+    return ref;
+
+  node = node_at(tree, ref, 0);
+
+  if (!(off = node->right) || !(right = node_at(tree, off, 0))->right
+      || node_at(tree, right->right, 0)->level != node->level)
+    return ref;
+
+  node  = node_at(tree, ref, 1);
+  right = node_at(tree, off, 1);
+
+  node->right = right->left;
+  right->left = ref;
+  right->level++;
+
+  return off;
+} /* split */
+
+/* Insert the entry into the subtree, the new node goes next to its parent.
+ * Returns the root of the subtree. */
+static uint64_t insert_node(aatree_paged_t *tree,
+                            uint64_t        ref,
+                            uint64_t        parent,
+                            const void     *entry,
+                            int            *error)
+{
+  const uint8_t       *key  = (const uint8_t *)entry + tree->header.key_offset;
+  aatree_paged_node_t *node = NULL;
+  int                  result;
+
+  if (!ref)
+  {
+    ref = alloc_slot(tree, parent);
+    memcpy(node_entry(node_at(tree, ref, 1)), entry, tree->header.entry_size);
+    tree->header.count++;
+
+    return ref;
+  }
+
+  node   = node_at(tree, ref, 0);
+  result = tree->cmp(key, node_key(tree, node));
+
+  if (!result)
+  {
+    *error = EEXIST;
+    return ref;
+  }
+
+  if (result < 0)
+    set_left(tree, ref, insert_node(tree, node->left, ref, entry, error));
+  else
+    set_right(tree, ref, insert_node(tree, node->right, ref, entry, error));
+
+  return split(tree, skew(tree, ref));
+} /* insert_node */
+
+/* Restore the invariants on the way up from a deleted node */
+static uint64_t rebalance(aatree_paged_t *tree, uint64_t ref)
+{
+  aatree_paged_node_t *node   = node_at(tree, ref, 0);
+  uint8_t              left   = node_level(tree, node->left);
+  uint8_t              right  = node_level(tree, node->right);
+  uint8_t              should = (left < right ? left : right) + 1;
+
+  if (should < node->level)
+  {
+    node_at(tree, ref, 1)->level = should;
+
+    if (right > should)
+      node_at(tree, node->right, 1)->level = should;
+  }
+
+  ref  = skew(tree, ref);
+  node = node_at(tree, ref, 0);
+  set_right(tree, ref, skew(tree, node->right));
+
+  if (node->right)
+  {
+    set_right(tree, node->right,
+              skew(tree, node_at(tree, node->right, 0)->right));
+  }
+
+  ref  = split(tree, ref);
+  node = node_at(tree, ref, 0);
+  set_right(tree, ref, split(tree, node->right));
+
+  return ref;
+} /* rebalance */
+
+/* Delete the entry with the key from the subtree, copying it out unless out
+ * is NULL. Returns the root of the subtree. */
+static uint64_t delete_node(aatree_paged_t *tree,
+                            uint64_t        ref,
+                            const void     *key,
+                            void           *out,
+                            int            *error)
+{
+  aatree_paged_node_t *node = NULL;
+  uint64_t             next = 0;
+  int                  result;
+
+  if (!ref)
+  {
+    *error = ENOENT;
+    return ref;
+  }
+
+  node   = node_at(tree, ref, 0);
+  result = tree->cmp(key, node_key(tree, node));
+
+  if (result < 0)
+  {
+    set_left(tree, ref, delete_node(tree, node->left, key, out, error));
+  }
+  else if (result > 0)
+  {
+    set_right(tree, ref, delete_node(tree, node->right, key, out, error));
+  }
+  else
+  {
+    if (out)
+      memcpy(out, node_entry(node), tree->header.entry_size);
+
+    if (!node->left && !node->right)
+    {
+      free_slot(tree, ref);
+      tree->header.count--;
+
+      return 0;
+    }
+
+    /* An inner node takes the entry of its neighbour, which is a leaf or
+     * next to one, and the neighbour is deleted from below instead. */
+    if (!node->left)
+    {
+      for (next = node->right; node_at(tree, next, 0)->left;
+           next = node_at(tree, next, 0)->left)
+      {
+      }
+    }
+    else
+    {
+      for (next = node->left; node_at(tree, next, 0)->right;
+           next = node_at(tree, next, 0)->right)
+      {
+      }
+    }
+
+    memcpy(node_entry(node_at(tree, ref, 1)),
+           node_entry(node_at(tree, next, 0)), tree->header.entry_size);
+    key = node_key(tree, node);
+
+    if (!node->left)
+      set_right(tree, ref, delete_node(tree, node->right, key, NULL, error));
+    else
+      set_left(tree, ref, delete_node(tree, node->left, key, NULL, error));
+  }
+
+  return rebalance(tree, ref);
+} /* delete_node */
+
+int aatree_paged_open(aatree_paged_t     *tree,
+                      int                 fd,
+                      size_t              page_size,
+                      size_t              entry_size,
+                      uint16_t            key_offset,
+                      aatree_keys_compare cmp,
+                      void               *memory,
+                      size_t              size)
+{
+  aatree_paged_header_t *header = &tree->header;
+  aatree_paged_frame_t  *spare  = NULL;
+  uint8_t               *data   = NULL;
+  struct stat            st;
+  size_t                 slots  = 0;
+  size_t                 i;
+  int                    error  = 0;
+
+  memset(tree, 0, sizeof(*tree));
+
+  tree->fd  = fd;
+  tree->cmp = cmp;
+
+  if (page_size < sizeof(aatree_paged_header_t)
+      || page_size < sizeof(aatree_paged_page_t) + slot_size(entry_size))
+  {
+    return EINVAL;
+  }
+
+  slots = (page_size - sizeof(aatree_paged_page_t)) / slot_size(entry_size);
+
+  if (slots > 0xffff)
+    slots = 0xffff;
+
+  /* As many frames as the memory takes */
+  tree->capacity = size / (sizeof(aatree_paged_frame_t) + sizeof(uint32_t)
+                           + page_size);
+
+  while (tree->capacity
+         && aatree_paged_memory_size(page_size, tree->capacity) > size)
+  {
+    tree->capacity--;
+  }
+
+  if (tree->capacity < AATREE_PAGED_MIN_FRAMES)
+  {
+    return EINVAL;
+  }
+
+  tree->frames  = memory;
+  tree->buckets = (uint32_t *)(tree->frames + tree->capacity + 1);
+  data          = (uint8_t *)memory + pages_offset(tree->capacity);
+
+  memset(tree->frames, 0, pages_offset(tree->capacity));
+
+  for (i = 0; i <= tree->capacity; i++)
+  {
+    tree->frames[i].data = data + i * page_size;
+  }
+
+  header->page_size = page_size;
+  spare             = &tree->frames[tree->capacity];
+
+  if (fstat(fd, &st))
+  {
+    return errno;
+  }
+
+  if (!st.st_size)
+  {
+    header->magic      = AATREE_PAGED_MAGIC;
+    header->entry_size = entry_size;
+    header->key_offset = key_offset;
+    header->slot_size  = slot_size(entry_size);
+    header->slots      = slots;
+    header->pages      = 1;
+
+    return aatree_paged_sync(tree);
+  }
+
+  if ((error = page_io(tree, 0, spare->data, 0)))
+  {
+    return error;
+  }
+
+  memcpy(header, spare->data, sizeof(*header));
+
+  if (header->magic != AATREE_PAGED_MAGIC || header->page_size != page_size
+      || header->entry_size != entry_size || header->key_offset != key_offset
+      || header->slot_size != slot_size(entry_size) || header->slots != slots)
+  {
+    return EINVAL;
+  }
+
+  return 0;
+} /* aatree_paged_open */
+
+int aatree_paged_sync(aatree_paged_t *tree)
+{
+  aatree_paged_frame_t *spare = &tree->frames[tree->capacity];
+  size_t                i;
+  int                   error = 0;
+
+  for (i = 0; i < tree->capacity && !tree->error; i++)
+  {
+    aatree_paged_frame_t *frame = &tree->frames[i];
+
+    if (frame->page && frame->dirty)
+    {
+      tree->writes++;
+
+      if ((error = page_io(tree, frame->page, frame->data, 1)))
+        fail(tree, error);
+
+      frame->dirty = 0;
+    }
+  }
+
+  if (!tree->error && fdatasync(tree->fd))
+  {
+    fail(tree, errno);
+  }
+
+  if (tree->error)
+  {
+    return tree->error;
+  }
+
+  /* The header goes last, over pages all on disk. */
+  memset(spare->data, 0, tree->header.page_size);
+  memcpy(spare->data, &tree->header, sizeof(tree->header));
+
+  if ((error = page_io(tree, 0, spare->data, 1)) || fdatasync(tree->fd))
+  {
+    fail(tree, error ? error : errno);
+  }
+
+  return tree->error;
+} /* aatree_paged_sync */
+
+int aatree_paged_insert(aatree_paged_t *tree, const void *entry)
+{
+  int error = 0;
+
+  if (tree->error)
+  {
+    return tree->error;
+  }
+
+  tree->header.root = insert_node(tree, tree->header.root, 0, entry, &error);
+  unpin_all(tree);
+
+  return tree->error ? tree->error : error;
+} /* aatree_paged_insert */
+
+int aatree_paged_delete(aatree_paged_t *tree, const void *key, void *out)
+{
+  int error = 0;
+
+  if (tree->error)
+  {
+    return tree->error;
+  }
+
+  tree->header.root = delete_node(tree, tree->header.root, key, out, &error);
+  unpin_all(tree);
+
+  return tree->error ? tree->error : error;
+} /* aatree_paged_delete */
+
+int aatree_paged_search(aatree_paged_t   *tree,
+                        const void       *key,
+                        aatree_keys_order order,
+                        void             *out)
+{
+  aatree_paged_node_t *node      = NULL;
+  uint64_t             ref       = 0;
+  uint64_t             candidate = 0;
+
+  if (tree->error)
+  {
+    return 0;
+  }
+
+  for (ref = tree->header.root; ref;)
+  {
+    int result = 0;
+
+    node   = node_at(tree, ref, 0);
+    result = tree->cmp(key, node_key(tree, node));
+
+    if (!result && order != AATREE_KEY_LT && order != AATREE_KEY_GT)
+    {
+      candidate = ref;
+      break;
+    }
+
+    /* Keep the closest node on the side the order asks for. */
+    if (result > 0 || (!result && order == AATREE_KEY_GT))
+    {
+      if (order == AATREE_KEY_LT || order == AATREE_KEY_LE)
+        candidate = ref;
+
+      ref = node->right;
+    }
+    else
+    {
+      if (order == AATREE_KEY_GT || order == AATREE_KEY_GE)
+        candidate = ref;
+
+      ref = node->left;
+    }
+  }
+
+  if (candidate)
+  {
+    memcpy(out, node_entry(node_at(tree, candidate, 0)),
+           tree->header.entry_size);
+  }
+
+  unpin_all(tree);
+
+  return candidate && !tree->error;
+} /* aatree_paged_search */
+
+/* Have the kernel read the page of a subtree to be visited later ahead,
+ * unless it is the page of its parent or already in the pool */
+static void prefetch(aatree_paged_t *tree, uint64_t parent, uint64_t ref)
+{
+  uint64_t page = ref_page(ref);
+
+  if (ref && page != ref_page(parent) && !find_frame(tree, page))
+  {
+    posix_fadvise(tree->fd, (off_t)(page * tree->header.page_size),
+                  (off_t)tree->header.page_size, POSIX_FADV_WILLNEED);
+  }
+} /* prefetch */
+
+int aatree_paged_scan(aatree_paged_t       *tree,
+                      const void           *lo,
+                      const void           *hi,
+                      aatree_paged_scan_fn *visit,
+                      void                 *arg)
+{
+  uint64_t             stack[AATREE_PAGED_MAX_DEPTH];
+  aatree_paged_node_t *node   = NULL;
+  uint64_t             ref    = tree->header.root;
+  int                  depth  = 0;
+  int                  result = 0;
+
+  if (tree->error)
+  {
+    return tree->error;
+  }
+
+  for (;;)
+  {
+    /* Nodes below lo are skipped with their left subtrees. */
+    while (ref && depth < AATREE_PAGED_MAX_DEPTH)
+    {
+      node = node_at(tree, ref, 0);
+
+      if (lo && tree->cmp(node_key(tree, node), lo) < 0)
+      {
+        ref = node->right;
+        continue;
+      }
+
+      prefetch(tree, ref, node->right);
+
+      stack[depth++] = ref;
+      ref            = node->left;
+    }
+
+    unpin_all(tree);
+
+    if (!depth)
+      break;
+
+    ref  = stack[--depth];
+    node = node_at(tree, ref, 0);
+
+    if (hi && tree->cmp(node_key(tree, node), hi) > 0)
+      break;
+
+    if ((result = visit(node_entry(node), arg)))
+      break;
+
+    ref = node->right;
+  }
+
+  unpin_all(tree);
+
+  return result ? result : tree->error;
+} /* aatree_paged_scan */
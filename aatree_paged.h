@@ -0,0 +1,212 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+
+#ifndef AATREE_PAGED_H
+#define AATREE_PAGED_H
+
+#include "aatree.h"
+
+/* AA tree in the pages of a file, for trees larger than memory.
+ *
+ * Entries of a fixed size are copied into slots of fixed size pages, and the
+ * links are references to a page and a slot in it, zero standing for NULL.
+ * Only the pages in use are in memory, in the frames of a buffer pool: a miss
+ * takes the frame the clock hand comes to first which is neither pinned nor
+ * recently used, writing it back first if it is dirty.
+ *
+ * A new node goes into the page of its parent while it has room, so the
+ * subtrees grown from a page mostly stay in it and a descent reads a page
+ * per several levels. Pages with free slots are listed for the others.
+ *
+ * The pages an operation touches are pinned until it is done, so a pool has
+ * AATREE_PAGED_MIN_FRAMES frames at least. A range scan pins one page at a
+ * time and advises the kernel of the pages of the right subtrees it has yet
+ * to visit, to have them read ahead while it walks the left ones.
+ *
+ * Evicted pages are written back in place whenever the pool runs out of
+ * frames, so the file is a valid tree only after aatree_paged_sync() with no
+ * update since, as when it is closed. A crash in between may leave pages of
+ * the next state under the header of the last sync: the tree is then to be
+ * rebuilt, e.g. from a snapshot and the log. A read or write error is kept
+ * and stops all updates, the pages in memory are not written any more.
+ *
+ * The tree is not thread-safe: the frames change under the searches too.
+ */
+
+/* File format identifier, changed with the layout */
+#define AATREE_PAGED_MAGIC UINT64_C(0x0100646567617061)
+
+/* Bound of the height, it takes more than 2^32 entries to exceed */
+#define AATREE_PAGED_MAX_DEPTH 64
+
+/* An operation touches at most so many nodes per level */
+#define AATREE_PAGED_MIN_FRAMES (8 * AATREE_PAGED_MAX_DEPTH)
+
+/* Slot of a page, the entry follows it */
+typedef struct aatree_paged_node
+{
+  uint64_t left;
+  uint64_t right;
+
+  uint8_t level;
+
+  /* set while the entry belongs to the tree */
+  uint8_t used;
+} aatree_paged_node_t;
+
+/* Header of a page, the slots follow it */
+typedef struct aatree_paged_page
+{
+  /* Next page on the list of pages with free slots */
+  uint64_t next;
+
+  /* First free slot plus one, free slots are linked through the right
+   * references */
+  uint16_t free;
+  uint16_t used;
+
+  /* set while the page is on the list */
+  uint8_t listed;
+} aatree_paged_page_t;
+
+/* File header, the first page */
+typedef struct aatree_paged_header
+{
+  uint64_t magic;
+  uint64_t page_size;
+  uint64_t entry_size;
+  uint64_t key_offset;
+  uint64_t slot_size;
+  uint64_t slots;
+
+  uint64_t root;
+  uint64_t count;
+  uint64_t pages;
+
+  /* Pages with free slots */
+  uint64_t partial;
+} aatree_paged_header_t;
+
+/* Frame of the buffer pool */
+typedef struct aatree_paged_frame
+{
+  /* Page in the frame, zero if none */
+  uint64_t page;
+  uint8_t *data;
+
+  /* Next frame of the hash chain plus one */
+  uint32_t next;
+
+  uint8_t pinned;
+  uint8_t dirty;
+  uint8_t referenced;
+} aatree_paged_frame_t;
+
+typedef struct aatree_paged
+{
+  aatree_paged_header_t header;
+
+  int                  fd;
+  aatree_keys_compare *cmp;
+
+  /* Buffer pool, its hash of the pages and the clock hand. A spare frame
+   * follows the others, for the header and in place of a page there is no
+   * frame for. */
+  aatree_paged_frame_t *frames;
+  uint32_t             *buckets;
+  size_t                capacity;
+  size_t                hand;
+
+  /* Frames pinned by the operation */
+  uint32_t pins[AATREE_PAGED_MIN_FRAMES];
+  size_t   pinned;
+
+  /* First read or write error */
+  int error;
+
+  /* Frame lookups, pages read and written back */
+  uint64_t hits;
+  uint64_t reads;
+  uint64_t writes;
+} aatree_paged_t;
+
+/* Visitor of a range scan, a non-zero result stops the scan */
+typedef int(aatree_paged_scan_fn)(const void *entry, void *arg);
+
+/* Size of the memory of a pool of the frames of page_size bytes */
+size_t aatree_paged_memory_size(size_t page_size, size_t frames);
+
+/* Open the tree in the file, or create an empty one if the file is empty,
+ * with the pool in the memory of size bytes. The page size, the entry size
+ * and the key offset must be the ones the file was created with. Returns
+ * zero, EINVAL if they are not, if the file is not a tree, or if a page does
+ * not hold an entry or the memory AATREE_PAGED_MIN_FRAMES frames, or the
+ * errno value of the read. */
+int aatree_paged_open(aatree_paged_t     *tree,
+                      int                 fd,
+                      size_t              page_size,
+                      size_t              entry_size,
+                      uint16_t            key_offset,
+                      aatree_keys_compare cmp,
+                      void               *memory,
+                      size_t              size) __nonnull((1, 6, 7));
+
+/* Write back and sync the dirty pages, then the header. Returns zero or the
+ * first error of the tree. */
+int aatree_paged_sync(aatree_paged_t *tree) __nonnull((1));
+
+/* Number of entries in the tree */
+static __inline__ __nonnull((1)) uint64_t
+aatree_paged_count(const aatree_paged_t *tree)
+{
+  return tree->header.count;
+} /* aatree_paged_count */
+
+/* Copy entry into the tree. Returns zero on success, EEXIST if an entry with
+ * the key is there, or the error of the tree. */
+int aatree_paged_insert(aatree_paged_t *tree, const void *entry)
+    __nonnull((1, 2));
+
+/* Delete entry with the key, copying it out unless out is NULL. Returns zero
+ * on success, ENOENT if there is no such entry, or the error of the tree. */
+int aatree_paged_delete(aatree_paged_t *tree, const void *key, void *out)
+    __nonnull((1, 2));
+
+/* Search entry like aatree_search() and copy it out. Returns non-zero if the
+ * entry is found, an error reads as a miss. */
+int aatree_paged_search(aatree_paged_t   *tree,
+                        const void       *key,
+                        aatree_keys_order order,
+                        void             *out) __nonnull((1, 2, 4));
+
+/* Visit the entries with keys from lo to hi inclusive in order, either bound
+ * is open if NULL. The entry is valid during the visit only. Returns zero,
+ * the non-zero result of the visitor, or the error of the tree. */
+int aatree_paged_scan(aatree_paged_t       *tree,
+                      const void           *lo,
+                      const void           *hi,
+                      aatree_paged_scan_fn *visit,
+                      void                 *arg) __nonnull((1, 4));
+
+#endif /* AATREE_PAGED_H */
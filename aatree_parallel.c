@@ -0,0 +1,817 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include "aatree_parallel.h"
+
+/* Runs of the merge sort sorted by insertion */
+#define AATREE_PARALLEL_RUN 16
+
+/* Start a task on a new thread, or run it right away if there is none.
+ * Returns non-zero if the task has to be joined. */
+static int fork_task(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+  if (!pthread_create(thread, NULL, fn, arg))
+  {
+    return 1;
+  }
+
+  fn(arg);
+
+  return 0;
+} /* fork_task */
+
+static __inline__ void join_task(pthread_t thread, int forked)
+{
+  if (forked)
+  {
+    pthread_join(thread, NULL);
+  }
+} /* join_task */
+
+static __inline__ int compare_nodes(const aatree_t *tree,
+                                   aatree_node_t  *a,
+                                   aatree_node_t  *b)
+{
+  return tree->cmp(aatree_node_key(tree, a), aatree_node_key(tree, b));
+} /* compare_nodes */
+
+/* Subtree of a range */
+typedef struct build_task
+{
+  aatree_t       *tree;
+  aatree_node_t **nodes;
+  size_t          count;
+  aatree_node_t  *parent;
+  unsigned        nthreads;
+
+  aatree_node_t *root;
+  int            error;
+} build_task_t;
+
+static void *build_range(void *arg)
+{
+  build_task_t  *task  = arg;
+  build_task_t   left  = *task;
+  build_task_t   right = *task;
+  aatree_node_t *node  = NULL;
+  pthread_t      thread;
+  size_t         half  = 0;
+  size_t         width = 0;
+  int            forked;
+
+  /* A small range is built by the sequential loader, which gives the very
+   * same subtree. */
+  if (task->nthreads <= 1 || task->count < AATREE_PARALLEL_GRAIN)
+  {
+    aatree_t subtree = *task->tree;
+
+    subtree.root  = NULL;
+    subtree.first = NULL;
+    subtree.last  = NULL;
+
+    task->error = aatree_build_sorted(&subtree, task->nodes, task->count);
+    task->root  = subtree.root;
+
+    if (task->root)
+    {
+      task->root->parent = task->parent;
+    }
+
+    return NULL;
+  }
+
+  half = (task->count - 1) / 2;
+  node = task->nodes[half];
+
+  left.count    = half;
+  left.parent   = node;
+  left.nthreads = task->nthreads / 2;
+
+  right.nodes    = task->nodes + half + 1;
+  right.count    = task->count - half - 1;
+  right.parent   = node;
+  right.nthreads = task->nthreads - left.nthreads;
+
+  forked = fork_task(&thread, build_range, &left);
+  build_range(&right);
+  join_task(thread, forked);
+
+  /* The halves check their own order, the middle node is checked here. */
+  task->error = left.error || right.error
+                || compare_nodes(task->tree, task->nodes[half - 1], node) >= 0
+                || compare_nodes(task->tree, node, task->nodes[half + 1]) >= 0;
+
+  node->parent = task->parent;
+  node->left   = left.root;
+  node->right  = right.root;
+  node->level  = 0;
+
+  for (width = task->count + 1; width > 1; width >>= 1)
+  {
+    node->level++;
+  }
+
+  if (task->tree->update)
+  {
+    task->tree->update(task->tree, node);
+  }
+
+  task->root = node;
+
+  return NULL;
+} /* build_range */
+
+int aatree_build_sorted_parallel(aatree_t       *tree,
+                                 aatree_node_t **nodes,
+                                 size_t          count,
+                                 unsigned        nthreads)
+{
+  build_task_t task;
+
+  if (tree->root)
+  {
+    return -1;
+  }
+
+  task.tree     = tree;
+  task.nodes    = nodes;
+  task.count    = count;
+  task.parent   = NULL;
+  task.nthreads = nthreads;
+  task.root     = NULL;
+  task.error    = 0;
+
+  build_range(&task);
+
+  if (task.error)
+  {
+    return -1;
+  }
+
+  if (count)
+  {
+    tree->first = nodes[0];
+    tree->last  = nodes[count - 1];
+    __atomic_store_n(&tree->root, task.root, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+} /* aatree_build_sorted_parallel */
+
+/* Stable merge of the sorted halves [0, mid) and [mid, count) */
+static void merge(const aatree_t *tree,
+                  aatree_node_t **src,
+                  size_t          mid,
+                  size_t          count,
+                  aatree_node_t **dst)
+{
+  size_t i = 0;
+  size_t j = mid;
+  size_t k = 0;
+
+  while (i < mid && j < count)
+  {
+    dst[k++] = compare_nodes(tree, src[j], src[i]) < 0 ? src[j++] : src[i++];
+  }
+
+  while (i < mid)
+  {
+    dst[k++] = src[i++];
+  }
+
+  while (j < count)
+  {
+    dst[k++] = src[j++];
+  }
+} /* merge */
+
+/* Sequential bottom-up merge sort */
+static void sort_run(const aatree_t *tree,
+                     aatree_node_t **nodes,
+                     aatree_node_t **scratch,
+                     size_t          count)
+{
+  aatree_node_t **src = nodes;
+  aatree_node_t **dst = scratch;
+  size_t          width, i, j;
+
+  for (i = 0; i < count; i += AATREE_PARALLEL_RUN)
+  {
+    size_t end = count - i < AATREE_PARALLEL_RUN ? count
+                                                 : i + AATREE_PARALLEL_RUN;
+
+    for (j = i + 1; j < end; j++)
+    {
+      aatree_node_t *node = nodes[j];
+      size_t         k    = j;
+
+      for (; k > i && compare_nodes(tree, node, nodes[k - 1]) < 0; k--)
+      {
+        nodes[k] = nodes[k - 1];
+      }
+
+      nodes[k] = node;
+    }
+  }
+
+  for (width = AATREE_PARALLEL_RUN; width < count; width *= 2)
+  {
+    aatree_node_t **tmp = src;
+
+    for (i = 0; i < count; i += 2 * width)
+    {
+      size_t mid = count - i < width ? count - i : width;
+      size_t end = count - i < 2 * width ? count - i : 2 * width;
+
+      merge(tree, src + i, mid, end, dst + i);
+    }
+
+    src = dst;
+    dst = tmp;
+  }
+
+  if (src != nodes)
+  {
+    memcpy(nodes, src, count * sizeof(*nodes));
+  }
+} /* sort_run */
+
+/* Range of the parallel sort */
+typedef struct sort_task
+{
+  const aatree_t *tree;
+  aatree_node_t **nodes;
+  aatree_node_t **scratch;
+  size_t          count;
+  unsigned        nthreads;
+} sort_task_t;
+
+static void *sort_range(void *arg)
+{
+  sort_task_t *task  = arg;
+  sort_task_t  left  = *task;
+  sort_task_t  right = *task;
+  pthread_t    thread;
+  int          forked;
+
+  if (task->nthreads <= 1 || task->count < AATREE_PARALLEL_GRAIN)
+  {
+    sort_run(task->tree, task->nodes, task->scratch, task->count);
+    return NULL;
+  }
+
+  left.count    = task->count / 2;
+  left.nthreads = task->nthreads / 2;
+
+  right.nodes    = task->nodes + left.count;
+  right.scratch  = task->scratch + left.count;
+  right.count    = task->count - left.count;
+  right.nthreads = task->nthreads - left.nthreads;
+
+  forked = fork_task(&thread, sort_range, &left);
+  sort_range(&right);
+  join_task(thread, forked);
+
+  merge(task->tree, task->nodes, left.count, task->count, task->scratch);
+  memcpy(task->nodes, task->scratch, task->count * sizeof(*task->nodes));
+
+  return NULL;
+} /* sort_range */
+
+void aatree_sort_parallel(const aatree_t *tree,
+                          aatree_node_t **nodes,
+                          aatree_node_t **scratch,
+                          size_t          count,
+                          unsigned        nthreads)
+{
+  sort_task_t task;
+
+  task.tree     = tree;
+  task.nodes    = nodes;
+  task.scratch  = scratch;
+  task.count    = count;
+  task.nthreads = nthreads;
+
+  sort_range(&task);
+} /* aatree_sort_parallel */
+
+int aatree_build_parallel(aatree_t       *tree,
+                          aatree_node_t **nodes,
+                          aatree_node_t **scratch,
+                          size_t          count,
+                          unsigned        nthreads,
+                          size_t         *linked)
+{
+  size_t dups = 0;
+  size_t i;
+
+  *linked = 0;
+
+  if (tree->root)
+  {
+    return EINVAL;
+  }
+
+  aatree_sort_parallel(tree, nodes, scratch, count, nthreads);
+
+  /* The sort is stable, so the first node of the array with a key is the
+   * first one of its run. */
+  for (i = 0; i < count; i++)
+  {
+    if (*linked && !compare_nodes(tree, nodes[*linked - 1], nodes[i]))
+      scratch[dups++] = nodes[i];
+    else
+      nodes[(*linked)++] = nodes[i];
+  }
+
+  memcpy(nodes + *linked, scratch, dups * sizeof(*nodes));
+  aatree_build_sorted_parallel(tree, nodes, *linked, nthreads);
+
+  return 0;
+} /* aatree_build_parallel */
+
+/* Subtrees of a set operation are forked off when they have at least this
+ * many levels, i.e. at least AATREE_PARALLEL_GRAIN nodes */
+#define AATREE_PARALLEL_GRAIN_LEVEL 12
+
+enum
+{
+  SET_UNION,
+  SET_INTERSECTION,
+  SET_DIFFERENCE
+};
+
+/* Set operation on a pair of detached subtrees */
+typedef struct set_task
+{
+  const aatree_t    *tree;
+  int                op;
+  aatree_resolve_fn *resolve;
+  void              *arg;
+  aatree_node_t     *root;
+  aatree_node_t     *other;
+  unsigned           nthreads;
+} set_task_t;
+
+/* Join two subtrees without a node between them, taking the last node of the
+ * left one instead */
+static aatree_node_t *join_pair(const aatree_t *tree,
+                                aatree_node_t  *left,
+                                aatree_node_t  *right)
+{
+  aatree_t       subtree = *tree;
+  aatree_node_t *node    = NULL;
+
+  if (!left || !right)
+  {
+    return left ? left : right;
+  }
+
+  subtree.root  = left;
+  subtree.first = NULL;
+
+  for (subtree.last = left; subtree.last->right;
+       subtree.last = subtree.last->right)
+  {
+  }
+
+  node = aatree_entry_node(tree, aatree_pop_last(&subtree));
+
+  return aatree_join_subtrees(tree, subtree.root, node, right);
+} /* join_pair */
+
+static void *set_range(void *arg)
+{
+  set_task_t    *task  = arg;
+  set_task_t     left  = *task;
+  set_task_t     right = *task;
+  aatree_node_t *node  = task->other;
+  aatree_node_t *found = NULL;
+  aatree_node_t *keep  = NULL;
+  pthread_t      thread;
+  int            forked;
+
+  if (!task->root || !task->other)
+  {
+    if (task->op == SET_INTERSECTION)
+      task->root = NULL;
+    else if (task->op == SET_UNION && !task->root)
+      task->root = task->other;
+
+    return NULL;
+  }
+
+  /* The root of the other subtree splits this one in two. */
+  left.other  = node->left;
+  right.other = node->right;
+
+  if (left.other)
+    left.other->parent = NULL;
+
+  if (right.other)
+    right.other->parent = NULL;
+
+  found = aatree_split_subtree(task->tree, task->root,
+                               aatree_node_key(task->tree, node), &left.root,
+                               &right.root);
+
+  left.nthreads  = task->nthreads / 2;
+  right.nthreads = task->nthreads - left.nthreads;
+
+  if (task->nthreads > 1 && node->level >= AATREE_PARALLEL_GRAIN_LEVEL)
+  {
+    forked = fork_task(&thread, set_range, &left);
+    set_range(&right);
+    join_task(thread, forked);
+  }
+  else
+  {
+    set_range(&left);
+    set_range(&right);
+  }
+
+  /* The node between the halves, if any, comes from either tree. */
+  if (found && task->op != SET_DIFFERENCE)
+    keep = task->resolve ? task->resolve(task->tree, found, node, task->arg)
+                         : found;
+  else if (!found && task->op == SET_UNION)
+    keep = node;
+
+  if (found && found != keep)
+    aatree_init_node(found);
+
+  if (node != keep)
+    aatree_init_node(node);
+
+  if (keep)
+    task->root = aatree_join_subtrees(task->tree, left.root, keep, right.root);
+  else
+    task->root = join_pair(task->tree, left.root, right.root);
+
+  return NULL;
+} /* set_range */
+
+static void set_operation(aatree_t          *tree,
+                          aatree_t          *other,
+                          int                op,
+                          aatree_resolve_fn *resolve,
+                          void              *arg,
+                          unsigned           nthreads)
+{
+  set_task_t task;
+
+  task.tree     = tree;
+  task.op       = op;
+  task.resolve  = resolve;
+  task.arg      = arg;
+  task.root     = tree->root;
+  task.other    = other->root;
+  task.nthreads = nthreads;
+
+  set_range(&task);
+
+  other->root  = NULL;
+  other->first = NULL;
+  other->last  = NULL;
+
+  tree->root  = task.root;
+  tree->first = task.root;
+  tree->last  = task.root;
+
+  for (; tree->first && tree->first->left; tree->first = tree->first->left)
+  {
+  }
+
+  for (; tree->last && tree->last->right; tree->last = tree->last->right)
+  {
+  }
+} /* set_operation */
+
+void aatree_union(aatree_t          *tree,
+                  aatree_t          *other,
+                  aatree_resolve_fn *resolve,
+                  void              *arg,
+                  unsigned           nthreads)
+{
+  set_operation(tree, other, SET_UNION, resolve, arg, nthreads);
+} /* aatree_union */
+
+void aatree_intersection(aatree_t          *tree,
+                         aatree_t          *other,
+                         aatree_resolve_fn *resolve,
+                         void              *arg,
+                         unsigned           nthreads)
+{
+  set_operation(tree, other, SET_INTERSECTION, resolve, arg, nthreads);
+} /* aatree_intersection */
+
+void aatree_difference(aatree_t *tree, aatree_t *other, unsigned nthreads)
+{
+  set_operation(tree, other, SET_DIFFERENCE, NULL, NULL, nthreads);
+} /* aatree_difference */
+
+/* In-order run of nodes of a range scan */
+typedef struct chunk
+{
+  aatree_node_t *first;
+  aatree_node_t *last;
+} chunk_t;
+
+/* Division of a key range into chunks */
+typedef struct range_walk
+{
+  const aatree_t *tree;
+  const void     *lo;
+  const void     *hi;
+
+  /* Subtrees up to this level are taken whole */
+  int level;
+
+  /* Weight of the range, of the last chunk and the one to close it at */
+  size_t total;
+  size_t weight;
+  size_t limit;
+
+  /* NULL while the range is weighed */
+  chunk_t *chunks;
+  size_t   count;
+  size_t   capacity;
+} range_walk_t;
+
+/* Scan of the chunks shared by the threads */
+typedef struct scan_task
+{
+  const aatree_t    *tree;
+  chunk_t           *chunks;
+  size_t             count;
+  size_t             next;
+  aatree_foreach_fn *fn;
+  aatree_fold_fn    *fold;
+  const void        *identity;
+  size_t             acc_size;
+  uint8_t           *scratch;
+  void              *arg;
+} scan_task_t;
+
+/* Scan threads of a fork-join tree */
+typedef struct scan_pool
+{
+  scan_task_t *task;
+  unsigned     nthreads;
+} scan_pool_t;
+
+/* Append the run from first to last of the given weight to the chunks */
+static void add_piece(range_walk_t  *walk,
+                      aatree_node_t *first,
+                      aatree_node_t *last,
+                      size_t         weight)
+{
+  if (!walk->chunks)
+  {
+    walk->total += weight;
+    return;
+  }
+
+  if (!walk->count
+      || (walk->weight >= walk->limit && walk->count < walk->capacity))
+  {
+    walk->chunks[walk->count].first = first;
+    walk->count++;
+    walk->weight = 0;
+  }
+
+  walk->chunks[walk->count - 1].last = last;
+  walk->weight += weight;
+} /* add_piece */
+
+/* Visit the subtree in order, taking low subtrees within the bounds whole, a
+ * subtree of level L being weighed as 2^L nodes */
+static void walk_range(range_walk_t  *walk,
+                       aatree_node_t *node,
+                       int            check_lo,
+                       int            check_hi)
+{
+  const aatree_t *tree  = walk->tree;
+  aatree_node_t  *first = node;
+  aatree_node_t  *last  = node;
+  const void     *key   = NULL;
+
+  if (!node)
+  {
+    return;
+  }
+
+  if (!check_lo && !check_hi && node->level <= walk->level)
+  {
+    for (; first->left; first = first->left)
+    {
+    }
+
+    for (; last->right; last = last->right)
+    {
+    }
+
+    add_piece(walk, first, last, (size_t)1 << node->level);
+    return;
+  }
+
+  key = aatree_node_key(tree, node);
+
+  if (check_lo && tree->cmp(key, walk->lo) < 0)
+  {
+    walk_range(walk, node->right, check_lo, check_hi);
+  }
+  else if (check_hi && tree->cmp(key, walk->hi) > 0)
+  {
+    walk_range(walk, node->left, check_lo, check_hi);
+  }
+  else
+  {
+    walk_range(walk, node->left, check_lo, 0);
+    add_piece(walk, node, node, 1);
+    walk_range(walk, node->right, 0, check_hi);
+  }
+} /* walk_range */
+
+static void *scan_chunks(void *arg)
+{
+  scan_task_t *task = arg;
+  size_t       i;
+
+  while ((i = __atomic_fetch_add(&task->next, 1, __ATOMIC_RELAXED))
+         < task->count)
+  {
+    aatree_node_t *node = task->chunks[i].first;
+    void          *acc  = NULL;
+
+    if (task->fold)
+    {
+      acc = task->scratch + i * task->acc_size;
+      memcpy(acc, task->identity, task->acc_size);
+    }
+
+    for (;; node = aatree_next_node(node))
+    {
+      if (task->fold)
+        task->fold(acc, aatree_node_entry(task->tree, node), task->arg);
+      else
+        task->fn(aatree_node_entry(task->tree, node), task->arg);
+
+      if (node == task->chunks[i].last)
+      {
+        break;
+      }
+    }
+  }
+
+  return NULL;
+} /* scan_chunks */
+
+static void *scan_threads(void *arg)
+{
+  scan_pool_t *pool  = arg;
+  scan_pool_t  left  = *pool;
+  scan_pool_t  right = *pool;
+  pthread_t    thread;
+  int          forked;
+
+  if (pool->nthreads <= 1)
+  {
+    return scan_chunks(pool->task);
+  }
+
+  left.nthreads  = pool->nthreads / 2;
+  right.nthreads = pool->nthreads - left.nthreads;
+
+  forked = fork_task(&thread, scan_threads, &left);
+  scan_threads(&right);
+  join_task(thread, forked);
+
+  return NULL;
+} /* scan_threads */
+
+/* Divide the range into chunks and scan them */
+static void scan_range(scan_task_t *task,
+                       const void  *lo,
+                       const void  *hi,
+                       unsigned     nthreads)
+{
+  chunk_t         chunks[AATREE_PARALLEL_CHUNKS];
+  range_walk_t    walk;
+  scan_pool_t     pool;
+  const aatree_t *tree   = task->tree;
+  size_t          target = nthreads * 4;
+  int             shift  = 2;
+
+  if (!tree->root)
+  {
+    task->count = 0;
+    return;
+  }
+
+  /* A few chunks a thread even out the threads, several pieces a chunk even
+   * out the chunks. */
+  if (target > AATREE_PARALLEL_CHUNKS || !nthreads)
+  {
+    target = AATREE_PARALLEL_CHUNKS;
+  }
+
+  for (; ((size_t)1 << shift) < target * 4; shift++)
+  {
+  }
+
+  walk.tree     = tree;
+  walk.lo       = lo;
+  walk.hi       = hi;
+  walk.level    = tree->root->level > shift ? tree->root->level - shift : 1;
+  walk.total    = 0;
+  walk.weight   = 0;
+  walk.chunks   = NULL;
+  walk.count    = 0;
+  walk.capacity = target;
+
+  walk_range(&walk, tree->root, lo != NULL, hi != NULL);
+
+  walk.limit  = (walk.total + target - 1) / target;
+  walk.chunks = chunks;
+
+  walk_range(&walk, tree->root, lo != NULL, hi != NULL);
+
+  task->chunks = chunks;
+  task->count  = walk.count;
+  task->next   = 0;
+
+  pool.task     = task;
+  pool.nthreads = nthreads < walk.count ? nthreads : (unsigned)walk.count;
+
+  scan_threads(&pool);
+} /* scan_range */
+
+void aatree_parallel_foreach(const aatree_t    *tree,
+                             const void        *lo,
+                             const void        *hi,
+                             aatree_foreach_fn *fn,
+                             void              *arg,
+                             unsigned           nthreads)
+{
+  scan_task_t task;
+
+  task.tree = tree;
+  task.fn   = fn;
+  task.fold = NULL;
+  task.arg  = arg;
+
+  scan_range(&task, lo, hi, nthreads);
+} /* aatree_parallel_foreach */
+
+void aatree_parallel_reduce(const aatree_t    *tree,
+                            const void        *lo,
+                            const void        *hi,
+                            aatree_fold_fn    *fold,
+                            aatree_combine_fn *combine,
+                            void              *acc,
+                            size_t             acc_size,
+                            void              *scratch,
+                            void              *arg,
+                            unsigned           nthreads)
+{
+  scan_task_t task;
+  size_t      i;
+
+  task.tree     = tree;
+  task.fn       = NULL;
+  task.fold     = fold;
+  task.identity = acc;
+  task.acc_size = acc_size;
+  task.scratch  = scratch;
+  task.arg      = arg;
+
+  scan_range(&task, lo, hi, nthreads);
+
+  for (i = 0; i < task.count; i++)
+  {
+    combine(acc, task.scratch + i * acc_size, arg);
+  }
+} /* aatree_parallel_reduce */
@@ -0,0 +1,142 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AATREE_PARALLEL_H
+#define AATREE_PARALLEL_H
+
+#include "aatree.h"
+
+/* Multi-threaded bulk operations.
+ *
+ * The work is split into independent ranges run by fork-join threads, at
+ * most nthreads of them at a time, the calling thread being one. With
+ * nthreads of one, or if a thread can not be started, the range is processed
+ * by the calling thread, so the result never depends on the threads.
+ */
+
+/* Ranges smaller than this are never split between threads */
+#define AATREE_PARALLEL_GRAIN 4096
+
+/* Parallel aatree_build_sorted(). The balanced tree of a range does not
+ * depend on the rest of the array, so the halves are built by different
+ * threads and joined under their middle node. Returns zero on success, or -1
+ * if the tree is not empty or the keys are out of order, in which case the
+ * tree is left empty and the nodes must be initialized again. */
+int aatree_build_sorted_parallel(aatree_t       *tree,
+                                 aatree_node_t **nodes,
+                                 size_t          count,
+                                 unsigned        nthreads) __nonnull((1));
+
+/* Sort the array of nodes by key with a parallel merge sort, using scratch
+ * memory of count pointers. The sort is stable. */
+void aatree_sort_parallel(const aatree_t *tree,
+                          aatree_node_t **nodes,
+                          aatree_node_t **scratch,
+                          size_t          count,
+                          unsigned        nthreads) __nonnull((1));
+
+/* Build an empty tree from nodes in any order: sort them, keep the first node
+ * of the array with each key, and link them in parallel. On return the array
+ * holds the linked nodes in order, then the duplicates left unlinked, and
+ * the number of nodes linked is stored in linked. Returns zero, or EINVAL if
+ * the tree is not empty. */
+int aatree_build_parallel(aatree_t       *tree,
+                          aatree_node_t **nodes,
+                          aatree_node_t **scratch,
+                          size_t          count,
+                          unsigned        nthreads,
+                          size_t         *linked) __nonnull((1, 6));
+
+/* Resolve a key found in both trees of a set operation: returns the node to
+ * keep, either of the two. The other one is left unlinked. */
+typedef aatree_node_t *(aatree_resolve_fn)(const aatree_t *tree,
+                                           aatree_node_t  *node,
+                                           aatree_node_t  *other,
+                                           void           *arg);
+
+/* Set operations on two trees with the same key layout, storing the result in
+ * the tree and leaving the other one empty. Nodes are relinked, not copied,
+ * by splitting the tree at the root of the other one and joining the results
+ * for both halves, which are independent and run by different threads when
+ * large enough. The work is O(m log(n/m + 1)) for trees of m <= n nodes.
+ *
+ * A key found in both trees is resolved by the callback, or keeps the node of
+ * the tree if there is none. Nodes dropped from the result may be left with
+ * stale links and have to be initialized before they are inserted again. */
+void aatree_union(aatree_t          *tree,
+                  aatree_t          *other,
+                  aatree_resolve_fn *resolve,
+                  void              *arg,
+                  unsigned           nthreads) __nonnull((1, 2));
+
+void aatree_intersection(aatree_t          *tree,
+                         aatree_t          *other,
+                         aatree_resolve_fn *resolve,
+                         void              *arg,
+                         unsigned           nthreads) __nonnull((1, 2));
+
+/* Keys of the other tree are dropped from the tree */
+void aatree_difference(aatree_t *tree, aatree_t *other, unsigned nthreads)
+    __nonnull((1, 2));
+
+/* Most chunks a range scan is divided into */
+#define AATREE_PARALLEL_CHUNKS 256
+
+/* Callback of a parallel scan */
+typedef void(aatree_foreach_fn)(void *entry, void *arg);
+
+/* Fold an entry into an accumulator */
+typedef void(aatree_fold_fn)(void *acc, void *entry, void *arg);
+
+/* Combine an accumulator with the one of the entries following it */
+typedef void(aatree_combine_fn)(void *acc, const void *next, void *arg);
+
+/* Call fn on the entries with keys in [lo, hi], a NULL bound being open.
+ * The range is divided into chunks of whole subtrees of about the same
+ * weight by their levels, which the threads take in turn as they get done,
+ * so a slow chunk does not hold up the others. Entries of a chunk are visited
+ * in ascending order, the chunks run concurrently. */
+void aatree_parallel_foreach(const aatree_t    *tree,
+                             const void        *lo,
+                             const void        *hi,
+                             aatree_foreach_fn *fn,
+                             void              *arg,
+                             unsigned           nthreads) __nonnull((1, 4));
+
+/* Reduce the entries with keys in [lo, hi] into the accumulator of acc_size
+ * bytes, which holds the identity on entry. Every chunk is folded into its
+ * own copy of the identity in scratch memory of AATREE_PARALLEL_CHUNKS
+ * accumulators, and the chunks are combined in key order, so the combine
+ * function has to be associative but not commutative. */
+void aatree_parallel_reduce(const aatree_t    *tree,
+                            const void        *lo,
+                            const void        *hi,
+                            aatree_fold_fn    *fold,
+                            aatree_combine_fn *combine,
+                            void              *acc,
+                            size_t             acc_size,
+                            void              *scratch,
+                            void              *arg,
+                            unsigned           nthreads)
+    __nonnull((1, 4, 5, 6, 8));
+
+#endif /* AATREE_PARALLEL_H */
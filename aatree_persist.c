@@ -0,0 +1,386 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "aatree_persist.h"
+
+#define entry_key(tree, entry) ((const uint8_t *)(entry) + (tree)->key_offset)
+
+static __inline__ uint8_t node_level(const aatree_pnode_t *node)
+{
+  return node ? node->level : 0;
+} /* node_level */
+
+void aatree_persist_init(aatree_persist_t      *tree,
+                         uint16_t               key_offset,
+                         aatree_keys_compare    cmp,
+                         aatree_pnode_alloc_fn *alloc,
+                         aatree_pnode_free_fn  *free,
+                         void                  *arg)
+{
+  tree->root       = NULL;
+  tree->key_offset = key_offset;
+  tree->cmp        = cmp;
+  tree->alloc      = alloc;
+  tree->free       = free;
+  tree->arg        = arg;
+} /* aatree_persist_init */
+
+void aatree_persist_release(aatree_persist_t *tree, aatree_pnode_t *root)
+{
+  aatree_pnode_t *stack = NULL;
+
+  if (!root || __atomic_sub_fetch(&root->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  /* Nodes to free are stacked through their entry pointers, so releasing a
+   * version of any size takes no memory. */
+  root->entry = NULL;
+  stack       = root;
+
+  while (stack)
+  {
+    aatree_pnode_t *node     = stack;
+    aatree_pnode_t *child[2] = {NULL, NULL};
+    int             i;
+
+    stack     = node->entry;
+    child[0]  = node->left;
+    child[1]  = node->right;
+
+    for (i = 0; i < 2; i++)
+    {
+      if (child[i] && !__atomic_sub_fetch(&child[i]->refs, 1, __ATOMIC_ACQ_REL))
+      {
+        child[i]->entry = stack;
+        stack           = child[i];
+      }
+    }
+
+    tree->free(node, tree->arg);
+  }
+} /* aatree_persist_release */
+
+void aatree_persist_clear(aatree_persist_t *tree)
+{
+  aatree_persist_release(tree, tree->root);
+  tree->root = NULL;
+} /* aatree_persist_clear */
+
+/* Make the node in the slot private to the latest version, copying it if any
+ * snapshot shares it. The slot itself must be private. */
+static aatree_pnode_t *own(aatree_persist_t *tree, aatree_pnode_t **slot)
+{
+  aatree_pnode_t *node = *slot;
+  aatree_pnode_t *copy = NULL;
+
+  /* A snapshot released concurrently may only make the count drop, so a
+   * stale value costs a needless copy at worst. */
+  if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1)
+    return node;
+
+  copy        = tree->alloc(tree->arg);
+  copy->left  = node->left;
+  copy->right = node->right;
+  copy->entry = node->entry;
+  copy->level = node->level;
+  copy->refs  = 1;
+
+  if (copy->left)
+    __atomic_add_fetch(&copy->left->refs, 1, __ATOMIC_RELAXED);
+
+  if (copy->right)
+    __atomic_add_fetch(&copy->right->refs, 1, __ATOMIC_RELAXED);
+
+  *slot = copy;
+  aatree_persist_release(tree, node);
+
+  return copy;
+} /* own */
+
+/* Unlike in aatree.c the rotations move the links only, so the reference
+ * counts stay as they are.
+ *
+ *     N        L
+ *    / \      / \
+ *   L   R -> A   N
+ *  / \          / \
+ * A   B        B   R
+ */
+static void skew(aatree_persist_t *tree, aatree_pnode_t **slot)
+{
+  aatree_pnode_t *node = *slot;
+  aatree_pnode_t *left = NULL;
+
+  if (!node || !node->left || node->left->level != node->level)
+    return;
+
+  node = own(tree, slot);
+  left = own(tree, &node->left);
+
+  node->left  = left->right;
+  left->right = node;
+  *slot       = left;
+} /* skew */
+
+/*
+ *   N            R
+ *  / \          / \
+ * A   R   ->   N   X
+ *    / \      / \
+ *   B   X    A   B
+ */
+static void split(aatree_persist_t *tree, aatree_pnode_t **slot)
+{
+  aatree_pnode_t *node  = *slot;
+  aatree_pnode_t *right = NULL;
+
+  if (!node || !node->right || !node->right->right
+      || node->right->right->level != node->level)
+    return;
+
+  node  = own(tree, slot);
+  right = own(tree, &node->right);
+
+  node->right = right->left;
+  right->left = node;
+  right->level++;
+  *slot = right;
+} /* split */
+
+void *aatree_persist_search(const aatree_persist_t *tree,
+                            const aatree_pnode_t   *root,
+                            const void             *key,
+                            aatree_keys_order       order)
+{
+  const aatree_pnode_t *node      = root;
+  const aatree_pnode_t *candidate = NULL;
+
+  while (node)
+  {
+    int result = tree->cmp(key, entry_key(tree, node->entry));
+
+    if (!result && order != AATREE_KEY_LT && order != AATREE_KEY_GT)
+    {
+      candidate = node;
+      break;
+    }
+
+    /* Keep the closest node on the side the order asks for. */
+    if (result > 0 || (!result && order == AATREE_KEY_GT))
+    {
+      if (order == AATREE_KEY_LT || order == AATREE_KEY_LE)
+        candidate = node;
+
+      node = node->right;
+    }
+    else
+    {
+      if (order == AATREE_KEY_GT || order == AATREE_KEY_GE)
+        candidate = node;
+
+      node = node->left;
+    }
+  }
+
+  return candidate ? candidate->entry : NULL;
+} /* aatree_persist_search */
+
+void *aatree_persist_insert(aatree_persist_t *tree, void *entry)
+{
+  aatree_pnode_t **path[AATREE_PERSIST_MAX_DEPTH];
+  aatree_pnode_t **slot  = &tree->root;
+  aatree_pnode_t  *node  = NULL;
+  void            *dup   = NULL;
+  int              depth = 0;
+
+  /* Look before copying anything: a failed insert leaves no trace. */
+  if ((dup = aatree_persist_search(tree, tree->root, entry_key(tree, entry),
+                                   AATREE_KEY_EQ)))
+    return dup;
+
+  while (*slot)
+  {
+    node          = own(tree, slot);
+    path[depth++] = slot;
+
+    if (tree->cmp(entry_key(tree, entry), entry_key(tree, node->entry)) < 0)
+      slot = &node->left;
+    else
+      slot = &node->right;
+  }
+
+  node        = tree->alloc(tree->arg);
+  node->left  = NULL;
+  node->right = NULL;
+  node->entry = entry;
+  node->level = 1;
+  node->refs  = 1;
+  *slot       = node;
+
+  while (depth--)
+  {
+    skew(tree, path[depth]);
+    split(tree, path[depth]);
+  }
+
+  return NULL;
+} /* aatree_persist_insert */
+
+/* Restore the invariants on the way up from a deletion */
+static void rebalance(aatree_persist_t *tree, aatree_pnode_t **slot)
+{
+  aatree_pnode_t *node   = *slot;
+  uint8_t         should = 0;
+
+  should = node_level(node->left) < node_level(node->right)
+               ? node_level(node->left) + 1
+               : node_level(node->right) + 1;
+
+  if (should < node->level)
+  {
+    node->level = should;
+
+    if (node->right && node->right->level > should)
+      own(tree, &node->right)->level = should;
+  }
+
+  skew(tree, slot);
+  node = *slot;
+
+  if (node->right)
+  {
+    skew(tree, &node->right);
+
+    /* The right child is only written to when it is rotated further. */
+    if (node->right->right && node->right->right->left
+        && node->right->right->left->level == node->right->right->level)
+      skew(tree, &own(tree, &node->right)->right);
+  }
+
+  split(tree, slot);
+  node = *slot;
+
+  if (node->right)
+    split(tree, &node->right);
+} /* rebalance */
+
+void *aatree_persist_delete(aatree_persist_t *tree, const void *key)
+{
+  aatree_pnode_t **path[AATREE_PERSIST_MAX_DEPTH];
+  aatree_pnode_t **slot   = &tree->root;
+  aatree_pnode_t  *node   = NULL;
+  aatree_pnode_t  *found  = NULL;
+  void            *entry  = NULL;
+  int              depth  = 0;
+
+  if (!(entry = aatree_persist_search(tree, tree->root, key, AATREE_KEY_EQ)))
+    return NULL;
+
+  for (;;)
+  {
+    int result = 0;
+
+    node   = own(tree, slot);
+    result = tree->cmp(key, entry_key(tree, node->entry));
+
+    if (!result)
+      break;
+
+    path[depth++] = slot;
+    slot          = result < 0 ? &node->left : &node->right;
+  }
+
+  /* An inner node takes the entry of its successor, which is a level one
+   * node with no left child, and the successor goes away instead. */
+  if (node->left)
+  {
+    found         = node;
+    path[depth++] = slot;
+    slot          = &node->right;
+    node          = own(tree, slot);
+
+    while (node->left)
+    {
+      path[depth++] = slot;
+      slot          = &node->left;
+      node          = own(tree, slot);
+    }
+
+    found->entry = node->entry;
+  }
+
+  *slot       = node->right;
+  node->right = NULL;
+  aatree_persist_release(tree, node);
+
+  while (depth--)
+  {
+    rebalance(tree, path[depth]);
+  }
+
+  return entry;
+} /* aatree_persist_delete */
+
+void *aatree_persist_seek(const aatree_persist_t *tree,
+                          aatree_persist_iter_t  *iter,
+                          aatree_pnode_t         *root,
+                          const void             *key)
+{
+  aatree_pnode_t *node = root;
+
+  iter->top = 0;
+
+  /* Stack the nodes of the path not less than the key, they are the next
+   * ones in order. */
+  while (node)
+  {
+    if (!key || tree->cmp(key, entry_key(tree, node->entry)) <= 0)
+    {
+      iter->stack[iter->top++] = node;
+      node                     = node->left;
+    }
+    else
+    {
+      node = node->right;
+    }
+  }
+
+  return iter->top ? iter->stack[iter->top - 1]->entry : NULL;
+} /* aatree_persist_seek */
+
+void *aatree_persist_next(aatree_persist_iter_t *iter)
+{
+  aatree_pnode_t *node = NULL;
+
+  if (!iter->top)
+    return NULL;
+
+  node = iter->stack[--iter->top]->right;
+
+  while (node)
+  {
+    iter->stack[iter->top++] = node;
+    node                     = node->left;
+  }
+
+  return iter->top ? iter->stack[iter->top - 1]->entry : NULL;
+} /* aatree_persist_next */
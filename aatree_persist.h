@@ -0,0 +1,136 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AATREE_PERSIST_H
+#define AATREE_PERSIST_H
+
+#include "aatree.h"
+
+/* Persistent AA tree with O(1) snapshots.
+ *
+ * Unlike aatree_t the tree nodes are not embedded into the entries: a node
+ * may be shared by any number of versions, so it is a separate reference
+ * counted object pointing to the entry. Taking a snapshot just references the
+ * root. An update copies only the nodes on its path, rotated ones included,
+ * which are still shared with some snapshot; nodes referenced by the tree
+ * alone are updated in place.
+ *
+ * There is one writer per tree. Snapshots are taken by the writer and may be
+ * read and released by any thread, while the writer goes on. Entries are
+ * not owned by the tree, they must outlive every version holding them.
+ */
+
+/* Deepest path of a tree fitting in memory */
+#define AATREE_PERSIST_MAX_DEPTH 128
+
+/* Shared node */
+typedef struct aatree_pnode
+{
+  struct aatree_pnode *left;
+  struct aatree_pnode *right;
+  void                *entry;
+
+  /* parents and snapshots referencing the node */
+  uint32_t refs;
+
+  uint8_t level;
+} aatree_pnode_t;
+
+/* Node allocation function, it must not fail */
+typedef aatree_pnode_t *(aatree_pnode_alloc_fn)(void *);
+
+/* Node release function */
+typedef void(aatree_pnode_free_fn)(aatree_pnode_t *, void *);
+
+/* Latest version of the tree */
+typedef struct aatree_persist
+{
+  aatree_pnode_t *root;
+
+  uint16_t             key_offset;
+  aatree_keys_compare *cmp;
+
+  aatree_pnode_alloc_fn *alloc;
+  aatree_pnode_free_fn  *free;
+  void                  *arg;
+} aatree_persist_t;
+
+/* In-order iterator of a version */
+typedef struct aatree_persist_iter
+{
+  aatree_pnode_t *stack[AATREE_PERSIST_MAX_DEPTH];
+  int             top;
+} aatree_persist_iter_t;
+
+/* Init empty tree */
+void aatree_persist_init(aatree_persist_t      *tree,
+                         uint16_t               key_offset,
+                         aatree_keys_compare    cmp,
+                         aatree_pnode_alloc_fn *alloc,
+                         aatree_pnode_free_fn  *free,
+                         void                  *arg) __nonnull((1, 3, 4, 5));
+
+/* Take snapshot of the latest version. The writer must not run concurrently. */
+static __inline__ __nonnull((1)) aatree_pnode_t *
+aatree_persist_snapshot(aatree_persist_t *tree)
+{
+  if (tree->root)
+  {
+    __atomic_add_fetch(&tree->root->refs, 1, __ATOMIC_RELAXED);
+  }
+
+  return tree->root;
+} /* aatree_persist_snapshot */
+
+/* Release a snapshot, freeing the nodes no other version shares */
+void aatree_persist_release(aatree_persist_t *tree, aatree_pnode_t *root)
+    __nonnull((1));
+
+/* Release the latest version, leaving the tree empty */
+void aatree_persist_clear(aatree_persist_t *tree) __nonnull((1));
+
+/* Search entry of a version like aatree_search() */
+void *aatree_persist_search(const aatree_persist_t *tree,
+                            const aatree_pnode_t   *root,
+                            const void             *key,
+                            aatree_keys_order       order) __nonnull((1));
+
+/* Try to insert entry into the latest version or return an existing one */
+void *aatree_persist_insert(aatree_persist_t *tree, void *entry)
+    __nonnull((1, 2));
+
+/* Delete the entry with the key from the latest version and return it */
+void *aatree_persist_delete(aatree_persist_t *tree, const void *key)
+    __nonnull((1));
+
+/* Start iteration of a version at the first entry with a key greater than or
+ * equal to the key, or at the very first entry if the key is NULL. Returns
+ * the entry or NULL. */
+void *aatree_persist_seek(const aatree_persist_t *tree,
+                          aatree_persist_iter_t  *iter,
+                          aatree_pnode_t         *root,
+                          const void             *key) __nonnull((1, 2));
+
+/* Get next entry of the iteration */
+void *aatree_persist_next(aatree_persist_iter_t *iter) __nonnull((1));
+
+#endif /* AATREE_PERSIST_H */
@@ -0,0 +1,215 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include "aatree_rcu.h"
+
+#define load_link(link) __atomic_load_n(&(link), __ATOMIC_ACQUIRE)
+
+int aatree_rcu_init(aatree_rcu_t            *rcu,
+                    uint16_t                 node_offset,
+                    uint16_t                 key_offset,
+                    aatree_keys_compare      cmp,
+                    aatree_epoch_reclaim_fn *reclaim,
+                    void                    *arg)
+{
+  aatree_init_tree(&rcu->tree, node_offset, key_offset, cmp);
+  aatree_epoch_init(&rcu->epoch, reclaim, arg);
+
+  rcu->seq = 0;
+
+  return pthread_mutex_init(&rcu->lock, NULL);
+} /* aatree_rcu_init */
+
+void aatree_rcu_destroy(aatree_rcu_t *rcu)
+{
+  aatree_rcu_synchronize(rcu);
+  pthread_mutex_destroy(&rcu->lock);
+} /* aatree_rcu_destroy */
+
+void aatree_rcu_unregister(aatree_rcu_t *rcu, aatree_epoch_record_t *record)
+{
+  pthread_mutex_lock(&rcu->lock);
+  aatree_epoch_unregister(&rcu->epoch, record);
+  pthread_mutex_unlock(&rcu->lock);
+} /* aatree_rcu_unregister */
+
+/* Descend the tree without the lock. Returns zero if the result can not be
+ * trusted because a writer got in the way. */
+static int search_lockless(aatree_rcu_t     *rcu,
+                           const void       *key,
+                           aatree_keys_order order,
+                           aatree_node_t   **found)
+{
+  const aatree_t *tree      = &rcu->tree;
+  aatree_node_t  *node      = NULL;
+  aatree_node_t  *candidate = NULL;
+  uint64_t        seq       = __atomic_load_n(&rcu->seq, __ATOMIC_ACQUIRE);
+  int             depth     = 0;
+
+  if (seq & 1)
+  {
+    return 0;
+  }
+
+  for (node = load_link(tree->root); node; depth++)
+  {
+    int result = 0;
+
+    if (depth == AATREE_RCU_MAX_DEPTH)
+    {
+      return 0;
+    }
+
+    result = tree->cmp(key, aatree_node_key(tree, node));
+
+    /* An entry with the very key is in the tree, whatever writers do. */
+    if (!result && order != AATREE_KEY_LT && order != AATREE_KEY_GT)
+    {
+      *found = node;
+      return 1;
+    }
+
+    /* Keep the closest node on the side the order asks for. */
+    if (result > 0 || (!result && order == AATREE_KEY_GT))
+    {
+      if (order == AATREE_KEY_LT || order == AATREE_KEY_LE)
+        candidate = node;
+
+      node = load_link(node->right);
+    }
+    else
+    {
+      if (order == AATREE_KEY_GT || order == AATREE_KEY_GE)
+        candidate = node;
+
+      node = load_link(node->left);
+    }
+  }
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  if (__atomic_load_n(&rcu->seq, __ATOMIC_RELAXED) != seq)
+  {
+    return 0;
+  }
+
+  *found = candidate;
+
+  return 1;
+} /* search_lockless */
+
+void *aatree_rcu_search(aatree_rcu_t     *rcu,
+                        const void       *key,
+                        aatree_keys_order order)
+{
+  aatree_node_t *node  = NULL;
+  void          *entry = NULL;
+  int            i;
+
+  for (i = 0; i < AATREE_RCU_RETRIES; i++)
+  {
+    if (search_lockless(rcu, key, order, &node))
+    {
+      return aatree_node_entry(&rcu->tree, node);
+    }
+  }
+
+  pthread_mutex_lock(&rcu->lock);
+  entry = aatree_search(&rcu->tree, key, order);
+  pthread_mutex_unlock(&rcu->lock);
+
+  return entry;
+} /* aatree_rcu_search */
+
+/* Mark the beginning of an update for the readers */
+static __inline__ void write_begin(aatree_rcu_t *rcu)
+{
+  /* Link stores are release stores, they can not pass this one. */
+  __atomic_store_n(&rcu->seq, rcu->seq + 1, __ATOMIC_RELAXED);
+} /* write_begin */
+
+/* Mark the end of an update */
+static __inline__ void write_end(aatree_rcu_t *rcu)
+{
+  __atomic_store_n(&rcu->seq, rcu->seq + 1, __ATOMIC_RELEASE);
+} /* write_end */
+
+void *aatree_rcu_insert(aatree_rcu_t *rcu, aatree_node_t *node)
+{
+  void *entry = NULL;
+
+  pthread_mutex_lock(&rcu->lock);
+
+  write_begin(rcu);
+  entry = aatree_insert(&rcu->tree, node);
+  write_end(rcu);
+
+  pthread_mutex_unlock(&rcu->lock);
+
+  return entry;
+} /* aatree_rcu_insert */
+
+void aatree_rcu_delete(aatree_rcu_t         *rcu,
+                       aatree_node_t        *node,
+                       aatree_epoch_entry_t *link)
+{
+  pthread_mutex_lock(&rcu->lock);
+
+  write_begin(rcu);
+  aatree_delete(&rcu->tree, node);
+  write_end(rcu);
+
+  aatree_epoch_retire(&rcu->epoch, link);
+
+  pthread_mutex_unlock(&rcu->lock);
+} /* aatree_rcu_delete */
+
+void aatree_rcu_synchronize(aatree_rcu_t *rcu)
+{
+  /* Readers falling back to the lock may wait for it, so the lock is never
+   * held while waiting for the readers. */
+  for (;;)
+  {
+    size_t pending, reclaimed = 0;
+
+    pthread_mutex_lock(&rcu->lock);
+
+    if ((pending = rcu->epoch.pending))
+    {
+      reclaimed = aatree_epoch_collect(&rcu->epoch);
+    }
+
+    pthread_mutex_unlock(&rcu->lock);
+
+    if (!pending)
+    {
+      break;
+    }
+
+    if (!reclaimed)
+    {
+      sched_yield();
+    }
+  }
+} /* aatree_rcu_synchronize */
@@ -0,0 +1,121 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AATREE_RCU_H
+#define AATREE_RCU_H
+
+#include <pthread.h>
+#include "aatree_epoch.h"
+
+/* AA tree with lock-free readers and serialized writers.
+ *
+ * Writers take a mutex and bump a sequence counter around every update. The
+ * tree publishes its links with release stores, so a reader descending with
+ * acquire loads only ever reaches initialized nodes, while removed nodes are
+ * kept alive by epoch based reclamation until every reader has left.
+ *
+ * A rotation may hide a part of the tree from a reader passing by, so only an
+ * exact match is trusted as it is. Misses and nearest key results are checked
+ * against the sequence counter and the descent is retried, falling back to
+ * the lock if writers keep interfering.
+ *
+ * Keys of the linked entries must not change, so aatree_reinsert() may not be
+ * used on the tree.
+ */
+
+/* Lock-free attempts before a search takes the lock */
+#define AATREE_RCU_RETRIES 4
+
+/* Bound of a lock-free descent: no AA tree fitting in memory is deeper, a
+ * longer path means the reader got carried around by rotations */
+#define AATREE_RCU_MAX_DEPTH 128
+
+typedef struct aatree_rcu
+{
+  aatree_t tree;
+
+  /* Odd while a writer is updating the tree */
+  uint64_t seq;
+
+  pthread_mutex_t lock;
+  aatree_epoch_t  epoch;
+} aatree_rcu_t;
+
+/* Init empty tree. Removed entries are handed to the reclaim function once no
+ * reader can reach them. Returns zero on success or an error number. */
+int aatree_rcu_init(aatree_rcu_t            *rcu,
+                    uint16_t                 node_offset,
+                    uint16_t                 key_offset,
+                    aatree_keys_compare      cmp,
+                    aatree_epoch_reclaim_fn *reclaim,
+                    void                    *arg) __nonnull((1, 4, 5));
+
+/* Reclaim every removed entry and release the lock. The tree itself is left
+ * as it is. */
+void aatree_rcu_destroy(aatree_rcu_t *rcu) __nonnull((1));
+
+/* Register reader record of the calling thread */
+static __inline__ __nonnull((1, 2)) void
+aatree_rcu_register(aatree_rcu_t *rcu, aatree_epoch_record_t *record)
+{
+  aatree_epoch_register(&rcu->epoch, record);
+} /* aatree_rcu_register */
+
+/* Unregister reader record of the calling thread before it exits */
+void aatree_rcu_unregister(aatree_rcu_t          *rcu,
+                           aatree_epoch_record_t *record) __nonnull((1, 2));
+
+/* Enter read-side critical section. Entries found inside it stay valid until
+ * the section is left. */
+static __inline__ __nonnull((1, 2)) void
+aatree_rcu_read_lock(aatree_rcu_t *rcu, aatree_epoch_record_t *record)
+{
+  aatree_epoch_enter(&rcu->epoch, record);
+} /* aatree_rcu_read_lock */
+
+/* Leave read-side critical section */
+static __inline__ __nonnull((1)) void
+aatree_rcu_read_unlock(aatree_epoch_record_t *record)
+{
+  aatree_epoch_exit(record);
+} /* aatree_rcu_read_unlock */
+
+/* Search entry like aatree_search(), from a read-side critical section */
+void *aatree_rcu_search(aatree_rcu_t     *rcu,
+                        const void       *key,
+                        aatree_keys_order order) __nonnull((1));
+
+/* Try to insert node into tree or return an existing entry */
+void *aatree_rcu_insert(aatree_rcu_t *rcu, aatree_node_t *node)
+    __nonnull((1, 2));
+
+/* Delete node from the tree and retire its entry through the link embedded
+ * into it */
+void aatree_rcu_delete(aatree_rcu_t         *rcu,
+                       aatree_node_t        *node,
+                       aatree_epoch_entry_t *link) __nonnull((1, 2, 3));
+
+/* Wait until every deleted entry is reclaimed. Must not be called from a
+ * read-side critical section. */
+void aatree_rcu_synchronize(aatree_rcu_t *rcu) __nonnull((1));
+
+#endif /* AATREE_RCU_H */
@@ -0,0 +1,562 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <string.h>
+#include "aatree_shard.h"
+
+/* Get key of a node */
+static __inline__ const void *node_key(const aatree_sharded_t *sh,
+                                       const aatree_node_t    *node)
+{
+  return (const uint8_t *)node - sh->node_offset + sh->key_offset;
+} /* node_key */
+
+/* Copy a bound of the table, which may be being rewritten */
+static __inline__ void load_key(aatree_shard_key_t       *key,
+                                const aatree_shard_key_t *bound)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(key->words) / sizeof(key->words[0]); i++)
+  {
+    key->words[i] = __atomic_load_n(&bound->words[i], __ATOMIC_RELAXED);
+  }
+} /* load_key */
+
+static __inline__ void store_key(aatree_shard_key_t       *bound,
+                                 const aatree_shard_key_t *key)
+{
+  size_t i;
+
+  for (i = 0; i < sizeof(key->words) / sizeof(key->words[0]); i++)
+  {
+    __atomic_store_n(&bound->words[i], key->words[i], __ATOMIC_RELAXED);
+  }
+} /* store_key */
+
+/* Get current boundary table */
+static __inline__ aatree_shard_table_t *current_table(aatree_sharded_t *sh)
+{
+  return __atomic_load_n(&sh->table, __ATOMIC_ACQUIRE);
+} /* current_table */
+
+int aatree_sharded_init(aatree_sharded_t   *sh,
+                        aatree_shard_t     *shards,
+                        size_t              capacity,
+                        size_t              key_size,
+                        uint16_t            node_offset,
+                        uint16_t            key_offset,
+                        aatree_keys_compare cmp,
+                        const void         *bounds,
+                        size_t              nbounds)
+{
+  const uint8_t *bound = bounds;
+  size_t         i;
+
+  if (capacity > AATREE_SHARD_MAX || nbounds >= capacity
+      || key_size > AATREE_SHARD_KEY_SIZE || (nbounds && !bounds))
+  {
+    return -1;
+  }
+
+  sh->shards      = shards;
+  sh->capacity    = capacity;
+  sh->key_size    = key_size;
+  sh->node_offset = node_offset;
+  sh->key_offset  = key_offset;
+  sh->cmp         = cmp;
+  sh->table       = &sh->tables[0];
+
+  pthread_mutex_init(&sh->resize, NULL);
+
+  for (i = 0; i < capacity; i++)
+  {
+    aatree_shard_t *shard = &shards[i];
+
+    pthread_mutex_init(&shard->lock, NULL);
+    aatree_init_tree(&shard->tree, node_offset, key_offset, cmp);
+
+    shard->ops    = 0;
+    shard->live   = i <= nbounds;
+    shard->has_lo = i > 0 && i <= nbounds;
+    shard->has_hi = i < nbounds;
+
+    if (shard->has_lo)
+      memcpy(shard->lo.bytes, bound + (i - 1) * key_size, key_size);
+
+    if (shard->has_hi)
+      memcpy(shard->hi.bytes, bound + i * key_size, key_size);
+  }
+
+  sh->tables[0].seq = 0;
+  sh->tables[1].seq = 0;
+  sh->table->count  = nbounds + 1;
+
+  for (i = 0; i <= nbounds; i++)
+  {
+    sh->table->shard[i] = (uint16_t)i;
+
+    if (i < nbounds)
+      memcpy(sh->table->bound[i].bytes, bound + i * key_size, key_size);
+  }
+
+  return 0;
+} /* aatree_sharded_init */
+
+void aatree_sharded_destroy(aatree_sharded_t *sh)
+{
+  size_t i;
+
+  for (i = 0; i < sh->capacity; i++)
+  {
+    pthread_mutex_destroy(&sh->shards[i].lock);
+  }
+
+  pthread_mutex_destroy(&sh->resize);
+} /* aatree_sharded_destroy */
+
+/* Find position of the range holding the key, or with below set, of the
+ * range holding the keys just below it. The table may be a stale one being
+ * rewritten, so nothing read from it is trusted beyond staying in bounds. */
+static size_t route(const aatree_sharded_t     *sh,
+                    const aatree_shard_table_t *table,
+                    const void                 *key,
+                    int                         below)
+{
+  aatree_shard_key_t bound;
+  size_t             lo    = 0;
+  size_t             hi    = 0;
+  size_t             count = __atomic_load_n(&table->count, __ATOMIC_RELAXED);
+
+  hi = count && count <= AATREE_SHARD_MAX ? count - 1 : 0;
+
+  while (lo < hi)
+  {
+    size_t mid    = lo + (hi - lo) / 2;
+    int    result = 0;
+
+    load_key(&bound, &table->bound[mid]);
+    result = sh->cmp(key, bound.bytes);
+
+    if (below ? result > 0 : result >= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+} /* route */
+
+/* Check the shard bounds, the shard lock must be held. With below set the
+ * key itself may be the upper bound but not the lower one. */
+static int covers(const aatree_sharded_t *sh,
+                  const aatree_shard_t   *shard,
+                  const void             *key,
+                  int                     below)
+{
+  if (!shard->live)
+    return 0;
+
+  if (shard->has_lo && sh->cmp(key, shard->lo.bytes) < below)
+    return 0;
+
+  if (shard->has_hi && sh->cmp(key, shard->hi.bytes) >= below)
+    return 0;
+
+  return 1;
+} /* covers */
+
+/* Lock the shard a key is routed to */
+static aatree_shard_t *lock_shard(aatree_sharded_t *sh,
+                                  const void       *key,
+                                  int               below)
+{
+  for (;;)
+  {
+    aatree_shard_table_t *table = current_table(sh);
+    aatree_shard_t       *shard = NULL;
+    uint64_t              seq   = 0;
+    uint16_t              ix    = 0;
+
+    seq = __atomic_load_n(&table->seq, __ATOMIC_ACQUIRE);
+    ix  = __atomic_load_n(&table->shard[route(sh, table, key, below)],
+                          __ATOMIC_RELAXED);
+
+    /* The buffer has been rewritten under the route, it is taken again. */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if ((seq & 1) || __atomic_load_n(&table->seq, __ATOMIC_RELAXED) != seq
+        || ix >= sh->capacity)
+    {
+      continue;
+    }
+
+    shard = &sh->shards[ix];
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* The route is stale if the shard has been split or merged since. */
+    if (covers(sh, shard, key, below))
+      return shard;
+
+    pthread_mutex_unlock(&shard->lock);
+  }
+} /* lock_shard */
+
+void *aatree_sharded_insert(aatree_sharded_t *sh, aatree_node_t *node)
+{
+  aatree_shard_t *shard = lock_shard(sh, node_key(sh, node), 0);
+  void           *entry = aatree_insert(&shard->tree, node);
+
+  if (!entry)
+  {
+    __atomic_store_n(&shard->ops, shard->ops + 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return entry;
+} /* aatree_sharded_insert */
+
+void aatree_sharded_delete(aatree_sharded_t *sh, aatree_node_t *node)
+{
+  aatree_shard_t *shard = lock_shard(sh, node_key(sh, node), 0);
+
+  aatree_delete(&shard->tree, node);
+
+  __atomic_store_n(&shard->ops, shard->ops + 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock(&shard->lock);
+} /* aatree_sharded_delete */
+
+void *aatree_sharded_search(aatree_sharded_t *sh,
+                            const void       *key,
+                            aatree_keys_order order)
+{
+  aatree_shard_key_t bound;
+  int                below = 0;
+
+  for (;;)
+  {
+    aatree_shard_t *shard = lock_shard(sh, key, below);
+    void           *entry = aatree_search(&shard->tree, key, order);
+    int             next  = 0;
+
+    /* Nearest keys may be found in the neighbour ranges only. */
+    if (!entry && (order == AATREE_KEY_GT || order == AATREE_KEY_GE))
+    {
+      if ((next = shard->has_hi))
+      {
+        memcpy(bound.bytes, shard->hi.bytes, sh->key_size);
+        order = AATREE_KEY_GE;
+        below = 0;
+      }
+    }
+    else if (!entry && (order == AATREE_KEY_LT || order == AATREE_KEY_LE))
+    {
+      if ((next = shard->has_lo))
+      {
+        memcpy(bound.bytes, shard->lo.bytes, sh->key_size);
+        order = AATREE_KEY_LT;
+        below = 1;
+      }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (!next)
+      return entry;
+
+    key = bound.bytes;
+  }
+} /* aatree_sharded_search */
+
+size_t aatree_sharded_scan(aatree_sharded_t     *sh,
+                           const void           *key,
+                           aatree_shard_scan_fn *fn,
+                           void                 *arg)
+{
+  aatree_shard_key_t bound;
+  size_t             visited = 0;
+  int                stop    = 0;
+
+  for (;;)
+  {
+    aatree_shard_t *shard = lock_shard(sh, key, 0);
+    aatree_node_t  *node  = NULL;
+    int             next  = 0;
+
+    node = aatree_entry_node(&shard->tree,
+                             aatree_search(&shard->tree, key, AATREE_KEY_GE));
+
+    for (; node && !stop; node = aatree_next_node(node))
+    {
+      visited++;
+      stop = fn(aatree_node_entry(&shard->tree, node), arg);
+    }
+
+    if ((next = !stop && shard->has_hi))
+    {
+      memcpy(bound.bytes, shard->hi.bytes, sh->key_size);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    if (!next)
+      return visited;
+
+    key = bound.bytes;
+  }
+} /* aatree_sharded_scan */
+
+size_t aatree_sharded_count(const aatree_sharded_t *sh)
+{
+  return __atomic_load_n(&__atomic_load_n(&sh->table, __ATOMIC_ACQUIRE)->count,
+                         __ATOMIC_RELAXED);
+} /* aatree_sharded_count */
+
+/* Write the next table into the buffer not in use and make it the current
+ * one. Readers of the buffer may still be routing through the table it held
+ * two swaps ago, they see the sequence change. The resize lock must be
+ * held. */
+static void publish_table(aatree_sharded_t           *sh,
+                          const aatree_shard_table_t *next)
+{
+  aatree_shard_table_t *table =
+      sh->table == &sh->tables[0] ? &sh->tables[1] : &sh->tables[0];
+  uint64_t seq = table->seq;
+  size_t   i;
+
+  __atomic_store_n(&table->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  __atomic_store_n(&table->count, next->count, __ATOMIC_RELAXED);
+
+  for (i = 0; i < next->count; i++)
+  {
+    __atomic_store_n(&table->shard[i], next->shard[i], __ATOMIC_RELAXED);
+
+    if (i + 1 < next->count)
+      store_key(&table->bound[i], &next->bound[i]);
+  }
+
+  __atomic_store_n(&table->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&sh->table, table, __ATOMIC_RELEASE);
+} /* publish_table */
+
+/* Split the range, the resize lock must be held */
+static int split_range(aatree_sharded_t *sh, size_t pos)
+{
+  aatree_shard_table_t table;
+  aatree_shard_key_t   cut;
+  aatree_shard_t      *shard = NULL;
+  aatree_shard_t      *upper = NULL;
+  aatree_node_t       *node  = NULL;
+  void                *entry = NULL;
+  size_t               i;
+  int                  result = -1;
+
+  for (i = 0; i < sh->capacity && sh->shards[i].live; i++)
+  {
+  }
+
+  if (pos >= sh->table->count || i == sh->capacity)
+    return -1;
+
+  shard = &sh->shards[sh->table->shard[pos]];
+  upper = &sh->shards[i];
+
+  /* Operations only ever hold one shard lock, so the order is free. */
+  pthread_mutex_lock(&shard->lock);
+  pthread_mutex_lock(&upper->lock);
+
+  /* A root with a left son has keys on both sides. */
+  if (shard->tree.root && shard->tree.root->left)
+  {
+    /* Cut off the keys from the one of the root for the new shard. The
+     * sides of a root of level L hold 2^(L-1) - 1 keys each at least, and
+     * the key takes no walk to find, so the cut takes logarithmic time. */
+    memcpy(cut.bytes, node_key(sh, shard->tree.root), sh->key_size);
+
+    entry = aatree_split(&shard->tree, cut.bytes, &shard->tree,
+                         &upper->tree);
+    node  = aatree_entry_node(&upper->tree, entry);
+
+    aatree_init_node(node);
+    aatree_insert(&upper->tree, node);
+
+    /* Both halves inherit the load, so they are not merged right back. */
+    __atomic_store_n(&upper->ops, shard->ops / 2, __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->ops, shard->ops - upper->ops, __ATOMIC_RELAXED);
+
+    upper->live   = 1;
+    upper->has_lo = 1;
+    upper->has_hi = shard->has_hi;
+    upper->lo     = cut;
+    upper->hi     = shard->hi;
+
+    shard->has_hi = 1;
+    shard->hi     = cut;
+
+    /* Publish the table with the new range inserted after the old one. */
+    table = *sh->table;
+
+    memmove(&table.shard[pos + 2], &table.shard[pos + 1],
+            (table.count - pos - 1) * sizeof(table.shard[0]));
+    memmove(&table.bound[pos + 1], &table.bound[pos],
+            (table.count - pos - 1) * sizeof(table.bound[0]));
+
+    table.shard[pos + 1] = (uint16_t)i;
+    table.bound[pos]     = cut;
+    table.count++;
+
+    publish_table(sh, &table);
+    result = 0;
+  }
+
+  pthread_mutex_unlock(&upper->lock);
+  pthread_mutex_unlock(&shard->lock);
+
+  return result;
+} /* split_range */
+
+/* Merge the range with the next one, the resize lock must be held */
+static int merge_ranges(aatree_sharded_t *sh, size_t pos)
+{
+  aatree_shard_table_t table;
+  aatree_shard_t      *shard = NULL;
+  aatree_shard_t      *upper = NULL;
+  void                *entry = NULL;
+
+  if (pos + 1 >= sh->table->count)
+    return -1;
+
+  shard = &sh->shards[sh->table->shard[pos]];
+  upper = &sh->shards[sh->table->shard[pos + 1]];
+
+  pthread_mutex_lock(&shard->lock);
+  pthread_mutex_lock(&upper->lock);
+
+  /* The first key of the upper range joins the trees in logarithmic time. */
+  if ((entry = aatree_pop_first(&upper->tree)))
+  {
+    aatree_join(&shard->tree, &shard->tree,
+                aatree_entry_node(&shard->tree, entry), &upper->tree);
+  }
+
+  shard->has_hi = upper->has_hi;
+  shard->hi     = upper->hi;
+
+  /* Operations routed by a stale table retry once they see it is gone. */
+  upper->live   = 0;
+  upper->has_lo = 0;
+  upper->has_hi = 0;
+
+  table = *sh->table;
+
+  memmove(&table.shard[pos + 1], &table.shard[pos + 2],
+          (table.count - pos - 2) * sizeof(table.shard[0]));
+  memmove(&table.bound[pos], &table.bound[pos + 1],
+          (table.count - pos - 2) * sizeof(table.bound[0]));
+  table.count--;
+
+  publish_table(sh, &table);
+
+  pthread_mutex_unlock(&upper->lock);
+  pthread_mutex_unlock(&shard->lock);
+
+  return 0;
+} /* merge_ranges */
+
+int aatree_sharded_split(aatree_sharded_t *sh, size_t pos)
+{
+  int result;
+
+  pthread_mutex_lock(&sh->resize);
+  result = split_range(sh, pos);
+  pthread_mutex_unlock(&sh->resize);
+
+  return result;
+} /* aatree_sharded_split */
+
+int aatree_sharded_merge(aatree_sharded_t *sh, size_t pos)
+{
+  int result;
+
+  pthread_mutex_lock(&sh->resize);
+  result = merge_ranges(sh, pos);
+  pthread_mutex_unlock(&sh->resize);
+
+  return result;
+} /* aatree_sharded_merge */
+
+/* Updates of the range at the position since the last balancing */
+static uint64_t range_ops(aatree_sharded_t *sh, size_t pos)
+{
+  aatree_shard_t *shard = &sh->shards[sh->table->shard[pos]];
+
+  return __atomic_load_n(&shard->ops, __ATOMIC_RELAXED);
+} /* range_ops */
+
+size_t aatree_sharded_balance(aatree_sharded_t *sh)
+{
+  uint64_t total = 0, mean;
+  size_t   changes = 0;
+  size_t   pos;
+
+  pthread_mutex_lock(&sh->resize);
+
+  for (pos = 0; pos < sh->table->count; pos++)
+  {
+    total += range_ops(sh, pos);
+  }
+
+  mean = total / sh->table->count;
+
+  /* Going backwards keeps the positions still to be visited in place. */
+  for (pos = sh->table->count; pos > 0; pos--)
+  {
+    if (range_ops(sh, pos - 1) > 2 * mean
+        && !split_range(sh, pos - 1))
+    {
+      changes++;
+    }
+  }
+
+  for (pos = sh->table->count - 1; pos > 0; pos--)
+  {
+    if (range_ops(sh, pos - 1) < mean / 4 && range_ops(sh, pos) < mean / 4
+        && !merge_ranges(sh, pos - 1))
+    {
+      changes++;
+    }
+  }
+
+  for (pos = 0; pos < sh->capacity; pos++)
+  {
+    __atomic_store_n(&sh->shards[pos].ops, 0, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&sh->resize);
+
+  return changes;
+} /* aatree_sharded_balance */
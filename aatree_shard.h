@@ -0,0 +1,164 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AATREE_SHARD_H
+#define AATREE_SHARD_H
+
+#include <pthread.h>
+#include "aatree.h"
+
+/* Range partitioned AA tree for concurrent writers.
+ *
+ * The key space is split into ranges, each one an AA tree with its own lock
+ * on its own cache lines. Operations are routed by key through a small
+ * boundary table kept in two buffers: a split or a merge writes the next table
+ * into the buffer not in use and swaps the pointer. The table is read and
+ * written a word at a time and carries a sequence, odd while it is being
+ * written, so a reader still routing through a buffer being rewritten sees
+ * the sequence change and retries. A stale route is harmless too, since every
+ * shard keeps its own bounds and the key is checked against them under the
+ * shard lock, retrying on a miss.
+ *
+ * Keys are copied into the bounds, so they must be plain bytes of at most
+ * AATREE_SHARD_KEY_SIZE bytes, e.g. integers.
+ */
+
+#define AATREE_SHARD_MAX 64
+#define AATREE_SHARD_KEY_SIZE 16
+
+/* Copy of a key, aligned for any type of key the bytes may hold */
+typedef union aatree_shard_key
+{
+  uint8_t     bytes[AATREE_SHARD_KEY_SIZE];
+  uint64_t    words[AATREE_SHARD_KEY_SIZE / sizeof(uint64_t)];
+  long double align;
+  void       *pointer;
+} aatree_shard_key_t;
+
+/* Range partition, the array of them must be cache line aligned */
+typedef struct aatree_shard
+{
+  /* The shard holds keys in [lo, hi), a missing bound is infinite */
+  aatree_shard_key_t lo;
+  aatree_shard_key_t hi;
+
+  pthread_mutex_t lock;
+  aatree_t        tree;
+
+  /* Updates since the last balancing */
+  uint64_t ops;
+
+  /* The shard is in use, the bounds are there */
+  uint8_t live;
+  uint8_t has_lo;
+  uint8_t has_hi;
+} __attribute__((aligned(AATREE_CACHE_LINE))) aatree_shard_t;
+
+/* Boundary table: shard of the i-th range and the lower bounds of all
+ * ranges but the first one */
+typedef struct aatree_shard_table
+{
+  /* Odd while the table is being written */
+  uint64_t seq;
+
+  size_t             count;
+  aatree_shard_key_t bound[AATREE_SHARD_MAX - 1];
+  uint16_t           shard[AATREE_SHARD_MAX];
+} aatree_shard_table_t;
+
+typedef struct aatree_sharded
+{
+  /* Current boundary table, one of the two buffers */
+  aatree_shard_table_t *table;
+  aatree_shard_table_t  tables[2];
+
+  /* Serializes splits and merges */
+  pthread_mutex_t resize;
+
+  aatree_shard_t *shards;
+  size_t          capacity;
+
+  size_t               key_size;
+  uint16_t             node_offset;
+  uint16_t             key_offset;
+  aatree_keys_compare *cmp;
+} aatree_sharded_t;
+
+/* Callback of a range scan, returns non-zero to stop the scan */
+typedef int(aatree_shard_scan_fn)(void *entry, void *arg);
+
+/* Init empty sharded tree with the pool of capacity shards (at most
+ * AATREE_SHARD_MAX). The key space is split by nbounds ascending keys into
+ * nbounds + 1 initial ranges. Returns zero on success, or -1 if the
+ * arguments do not fit the limits. */
+int aatree_sharded_init(aatree_sharded_t   *sh,
+                        aatree_shard_t     *shards,
+                        size_t              capacity,
+                        size_t              key_size,
+                        uint16_t            node_offset,
+                        uint16_t            key_offset,
+                        aatree_keys_compare cmp,
+                        const void         *bounds,
+                        size_t              nbounds) __nonnull((1, 2, 7));
+
+/* Release the locks. The entries are left as they are. */
+void aatree_sharded_destroy(aatree_sharded_t *sh) __nonnull((1));
+
+/* Try to insert node or return an existing entry */
+void *aatree_sharded_insert(aatree_sharded_t *sh, aatree_node_t *node)
+    __nonnull((1, 2));
+
+/* Delete the node from its shard */
+void aatree_sharded_delete(aatree_sharded_t *sh, aatree_node_t *node)
+    __nonnull((1, 2));
+
+/* Search entry like aatree_search(), crossing shards if needed */
+void *aatree_sharded_search(aatree_sharded_t *sh,
+                            const void       *key,
+                            aatree_keys_order order) __nonnull((1, 2));
+
+/* Call fn on entries with keys not less than the key in ascending order,
+ * until it returns non-zero. Each shard is visited under its lock, the scan
+ * as a whole is not atomic. Returns number of entries visited. */
+size_t aatree_sharded_scan(aatree_sharded_t     *sh,
+                           const void           *key,
+                           aatree_shard_scan_fn *fn,
+                           void                 *arg) __nonnull((1, 2, 3));
+
+/* Number of ranges */
+size_t aatree_sharded_count(const aatree_sharded_t *sh) __nonnull((1));
+
+/* Split the range at the position in key order at the key of the root of its
+ * tree, in logarithmic time. Returns zero on success, or -1 if there is no
+ * free shard or nothing to split. */
+int aatree_sharded_split(aatree_sharded_t *sh, size_t pos) __nonnull((1));
+
+/* Merge the range at the position with the next one. Returns zero on
+ * success, or -1 if there is no next range. */
+int aatree_sharded_merge(aatree_sharded_t *sh, size_t pos) __nonnull((1));
+
+/* Split the ranges taking more than twice the mean share of updates since
+ * the last call and merge the neighbours taking less than a quarter of it.
+ * Returns number of splits and merges done. */
+size_t aatree_sharded_balance(aatree_sharded_t *sh) __nonnull((1));
+
+#endif /* AATREE_SHARD_H */
@@ -0,0 +1,638 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "aatree_shm.h"
+
+#define load_link(link) __atomic_load_n(&(link), __ATOMIC_ACQUIRE)
+#define publish(link, off) __atomic_store_n(&(link), (off), __ATOMIC_RELEASE)
+
+/* Slots start at the first cache line past the header */
+#define slots_offset()                                                         \
+  ((sizeof(aatree_shm_header_t) + AATREE_CACHE_LINE - 1)                       \
+   & ~(size_t)(AATREE_CACHE_LINE - 1))
+
+static __inline__ aatree_shm_node_t *node_at(const aatree_shm_t *shm,
+                                             uint64_t            off)
+{
+  return (aatree_shm_node_t *)(shm->base + off);
+} /* node_at */
+
+static __inline__ uint8_t *slot_entry(const aatree_shm_t *shm, uint64_t off)
+{
+  return shm->base + off + sizeof(aatree_shm_node_t);
+} /* slot_entry */
+
+static __inline__ const void *slot_key(const aatree_shm_t *shm, uint64_t off)
+{
+  return slot_entry(shm, off) + shm->header->key_offset;
+} /* slot_key */
+
+static __inline__ uint8_t node_level(const aatree_shm_t *shm, uint64_t off)
+{
+  return off ? node_at(shm, off)->level : 0;
+} /* node_level */
+
+static __inline__ size_t slot_size(size_t entry_size)
+{
+  return (sizeof(aatree_shm_node_t) + entry_size + 7) & ~(size_t)7;
+} /* slot_size */
+
+size_t aatree_shm_region_size(size_t entry_size, size_t capacity)
+{
+  return slots_offset() + capacity * slot_size(entry_size);
+} /* aatree_shm_region_size */
+
+/* Map the whole file */
+static int map_region(aatree_shm_t *shm, int fd, size_t size)
+{
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (base == MAP_FAILED)
+  {
+    return errno;
+  }
+
+  shm->base   = base;
+  shm->header = base;
+  shm->size   = size;
+
+  return 0;
+} /* map_region */
+
+int aatree_shm_format(aatree_shm_t       *shm,
+                      int                 fd,
+                      size_t              entry_size,
+                      uint16_t            key_offset,
+                      size_t              capacity,
+                      aatree_keys_compare cmp)
+{
+  aatree_shm_header_t *header = NULL;
+  pthread_mutexattr_t  attr;
+  size_t               size   = aatree_shm_region_size(entry_size, capacity);
+  size_t               i;
+  int                  error  = 0;
+
+  if (ftruncate(fd, (off_t)size))
+  {
+    return errno;
+  }
+
+  if ((error = map_region(shm, fd, size)))
+  {
+    return error;
+  }
+
+  shm->cmp = cmp;
+  header   = shm->header;
+
+  header->size       = size;
+  header->entry_size = entry_size;
+  header->key_offset = key_offset;
+  header->capacity   = capacity;
+  header->slot_size  = slot_size(entry_size);
+  header->seq        = 0;
+  header->root       = 0;
+  header->count      = 0;
+  header->free       = 0;
+
+  for (i = capacity; i > 0; i--)
+  {
+    uint64_t           off  = slots_offset() + (i - 1) * header->slot_size;
+    aatree_shm_node_t *node = node_at(shm, off);
+
+    node->left   = 0;
+    node->level  = 0;
+    node->used   = 0;
+    node->right  = header->free;
+    header->free = off;
+  }
+
+  /* A writer dying with the lock held must not hang the other processes. */
+  if ((error = pthread_mutexattr_init(&attr)))
+  {
+    aatree_shm_unmap(shm);
+    return error;
+  }
+
+  if (!(error = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED))
+      && !(error = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)))
+  {
+    error = pthread_mutex_init(&header->lock, &attr);
+  }
+
+  pthread_mutexattr_destroy(&attr);
+
+  if (error)
+  {
+    aatree_shm_unmap(shm);
+    return error;
+  }
+
+  /* The magic goes last: a region is never mapped half formatted. */
+  __atomic_store_n(&header->magic, AATREE_SHM_MAGIC, __ATOMIC_RELEASE);
+
+  return 0;
+} /* aatree_shm_format */
+
+int aatree_shm_map(aatree_shm_t *shm, int fd, aatree_keys_compare cmp)
+{
+  struct stat st;
+  int         error = 0;
+
+  if (fstat(fd, &st))
+  {
+    return errno;
+  }
+
+  if ((size_t)st.st_size < slots_offset())
+  {
+    return EINVAL;
+  }
+
+  if ((error = map_region(shm, fd, (size_t)st.st_size)))
+  {
+    return error;
+  }
+
+  shm->cmp = cmp;
+
+  if (__atomic_load_n(&shm->header->magic, __ATOMIC_ACQUIRE)
+          != AATREE_SHM_MAGIC
+      || shm->header->size != shm->size
+      || shm->header->slot_size != slot_size(shm->header->entry_size))
+  {
+    aatree_shm_unmap(shm);
+    return EINVAL;
+  }
+
+  return 0;
+} /* aatree_shm_map */
+
+void aatree_shm_unmap(aatree_shm_t *shm)
+{
+  munmap(shm->base, shm->size);
+
+  shm->base   = NULL;
+  shm->header = NULL;
+  shm->size   = 0;
+} /* aatree_shm_unmap */
+
+/* Mark the beginning of an update for the readers */
+static __inline__ void write_begin(aatree_shm_header_t *header)
+{
+  /* Link stores are release stores, they can not pass this one. */
+  __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELAXED);
+} /* write_begin */
+
+/* Mark the end of an update */
+static __inline__ void write_end(aatree_shm_header_t *header)
+{
+  __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+} /* write_end */
+
+/*
+ *     N        L
+ *    / \      / \
+ *   L   R -> A   N
+ *  / \          / \
+ * A   B        B   R
+ */
+static void skew(aatree_shm_t *shm, uint64_t *link)
+{
+  aatree_shm_node_t *node = node_at(shm, *link);
+  aatree_shm_node_t *left = NULL;
+  uint64_t           off  = *link;
+
+  if (!node->left || node_at(shm, node->left)->level != node->level)
+    return;
+
+  left = node_at(shm, node->left);
+
+  publish(*link, node->left);
+  publish(node->left, left->right);
+  publish(left->right, off);
+} /* skew */
+
+/*
+ *   N            R
+ *  / \          / \
+ * A   R   ->   N   X
+ *    / \      / \
+ *   B   X    A   B
+ */
+static void split(aatree_shm_t *shm, uint64_t *link)
+{
+  aatree_shm_node_t *node  = node_at(shm, *link);
+  aatree_shm_node_t *right = NULL;
+  uint64_t           off   = *link;
+
+  if (!node->right || !node_at(shm, node->right)->right
+      || node_at(shm, node_at(shm, node->right)->right)->level != node->level)
+    return;
+
+  right = node_at(shm, node->right);
+  right->level++;
+
+  publish(*link, node->right);
+  publish(node->right, right->left);
+  publish(right->left, off);
+} /* split */
+
+/* Find the slot with the key, the lock must be held */
+static uint64_t find_slot(const aatree_shm_t *shm, const void *key)
+{
+  uint64_t off = shm->header->root;
+
+  while (off)
+  {
+    int result = shm->cmp(key, slot_key(shm, off));
+
+    if (!result)
+      break;
+
+    off = result < 0 ? node_at(shm, off)->left : node_at(shm, off)->right;
+  }
+
+  return off;
+} /* find_slot */
+
+/* Link a used slot with a key not in the tree yet */
+static void link_slot(aatree_shm_t *shm, uint64_t off)
+{
+  uint64_t          *path[AATREE_SHM_MAX_DEPTH];
+  uint64_t          *link  = &shm->header->root;
+  aatree_shm_node_t *node  = node_at(shm, off);
+  int                depth = 0;
+
+  while (*link)
+  {
+    path[depth++] = link;
+
+    if (shm->cmp(slot_key(shm, off), slot_key(shm, *link)) < 0)
+      link = &node_at(shm, *link)->left;
+    else
+      link = &node_at(shm, *link)->right;
+  }
+
+  node->left  = 0;
+  node->right = 0;
+  node->level = 1;
+  publish(*link, off);
+
+  while (depth--)
+  {
+    skew(shm, path[depth]);
+    split(shm, path[depth]);
+  }
+} /* link_slot */
+
+/* Restore the invariants on the way up from an unlinked slot */
+static void rebalance(aatree_shm_t *shm, uint64_t *link)
+{
+  aatree_shm_node_t *node   = node_at(shm, *link);
+  uint8_t            left   = node_level(shm, node->left);
+  uint8_t            right  = node_level(shm, node->right);
+  uint8_t            should = (left < right ? left : right) + 1;
+
+  if (should < node->level)
+  {
+    node->level = should;
+
+    if (right > should)
+      node_at(shm, node->right)->level = should;
+  }
+
+  skew(shm, link);
+  node = node_at(shm, *link);
+
+  if (node->right)
+  {
+    skew(shm, &node->right);
+
+    if (node_at(shm, node->right)->right)
+      skew(shm, &node_at(shm, node->right)->right);
+  }
+
+  split(shm, link);
+  node = node_at(shm, *link);
+
+  if (node->right)
+    split(shm, &node->right);
+} /* rebalance */
+
+/* Unlink the slot with the key, which must be in the tree */
+static void unlink_slot(aatree_shm_t *shm, const void *key)
+{
+  uint64_t          *path[AATREE_SHM_MAX_DEPTH];
+  uint64_t          *link  = &shm->header->root;
+  aatree_shm_node_t *node  = NULL;
+  int                depth = 0;
+  int                found = 0;
+
+  for (;;)
+  {
+    int result = shm->cmp(key, slot_key(shm, *link));
+
+    if (!result)
+      break;
+
+    node          = node_at(shm, *link);
+    path[depth++] = link;
+    link          = result < 0 ? &node->left : &node->right;
+  }
+
+  node  = node_at(shm, *link);
+  found = depth;
+
+  if (!node->left)
+  {
+    publish(*link, node->right);
+  }
+  else
+  {
+    /* An inner node is replaced by its successor, a level one node with no
+     * left son, which is unlinked from below first. */
+    uint64_t          *succ_link = &node->right;
+    aatree_shm_node_t *succ      = NULL;
+    uint64_t           succ_off  = 0;
+
+    path[depth++] = link;
+
+    while (node_at(shm, *succ_link)->left)
+    {
+      path[depth++] = succ_link;
+      succ_link     = &node_at(shm, *succ_link)->left;
+    }
+
+    succ_off = *succ_link;
+    succ     = node_at(shm, succ_off);
+    publish(*succ_link, succ->right);
+
+    succ->level = node->level;
+    publish(succ->left, node->left);
+    publish(succ->right, node->right);
+    publish(*link, succ_off);
+
+    /* The path went through the node replaced. */
+    if (depth > found + 1)
+      path[found + 1] = &succ->right;
+  }
+
+  while (depth--)
+  {
+    rebalance(shm, path[depth]);
+  }
+} /* unlink_slot */
+
+/* Relink the tree and the free list from the used marks after a writer died
+ * in the middle of an update */
+static void recover(aatree_shm_t *shm)
+{
+  aatree_shm_header_t *header = shm->header;
+  size_t               i;
+
+  header->root  = 0;
+  header->count = 0;
+  header->free  = 0;
+
+  for (i = header->capacity; i > 0; i--)
+  {
+    uint64_t           off  = slots_offset() + (i - 1) * header->slot_size;
+    aatree_shm_node_t *node = node_at(shm, off);
+
+    if (node->used && !find_slot(shm, slot_key(shm, off)))
+    {
+      link_slot(shm, off);
+      header->count++;
+    }
+    else
+    {
+      node->used   = 0;
+      node->right  = header->free;
+      header->free = off;
+    }
+  }
+} /* recover */
+
+/* Take the writers' lock, repairing the tree left by a dead owner */
+static int lock_region(aatree_shm_t *shm)
+{
+  aatree_shm_header_t *header = shm->header;
+  int                  error  = pthread_mutex_lock(&header->lock);
+
+  if (error == EOWNERDEAD)
+  {
+    if (header->seq & 1)
+    {
+      recover(shm);
+      write_end(header);
+    }
+
+    error = pthread_mutex_consistent(&header->lock);
+  }
+
+  return error;
+} /* lock_region */
+
+int aatree_shm_insert(aatree_shm_t *shm, const void *entry)
+{
+  aatree_shm_header_t *header = shm->header;
+  const uint8_t       *key    = (const uint8_t *)entry + header->key_offset;
+  uint64_t             off    = 0;
+  int                  error  = 0;
+
+  if ((error = lock_region(shm)))
+  {
+    return error;
+  }
+
+  if (find_slot(shm, key))
+  {
+    error = EEXIST;
+  }
+  else if (!(off = header->free))
+  {
+    error = ENOMEM;
+  }
+  else
+  {
+    write_begin(header);
+
+    header->free = node_at(shm, off)->right;
+    memcpy(slot_entry(shm, off), entry, header->entry_size);
+    node_at(shm, off)->used = 1;
+
+    link_slot(shm, off);
+    header->count++;
+
+    write_end(header);
+  }
+
+  pthread_mutex_unlock(&header->lock);
+
+  return error;
+} /* aatree_shm_insert */
+
+int aatree_shm_delete(aatree_shm_t *shm, const void *key, void *out)
+{
+  aatree_shm_header_t *header = shm->header;
+  uint64_t             off    = 0;
+  int                  error  = 0;
+
+  if ((error = lock_region(shm)))
+  {
+    return error;
+  }
+
+  if (!(off = find_slot(shm, key)))
+  {
+    error = ENOENT;
+  }
+  else
+  {
+    if (out)
+      memcpy(out, slot_entry(shm, off), header->entry_size);
+
+    write_begin(header);
+
+    unlink_slot(shm, slot_key(shm, off));
+    header->count--;
+
+    node_at(shm, off)->used  = 0;
+    node_at(shm, off)->right = header->free;
+    header->free             = off;
+
+    write_end(header);
+  }
+
+  pthread_mutex_unlock(&header->lock);
+
+  return error;
+} /* aatree_shm_delete */
+
+/* Descend the tree without the lock. Returns zero if a writer got in the way,
+ * or sets found otherwise. */
+static int search_lockless(aatree_shm_t     *shm,
+                           const void       *key,
+                           aatree_keys_order order,
+                           void             *out,
+                           int              *found)
+{
+  aatree_shm_header_t *header    = shm->header;
+  uint64_t             off       = 0;
+  uint64_t             candidate = 0;
+  uint64_t             seq       = 0;
+  int                  depth     = 0;
+
+  seq = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE);
+
+  if (seq & 1)
+  {
+    return 0;
+  }
+
+  for (off = load_link(header->root); off; depth++)
+  {
+    int result = 0;
+
+    if (depth == AATREE_SHM_MAX_DEPTH)
+    {
+      return 0;
+    }
+
+    result = shm->cmp(key, slot_key(shm, off));
+
+    if (!result && order != AATREE_KEY_LT && order != AATREE_KEY_GT)
+    {
+      candidate = off;
+      break;
+    }
+
+    /* Keep the closest node on the side the order asks for. */
+    if (result > 0 || (!result && order == AATREE_KEY_GT))
+    {
+      if (order == AATREE_KEY_LT || order == AATREE_KEY_LE)
+        candidate = off;
+
+      off = load_link(node_at(shm, off)->right);
+    }
+    else
+    {
+      if (order == AATREE_KEY_GT || order == AATREE_KEY_GE)
+        candidate = off;
+
+      off = load_link(node_at(shm, off)->left);
+    }
+  }
+
+  if (candidate)
+  {
+    memcpy(out, slot_entry(shm, candidate), header->entry_size);
+  }
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  if (__atomic_load_n(&header->seq, __ATOMIC_RELAXED) != seq)
+  {
+    return 0;
+  }
+
+  *found = candidate != 0;
+
+  return 1;
+} /* search_lockless */
+
+int aatree_shm_search(aatree_shm_t     *shm,
+                      const void       *key,
+                      aatree_keys_order order,
+                      void             *out)
+{
+  int found = 0;
+  int error = 0;
+  int i;
+
+  for (i = 0; i < AATREE_SHM_RETRIES; i++)
+  {
+    if (search_lockless(shm, key, order, out, &found))
+    {
+      return found ? 0 : ENOENT;
+    }
+  }
+
+  /* Writers keep interfering, or one died: the lock repairs the tree if
+   * needed, and no version changes while it is held. */
+  if ((error = lock_region(shm)))
+  {
+    return error;
+  }
+
+  search_lockless(shm, key, order, out, &found);
+  pthread_mutex_unlock(&shm->header->lock);
+
+  return found ? 0 : ENOENT;
+} /* aatree_shm_search */
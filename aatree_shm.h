@@ -0,0 +1,142 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AATREE_SHM_H
+#define AATREE_SHM_H
+
+#include <pthread.h>
+#include "aatree.h"
+
+/* AA tree in a shared memory region.
+ *
+ * The whole tree lives in a region mapped by several processes, e.g. a
+ * shm_open() or memfd_create() file, each at its own address: links are
+ * offsets from the start of the region, zero standing for NULL. Entries of a
+ * fixed size are copied into slots carved out of the region.
+ *
+ * Writers of all the processes are serialized by a robust process-shared
+ * mutex and bump a version counter around every update, so readers descend
+ * without locks and validate the copies they make, as in aatree_sync.h. Keys
+ * must be stored inline and the comparison function must tolerate reading a
+ * key being overwritten.
+ *
+ * A writer dying in the middle of an update leaves the links inconsistent.
+ * The next process to take the lock relinks the tree from the slots marked as
+ * used, so the interrupted update is either done or not, but never half done.
+ */
+
+/* Region format identifier, changed with the layout */
+#define AATREE_SHM_MAGIC UINT64_C(0x0100656572746161)
+
+/* Lock-free attempts before a search takes the lock */
+#define AATREE_SHM_RETRIES 8
+
+/* Bound of a lock-free descent, see AATREE_RCU_MAX_DEPTH */
+#define AATREE_SHM_MAX_DEPTH 128
+
+/* Slot of the region, the entry follows it */
+typedef struct aatree_shm_node
+{
+  uint64_t left;
+  uint64_t right;
+
+  uint8_t level;
+
+  /* set while the entry belongs to the tree */
+  uint8_t used;
+} aatree_shm_node_t;
+
+/* Region header, there is nothing but offsets and numbers in it */
+typedef struct aatree_shm_header
+{
+  uint64_t magic;
+  uint64_t size;
+  uint64_t entry_size;
+  uint64_t key_offset;
+  uint64_t capacity;
+  uint64_t slot_size;
+
+  /* Odd while a writer is updating the tree */
+  uint64_t seq;
+
+  uint64_t root;
+  uint64_t count;
+
+  /* Unused slots, linked through the right offsets */
+  uint64_t free;
+
+  pthread_mutex_t lock;
+} aatree_shm_header_t;
+
+/* Mapping of the region in the calling process */
+typedef struct aatree_shm
+{
+  aatree_shm_header_t *header;
+  uint8_t             *base;
+  size_t               size;
+  aatree_keys_compare *cmp;
+} aatree_shm_t;
+
+/* Size of a region for capacity entries of entry_size bytes each */
+size_t aatree_shm_region_size(size_t entry_size, size_t capacity);
+
+/* Size the file to fit capacity entries, map it and init empty tree in it.
+ * Returns zero on success or an error number. */
+int aatree_shm_format(aatree_shm_t       *shm,
+                      int                 fd,
+                      size_t              entry_size,
+                      uint16_t            key_offset,
+                      size_t              capacity,
+                      aatree_keys_compare cmp) __nonnull((1));
+
+/* Map a region formatted by any process. Returns zero on success or an error
+ * number, EINVAL if the file is not a region. */
+int aatree_shm_map(aatree_shm_t *shm, int fd, aatree_keys_compare cmp)
+    __nonnull((1));
+
+/* Unmap the region, the tree stays in the file */
+void aatree_shm_unmap(aatree_shm_t *shm) __nonnull((1));
+
+/* Number of entries in the tree */
+static __inline__ __nonnull((1)) size_t
+aatree_shm_count(const aatree_shm_t *shm)
+{
+  return __atomic_load_n(&shm->header->count, __ATOMIC_RELAXED);
+} /* aatree_shm_count */
+
+/* Copy entry into the tree. Returns zero on success, EEXIST if an entry with
+ * the key is there, ENOMEM if the region is full, or a lock error number. */
+int aatree_shm_insert(aatree_shm_t *shm, const void *entry) __nonnull((1, 2));
+
+/* Delete entry with the key, copying it out unless out is NULL. Returns zero
+ * on success, ENOENT if there is no such entry, or a lock error number. */
+int aatree_shm_delete(aatree_shm_t *shm, const void *key, void *out)
+    __nonnull((1));
+
+/* Search entry like aatree_search() and copy it out. Returns zero if the
+ * entry is found, ENOENT if there is none, or a lock error number. */
+int aatree_shm_search(aatree_shm_t     *shm,
+                      const void       *key,
+                      aatree_keys_order order,
+                      void             *out) __nonnull((1, 4));
+
+#endif /* AATREE_SHM_H */
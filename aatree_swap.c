@@ -0,0 +1,122 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "aatree_swap.h"
+
+/* The buffer not published */
+static __inline__ aatree_t *back_buffer(aatree_swap_t *swap)
+{
+  return swap->current == &swap->trees[0] ? &swap->trees[1] : &swap->trees[0];
+} /* back_buffer */
+
+/* Reclaim function of the epoch domain, the only object ever retired is the
+ * replaced tree */
+static void reclaim_tree(aatree_epoch_entry_t *entry, void *arg)
+{
+  aatree_swap_t *swap = arg;
+
+  (void)entry;
+
+  swap->teardown(back_buffer(swap), swap->arg);
+} /* reclaim_tree */
+
+int aatree_swap_init(aatree_swap_t           *swap,
+                     uint16_t                 node_offset,
+                     uint16_t                 key_offset,
+                     aatree_keys_compare      cmp,
+                     aatree_swap_teardown_fn *teardown,
+                     void                    *arg)
+{
+  aatree_init_tree(&swap->trees[0], node_offset, key_offset, cmp);
+  aatree_init_tree(&swap->trees[1], node_offset, key_offset, cmp);
+  aatree_epoch_init(&swap->epoch, reclaim_tree, swap);
+
+  swap->current  = &swap->trees[0];
+  swap->teardown = teardown;
+  swap->arg      = arg;
+
+  return pthread_mutex_init(&swap->lock, NULL);
+} /* aatree_swap_init */
+
+void aatree_swap_destroy(aatree_swap_t *swap)
+{
+  aatree_epoch_synchronize(&swap->epoch);
+  swap->teardown(swap->current, swap->arg);
+  pthread_mutex_destroy(&swap->lock);
+} /* aatree_swap_destroy */
+
+void aatree_swap_unregister(aatree_swap_t         *swap,
+                            aatree_epoch_record_t *record)
+{
+  pthread_mutex_lock(&swap->lock);
+  aatree_epoch_unregister(&swap->epoch, record);
+  pthread_mutex_unlock(&swap->lock);
+} /* aatree_swap_unregister */
+
+aatree_t *aatree_swap_prepare(aatree_swap_t *swap)
+{
+  aatree_t *back = NULL;
+
+  pthread_mutex_lock(&swap->lock);
+
+  /* Readers never take the lock, so waiting for them under it is fine. */
+  aatree_epoch_synchronize(&swap->epoch);
+
+  back = back_buffer(swap);
+  aatree_init_tree(back, swap->current->offset.node, swap->current->offset.key,
+                   swap->current->cmp);
+
+  return back;
+} /* aatree_swap_prepare */
+
+void aatree_swap_publish(aatree_swap_t *swap)
+{
+  __atomic_store_n(&swap->current, back_buffer(swap), __ATOMIC_RELEASE);
+
+  /* The teardown is left to a later collection or rebuild, so publishing
+   * never waits for the readers. */
+  aatree_epoch_retire(&swap->epoch, &swap->retired);
+  aatree_epoch_collect(&swap->epoch);
+
+  pthread_mutex_unlock(&swap->lock);
+} /* aatree_swap_publish */
+
+void aatree_swap_cancel(aatree_swap_t *swap)
+{
+  swap->teardown(back_buffer(swap), swap->arg);
+  pthread_mutex_unlock(&swap->lock);
+} /* aatree_swap_cancel */
+
+int aatree_swap_rebuild(aatree_swap_t  *swap,
+                        aatree_node_t **nodes,
+                        size_t          count)
+{
+  if (aatree_build_sorted(aatree_swap_prepare(swap), nodes, count))
+  {
+    aatree_swap_cancel(swap);
+    return -1;
+  }
+
+  aatree_swap_publish(swap);
+
+  return 0;
+} /* aatree_swap_rebuild */
@@ -0,0 +1,124 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AATREE_SWAP_H
+#define AATREE_SWAP_H
+
+#include <pthread.h>
+#include "aatree_epoch.h"
+
+/* Double buffered tree for background rebuilds.
+ *
+ * Readers query the published tree, which is never modified. A rebuild fills
+ * the back buffer, e.g. with aatree_build_sorted(), and publishes it with a
+ * single atomic store, so queries go on during the whole rebuild. The tree
+ * replaced is handed to the teardown function once every reader pinned to it
+ * has left, and its buffer is reused by the rebuild after the next one.
+ *
+ * A node is linked into one tree only, so every rebuild links fresh entries,
+ * and the teardown function is the one to release the old ones.
+ */
+
+/* Teardown function of a replaced tree, it may be empty */
+typedef void(aatree_swap_teardown_fn)(aatree_t *, void *);
+
+typedef struct aatree_swap
+{
+  /* Published tree, the only field the readers load */
+  aatree_t *current;
+  uint8_t   pad[AATREE_CACHE_LINE - sizeof(void *)];
+
+  /* Front and back buffers */
+  aatree_t trees[2];
+
+  /* Link of the replaced tree while readers may still use it */
+  aatree_epoch_entry_t retired;
+
+  /* Serializes rebuilds */
+  pthread_mutex_t lock;
+  aatree_epoch_t  epoch;
+
+  aatree_swap_teardown_fn *teardown;
+  void                    *arg;
+} aatree_swap_t;
+
+/* Init with an empty tree published. Returns zero on success or an error
+ * number. */
+int aatree_swap_init(aatree_swap_t           *swap,
+                     uint16_t                 node_offset,
+                     uint16_t                 key_offset,
+                     aatree_keys_compare      cmp,
+                     aatree_swap_teardown_fn *teardown,
+                     void                    *arg) __nonnull((1, 4, 5));
+
+/* Tear down both the replaced and the published trees. No reader may be left
+ * inside a read-side critical section. */
+void aatree_swap_destroy(aatree_swap_t *swap) __nonnull((1));
+
+/* Register reader record of the calling thread */
+static __inline__ __nonnull((1, 2)) void
+aatree_swap_register(aatree_swap_t *swap, aatree_epoch_record_t *record)
+{
+  aatree_epoch_register(&swap->epoch, record);
+} /* aatree_swap_register */
+
+/* Unregister reader record of the calling thread before it exits */
+void aatree_swap_unregister(aatree_swap_t         *swap,
+                            aatree_epoch_record_t *record) __nonnull((1, 2));
+
+/* Enter read-side critical section and pin the published tree. The tree and
+ * its entries stay valid until the section is left, and must not be
+ * modified. */
+static __inline__ __nonnull((1, 2)) const aatree_t *
+aatree_swap_read_lock(aatree_swap_t *swap, aatree_epoch_record_t *record)
+{
+  aatree_epoch_enter(&swap->epoch, record);
+
+  return __atomic_load_n(&swap->current, __ATOMIC_ACQUIRE);
+} /* aatree_swap_read_lock */
+
+/* Leave read-side critical section */
+static __inline__ __nonnull((1)) void
+aatree_swap_read_unlock(aatree_epoch_record_t *record)
+{
+  aatree_epoch_exit(record);
+} /* aatree_swap_read_unlock */
+
+/* Start a rebuild and get the empty back buffer to fill. Waits for the tree
+ * replaced by the previous rebuild to be torn down. The rebuild must end with
+ * aatree_swap_publish() or aatree_swap_cancel(). */
+aatree_t *aatree_swap_prepare(aatree_swap_t *swap) __nonnull((1));
+
+/* Publish the back buffer and retire the tree it replaces */
+void aatree_swap_publish(aatree_swap_t *swap) __nonnull((1));
+
+/* Abandon a rebuild, handing the back buffer to the teardown function */
+void aatree_swap_cancel(aatree_swap_t *swap) __nonnull((1));
+
+/* Rebuild from an array of nodes sorted by strictly ascending keys and
+ * publish it. Returns zero on success, or -1 if the keys are out of order, in
+ * which case the published tree stays as it is. */
+int aatree_swap_rebuild(aatree_swap_t  *swap,
+                        aatree_node_t **nodes,
+                        size_t          count) __nonnull((1));
+
+#endif /* AATREE_SWAP_H */
@@ -0,0 +1,385 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <string.h>
+#include "aatree_sync.h"
+
+#define load_link(link) __atomic_load_n(&(link), __ATOMIC_ACQUIRE)
+
+/* Get pool entry by index */
+static __inline__ void *pool_entry(const aatree_sync_t *sync, size_t ix)
+{
+  return sync->pool + ix * sync->entry_size;
+} /* pool_entry */
+
+int aatree_sync_init(aatree_sync_t      *sync,
+                     void               *pool,
+                     size_t              entry_size,
+                     size_t              capacity,
+                     uint16_t            node_offset,
+                     uint16_t            key_offset,
+                     aatree_keys_compare cmp)
+{
+  size_t i;
+
+  aatree_init_tree(&sync->tree, node_offset, key_offset, cmp);
+
+  sync->seq        = 0;
+  sync->pool       = pool;
+  sync->entry_size = entry_size;
+  sync->capacity   = capacity;
+  sync->free       = NULL;
+
+  for (i = capacity; i > 0; i--)
+  {
+    aatree_node_t *node = NULL;
+
+    node = aatree_entry_node(&sync->tree, pool_entry(sync, i - 1));
+    aatree_init_node(node);
+    node->parent = sync->free;
+    sync->free   = node;
+  }
+
+  return pthread_mutex_init(&sync->lock, NULL);
+} /* aatree_sync_init */
+
+void aatree_sync_destroy(aatree_sync_t *sync)
+{
+  pthread_mutex_destroy(&sync->lock);
+} /* aatree_sync_destroy */
+
+void *aatree_sync_alloc(aatree_sync_t *sync)
+{
+  aatree_node_t *node = NULL;
+
+  pthread_mutex_lock(&sync->lock);
+
+  if ((node = sync->free))
+  {
+    sync->free = node->parent;
+  }
+
+  pthread_mutex_unlock(&sync->lock);
+
+  if (node)
+  {
+    aatree_init_node(node);
+  }
+
+  return aatree_node_entry(&sync->tree, node);
+} /* aatree_sync_alloc */
+
+/* Put an entry on the free list, the lock must be held */
+static void pool_put(aatree_sync_t *sync, aatree_node_t *node)
+{
+  node->parent = sync->free;
+  sync->free   = node;
+} /* pool_put */
+
+void aatree_sync_free(aatree_sync_t *sync, void *entry)
+{
+  pthread_mutex_lock(&sync->lock);
+  pool_put(sync, aatree_entry_node(&sync->tree, entry));
+  pthread_mutex_unlock(&sync->lock);
+} /* aatree_sync_free */
+
+/* Mark the beginning of an update for the readers */
+static __inline__ void write_begin(aatree_sync_t *sync)
+{
+  /* Link stores are release stores, they can not pass this one. */
+  __atomic_store_n(&sync->seq, sync->seq + 1, __ATOMIC_RELAXED);
+} /* write_begin */
+
+/* Mark the end of an update */
+static __inline__ void write_end(aatree_sync_t *sync)
+{
+  __atomic_store_n(&sync->seq, sync->seq + 1, __ATOMIC_RELEASE);
+} /* write_end */
+
+void *aatree_sync_insert(aatree_sync_t *sync, void *entry)
+{
+  void *existing = NULL;
+
+  pthread_mutex_lock(&sync->lock);
+
+  write_begin(sync);
+  existing = aatree_insert(&sync->tree, aatree_entry_node(&sync->tree, entry));
+  write_end(sync);
+
+  pthread_mutex_unlock(&sync->lock);
+
+  return existing;
+} /* aatree_sync_insert */
+
+int aatree_sync_delete(aatree_sync_t *sync, const void *key)
+{
+  void *entry = NULL;
+
+  pthread_mutex_lock(&sync->lock);
+
+  if ((entry = aatree_search(&sync->tree, key, AATREE_KEY_EQ)))
+  {
+    aatree_node_t *node = aatree_entry_node(&sync->tree, entry);
+
+    write_begin(sync);
+    aatree_delete(&sync->tree, node);
+    write_end(sync);
+
+    pool_put(sync, node);
+  }
+
+  pthread_mutex_unlock(&sync->lock);
+
+  return entry != NULL;
+} /* aatree_sync_delete */
+
+/* Check that no writer has got in the way since the version was read */
+static __inline__ int read_validate(const aatree_sync_t *sync, uint64_t seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  return __atomic_load_n(&sync->seq, __ATOMIC_RELAXED) == seq;
+} /* read_validate */
+
+/* Descend the tree without the lock. Returns zero if a writer got in the way,
+ * or sets found otherwise. */
+static int search_lockless(aatree_sync_t    *sync,
+                           const void       *key,
+                           aatree_keys_order order,
+                           void             *out,
+                           int              *found)
+{
+  const aatree_t *tree      = &sync->tree;
+  aatree_node_t  *node      = NULL;
+  aatree_node_t  *candidate = NULL;
+  uint64_t        seq       = __atomic_load_n(&sync->seq, __ATOMIC_ACQUIRE);
+  int             depth     = 0;
+
+  if (seq & 1)
+  {
+    return 0;
+  }
+
+  for (node = load_link(tree->root); node; depth++)
+  {
+    int result = 0;
+
+    if (depth == AATREE_SYNC_MAX_DEPTH)
+    {
+      return 0;
+    }
+
+    result = tree->cmp(key, aatree_node_key(tree, node));
+
+    if (!result && order != AATREE_KEY_LT && order != AATREE_KEY_GT)
+    {
+      candidate = node;
+      break;
+    }
+
+    /* Keep the closest node on the side the order asks for. */
+    if (result > 0 || (!result && order == AATREE_KEY_GT))
+    {
+      if (order == AATREE_KEY_LT || order == AATREE_KEY_LE)
+        candidate = node;
+
+      node = load_link(node->right);
+    }
+    else
+    {
+      if (order == AATREE_KEY_GT || order == AATREE_KEY_GE)
+        candidate = node;
+
+      node = load_link(node->left);
+    }
+  }
+
+  /* The entry may be changing under our feet, the copy is only trusted once
+   * the version is validated. */
+  if (candidate)
+  {
+    memcpy(out, aatree_node_entry(tree, candidate), sync->entry_size);
+  }
+
+  if (!read_validate(sync, seq))
+  {
+    return 0;
+  }
+
+  *found = candidate != NULL;
+
+  return 1;
+} /* search_lockless */
+
+int aatree_sync_search(aatree_sync_t       *sync,
+                       const void          *key,
+                       aatree_keys_order    order,
+                       void                *out,
+                       aatree_sync_stats_t *stats)
+{
+  void *entry = NULL;
+  int   found = 0;
+  int   i;
+
+  if (stats)
+    stats->reads++;
+
+  for (i = 0; i < AATREE_SYNC_RETRIES; i++)
+  {
+    if (search_lockless(sync, key, order, out, &found))
+    {
+      return found;
+    }
+
+    if (stats)
+      stats->retries++;
+  }
+
+  if (stats)
+    stats->fallbacks++;
+
+  pthread_mutex_lock(&sync->lock);
+
+  if ((entry = aatree_search(&sync->tree, key, order)))
+  {
+    memcpy(out, entry, sync->entry_size);
+  }
+
+  pthread_mutex_unlock(&sync->lock);
+
+  return entry != NULL;
+} /* aatree_sync_search */
+
+/* In-order scan without the lock. Parent links are not published for the
+ * readers, so the path is kept on a stack. Returns zero if a writer got in
+ * the way, or sets count otherwise. */
+static int scan_lockless(aatree_sync_t *sync,
+                         const void    *key,
+                         uint8_t       *out,
+                         size_t         max,
+                         size_t        *count)
+{
+  const aatree_t *tree = &sync->tree;
+  aatree_node_t  *stack[AATREE_SYNC_MAX_DEPTH];
+  aatree_node_t  *node  = NULL;
+  uint64_t        seq   = __atomic_load_n(&sync->seq, __ATOMIC_ACQUIRE);
+  size_t          n     = 0;
+  int             top   = 0;
+  int             depth = 0;
+
+  if (seq & 1)
+  {
+    return 0;
+  }
+
+  /* Stack the nodes of the search path not less than the key: they are the
+   * successors of the key in order. */
+  for (node = load_link(tree->root); node; depth++)
+  {
+    if (depth == AATREE_SYNC_MAX_DEPTH)
+    {
+      return 0;
+    }
+
+    if (tree->cmp(key, aatree_node_key(tree, node)) <= 0)
+    {
+      stack[top++] = node;
+      node         = load_link(node->left);
+    }
+    else
+    {
+      node = load_link(node->right);
+    }
+  }
+
+  for (; top && n < max; n++)
+  {
+    node = stack[--top];
+
+    memcpy(out + n * sync->entry_size, aatree_node_entry(tree, node),
+           sync->entry_size);
+
+    for (node = load_link(node->right); node; node = load_link(node->left))
+    {
+      if (top == AATREE_SYNC_MAX_DEPTH)
+      {
+        return 0;
+      }
+
+      stack[top++] = node;
+    }
+  }
+
+  if (!read_validate(sync, seq))
+  {
+    return 0;
+  }
+
+  *count = n;
+
+  return 1;
+} /* scan_lockless */
+
+size_t aatree_sync_scan(aatree_sync_t       *sync,
+                        const void          *key,
+                        void                *out,
+                        size_t               max,
+                        aatree_sync_stats_t *stats)
+{
+  aatree_node_t *node  = NULL;
+  size_t         count = 0;
+  int            i;
+
+  if (stats)
+    stats->reads++;
+
+  for (i = 0; i < AATREE_SYNC_RETRIES; i++)
+  {
+    if (scan_lockless(sync, key, out, max, &count))
+    {
+      return count;
+    }
+
+    if (stats)
+      stats->retries++;
+  }
+
+  if (stats)
+    stats->fallbacks++;
+
+  pthread_mutex_lock(&sync->lock);
+
+  node = aatree_entry_node(&sync->tree,
+                           aatree_search(&sync->tree, key, AATREE_KEY_GE));
+
+  for (count = 0; node && count < max; count++)
+  {
+    memcpy((uint8_t *)out + count * sync->entry_size,
+           aatree_node_entry(&sync->tree, node), sync->entry_size);
+
+    node = aatree_next_node(node);
+  }
+
+  pthread_mutex_unlock(&sync->lock);
+
+  return count;
+} /* aatree_sync_scan */
@@ -0,0 +1,119 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AATREE_SYNC_H
+#define AATREE_SYNC_H
+
+#include <pthread.h>
+#include "aatree.h"
+
+/* AA tree with seqlock validated readers.
+ *
+ * A lighter alternative to aatree_rcu.h: there is no reclamation protocol and
+ * readers never write shared memory. Writers bump a version counter around
+ * every update under a mutex; readers descend without locks, copy the result
+ * out and retry if the version has changed in the meantime, falling back to
+ * the lock if writers keep interfering.
+ *
+ * Memory safety comes from a type-stable pool: entries are carved out of a
+ * caller supplied array and only ever recycled within it, so a reader racing
+ * with a writer may read stale data, but never unmapped memory. Keys must be
+ * stored inline in the entry and the comparison function must tolerate
+ * reading a key which is being overwritten, e.g. plain integers.
+ */
+
+/* Lock-free attempts before an operation takes the lock */
+#define AATREE_SYNC_RETRIES 8
+
+/* Bound of a lock-free descent, see AATREE_RCU_MAX_DEPTH */
+#define AATREE_SYNC_MAX_DEPTH 128
+
+/* Reader contention counters, kept by the caller per thread */
+typedef struct aatree_sync_stats
+{
+  uint64_t reads;
+  uint64_t retries;
+  uint64_t fallbacks;
+} aatree_sync_stats_t;
+
+typedef struct aatree_sync
+{
+  aatree_t tree;
+
+  /* Odd while a writer is updating the tree */
+  uint64_t seq;
+
+  pthread_mutex_t lock;
+
+  /* Type-stable pool of entries, free ones linked through node parents */
+  uint8_t       *pool;
+  size_t         entry_size;
+  size_t         capacity;
+  aatree_node_t *free;
+} aatree_sync_t;
+
+/* Init empty tree with the pool of capacity entries of entry_size bytes each.
+ * Returns zero on success or an error number. */
+int aatree_sync_init(aatree_sync_t      *sync,
+                     void               *pool,
+                     size_t              entry_size,
+                     size_t              capacity,
+                     uint16_t            node_offset,
+                     uint16_t            key_offset,
+                     aatree_keys_compare cmp) __nonnull((1, 2, 7));
+
+/* Release the lock. The pool is left to the caller. */
+void aatree_sync_destroy(aatree_sync_t *sync) __nonnull((1));
+
+/* Get an unlinked entry from the pool, or NULL if it is exhausted */
+void *aatree_sync_alloc(aatree_sync_t *sync) __nonnull((1));
+
+/* Return an unlinked entry to the pool */
+void aatree_sync_free(aatree_sync_t *sync, void *entry) __nonnull((1, 2));
+
+/* Try to insert an entry from the pool, or return an existing one. The entry
+ * stays the caller's if it is not inserted. */
+void *aatree_sync_insert(aatree_sync_t *sync, void *entry) __nonnull((1, 2));
+
+/* Delete the entry with the key and return it to the pool. Returns non-zero
+ * if the key was found. */
+int aatree_sync_delete(aatree_sync_t *sync, const void *key) __nonnull((1));
+
+/* Search entry like aatree_search() and copy it out. Returns non-zero if an
+ * entry was found. Stats may be NULL. */
+int aatree_sync_search(aatree_sync_t       *sync,
+                       const void          *key,
+                       aatree_keys_order    order,
+                       void                *out,
+                       aatree_sync_stats_t *stats) __nonnull((1, 4));
+
+/* Copy out up to max consecutive entries starting with the first one whose
+ * key is greater than or equal to the key. Returns the number of entries
+ * copied. The scan is validated as a whole, so keep it short under heavy
+ * writes. Stats may be NULL. */
+size_t aatree_sync_scan(aatree_sync_t       *sync,
+                        const void          *key,
+                        void                *out,
+                        size_t               max,
+                        aatree_sync_stats_t *stats) __nonnull((1, 3));
+
+#endif /* AATREE_SYNC_H */
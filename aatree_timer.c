@@ -0,0 +1,232 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "aatree_timer.h"
+
+#define link_timer(l)                                                          \
+  ((aatree_timer_t *)((uint8_t *)(l) - offsetof(aatree_timer_t, link)))
+
+/* Compare (deadline, seq) keys */
+static int timer_keys_compare(const void *a, const void *b)
+{
+  const struct aatree_timer_key *key_a = a;
+  const struct aatree_timer_key *key_b = b;
+
+  if (key_a->deadline != key_b->deadline)
+    return key_a->deadline < key_b->deadline ? -1 : 1;
+
+  if (key_a->seq != key_b->seq)
+    return key_a->seq < key_b->seq ? -1 : 1;
+
+  return 0;
+} /* timer_keys_compare */
+
+static __inline__ void list_init(aatree_timer_link_t *head)
+{
+  head->prev = head;
+  head->next = head;
+} /* list_init */
+
+static __inline__ int list_empty(const aatree_timer_link_t *head)
+{
+  return head->next == head;
+} /* list_empty */
+
+static __inline__ void list_append(aatree_timer_link_t *head,
+                                   aatree_timer_link_t *link)
+{
+  link->prev       = head->prev;
+  link->next       = head;
+  head->prev->next = link;
+  head->prev       = link;
+} /* list_append */
+
+static __inline__ void list_unlink(aatree_timer_link_t *link)
+{
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link->prev       = NULL;
+  link->next       = NULL;
+} /* list_unlink */
+
+/* Move all links from one list to the tail of another */
+static __inline__ void list_splice(aatree_timer_link_t *to,
+                                   aatree_timer_link_t *from)
+{
+  if (list_empty(from))
+    return;
+
+  from->next->prev = to->prev;
+  to->prev->next   = from->next;
+  from->prev->next = to;
+  to->prev         = from->prev;
+
+  list_init(from);
+} /* list_splice */
+
+void aatree_timers_init(aatree_timers_t *timers,
+                        aatree_clock_fn *clock,
+                        void            *clock_arg,
+                        uint64_t         granularity)
+{
+  aatree_init_tree(&timers->tree, offsetof(aatree_timer_t, node),
+                   offsetof(aatree_timer_t, key), timer_keys_compare);
+
+  list_init(&timers->bucket);
+
+  timers->bucket_end  = 0;
+  timers->granularity = granularity;
+  timers->seq         = 0;
+  timers->count       = 0;
+  timers->clock       = clock;
+  timers->clock_arg   = clock_arg;
+} /* aatree_timers_init */
+
+int aatree_timer_cancel(aatree_timers_t *timers, aatree_timer_t *timer)
+{
+  switch (timer->state)
+  {
+    case AATREE_TIMER_TREE:
+      aatree_delete(&timers->tree, &timer->node);
+      break;
+
+    case AATREE_TIMER_BUCKET:
+    case AATREE_TIMER_READY:
+      list_unlink(&timer->link);
+      break;
+
+    case AATREE_TIMER_IDLE:
+    default:
+      return 0;
+  }
+
+  timer->state = AATREE_TIMER_IDLE;
+  timers->count--;
+
+  return 1;
+} /* aatree_timer_cancel */
+
+void aatree_timer_arm(aatree_timers_t *timers,
+                      aatree_timer_t  *timer,
+                      uint64_t         deadline)
+{
+  aatree_timer_cancel(timers, timer);
+
+  timer->key.deadline = deadline;
+  timer->key.seq      = timers->seq++;
+
+  timers->count++;
+
+  if (timers->granularity)
+  {
+    /* An empty bucket is moved to the slot the clock is in now. */
+    if (list_empty(&timers->bucket))
+    {
+      uint64_t slot = aatree_timers_now(timers) / timers->granularity;
+
+      timers->bucket_end = (slot + 1) * timers->granularity;
+    }
+
+    if (deadline < timers->bucket_end)
+    {
+      list_append(&timers->bucket, &timer->link);
+      timer->state = AATREE_TIMER_BUCKET;
+      return;
+    }
+  }
+
+  /* Sequence numbers make keys unique, so the insert always succeeds. */
+  aatree_insert(&timers->tree, &timer->node);
+  timer->state = AATREE_TIMER_TREE;
+} /* aatree_timer_arm */
+
+void aatree_timer_arm_after(aatree_timers_t *timers,
+                            aatree_timer_t  *timer,
+                            uint64_t         timeout)
+{
+  aatree_timer_arm(timers, timer, aatree_timers_now(timers) + timeout);
+} /* aatree_timer_arm_after */
+
+size_t aatree_timers_expire(aatree_timers_t *timers)
+{
+  aatree_timer_link_t ready;
+  aatree_timer_link_t *link  = NULL;
+  aatree_timer_t      *timer = NULL;
+  uint64_t             now   = aatree_timers_now(timers);
+  size_t               fired = 0;
+
+  list_init(&ready);
+
+  /* Collect the due timers first: the whole bucket once its slot is over,
+   * then the tree in deadline order. */
+  if (!list_empty(&timers->bucket) && now >= timers->bucket_end)
+  {
+    for (link = timers->bucket.next; link != &timers->bucket; link = link->next)
+    {
+      link_timer(link)->state = AATREE_TIMER_READY;
+    }
+
+    list_splice(&ready, &timers->bucket);
+  }
+
+  while ((timer = aatree_first(&timers->tree)) && timer->key.deadline <= now)
+  {
+    aatree_pop_first(&timers->tree);
+    list_append(&ready, &timer->link);
+    timer->state = AATREE_TIMER_READY;
+  }
+
+  /* Callbacks are free to arm or cancel any timer, including the ones still
+   * waiting in the ready list. */
+  while (!list_empty(&ready))
+  {
+    timer = link_timer(ready.next);
+
+    list_unlink(&timer->link);
+    timer->state = AATREE_TIMER_IDLE;
+    timers->count--;
+    fired++;
+
+    timer->fn(timer);
+  }
+
+  return fired;
+} /* aatree_timers_expire */
+
+int aatree_timers_next(const aatree_timers_t *timers, uint64_t *deadline)
+{
+  const aatree_timer_t *timer = aatree_first(&timers->tree);
+  int                   found = 0;
+
+  if (!list_empty(&timers->bucket))
+  {
+    *deadline = timers->bucket_end;
+    found     = 1;
+  }
+
+  if (timer && (!found || timer->key.deadline < *deadline))
+  {
+    *deadline = timer->key.deadline;
+    found     = 1;
+  }
+
+  return found;
+} /* aatree_timers_next */
@@ -0,0 +1,152 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef AATREE_TIMER_H
+#define AATREE_TIMER_H
+
+#include "aatree.h"
+
+/* Timer service built on the AA tree.
+ *
+ * Timers are ordered by (deadline, sequence number), so timers with equal
+ * deadlines fire in the order they were armed. Timers due within the current
+ * granularity slot are kept in an unordered front bucket instead: arming and
+ * cancelling them is O(1), and they all fire once the slot is over, i.e. up to
+ * one granularity late but never early. Time is read from a caller supplied
+ * clock, the unit is up to the caller.
+ *
+ * Like the tree itself, the service performs no memory allocations: the timer
+ * struct is embedded into the caller's object.
+ */
+
+struct aatree_timer;
+
+/* Timer callback, invoked with the timer already disarmed */
+typedef void(aatree_timer_fn)(struct aatree_timer *);
+
+/* Clock source, returns the current time */
+typedef uint64_t(aatree_clock_fn)(void *);
+
+typedef struct aatree_timer_link
+{
+  struct aatree_timer_link *prev;
+  struct aatree_timer_link *next;
+} aatree_timer_link_t;
+
+typedef enum aatree_timer_state_e
+{
+  AATREE_TIMER_IDLE,
+  AATREE_TIMER_TREE,
+  AATREE_TIMER_BUCKET,
+  AATREE_TIMER_READY
+} aatree_timer_state;
+
+/* Timer */
+typedef struct aatree_timer
+{
+  aatree_node_t       node;
+  aatree_timer_link_t link;
+
+  struct aatree_timer_key
+  {
+    uint64_t deadline;
+    uint64_t seq;
+  } key;
+
+  aatree_timer_fn *fn;
+  uint8_t          state;
+} aatree_timer_t;
+
+/* Timer service */
+typedef struct aatree_timers
+{
+  aatree_t tree;
+
+  /* Front bucket: timers with deadlines before bucket_end */
+  aatree_timer_link_t bucket;
+  uint64_t            bucket_end;
+  uint64_t            granularity;
+
+  uint64_t seq;
+  size_t   count;
+
+  aatree_clock_fn *clock;
+  void            *clock_arg;
+} aatree_timers_t;
+
+/* Init timer service. Granularity 0 disables the front bucket. */
+void aatree_timers_init(aatree_timers_t *timers,
+                        aatree_clock_fn *clock,
+                        void            *clock_arg,
+                        uint64_t         granularity) __nonnull((1, 2));
+
+/* Init timer */
+static __inline__ __nonnull((1)) void aatree_timer_init(aatree_timer_t  *timer,
+                                                        aatree_timer_fn *fn)
+{
+  aatree_init_node(&timer->node);
+
+  timer->link.prev    = NULL;
+  timer->link.next    = NULL;
+  timer->key.deadline = 0;
+  timer->key.seq      = 0;
+  timer->fn           = fn;
+  timer->state        = AATREE_TIMER_IDLE;
+} /* aatree_timer_init */
+
+/* Check whether the timer is armed */
+static __inline__ __nonnull((1)) int
+aatree_timer_pending(const aatree_timer_t *timer)
+{
+  return timer->state != AATREE_TIMER_IDLE;
+} /* aatree_timer_pending */
+
+/* Read the service clock */
+static __inline__ __nonnull((1)) uint64_t
+aatree_timers_now(const aatree_timers_t *timers)
+{
+  return timers->clock(timers->clock_arg);
+} /* aatree_timers_now */
+
+/* Arm (or re-arm) timer to fire at the absolute deadline */
+void aatree_timer_arm(aatree_timers_t *timers,
+                      aatree_timer_t  *timer,
+                      uint64_t         deadline) __nonnull((1, 2));
+
+/* Arm (or re-arm) timer to fire after the timeout from now */
+void aatree_timer_arm_after(aatree_timers_t *timers,
+                            aatree_timer_t  *timer,
+                            uint64_t         timeout) __nonnull((1, 2));
+
+/* Disarm timer. Returns non-zero if the timer was pending. */
+int aatree_timer_cancel(aatree_timers_t *timers, aatree_timer_t *timer)
+    __nonnull((1, 2));
+
+/* Fire all due timers. Due timers are collected first, so timers armed from a
+ * callback fire on a later call even if already due. Returns number of timers
+ * fired. */
+size_t aatree_timers_expire(aatree_timers_t *timers) __nonnull((1));
+
+/* Get the time the next timer is due. Returns zero if no timer is armed. */
+int aatree_timers_next(const aatree_timers_t *timers, uint64_t *deadline)
+    __nonnull((1, 2));
+
+#endif /* AATREE_TIMER_H */
@@ -0,0 +1,425 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "aatree_io.h"
+#include "aatree_wal.h"
+
+/* Size of a record of size bytes of data */
+static __inline__ size_t record_size(size_t size)
+{
+  return AATREE_WAL_HEADER
+         + (size + AATREE_WAL_HEADER - 1) / AATREE_WAL_HEADER
+               * AATREE_WAL_HEADER;
+} /* record_size */
+
+/* Checksum of the operation, the padding and the data of a record */
+static __inline__ uint32_t record_crc(const uint8_t *record, size_t size)
+{
+  return aatree_io_crc32(0, record + 4, AATREE_WAL_HEADER - 4 + size);
+} /* record_crc */
+
+int aatree_wal_init(aatree_wal_t *wal,
+                    int           fd,
+                    void         *buffer,
+                    size_t        size,
+                    size_t        entry_size,
+                    size_t        key_size,
+                    unsigned      delay,
+                    size_t        batch)
+{
+  int error = 0;
+
+  memset(wal, 0, sizeof(*wal));
+
+  wal->fd         = fd;
+  wal->buffer     = buffer;
+  wal->size       = size;
+  wal->delay      = delay;
+  wal->batch      = batch;
+  wal->entry_size = entry_size;
+  wal->key_size   = key_size;
+
+  if ((error = pthread_mutex_init(&wal->lock, NULL)))
+  {
+    return error;
+  }
+
+  if ((error = pthread_cond_init(&wal->flushed, NULL)))
+  {
+    pthread_mutex_destroy(&wal->lock);
+    return error;
+  }
+
+  if ((error = pthread_cond_init(&wal->filled, NULL)))
+  {
+    pthread_cond_destroy(&wal->flushed);
+    pthread_mutex_destroy(&wal->lock);
+    return error;
+  }
+
+  return 0;
+} /* aatree_wal_init */
+
+void aatree_wal_destroy(aatree_wal_t *wal)
+{
+  pthread_cond_destroy(&wal->filled);
+  pthread_cond_destroy(&wal->flushed);
+  pthread_mutex_destroy(&wal->lock);
+} /* aatree_wal_destroy */
+
+/* Write all of the data, retrying short writes */
+static int write_all(int fd, const uint8_t *data, size_t size)
+{
+  while (size)
+  {
+    ssize_t n = write(fd, data, size);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return errno;
+    }
+
+    data += n;
+    size -= n;
+  }
+
+  return 0;
+} /* write_all */
+
+/* Write out and sync the active half as the leader, the lock must be held
+ * and is dropped while the file is being written. With wait set, the leader
+ * first gives the other writers the delay to fill the batch. */
+static void flush(aatree_wal_t *wal, int wait)
+{
+  uint8_t *data  = NULL;
+  size_t   size  = 0;
+  uint64_t end   = 0;
+  int      error = 0;
+
+  wal->flushing = 1;
+
+  if (wait && wal->delay && wal->used < wal->batch)
+  {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)(wal->delay % 1000000) * 1000;
+    deadline.tv_sec  += wal->delay / 1000000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    while (wal->used < wal->batch
+           && pthread_cond_timedwait(&wal->filled, &wal->lock, &deadline)
+                  != ETIMEDOUT)
+    {
+    }
+  }
+
+  data = wal->buffer + wal->active * wal->size;
+  size = wal->used;
+  end  = wal->appended;
+
+  wal->active ^= 1;
+  wal->used    = 0;
+
+  pthread_mutex_unlock(&wal->lock);
+
+  if (!(error = write_all(wal->fd, data, size)) && fdatasync(wal->fd))
+  {
+    error = errno;
+  }
+
+  pthread_mutex_lock(&wal->lock);
+
+  if (error && !wal->error)
+    wal->error = error;
+  else if (!error)
+    wal->durable = end;
+
+  wal->syncs++;
+  wal->flushing = 0;
+
+  pthread_cond_broadcast(&wal->flushed);
+} /* flush */
+
+/* Append a record of the operation and the data */
+static int append(aatree_wal_t *wal,
+                  int           op,
+                  const void   *data,
+                  size_t        size,
+                  uint64_t     *lsn)
+{
+  uint8_t *record = NULL;
+  uint32_t crc    = 0;
+  int      error  = 0;
+
+  if (record_size(size) > wal->size)
+  {
+    return EMSGSIZE;
+  }
+
+  pthread_mutex_lock(&wal->lock);
+
+  /* A full half waits for the leader to be done with the other one. */
+  while (!wal->error && wal->used + record_size(size) > wal->size)
+  {
+    if (wal->flushing)
+      pthread_cond_wait(&wal->flushed, &wal->lock);
+    else
+      flush(wal, 0);
+  }
+
+  if (!(error = wal->error))
+  {
+    record = wal->buffer + wal->active * wal->size + wal->used;
+
+    memset(record, 0, record_size(size));
+    record[4] = (uint8_t)op;
+    memcpy(record + AATREE_WAL_HEADER, data, size);
+
+    crc       = record_crc(record, size);
+    record[0] = (uint8_t)crc;
+    record[1] = (uint8_t)(crc >> 8);
+    record[2] = (uint8_t)(crc >> 16);
+    record[3] = (uint8_t)(crc >> 24);
+
+    wal->used     += record_size(size);
+    wal->appended += record_size(size);
+    *lsn           = wal->appended;
+
+    if (wal->used >= wal->batch)
+    {
+      pthread_cond_signal(&wal->filled);
+    }
+  }
+
+  pthread_mutex_unlock(&wal->lock);
+
+  return error;
+} /* append */
+
+int aatree_wal_insert(aatree_wal_t *wal, const void *entry, uint64_t *lsn)
+{
+  return append(wal, AATREE_WAL_INSERT, entry, wal->entry_size, lsn);
+} /* aatree_wal_insert */
+
+int aatree_wal_delete(aatree_wal_t *wal, const void *key, uint64_t *lsn)
+{
+  return append(wal, AATREE_WAL_DELETE, key, wal->key_size, lsn);
+} /* aatree_wal_delete */
+
+int aatree_wal_commit(aatree_wal_t *wal, uint64_t lsn)
+{
+  int error = 0;
+
+  pthread_mutex_lock(&wal->lock);
+
+  wal->commits++;
+
+  while (wal->durable < lsn && !wal->error)
+  {
+    if (wal->flushing)
+      pthread_cond_wait(&wal->flushed, &wal->lock);
+    else
+      flush(wal, 1);
+  }
+
+  error = wal->error;
+
+  pthread_mutex_unlock(&wal->lock);
+
+  return error;
+} /* aatree_wal_commit */
+
+int aatree_wal_reset(aatree_wal_t *wal)
+{
+  int error = 0;
+
+  pthread_mutex_lock(&wal->lock);
+
+  while (wal->flushing)
+  {
+    pthread_cond_wait(&wal->flushed, &wal->lock);
+  }
+
+  if (!(error = wal->error)
+      && (ftruncate(wal->fd, 0) || lseek(wal->fd, 0, SEEK_SET)
+          || fdatasync(wal->fd)))
+  {
+    error = errno;
+  }
+
+  /* Records appended but not committed go with the log, the snapshot covers
+   * them as well, so their LSNs count as durable. */
+  wal->used    = 0;
+  wal->durable = wal->appended;
+
+  pthread_mutex_unlock(&wal->lock);
+
+  return error;
+} /* aatree_wal_reset */
+
+/* Apply a record, hint is the node of the previous insert */
+static int apply(aatree_t            *tree,
+                 int                  op,
+                 const uint8_t       *data,
+                 size_t               entry_size,
+                 aatree_wal_alloc_fn *alloc,
+                 aatree_wal_free_fn  *release,
+                 void                *arg,
+                 aatree_node_t      **hint)
+{
+  void          *entry = NULL;
+  aatree_node_t *node  = NULL;
+
+  if (op == AATREE_WAL_DELETE)
+  {
+    *hint = NULL;
+
+    if ((entry = aatree_search(tree, data, AATREE_KEY_EQ)))
+    {
+      aatree_delete(tree, aatree_entry_node(tree, entry));
+      release(entry, arg);
+    }
+
+    return 0;
+  }
+
+  if (!(entry = alloc(arg)))
+  {
+    return ENOMEM;
+  }
+
+  memcpy(entry, data, entry_size);
+  node = aatree_entry_node(tree, entry);
+  aatree_init_node(node);
+
+  if (aatree_insert_hint(tree, node, *hint))
+  {
+    release(entry, arg);
+    return 0;
+  }
+
+  *hint = node;
+
+  return 0;
+} /* apply */
+
+int aatree_wal_replay(aatree_t            *tree,
+                      int                  fd,
+                      size_t               entry_size,
+                      size_t               key_size,
+                      aatree_wal_alloc_fn *alloc,
+                      aatree_wal_free_fn  *release,
+                      void                *arg,
+                      void                *buffer,
+                      size_t               size,
+                      uint64_t            *end)
+{
+  uint8_t       *data  = buffer;
+  aatree_node_t *hint  = NULL;
+  size_t         used  = 0;
+  size_t         pos   = 0;
+  int            eof   = 0;
+  int            error = 0;
+
+  *end = 0;
+
+  if (size < record_size(entry_size) + record_size(key_size))
+  {
+    return EINVAL;
+  }
+
+  if (lseek(fd, 0, SEEK_SET))
+  {
+    return errno;
+  }
+
+  for (;;)
+  {
+    size_t   length = 0;
+    uint32_t crc    = 0;
+    int      op     = 0;
+
+    /* Keep the buffer full, the records are no larger than the entries. */
+    if (!eof && used - pos < record_size(entry_size) + record_size(key_size))
+    {
+      ssize_t n = 0;
+
+      memmove(data, data + pos, used - pos);
+      used -= pos;
+      pos   = 0;
+
+      if ((n = read(fd, data + used, size - used)) < 0)
+      {
+        if (errno == EINTR)
+          continue;
+
+        return errno;
+      }
+
+      eof   = !n;
+      used += n;
+      continue;
+    }
+
+    if (used - pos < AATREE_WAL_HEADER)
+    {
+      return 0;
+    }
+
+    op = data[pos + 4];
+
+    if (op == AATREE_WAL_INSERT)
+      length = entry_size;
+    else if (op == AATREE_WAL_DELETE)
+      length = key_size;
+    else
+      return 0;
+
+    crc = data[pos] | (uint32_t)data[pos + 1] << 8
+          | (uint32_t)data[pos + 2] << 16 | (uint32_t)data[pos + 3] << 24;
+
+    if (used - pos < record_size(length)
+        || record_crc(data + pos, length) != crc)
+    {
+      return 0;
+    }
+
+    if ((error = apply(tree, op, data + pos + AATREE_WAL_HEADER, entry_size,
+                       alloc, release, arg, &hint)))
+    {
+      return error;
+    }
+
+    pos  += record_size(length);
+    *end += record_size(length);
+  }
+} /* aatree_wal_replay */
@@ -0,0 +1,152 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#ifndef AATREE_WAL_H
+#define AATREE_WAL_H
+
+#include <pthread.h>
+#include "aatree.h"
+
+/* Write-ahead log of a tree of fixed size entries.
+ *
+ * Every insert and delete is recorded before it is acknowledged: the record
+ * is appended to a memory buffer and stamped with its log sequence number,
+ * the end of the log right after it, and a commit waits for that LSN to get
+ * to the disk. Commits are grouped: the first waiter becomes the leader, it
+ * waits up to delay microseconds for the others unless batch bytes are
+ * already there, then swaps the double buffer, writes out and syncs the full
+ * half while the records go on to the other one, and wakes everyone covered.
+ * A zero delay syncs as soon as possible, still picking up all the records
+ * appended by the time the leader gets to it.
+ *
+ * A record is a CRC-32 of the rest, the operation and the data: the entry,
+ * copied as plain bytes, or the key. After a crash the log is replayed on top
+ * of the latest snapshot, up to the first torn or corrupted record.
+ */
+
+/* Recorded operations */
+#define AATREE_WAL_INSERT 1
+#define AATREE_WAL_DELETE 2
+
+/* Size of the framing of a record, records are padded to its multiple to
+ * keep the entries aligned in the buffers */
+#define AATREE_WAL_HEADER 8
+
+typedef struct aatree_wal
+{
+  pthread_mutex_t lock;
+
+  /* Signaled when the durable LSN moves, and when a batch fills up */
+  pthread_cond_t flushed;
+  pthread_cond_t filled;
+
+  int fd;
+
+  /* Halves of the buffer, records go to the active one */
+  uint8_t *buffer;
+  size_t   size;
+  size_t   used;
+  int      active;
+
+  /* End of the log appended and synced, a leader is at work */
+  uint64_t appended;
+  uint64_t durable;
+  int      flushing;
+
+  /* First write error, the log is unusable after it */
+  int error;
+
+  /* Group commit window */
+  unsigned delay;
+  size_t   batch;
+
+  size_t entry_size;
+  size_t key_size;
+
+  /* Commits waited for and syncs made */
+  uint64_t commits;
+  uint64_t syncs;
+} aatree_wal_t;
+
+/* Memory of a replayed entry, or NULL */
+typedef void *(aatree_wal_alloc_fn)(void *arg);
+
+/* Release an entry deleted or found to be a duplicate by the replay */
+typedef void(aatree_wal_free_fn)(void *entry, void *arg);
+
+/* Init the log appending to the file open for writing, with the buffer of
+ * twice size bytes for the two halves, aligned for the entries. Commits wait
+ * up to delay microseconds for batch bytes of records. Returns zero or an
+ * errno value. */
+int aatree_wal_init(aatree_wal_t *wal,
+                    int           fd,
+                    void         *buffer,
+                    size_t        size,
+                    size_t        entry_size,
+                    size_t        key_size,
+                    unsigned      delay,
+                    size_t        batch) __nonnull((1, 3));
+
+/* Release the locks, records not committed are not written */
+void aatree_wal_destroy(aatree_wal_t *wal) __nonnull((1));
+
+/* Record an insert of the entry or a delete of the key. The LSN to commit is
+ * stored in lsn. Returns zero, EMSGSIZE if a record does not fit into a
+ * half of the buffer, or the write error of the log. */
+int aatree_wal_insert(aatree_wal_t *wal, const void *entry, uint64_t *lsn)
+    __nonnull((1, 2, 3));
+
+int aatree_wal_delete(aatree_wal_t *wal, const void *key, uint64_t *lsn)
+    __nonnull((1, 2, 3));
+
+/* Wait until the log is on disk up to the LSN. Returns zero or the write
+ * error of the log. */
+int aatree_wal_commit(aatree_wal_t *wal, uint64_t lsn) __nonnull((1));
+
+/* Empty the log once a snapshot covers all of it. Records not committed yet
+ * are dropped and a later commit of their LSNs returns at once. Returns zero
+ * or an errno value. */
+int aatree_wal_reset(aatree_wal_t *wal) __nonnull((1));
+
+/* Apply the log in the file to the tree, taking memory of the inserted
+ * entries from alloc and reading through the buffer of size bytes. Runs of
+ * ascending inserts go through aatree_insert_hint(), each one after the
+ * previous. The log may overlap the snapshot: an insert of an existing key or
+ * a delete of a missing one is skipped. The replay stops at a torn or
+ * corrupted record and stores the length of the valid log in end, where the
+ * file is to be truncated. The buffer must be aligned for the entries and
+ * hold at least a record of each kind. Returns zero, EINVAL if it does not,
+ * ENOMEM if alloc fails, or the read error. */
+int aatree_wal_replay(aatree_t            *tree,
+                      int                  fd,
+                      size_t               entry_size,
+                      size_t               key_size,
+                      aatree_wal_alloc_fn *alloc,
+                      aatree_wal_free_fn  *release,
+                      void                *arg,
+                      void                *buffer,
+                      size_t               size,
+                      uint64_t            *end)
+    __nonnull((1, 5, 6, 8, 10));
+
+#endif /* AATREE_WAL_H */
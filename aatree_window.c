@@ -0,0 +1,232 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "aatree_window.h"
+
+#define window_node(n) ((aatree_window_node_t *)(n))
+
+static int values_compare(const void *a, const void *b)
+{
+  double value_a = *(const double *)a;
+  double value_b = *(const double *)b;
+
+  return (value_a > value_b) - (value_a < value_b);
+} /* values_compare */
+
+/* Samples in a subtree */
+static __inline__ uint64_t subtree_count(const aatree_node_t *node)
+{
+  return node ? window_node(node)->count : 0;
+} /* subtree_count */
+
+static void update_count(const aatree_t *tree, aatree_node_t *node)
+{
+  (void)tree;
+
+  window_node(node)->count = window_node(node)->mult
+                             + subtree_count(node->left)
+                             + subtree_count(node->right);
+} /* update_count */
+
+void aatree_window_init(aatree_window_t      *win,
+                        double               *samples,
+                        aatree_window_node_t *nodes,
+                        size_t                capacity)
+{
+  size_t i;
+
+  aatree_init_tree(&win->tree, offsetof(aatree_window_node_t, node),
+                   offsetof(aatree_window_node_t, value), values_compare);
+  aatree_augment(&win->tree, update_count);
+
+  win->samples  = samples;
+  win->capacity = capacity;
+  win->head     = 0;
+  win->size     = 0;
+  win->free     = NULL;
+
+  for (i = capacity; i > 0; i--)
+  {
+    aatree_init_node(&nodes[i - 1].node);
+    nodes[i - 1].node.right = win->free ? &win->free->node : NULL;
+    win->free               = &nodes[i - 1];
+  }
+} /* aatree_window_init */
+
+/* Add one sample of the value to the tree */
+static void add_value(aatree_window_t *win, double value)
+{
+  aatree_window_node_t *node = win->free;
+  aatree_window_node_t *dup  = NULL;
+
+  win->free = window_node(node->node.right);
+
+  aatree_init_node(&node->node);
+  node->value = value;
+  node->mult  = 1;
+
+  if ((dup = aatree_insert(&win->tree, &node->node)))
+  {
+    /* The value is already there: count it and give the node back. */
+    dup->mult++;
+    aatree_refresh(&win->tree, &dup->node);
+
+    aatree_init_node(&node->node);
+    node->node.right = win->free ? &win->free->node : NULL;
+    win->free        = node;
+  }
+} /* add_value */
+
+/* Remove one sample of the value from the tree */
+static void remove_value(aatree_window_t *win, double value)
+{
+  aatree_window_node_t *node = aatree_search(&win->tree, &value, AATREE_KEY_EQ);
+
+  if (--node->mult)
+  {
+    aatree_refresh(&win->tree, &node->node);
+  }
+  else
+  {
+    aatree_delete(&win->tree, &node->node);
+
+    node->node.right = win->free ? &win->free->node : NULL;
+    win->free        = node;
+  }
+} /* remove_value */
+
+void aatree_window_push(aatree_window_t *win, double value)
+{
+  size_t tail;
+
+  if (win->size == win->capacity)
+  {
+    double oldest = win->samples[win->head];
+
+    win->head = (win->head + 1) % win->capacity;
+    win->size--;
+
+    /* Replacing a sample with an equal one leaves the tree as it is. */
+    if (values_compare(&oldest, &value) != 0)
+    {
+      remove_value(win, oldest);
+      add_value(win, value);
+    }
+  }
+  else
+  {
+    add_value(win, value);
+  }
+
+  tail               = (win->head + win->size) % win->capacity;
+  win->samples[tail] = value;
+  win->size++;
+} /* aatree_window_push */
+
+void aatree_window_advance(aatree_window_t *win,
+                           const double    *values,
+                           size_t           k)
+{
+  size_t i;
+
+  /* Samples which would be expired within the same batch never need to
+   * enter the tree. */
+  if (k > win->capacity)
+  {
+    aatree_window_expire(win, win->size);
+    values += k - win->capacity;
+    k = win->capacity;
+  }
+
+  for (i = 0; i < k; i++)
+  {
+    aatree_window_push(win, values[i]);
+  }
+} /* aatree_window_advance */
+
+size_t aatree_window_expire(aatree_window_t *win, size_t k)
+{
+  size_t i;
+
+  if (k > win->size)
+    k = win->size;
+
+  for (i = 0; i < k; i++)
+  {
+    remove_value(win, win->samples[win->head]);
+
+    win->head = (win->head + 1) % win->capacity;
+    win->size--;
+  }
+
+  return k;
+} /* aatree_window_expire */
+
+double aatree_window_rank(const aatree_window_t *win, uint64_t rank)
+{
+  aatree_node_t *node = win->tree.root;
+
+  while (node)
+  {
+    uint64_t left = subtree_count(node->left);
+
+    if (rank < left)
+    {
+      node = node->left;
+    }
+    else if (rank < left + window_node(node)->mult)
+    {
+      break;
+    }
+    else
+    {
+      rank -= left + window_node(node)->mult;
+      node = node->right;
+    }
+  }
+
+  return node ? window_node(node)->value : 0.0;
+} /* aatree_window_rank */
+
+double aatree_window_quantile(const aatree_window_t *win, double q)
+{
+  double   pos, lo_value, hi_value;
+  uint64_t lo;
+
+  if (!win->size)
+    return 0.0;
+
+  if (q < 0.0)
+    q = 0.0;
+  else if (q > 1.0)
+    q = 1.0;
+
+  pos      = q * (double)(win->size - 1);
+  lo       = (uint64_t)pos;
+  lo_value = aatree_window_rank(win, lo);
+
+  if (lo + 1 >= win->size || pos == (double)lo)
+    return lo_value;
+
+  hi_value = aatree_window_rank(win, lo + 1);
+
+  return lo_value + (pos - (double)lo) * (hi_value - lo_value);
+} /* aatree_window_quantile */
@@ -0,0 +1,101 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef AATREE_WINDOW_H
+#define AATREE_WINDOW_H
+
+#include "aatree.h"
+
+/* Sliding window quantiles.
+ *
+ * Samples are kept in a ring buffer in arrival order and indexed by an order
+ * statistics tree: an AA tree augmented with subtree sample counts. Equal
+ * values share one node with a multiplicity, so any quantile is found in
+ * O(log n) by a single descent. The values must not be NaN.
+ *
+ * Both the ring buffer and the nodes are supplied by the caller, one node per
+ * sample of capacity.
+ */
+
+/* Distinct value of the window */
+typedef struct aatree_window_node
+{
+  aatree_node_t node;
+  double        value;
+
+  /* samples with this value */
+  uint64_t mult;
+
+  /* samples in the subtree */
+  uint64_t count;
+} aatree_window_node_t;
+
+/* Sliding window */
+typedef struct aatree_window
+{
+  aatree_t tree;
+
+  /* Ring buffer of samples, oldest first */
+  double *samples;
+  size_t  capacity;
+  size_t  head;
+  size_t  size;
+
+  /* Unused nodes, linked through the right pointers */
+  aatree_window_node_t *free;
+} aatree_window_t;
+
+/* Init window of capacity samples with the ring buffer and nodes arrays of
+ * capacity elements each */
+void aatree_window_init(aatree_window_t      *win,
+                        double               *samples,
+                        aatree_window_node_t *nodes,
+                        size_t                capacity) __nonnull((1, 2, 3));
+
+/* Number of samples in the window */
+static __inline__ __nonnull((1)) size_t
+aatree_window_size(const aatree_window_t *win)
+{
+  return win->size;
+} /* aatree_window_size */
+
+/* Add sample to the window, expiring the oldest one if the window is full */
+void aatree_window_push(aatree_window_t *win, double value) __nonnull((1));
+
+/* Advance window by k samples */
+void aatree_window_advance(aatree_window_t *win,
+                           const double    *values,
+                           size_t           k) __nonnull((1, 2));
+
+/* Expire k oldest samples. Returns number of samples expired. */
+size_t aatree_window_expire(aatree_window_t *win, size_t k) __nonnull((1));
+
+/* Get k-th smallest sample, counting from zero. The rank must be less than the
+ * window size. */
+double aatree_window_rank(const aatree_window_t *win, uint64_t rank)
+    __nonnull((1));
+
+/* Get q-quantile (0 <= q <= 1) of a non-empty window, linearly interpolated
+ * between the closest ranks */
+double aatree_window_quantile(const aatree_window_t *win, double q)
+    __nonnull((1));
+
+#endif /* AATREE_WINDOW_H */
@@ -0,0 +1,189 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/* Bulk loading benchmark: insert loop, sorted loaders and parallel build.
+ *
+ * Usage: aatree-bench-build [entries] [threads]
+ *
+ * The same entries are loaded by aatree_insert() in random order, by
+ * aatree_build_sorted() and aatree_build_sorted_parallel() from a sorted
+ * array, and by aatree_build_parallel() from a shuffled one, which includes
+ * the sort, and by aatree_append() in order, the way a snapshot is loaded.
+ * Every tree is verified.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "aatree_parallel.h"
+
+typedef struct item
+{
+  aatree_node_t node;
+  uint64_t      key;
+} item_t;
+
+static uint64_t rng(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+  uint64_t key_a = *(const uint64_t *)a;
+  uint64_t key_b = *(const uint64_t *)b;
+
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+static void reset(aatree_t *tree, item_t *items, size_t n)
+{
+  size_t i;
+
+  aatree_init_tree(tree, offsetof(item_t, node), offsetof(item_t, key),
+                   cmp_keys);
+
+  for (i = 0; i < n; i++)
+  {
+    aatree_init_node(&items[i].node);
+  }
+}
+
+static void report(const char *name, double elapsed, size_t n)
+{
+  printf("%-22s %8.3f s %8.2f M entries/s\n", name, elapsed,
+         n / elapsed * 1e-6);
+}
+
+int main(int argc, char **argv)
+{
+  size_t          n       = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  unsigned        threads = argc > 2 ? (unsigned)atoi(argv[2]) : 4;
+  item_t         *items   = malloc(n * sizeof(*items));
+  aatree_node_t **nodes   = malloc(n * sizeof(*nodes));
+  aatree_node_t **scratch = malloc(n * sizeof(*scratch));
+  uint64_t        state   = 0x9e3779b97f4a7c15ULL;
+  aatree_t        tree;
+  double          start;
+  size_t          linked  = 0;
+  size_t          i;
+
+  for (i = 0; i < n; i++)
+  {
+    items[i].key = i * 2;
+  }
+
+  /* Random order insertion */
+  reset(&tree, items, n);
+
+  for (i = 0; i < n; i++)
+  {
+    nodes[i] = &items[i].node;
+  }
+
+  for (i = n; i > 1; i--)
+  {
+    size_t         j = rng(&state) % i;
+    aatree_node_t *t = nodes[i - 1];
+
+    nodes[i - 1] = nodes[j];
+    nodes[j]     = t;
+  }
+
+  start = now();
+
+  for (i = 0; i < n; i++)
+  {
+    aatree_insert(&tree, nodes[i]);
+  }
+
+  report("insert", now() - start, n);
+  aatree_verify(&tree);
+
+  /* The shuffled array again, sorted along the way */
+  reset(&tree, items, n);
+  start = now();
+
+  if (aatree_build_parallel(&tree, nodes, scratch, n, threads, &linked)
+      || linked != n)
+  {
+    fprintf(stderr, "build_parallel: duplicate keys\n");
+    return EXIT_FAILURE;
+  }
+
+  report("build_parallel", now() - start, n);
+  aatree_verify(&tree);
+
+  /* Sorted array */
+  reset(&tree, items, n);
+  start = now();
+
+  if (aatree_build_sorted(&tree, nodes, n))
+  {
+    fprintf(stderr, "build_sorted: keys out of order\n");
+    return EXIT_FAILURE;
+  }
+
+  report("build_sorted", now() - start, n);
+  aatree_verify(&tree);
+
+  reset(&tree, items, n);
+  start = now();
+
+  if (aatree_build_sorted_parallel(&tree, nodes, n, threads))
+  {
+    fprintf(stderr, "build_sorted_parallel: keys out of order\n");
+    return EXIT_FAILURE;
+  }
+
+  report("build_sorted_parallel", now() - start, n);
+  aatree_verify(&tree);
+
+  reset(&tree, items, n);
+  start = now();
+
+  for (i = 0; i < n; i++)
+  {
+    aatree_append(&tree, nodes[i]);
+  }
+
+  report("append", now() - start, n);
+  aatree_verify(&tree);
+
+  free(scratch);
+  free(nodes);
+  free(items);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,273 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/* Contended tree benchmark: flat combining against a mutex and a rwlock.
+ *
+ * Usage: aatree-bench-fc [max threads] [operations per thread] [search %]
+ *
+ * All threads hammer one tree with inserts and deletes of their own keys
+ * mixed with searches of random ones. The run is repeated for 1, 2, 4 ...
+ * max threads, reporting the aggregate operation rate.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "aatree_fc.h"
+
+#define KEYS_PER_THREAD 1024
+
+enum
+{
+  MODE_FC,
+  MODE_MUTEX,
+  MODE_RWLOCK
+};
+
+typedef struct item
+{
+  aatree_node_t node;
+  uint64_t      key;
+  int           linked;
+} item_t;
+
+typedef struct bench
+{
+  int              mode;
+  aatree_fc_t      fc;
+  pthread_mutex_t  mutex;
+  pthread_rwlock_t rwlock;
+  uint64_t         keys;
+  size_t           ops;
+  unsigned         search;
+} bench_t;
+
+typedef struct worker
+{
+  bench_t  *bench;
+  pthread_t tid;
+  item_t   *items;
+  uint64_t  rng;
+} worker_t;
+
+static uint64_t rng(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+  uint64_t key_a = *(const uint64_t *)a;
+  uint64_t key_b = *(const uint64_t *)b;
+
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+static void lock(bench_t *bench, int write)
+{
+  if (bench->mode == MODE_MUTEX)
+    pthread_mutex_lock(&bench->mutex);
+  else if (write)
+    pthread_rwlock_wrlock(&bench->rwlock);
+  else
+    pthread_rwlock_rdlock(&bench->rwlock);
+}
+
+static void unlock(bench_t *bench)
+{
+  if (bench->mode == MODE_MUTEX)
+    pthread_mutex_unlock(&bench->mutex);
+  else
+    pthread_rwlock_unlock(&bench->rwlock);
+}
+
+static void *worker(void *arg)
+{
+  worker_t        *self  = arg;
+  bench_t         *bench = self->bench;
+  aatree_t        *tree  = &bench->fc.tree;
+  aatree_fc_slot_t slot;
+  size_t           i;
+
+  if (bench->mode == MODE_FC)
+    aatree_fc_register(&bench->fc, &slot);
+
+  for (i = 0; i < bench->ops; i++)
+  {
+    uint64_t r = rng(&self->rng);
+
+    if (r % 100 < bench->search)
+    {
+      uint64_t key = r % bench->keys;
+
+      if (bench->mode == MODE_FC)
+      {
+        aatree_fc_search(&bench->fc, &slot, &key, AATREE_KEY_GE);
+      }
+      else
+      {
+        lock(bench, 0);
+        aatree_search(tree, &key, AATREE_KEY_GE);
+        unlock(bench);
+      }
+    }
+    else
+    {
+      item_t *item = &self->items[(r >> 8) % KEYS_PER_THREAD];
+
+      if (item->linked)
+      {
+        if (bench->mode == MODE_FC)
+        {
+          aatree_fc_delete(&bench->fc, &slot, &item->node);
+        }
+        else
+        {
+          lock(bench, 1);
+          aatree_delete(tree, &item->node);
+          unlock(bench);
+        }
+      }
+      else
+      {
+        aatree_init_node(&item->node);
+
+        if (bench->mode == MODE_FC)
+        {
+          aatree_fc_insert(&bench->fc, &slot, &item->node);
+        }
+        else
+        {
+          lock(bench, 1);
+          aatree_insert(tree, &item->node);
+          unlock(bench);
+        }
+      }
+
+      item->linked = !item->linked;
+    }
+  }
+
+  if (bench->mode == MODE_FC)
+    aatree_fc_unregister(&bench->fc, &slot);
+
+  return NULL;
+}
+
+static void run(bench_t *bench, int threads)
+{
+  static const char *names[] = {"fc", "mutex", "rwlock"};
+  worker_t          *workers = calloc(threads, sizeof(*workers));
+  double             start, elapsed;
+  int                t, i;
+
+  /* The tree of the combiner is shared by the lock based modes. */
+  aatree_fc_init(&bench->fc, offsetof(item_t, node), offsetof(item_t, key),
+                 cmp_keys);
+  pthread_mutex_init(&bench->mutex, NULL);
+  pthread_rwlock_init(&bench->rwlock, NULL);
+
+  bench->keys = (uint64_t)threads * KEYS_PER_THREAD;
+
+  for (t = 0; t < threads; t++)
+  {
+    workers[t].bench = bench;
+    workers[t].rng   = 0x9e3779b97f4a7c15ULL * (t + 1);
+    workers[t].items = calloc(KEYS_PER_THREAD, sizeof(item_t));
+
+    /* Keys of the threads are interleaved over the whole key space. */
+    for (i = 0; i < KEYS_PER_THREAD; i++)
+    {
+      workers[t].items[i].key = (uint64_t)i * threads + t;
+    }
+  }
+
+  start = now();
+
+  for (t = 0; t < threads; t++)
+  {
+    pthread_create(&workers[t].tid, NULL, worker, &workers[t]);
+  }
+
+  for (t = 0; t < threads; t++)
+  {
+    pthread_join(workers[t].tid, NULL);
+  }
+
+  elapsed = now() - start;
+
+  printf("%-6s threads %2d: %8.2f Mops/s", names[bench->mode], threads,
+         threads * bench->ops / elapsed * 1e-6);
+
+  if (bench->mode == MODE_FC)
+  {
+    printf(", %.1f requests per pass",
+           bench->fc.passes ? (double)bench->fc.combined / bench->fc.passes
+                            : 0.0);
+  }
+
+  printf("\n");
+
+  for (t = 0; t < threads; t++)
+  {
+    free(workers[t].items);
+  }
+
+  aatree_fc_destroy(&bench->fc);
+  pthread_mutex_destroy(&bench->mutex);
+  pthread_rwlock_destroy(&bench->rwlock);
+  free(workers);
+}
+
+int main(int argc, char **argv)
+{
+  int     threads = argc > 1 ? atoi(argv[1]) : 64;
+  bench_t bench;
+  int     t;
+
+  bench.ops    = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+  bench.search = argc > 3 ? (unsigned)atoi(argv[3]) : 50;
+
+  for (t = 1; t <= threads; t *= 2)
+  {
+    for (bench.mode = MODE_FC; bench.mode <= MODE_RWLOCK; bench.mode++)
+    {
+      run(&bench, t);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
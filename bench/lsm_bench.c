@@ -0,0 +1,137 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/* Ingestion benchmark: plain inserts against a write buffer.
+ *
+ * Usage: aatree-bench-lsm [entries] [buffer]
+ *
+ * The same random keys are loaded by aatree_insert() and through a write
+ * buffer of the given capacity, merged into the tree in sorted batches.
+ * Both trees are verified.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "aatree_lsm.h"
+
+typedef struct item
+{
+  aatree_lsm_node_t node;
+  uint64_t          key;
+} item_t;
+
+static uint64_t rng(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+  uint64_t key_a = *(const uint64_t *)a;
+  uint64_t key_b = *(const uint64_t *)b;
+
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+static void release(void *entry, void *arg)
+{
+  (void)entry;
+  (*(size_t *)arg)++;
+}
+
+static void report(const char *name, double elapsed, size_t n)
+{
+  printf("%-22s %8.3f s %8.2f M entries/s\n", name, elapsed,
+         n / elapsed * 1e-6);
+}
+
+int main(int argc, char **argv)
+{
+  size_t       n        = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  size_t       capacity = argc > 2 ? strtoul(argv[2], NULL, 10) : 65536;
+  item_t      *items    = malloc(n * sizeof(*items));
+  uint64_t     state    = 0x9e3779b97f4a7c15ULL;
+  size_t       released = 0;
+  int          status   = EXIT_SUCCESS;
+  aatree_t     tree;
+  aatree_lsm_t lsm;
+  double       start;
+  size_t       i;
+
+  for (i = 0; i < n; i++)
+  {
+    items[i].key = rng(&state);
+    aatree_init_node(&items[i].node.node);
+  }
+
+  aatree_init_tree(&tree, offsetof(item_t, node), offsetof(item_t, key),
+                   cmp_keys);
+  start = now();
+
+  for (i = 0; i < n; i++)
+  {
+    aatree_insert(&tree, &items[i].node.node);
+  }
+
+  report("insert", now() - start, n);
+
+  if (aatree_verify(&tree) != EXIT_SUCCESS)
+  {
+    status = EXIT_FAILURE;
+  }
+
+  aatree_lsm_init(&lsm, offsetof(item_t, node), offsetof(item_t, key),
+                  cmp_keys, capacity, release, &released);
+  start = now();
+
+  for (i = 0; i < n; i++)
+  {
+    aatree_lsm_insert(&lsm, &items[i]);
+  }
+
+  aatree_lsm_merge(&lsm);
+
+  report("write buffer", now() - start, n);
+
+  if (aatree_verify(&lsm.tree) != EXIT_SUCCESS || released)
+  {
+    status = EXIT_FAILURE;
+  }
+
+  free(items);
+
+  return status;
+}
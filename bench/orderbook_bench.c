@@ -0,0 +1,486 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Limit order book benchmark.
+ *
+ * Usage: aatree-bench-orderbook [events] [seed]
+ *
+ * Price levels live in two AA trees, bids ordered by descending and asks by
+ * ascending price, so the best price of either side is tree->first. Each level
+ * keeps a FIFO of resting orders. A synthetic market data stream (a random
+ * walk of the mid price with adds, cancels, modifies and aggressive orders) is
+ * generated up front and replayed against the book, reporting throughput and
+ * per-event latency percentiles. The book is checked for consistency at the
+ * end, so a short run doubles as a smoke test.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "aatree.h"
+
+typedef enum
+{
+  BID,
+  ASK
+} side_t;
+
+typedef enum
+{
+  EV_ADD,
+  EV_CANCEL,
+  EV_MODIFY,
+  EV_MARKET
+} event_kind;
+
+typedef struct event
+{
+  uint8_t  kind;
+  uint8_t  side;
+  uint32_t id;
+  int64_t  price;
+  int64_t  qty;
+} event_t;
+
+struct level;
+
+typedef struct order
+{
+  struct order *prev;
+  struct order *next;
+  struct level *level;
+  int64_t       qty;
+  uint8_t       side;
+  uint8_t       live;
+} order_t;
+
+typedef struct level
+{
+  aatree_node_t node;
+  int64_t       price;
+  int64_t       qty;
+  order_t      *head;
+  order_t      *tail;
+  struct level *free_next;
+} level_t;
+
+typedef struct book
+{
+  aatree_t side[2];
+  order_t *orders;
+  level_t *levels;
+  level_t *free_levels;
+  uint64_t trades;
+  int64_t  volume;
+} book_t;
+
+static int cmp_asc(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static int cmp_desc(const void *a, const void *b)
+{
+  return cmp_asc(b, a);
+}
+
+static level_t *level_get(book_t *book, side_t side, int64_t price)
+{
+  level_t *level = aatree_search(&book->side[side], &price, AATREE_KEY_EQ);
+
+  if (!level)
+  {
+    level             = book->free_levels;
+    book->free_levels = level->free_next;
+
+    aatree_init_node(&level->node);
+    level->price = price;
+    level->qty   = 0;
+    level->head  = NULL;
+    level->tail  = NULL;
+
+    aatree_insert(&book->side[side], &level->node);
+  }
+
+  return level;
+}
+
+static void level_put(book_t *book, side_t side, level_t *level)
+{
+  if (level->head)
+    return;
+
+  aatree_delete(&book->side[side], &level->node);
+
+  level->free_next  = book->free_levels;
+  book->free_levels = level;
+}
+
+static void order_unlink(order_t *order)
+{
+  level_t *level = order->level;
+
+  if (order->prev)
+    order->prev->next = order->next;
+  else
+    level->head = order->next;
+
+  if (order->next)
+    order->next->prev = order->prev;
+  else
+    level->tail = order->prev;
+
+  level->qty -= order->qty;
+  order->live = 0;
+}
+
+/* Take liquidity from the opposite side, returns the remaining quantity */
+static int64_t match(book_t *book, side_t side, int64_t limit, int64_t qty)
+{
+  aatree_t *opposite = &book->side[side == BID ? ASK : BID];
+  level_t  *level    = NULL;
+
+  while (qty > 0 && (level = aatree_first(opposite)))
+  {
+    if (side == BID ? level->price > limit : level->price < limit)
+      break;
+
+    while (qty > 0 && level->head)
+    {
+      order_t *maker = level->head;
+      int64_t  fill  = maker->qty < qty ? maker->qty : qty;
+
+      qty -= fill;
+      book->trades++;
+      book->volume += fill;
+
+      if (fill == maker->qty)
+      {
+        order_unlink(maker);
+      }
+      else
+      {
+        maker->qty -= fill;
+        level->qty -= fill;
+      }
+    }
+
+    if (!level->head)
+    {
+      aatree_pop_first(opposite);
+      level->free_next  = book->free_levels;
+      book->free_levels = level;
+    }
+  }
+
+  return qty;
+}
+
+static void add(book_t *book, uint32_t id, side_t side, int64_t price,
+                int64_t qty)
+{
+  order_t *order = &book->orders[id];
+  level_t *level;
+
+  qty = match(book, side, price, qty);
+
+  if (!qty)
+    return;
+
+  level = level_get(book, side, price);
+
+  order->qty   = qty;
+  order->side  = side;
+  order->live  = 1;
+  order->level = level;
+  order->next  = NULL;
+  order->prev  = level->tail;
+
+  if (level->tail)
+    level->tail->next = order;
+  else
+    level->head = order;
+
+  level->tail = order;
+  level->qty += qty;
+}
+
+static void cancel(book_t *book, uint32_t id)
+{
+  order_t *order = &book->orders[id];
+
+  if (!order->live)
+    return;
+
+  order_unlink(order);
+  level_put(book, (side_t)order->side, order->level);
+}
+
+/* Decreasing the quantity keeps the time priority, anything else re-queues */
+static void modify(book_t *book, uint32_t id, int64_t price, int64_t qty)
+{
+  order_t *order = &book->orders[id];
+
+  if (!order->live)
+    return;
+
+  if (price == order->level->price && qty <= order->qty)
+  {
+    order->level->qty -= order->qty - qty;
+    order->qty = qty;
+    return;
+  }
+
+  cancel(book, id);
+  add(book, id, (side_t)order->side, price, qty);
+}
+
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/* Synthetic feed: prices walk around the mid, most activity is close to the
+ * touch, cancels dominate as on real venues. */
+static void generate(event_t *ev, size_t n, uint32_t *max_id)
+{
+  int64_t   mid     = 100000;
+  uint32_t *live    = malloc(n * sizeof(*live));
+  uint8_t  *sides   = malloc(n * sizeof(*sides));
+  size_t    nlive   = 0;
+  uint32_t  next_id = 0;
+  size_t    i;
+
+  for (i = 0; i < n; i++)
+  {
+    uint64_t r = rng() % 100;
+
+    if (rng() % 16 == 0)
+      mid += (int64_t)(rng() % 3) - 1;
+
+    ev[i].side = rng() & 1;
+    ev[i].qty  = 1 + rng() % 100;
+
+    if (r < 45 || !nlive)
+    {
+      int64_t offset = (int64_t)(rng() % 64) * (int64_t)(rng() % 4 ? 1 : 8);
+
+      ev[i].kind  = EV_ADD;
+      ev[i].id    = next_id++;
+      ev[i].price = ev[i].side == BID ? mid - 1 - offset : mid + 1 + offset;
+
+      sides[ev[i].id] = ev[i].side;
+      live[nlive++]   = ev[i].id;
+    }
+    else if (r < 85)
+    {
+      size_t k = rng() % nlive;
+
+      ev[i].kind = EV_CANCEL;
+      ev[i].id   = live[k];
+      live[k]    = live[--nlive];
+    }
+    else if (r < 95)
+    {
+      ev[i].kind  = EV_MODIFY;
+      ev[i].id    = live[rng() % nlive];
+      ev[i].side  = sides[ev[i].id];
+      ev[i].price = ev[i].side == BID ? mid - 1 - (int64_t)(rng() % 32)
+                                      : mid + 1 + (int64_t)(rng() % 32);
+    }
+    else
+    {
+      ev[i].kind  = EV_MARKET;
+      ev[i].price = ev[i].side == BID ? INT64_MAX : INT64_MIN;
+    }
+  }
+
+  *max_id = next_id;
+  free(sides);
+  free(live);
+}
+
+static int check(book_t *book)
+{
+  int      s;
+  level_t *bid = aatree_first(&book->side[BID]);
+  level_t *ask = aatree_first(&book->side[ASK]);
+
+  if (bid && ask && bid->price >= ask->price)
+  {
+    fprintf(stderr, "crossed book: %lld >= %lld\n", (long long)bid->price,
+            (long long)ask->price);
+    return -1;
+  }
+
+  for (s = BID; s <= ASK; s++)
+  {
+    level_t *level = aatree_first(&book->side[s]);
+
+    if (aatree_verify(&book->side[s]) != EXIT_SUCCESS)
+      return -1;
+
+    for (; level; level = aatree_next(&book->side[s], &level->node))
+    {
+      int64_t  qty = 0;
+      order_t *o;
+
+      for (o = level->head; o; o = o->next)
+      {
+        if (o->level != level || !o->live || o->side != s)
+          return -1;
+
+        qty += o->qty;
+      }
+
+      if (!level->head || qty != level->qty)
+      {
+        fprintf(stderr, "level %lld is inconsistent\n",
+                (long long)level->price);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static size_t count_levels(aatree_t *tree)
+{
+  size_t   n     = 0;
+  level_t *level = aatree_first(tree);
+
+  for (; level; level = aatree_next(tree, &level->node))
+    n++;
+
+  return n;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+  size_t   n    = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+  uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+  event_t *ev   = malloc(n * sizeof(*ev));
+  double  *lat  = malloc(n * sizeof(*lat));
+  book_t   book;
+  uint32_t max_id = 0;
+  double   t0, t1;
+  size_t   i;
+  size_t   bids, asks;
+
+  rng_state = seed * 0x9e3779b97f4a7c15ULL + 1;
+  generate(ev, n, &max_id);
+
+  aatree_init_tree(&book.side[BID], offsetof(level_t, node),
+                   offsetof(level_t, price), cmp_desc);
+  aatree_init_tree(&book.side[ASK], offsetof(level_t, node),
+                   offsetof(level_t, price), cmp_asc);
+
+  book.orders      = calloc(max_id + 1, sizeof(order_t));
+  book.levels      = calloc(max_id + 1, sizeof(level_t));
+  book.free_levels = NULL;
+  book.trades      = 0;
+  book.volume      = 0;
+
+  for (i = 0; i <= max_id; i++)
+  {
+    book.levels[i].free_next = book.free_levels;
+    book.free_levels         = &book.levels[i];
+  }
+
+  t0 = now();
+
+  for (i = 0; i < n; i++)
+  {
+    double start = now();
+
+    switch (ev[i].kind)
+    {
+      case EV_ADD:
+        add(&book, ev[i].id, (side_t)ev[i].side, ev[i].price, ev[i].qty);
+        break;
+      case EV_CANCEL:
+        cancel(&book, ev[i].id);
+        break;
+      case EV_MODIFY:
+        modify(&book, ev[i].id, ev[i].price, ev[i].qty);
+        break;
+      case EV_MARKET:
+        match(&book, (side_t)ev[i].side, ev[i].price, ev[i].qty);
+        break;
+    }
+
+    lat[i] = now() - start;
+  }
+
+  t1 = now();
+
+  qsort(lat, n, sizeof(*lat), cmp_doubles);
+
+  bids = count_levels(&book.side[BID]);
+  asks = count_levels(&book.side[ASK]);
+
+  printf("events %zu, %.2f Mevents/s, latency ns p50 %.0f p99 %.0f "
+         "p99.9 %.0f max %.0f\n",
+         n, n / (t1 - t0) * 1e3, lat[n / 2], lat[n * 99 / 100],
+         lat[n * 999 / 1000], lat[n - 1]);
+  printf("trades %llu, volume %lld, bid levels %zu, ask levels %zu\n",
+         (unsigned long long)book.trades, (long long)book.volume, bids, asks);
+
+  if (check(&book))
+  {
+    fprintf(stderr, "order book is inconsistent\n");
+    return EXIT_FAILURE;
+  }
+
+  free(book.orders);
+  free(book.levels);
+  free(lat);
+  free(ev);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,422 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Priority queue benchmark: the AA tree used as a run queue against a binary
+ * heap and a pairing heap.
+ *
+ * Usage: aatree-bench-pqueue [queue size] [operations]
+ *
+ * Every queue is filled with random keys and then driven with the "hold"
+ * model: pop the minimum, push it back with a later key. A second round
+ * reschedules random entries (decrease/increase key), which the binary heap
+ * supports through its position index and the pairing heap by cut and meld.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "aatree.h"
+
+typedef struct item
+{
+  aatree_node_t node;
+  uint64_t      key;
+
+  /* binary heap position */
+  size_t pos;
+
+  /* pairing heap links */
+  struct item *child;
+  struct item *sibling;
+  struct item *prev;
+} item_t;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Keys are made unique by mixing in the item index in the low bits. */
+static uint64_t make_key(uint64_t base, size_t ix)
+{
+  return (base << 24) | (ix & 0xffffff);
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+  uint64_t key_a = *(const uint64_t *)a;
+  uint64_t key_b = *(const uint64_t *)b;
+
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+/* Binary heap */
+
+typedef struct heap
+{
+  item_t **v;
+  size_t   n;
+} heap_t;
+
+static void heap_set(heap_t *h, size_t i, item_t *x)
+{
+  h->v[i] = x;
+  x->pos  = i;
+}
+
+static void heap_up(heap_t *h, size_t i)
+{
+  item_t *x = h->v[i];
+
+  while (i > 0)
+  {
+    size_t p = (i - 1) / 2;
+
+    if (h->v[p]->key <= x->key)
+      break;
+
+    heap_set(h, i, h->v[p]);
+    i = p;
+  }
+
+  heap_set(h, i, x);
+}
+
+static void heap_down(heap_t *h, size_t i)
+{
+  item_t *x = h->v[i];
+
+  for (;;)
+  {
+    size_t c = 2 * i + 1;
+
+    if (c >= h->n)
+      break;
+
+    if (c + 1 < h->n && h->v[c + 1]->key < h->v[c]->key)
+      c++;
+
+    if (x->key <= h->v[c]->key)
+      break;
+
+    heap_set(h, i, h->v[c]);
+    i = c;
+  }
+
+  heap_set(h, i, x);
+}
+
+static void heap_push(heap_t *h, item_t *x)
+{
+  h->v[h->n] = x;
+  heap_up(h, h->n++);
+}
+
+static item_t *heap_pop(heap_t *h)
+{
+  item_t *top = h->v[0];
+
+  if (--h->n)
+  {
+    heap_set(h, 0, h->v[h->n]);
+    heap_down(h, 0);
+  }
+
+  return top;
+}
+
+static void heap_update(heap_t *h, item_t *x)
+{
+  heap_up(h, x->pos);
+  heap_down(h, x->pos);
+}
+
+/* Pairing heap */
+
+static item_t *ph_meld(item_t *a, item_t *b)
+{
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+
+  if (b->key < a->key)
+  {
+    item_t *t = a;
+    a         = b;
+    b         = t;
+  }
+
+  b->prev    = a;
+  b->sibling = a->child;
+
+  if (a->child)
+    a->child->prev = b;
+
+  a->child   = b;
+  a->sibling = NULL;
+  a->prev    = NULL;
+
+  return a;
+}
+
+static item_t *ph_push(item_t *root, item_t *x)
+{
+  x->child = x->sibling = x->prev = NULL;
+  return ph_meld(root, x);
+}
+
+/* Two-pass pairing of the children list. */
+static item_t *ph_merge_pairs(item_t *first)
+{
+  item_t *pairs = NULL;
+  item_t *root  = NULL;
+
+  while (first)
+  {
+    item_t *a = first;
+    item_t *b = a->sibling;
+
+    first = b ? b->sibling : NULL;
+
+    a->sibling = NULL;
+    if (b)
+      b->sibling = NULL;
+
+    a          = ph_meld(a, b);
+    a->sibling = pairs;
+    pairs      = a;
+  }
+
+  while (pairs)
+  {
+    item_t *next = pairs->sibling;
+    root         = ph_meld(root, pairs);
+    pairs        = next;
+  }
+
+  return root;
+}
+
+static item_t *ph_pop(item_t **root)
+{
+  item_t *top = *root;
+
+  *root = ph_merge_pairs(top->child);
+
+  if (*root)
+    (*root)->prev = NULL;
+
+  return top;
+}
+
+/* Cut a subtree from its parent and meld it back with the new key. */
+static item_t *ph_update(item_t *root, item_t *x)
+{
+  if (x == root)
+  {
+    root = ph_merge_pairs(x->child);
+
+    if (root)
+      root->prev = NULL;
+  }
+  else
+  {
+    if (x->prev->child == x)
+      x->prev->child = x->sibling;
+    else
+      x->prev->sibling = x->sibling;
+
+    if (x->sibling)
+      x->sibling->prev = x->prev;
+
+    x->sibling = x->prev = NULL;
+
+    /* Increasing the key requires the children to be re-melded too. */
+    root = ph_meld(root, ph_merge_pairs(x->child));
+  }
+
+  x->child = NULL;
+  return ph_meld(root, x);
+}
+
+typedef enum
+{
+  AA_POP,
+  AA_DELETE,
+  HEAP,
+  PAIRING
+} queue_kind;
+
+static const char *names[] = {"aatree pop_first", "aatree first+delete",
+                              "binary heap", "pairing heap"};
+
+static void run(queue_kind kind, item_t *items, size_t n, size_t ops)
+{
+  aatree_t tree;
+  heap_t   heap;
+  item_t  *ph   = NULL;
+  uint64_t sink = 0;
+  double   t0, t1, t2;
+  size_t   i;
+
+  aatree_init_tree(&tree, offsetof(item_t, node), offsetof(item_t, key),
+                   cmp_keys);
+
+  heap.v = malloc(n * sizeof(*heap.v));
+  heap.n = 0;
+
+  rng_state = 0x9e3779b97f4a7c15ULL;
+
+  for (i = 0; i < n; i++)
+  {
+    items[i].key = make_key(rng() >> 40, i);
+    aatree_init_node(&items[i].node);
+
+    switch (kind)
+    {
+      case AA_POP:
+      case AA_DELETE:
+        aatree_insert(&tree, &items[i].node);
+        break;
+      case HEAP:
+        heap_push(&heap, &items[i]);
+        break;
+      case PAIRING:
+        ph = ph_push(ph, &items[i]);
+        break;
+    }
+  }
+
+  /* Hold model. */
+  t0 = now();
+
+  for (i = 0; i < ops; i++)
+  {
+    item_t  *x     = NULL;
+    uint64_t delta = 1 + (rng() >> 48);
+
+    switch (kind)
+    {
+      case AA_POP:
+        x      = aatree_pop_first(&tree);
+        x->key = make_key((x->key >> 24) + delta, x - items);
+        aatree_insert(&tree, &x->node);
+        break;
+      case AA_DELETE:
+        x = aatree_first(&tree);
+        aatree_delete(&tree, &x->node);
+        x->key = make_key((x->key >> 24) + delta, x - items);
+        aatree_insert(&tree, &x->node);
+        break;
+      case HEAP:
+        x      = heap_pop(&heap);
+        x->key = make_key((x->key >> 24) + delta, x - items);
+        heap_push(&heap, x);
+        break;
+      case PAIRING:
+        x      = ph_pop(&ph);
+        x->key = make_key((x->key >> 24) + delta, x - items);
+        ph     = ph_push(ph, x);
+        break;
+    }
+
+    sink += x->key;
+  }
+
+  t1 = now();
+
+  /* Reschedule random entries. */
+  for (i = 0; i < ops; i++)
+  {
+    item_t  *x    = &items[rng() % n];
+    uint64_t base = rng() >> 40;
+
+    x->key = make_key(base, x - items);
+
+    switch (kind)
+    {
+      case AA_POP:
+        aatree_reinsert(&tree, &x->node);
+        break;
+      case AA_DELETE:
+        aatree_delete(&tree, &x->node);
+        aatree_insert(&tree, &x->node);
+        break;
+      case HEAP:
+        heap_update(&heap, x);
+        break;
+      case PAIRING:
+        ph = ph_update(ph, x);
+        break;
+    }
+  }
+
+  t2 = now();
+
+  printf("%-22s hold %7.1f ns/op   reschedule %7.1f ns/op   (%llu)\n",
+         names[kind], (t1 - t0) * 1e9 / ops, (t2 - t1) * 1e9 / ops,
+         (unsigned long long)(sink & 0xff));
+
+  free(heap.v);
+}
+
+int main(int argc, char **argv)
+{
+  size_t  n   = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  size_t  ops = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+  item_t *items;
+  int     kind;
+
+  if (!n || n > 0xffffff)
+  {
+    fprintf(stderr, "queue size must be in range 1..%d\n", 0xffffff);
+    return EXIT_FAILURE;
+  }
+
+  items = calloc(n, sizeof(*items));
+
+  printf("queue size %zu, %zu operations\n", n, ops);
+
+  for (kind = AA_POP; kind <= PAIRING; kind++)
+  {
+    run((queue_kind)kind, items, n, ops);
+  }
+
+  free(items);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,342 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/* Read scalability benchmark: lock-free readers of aatree_rcu_t against
+ * readers taking a rwlock around aatree_search().
+ *
+ * Usage: aatree-bench-rcu [max threads] [tree size] [seconds]
+ *
+ * Readers look up random keys while a writer keeps inserting and deleting
+ * entries at one update per READS_PER_UPDATE reads. The run is repeated for
+ * 1 .. max threads, reporting the aggregate read rate.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "aatree_rcu.h"
+
+#define READS_PER_UPDATE 1000
+
+enum
+{
+  ITEM_FREE,
+  ITEM_LINKED,
+  ITEM_RETIRED
+};
+
+typedef struct item
+{
+  aatree_node_t        node;
+  uint64_t             key;
+  aatree_epoch_entry_t retire;
+  int                  state;
+} item_t;
+
+/* Per reader counter, kept on its own cache line */
+typedef struct counter
+{
+  uint64_t reads;
+  uint8_t  pad[AATREE_CACHE_LINE - sizeof(uint64_t)];
+} counter_t;
+
+typedef struct bench
+{
+  int              use_rcu;
+  aatree_rcu_t     rcu;
+  aatree_t         tree;
+  pthread_rwlock_t rwlock;
+  item_t          *items;
+  size_t           size;
+  counter_t       *counters;
+  int              threads;
+  int              stop;
+
+  /* Readers quit by themselves past it, should the writer starve */
+  double deadline;
+} bench_t;
+
+typedef struct reader
+{
+  bench_t *bench;
+  int      ix;
+} reader_t;
+
+static uint64_t rng(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+  uint64_t key_a = *(const uint64_t *)a;
+  uint64_t key_b = *(const uint64_t *)b;
+
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+static void on_reclaim(aatree_epoch_entry_t *link, void *arg)
+{
+  item_t *item = (item_t *)((uint8_t *)link - offsetof(item_t, retire));
+
+  (void)arg;
+  item->state = ITEM_FREE;
+}
+
+static void *reader(void *arg)
+{
+  reader_t             *self   = arg;
+  bench_t              *bench  = self->bench;
+  counter_t            *count  = &bench->counters[self->ix];
+  uint64_t              state  = 0x9e3779b97f4a7c15ULL * (self->ix + 1);
+  uint64_t              found  = 0;
+  aatree_epoch_record_t record;
+
+  if (bench->use_rcu)
+    aatree_rcu_register(&bench->rcu, &record);
+
+  while (!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)
+         && now() < bench->deadline)
+  {
+    int i;
+
+    for (i = 0; i < 64; i++)
+    {
+      uint64_t key = rng(&state) % (bench->size * 2);
+
+      if (bench->use_rcu)
+      {
+        aatree_rcu_read_lock(&bench->rcu, &record);
+        found += aatree_rcu_search(&bench->rcu, &key, AATREE_KEY_EQ) != NULL;
+        aatree_rcu_read_unlock(&record);
+      }
+      else
+      {
+        pthread_rwlock_rdlock(&bench->rwlock);
+        found += aatree_search(&bench->tree, &key, AATREE_KEY_EQ) != NULL;
+        pthread_rwlock_unlock(&bench->rwlock);
+      }
+    }
+
+    __atomic_store_n(&count->reads, count->reads + 64, __ATOMIC_RELAXED);
+  }
+
+  if (bench->use_rcu)
+    aatree_rcu_unregister(&bench->rcu, &record);
+
+  return (void *)(uintptr_t)found;
+}
+
+static uint64_t total_reads(bench_t *bench)
+{
+  uint64_t total = 0;
+  int      i;
+
+  for (i = 0; i < bench->threads; i++)
+  {
+    total += __atomic_load_n(&bench->counters[i].reads, __ATOMIC_RELAXED);
+  }
+
+  return total;
+}
+
+/* Toggle a random odd key in or out of the tree */
+static void update(bench_t *bench, uint64_t *state)
+{
+  item_t *item = &bench->items[(rng(state) % bench->size) | 1];
+
+  if (bench->use_rcu)
+  {
+    if (item->state == ITEM_FREE)
+    {
+      aatree_init_node(&item->node);
+      item->state = ITEM_LINKED;
+      aatree_rcu_insert(&bench->rcu, &item->node);
+    }
+    else if (item->state == ITEM_LINKED)
+    {
+      item->state = ITEM_RETIRED;
+      aatree_rcu_delete(&bench->rcu, &item->node, &item->retire);
+    }
+  }
+  else
+  {
+    pthread_rwlock_wrlock(&bench->rwlock);
+
+    if (item->state == ITEM_FREE)
+    {
+      aatree_init_node(&item->node);
+      item->state = ITEM_LINKED;
+      aatree_insert(&bench->tree, &item->node);
+    }
+    else
+    {
+      item->state = ITEM_FREE;
+      aatree_delete(&bench->tree, &item->node);
+    }
+
+    pthread_rwlock_unlock(&bench->rwlock);
+  }
+}
+
+static void run(bench_t *bench, int threads, double seconds)
+{
+  pthread_t *tids    = malloc(threads * sizeof(*tids));
+  reader_t  *readers = malloc(threads * sizeof(*readers));
+  uint64_t   state   = 42;
+  uint64_t   updates = 0;
+  uint64_t   reads   = 0;
+  double     start, elapsed;
+  size_t     i;
+  int        t;
+
+  if (bench->use_rcu)
+  {
+    aatree_rcu_init(&bench->rcu, offsetof(item_t, node), offsetof(item_t, key),
+                    cmp_keys, on_reclaim, NULL);
+  }
+  else
+  {
+    pthread_rwlockattr_t attr;
+
+    /* The readers would hold off the writer for good with glibc's default,
+     * which lets a reader in while another one holds the lock. */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+
+    aatree_init_tree(&bench->tree, offsetof(item_t, node),
+                     offsetof(item_t, key), cmp_keys);
+    pthread_rwlock_init(&bench->rwlock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+  }
+
+  for (i = 0; i < bench->size; i++)
+  {
+    item_t *item = &bench->items[i];
+
+    aatree_init_node(&item->node);
+    item->key   = i;
+    item->state = ITEM_FREE;
+
+    if (i % 2 == 0)
+    {
+      item->state = ITEM_LINKED;
+
+      if (bench->use_rcu)
+        aatree_rcu_insert(&bench->rcu, &item->node);
+      else
+        aatree_insert(&bench->tree, &item->node);
+    }
+  }
+
+  bench->counters = calloc(threads, sizeof(counter_t));
+  bench->threads  = threads;
+  bench->stop     = 0;
+  bench->deadline = now() + seconds;
+
+  for (t = 0; t < threads; t++)
+  {
+    readers[t].bench = bench;
+    readers[t].ix    = t;
+    pthread_create(&tids[t], NULL, reader, &readers[t]);
+  }
+
+  start = now();
+
+  while ((elapsed = now() - start) < seconds)
+  {
+    reads = total_reads(bench);
+
+    if (updates < reads / READS_PER_UPDATE)
+    {
+      update(bench, &state);
+      updates++;
+    }
+    else
+    {
+      sched_yield();
+    }
+  }
+
+  __atomic_store_n(&bench->stop, 1, __ATOMIC_RELAXED);
+
+  for (t = 0; t < threads; t++)
+  {
+    pthread_join(tids[t], NULL);
+  }
+
+  reads = total_reads(bench);
+
+  printf("%-6s threads %2d: %8.2f Mreads/s, %llu updates\n",
+         bench->use_rcu ? "rcu" : "rwlock", threads, reads / elapsed * 1e-6,
+         (unsigned long long)updates);
+
+  if (bench->use_rcu)
+    aatree_rcu_destroy(&bench->rcu);
+  else
+    pthread_rwlock_destroy(&bench->rwlock);
+
+  free(bench->counters);
+  free(readers);
+  free(tids);
+}
+
+int main(int argc, char **argv)
+{
+  int     threads = argc > 1 ? atoi(argv[1]) : 4;
+  size_t  size    = argc > 2 ? strtoul(argv[2], NULL, 10) : 1 << 20;
+  double  seconds = argc > 3 ? atof(argv[3]) : 1.0;
+  bench_t bench;
+  int     t;
+
+  bench.size  = size;
+  bench.items = malloc(size * sizeof(item_t));
+
+  for (t = 1; t <= threads; t++)
+  {
+    bench.use_rcu = 1;
+    run(&bench, t, seconds);
+
+    bench.use_rcu = 0;
+    run(&bench, t, seconds);
+  }
+
+  free(bench.items);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,215 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/* Write scalability benchmark: the range partitioned tree against a single
+ * tree behind one mutex.
+ *
+ * Usage: aatree-bench-shard [max threads] [shards] [keys per thread]
+ *
+ * Every thread inserts and deletes its own random keys spread over the whole
+ * key space. The run is repeated for 1 .. max threads, reporting the
+ * aggregate update rate.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "aatree_shard.h"
+
+#define ROUNDS 8
+
+typedef struct item
+{
+  aatree_node_t node;
+  uint64_t      key;
+} item_t;
+
+typedef struct bench
+{
+  int              sharded;
+  aatree_sharded_t sh;
+  aatree_t         tree;
+  pthread_mutex_t  lock;
+} bench_t;
+
+typedef struct worker
+{
+  bench_t  *bench;
+  pthread_t tid;
+  item_t   *items;
+  size_t    count;
+} worker_t;
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+  uint64_t key_a = *(const uint64_t *)a;
+  uint64_t key_b = *(const uint64_t *)b;
+
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+static void *worker(void *arg)
+{
+  worker_t *self  = arg;
+  bench_t  *bench = self->bench;
+  int       round;
+  size_t    i;
+
+  for (round = 0; round < ROUNDS; round++)
+  {
+    for (i = 0; i < self->count; i++)
+    {
+      aatree_node_t *node = &self->items[i].node;
+
+      if (bench->sharded)
+      {
+        if (round % 2 == 0)
+          aatree_sharded_insert(&bench->sh, node);
+        else
+          aatree_sharded_delete(&bench->sh, node);
+      }
+      else
+      {
+        pthread_mutex_lock(&bench->lock);
+
+        if (round % 2 == 0)
+          aatree_insert(&bench->tree, node);
+        else
+          aatree_delete(&bench->tree, node);
+
+        pthread_mutex_unlock(&bench->lock);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void run(bench_t *bench, int threads, size_t shards, size_t count)
+{
+  static aatree_shard_t pool[AATREE_SHARD_MAX];
+  uint64_t              bounds[AATREE_SHARD_MAX];
+  worker_t             *workers = calloc(threads, sizeof(*workers));
+  uint64_t              state   = 0x9e3779b97f4a7c15ULL;
+  double                start, elapsed;
+  size_t                i;
+  int                   t;
+
+  /* Keys are uniform over 64 bits, so even bounds give even ranges. */
+  for (i = 1; i < shards; i++)
+  {
+    bounds[i - 1] = UINT64_MAX / shards * i;
+  }
+
+  if (bench->sharded)
+  {
+    aatree_sharded_init(&bench->sh, pool, AATREE_SHARD_MAX, sizeof(uint64_t),
+                        offsetof(item_t, node), offsetof(item_t, key),
+                        cmp_keys, bounds, shards - 1);
+  }
+  else
+  {
+    aatree_init_tree(&bench->tree, offsetof(item_t, node),
+                     offsetof(item_t, key), cmp_keys);
+    pthread_mutex_init(&bench->lock, NULL);
+  }
+
+  for (t = 0; t < threads; t++)
+  {
+    workers[t].bench = bench;
+    workers[t].count = count;
+    workers[t].items = malloc(count * sizeof(item_t));
+
+    for (i = 0; i < count; i++)
+    {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+
+      aatree_init_node(&workers[t].items[i].node);
+      workers[t].items[i].key = state;
+    }
+  }
+
+  start = now();
+
+  for (t = 0; t < threads; t++)
+  {
+    pthread_create(&workers[t].tid, NULL, worker, &workers[t]);
+  }
+
+  for (t = 0; t < threads; t++)
+  {
+    pthread_join(workers[t].tid, NULL);
+    free(workers[t].items);
+  }
+
+  elapsed = now() - start;
+
+  printf("%-7s threads %2d: %8.2f Mupdates/s\n",
+         bench->sharded ? "sharded" : "mutex", threads,
+         (double)threads * count * ROUNDS / elapsed * 1e-6);
+
+  if (bench->sharded)
+    aatree_sharded_destroy(&bench->sh);
+  else
+    pthread_mutex_destroy(&bench->lock);
+
+  free(workers);
+}
+
+int main(int argc, char **argv)
+{
+  int     threads = argc > 1 ? atoi(argv[1]) : 4;
+  size_t  shards  = argc > 2 ? strtoul(argv[2], NULL, 10) : 32;
+  size_t  count   = argc > 3 ? strtoul(argv[3], NULL, 10) : 100000;
+  bench_t bench;
+  int     t;
+
+  if (!shards || shards > AATREE_SHARD_MAX)
+  {
+    fprintf(stderr, "shards must be 1 .. %d\n", AATREE_SHARD_MAX);
+    return EXIT_FAILURE;
+  }
+
+  for (t = 1; t <= threads; t++)
+  {
+    bench.sharded = 1;
+    run(&bench, t, shards, count);
+
+    bench.sharded = 0;
+    run(&bench, t, shards, count);
+  }
+
+  return EXIT_SUCCESS;
+}
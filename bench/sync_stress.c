@@ -0,0 +1,287 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/* Stress test of aatree_sync_t: concurrent writers and seqlock validated
+ * readers.
+ *
+ * Usage: aatree-bench-sync [readers] [writers] [seconds] [keys]
+ *
+ * Writers insert and delete random keys, readers run point lookups and short
+ * range scans. Every entry carries payload derived from its key, so a torn
+ * copy slipping through the validation is detected. Reports throughput, the
+ * retry and lock fallback rates and lookup latency percentiles, and fails if
+ * a reader has seen an inconsistent entry.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "aatree_sync.h"
+
+#define SCAN_LENGTH 16
+#define LATENCY_SAMPLES (1 << 16)
+
+typedef struct entry
+{
+  aatree_node_t node;
+  uint64_t      key;
+  uint64_t      check[2];
+} entry_t;
+
+typedef struct shared
+{
+  aatree_sync_t sync;
+  uint64_t      keys;
+  int           stop;
+} shared_t;
+
+typedef struct worker
+{
+  shared_t           *shared;
+  pthread_t           tid;
+  uint64_t            rng;
+  uint64_t            ops;
+  uint64_t            errors;
+  aatree_sync_stats_t stats;
+  double             *latency;
+  size_t              samples;
+} worker_t;
+
+static uint64_t rng(uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_keys(const void *a, const void *b)
+{
+  uint64_t key_a = *(const uint64_t *)a;
+  uint64_t key_b = *(const uint64_t *)b;
+
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+static int cmp_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void fill(entry_t *entry, uint64_t key)
+{
+  entry->key      = key;
+  entry->check[0] = key * 0x9e3779b97f4a7c15ULL;
+  entry->check[1] = ~key;
+}
+
+static int consistent(const entry_t *entry)
+{
+  return entry->check[0] == entry->key * 0x9e3779b97f4a7c15ULL
+         && entry->check[1] == ~entry->key;
+}
+
+static void *writer(void *arg)
+{
+  worker_t *self   = arg;
+  shared_t *shared = self->shared;
+
+  while (!__atomic_load_n(&shared->stop, __ATOMIC_RELAXED))
+  {
+    uint64_t key   = rng(&self->rng) % shared->keys;
+    entry_t *entry = aatree_sync_alloc(&shared->sync);
+
+    if (entry)
+    {
+      fill(entry, key);
+
+      if (!aatree_sync_insert(&shared->sync, entry))
+      {
+        self->ops++;
+        continue;
+      }
+
+      aatree_sync_free(&shared->sync, entry);
+    }
+
+    aatree_sync_delete(&shared->sync, &key);
+    self->ops++;
+  }
+
+  return NULL;
+}
+
+static void *reader(void *arg)
+{
+  worker_t *self   = arg;
+  shared_t *shared = self->shared;
+  entry_t   out[SCAN_LENGTH];
+
+  while (!__atomic_load_n(&shared->stop, __ATOMIC_RELAXED))
+  {
+    uint64_t key   = rng(&self->rng) % shared->keys;
+    double   start = now();
+    size_t   i, n;
+
+    if (self->ops % 16)
+    {
+      if (aatree_sync_search(&shared->sync, &key, AATREE_KEY_EQ, out,
+                             &self->stats)
+          && (out[0].key != key || !consistent(&out[0])))
+      {
+        self->errors++;
+      }
+
+      if (self->samples < LATENCY_SAMPLES)
+        self->latency[self->samples++] = now() - start;
+    }
+    else
+    {
+      n = aatree_sync_scan(&shared->sync, &key, out, SCAN_LENGTH,
+                           &self->stats);
+
+      for (i = 0; i < n; i++)
+      {
+        if (!consistent(&out[i]) || out[i].key < key
+            || (i && out[i].key <= out[i - 1].key))
+        {
+          self->errors++;
+        }
+      }
+    }
+
+    self->ops++;
+  }
+
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  int       readers = argc > 1 ? atoi(argv[1]) : 4;
+  int       writers = argc > 2 ? atoi(argv[2]) : 1;
+  double    seconds = argc > 3 ? atof(argv[3]) : 1.0;
+  uint64_t  keys    = argc > 4 ? strtoull(argv[4], NULL, 10) : 1 << 16;
+  shared_t  shared;
+  entry_t  *pool    = malloc(keys * sizeof(entry_t));
+  worker_t *workers = calloc(readers + writers, sizeof(worker_t));
+  double   *latency = malloc(readers * LATENCY_SAMPLES * sizeof(double));
+  uint64_t  reads = 0, writes = 0, retries = 0, fallbacks = 0, errors = 0;
+  size_t    samples = 0;
+  double    start, elapsed;
+  int       i;
+
+  aatree_sync_init(&shared.sync, pool, sizeof(entry_t), keys,
+                   offsetof(entry_t, node), offsetof(entry_t, key), cmp_keys);
+  shared.keys = keys;
+  shared.stop = 0;
+
+  start = now();
+
+  for (i = 0; i < readers + writers; i++)
+  {
+    workers[i].shared  = &shared;
+    workers[i].rng     = 0x9e3779b97f4a7c15ULL * (i + 1);
+    workers[i].latency = &latency[(size_t)i * LATENCY_SAMPLES];
+
+    pthread_create(&workers[i].tid, NULL, i < readers ? reader : writer,
+                   &workers[i]);
+  }
+
+  while (now() - start < seconds * 1e9)
+  {
+    struct timespec ts = {0, 10000000};
+
+    nanosleep(&ts, NULL);
+  }
+
+  __atomic_store_n(&shared.stop, 1, __ATOMIC_RELAXED);
+
+  for (i = 0; i < readers + writers; i++)
+  {
+    pthread_join(workers[i].tid, NULL);
+  }
+
+  elapsed = (now() - start) * 1e-9;
+
+  for (i = 0; i < readers + writers; i++)
+  {
+    worker_t *w = &workers[i];
+
+    if (i < readers)
+    {
+      size_t k;
+
+      for (k = 0; k < w->samples; k++)
+      {
+        latency[samples++] = w->latency[k];
+      }
+
+      reads += w->stats.reads;
+      retries += w->stats.retries;
+      fallbacks += w->stats.fallbacks;
+      errors += w->errors;
+    }
+    else
+    {
+      writes += w->ops;
+    }
+  }
+
+  qsort(latency, samples, sizeof(double), cmp_doubles);
+
+  printf("readers %d, writers %d: %.2f Mreads/s, %.2f Mwrites/s\n", readers,
+         writers, reads / elapsed * 1e-6, writes / elapsed * 1e-6);
+  printf("retry rate %.4f%%, fallback rate %.4f%%, lookup latency ns "
+         "p50 %.0f p99 %.0f\n",
+         reads ? 100.0 * retries / reads : 0.0,
+         reads ? 100.0 * fallbacks / reads : 0.0,
+         samples ? latency[samples / 2] : 0.0,
+         samples ? latency[samples * 99 / 100] : 0.0);
+
+  if (errors || aatree_verify(&shared.sync.tree) != EXIT_SUCCESS)
+  {
+    fprintf(stderr, "%llu inconsistent reads\n", (unsigned long long)errors);
+    return EXIT_FAILURE;
+  }
+
+  aatree_sync_destroy(&shared.sync);
+  free(latency);
+  free(workers);
+  free(pool);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+/* The MIT License (MIT)
+Copyright (c) 2023 Sergei Malykhin
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+/* Write-ahead log benchmark: committed inserts with and without grouping.
+ *
+ * Usage: aatree-bench-wal [log file] [max threads] [commits per thread]
+ *                         [delay us]
+ *
+ * Every thread records inserts and waits for each one to be committed. The
+ * run is repeated for 1, 2, 4 ... max threads with no commit window and with
+ * the given one, reporting the commit rate and the commits per sync.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "aatree_wal.h"
+
+#define HALF_SIZE (1 << 16)
+
+typedef struct item
+{
+  aatree_node_t node;
+  uint64_t      key;
+  uint64_t      value;
+} item_t;
+
+typedef struct bench
+{
+  aatree_wal_t wal;
+  size_t       commits;
+  int          errors;
+} bench_t;
+
+typedef struct worker
+{
+  bench_t  *bench;
+  pthread_t tid;
+  uint64_t  id;
+} worker_t;
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *worker(void *arg)
+{
+  worker_t *self  = arg;
+  bench_t  *bench = self->bench;
+  item_t    item;
+  uint64_t  lsn;
+  size_t    i;
+
+  for (i = 0; i < bench->commits; i++)
+  {
+    item.key   = self->id << 32 | i;
+    item.value = i;
+
+    if (aatree_wal_insert(&bench->wal, &item, &lsn)
+        || aatree_wal_commit(&bench->wal, lsn))
+    {
+      __atomic_fetch_add(&bench->errors, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  return NULL;
+}
+
+static int run(bench_t    *bench,
+               const char *path,
+               uint64_t   *buffer,
+               int         threads,
+               unsigned    delay)
+{
+  worker_t *workers = calloc(threads, sizeof(*workers));
+  int       fd      = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  double    start, elapsed;
+  int       t;
+
+  if (fd < 0)
+  {
+    perror(path);
+    return -1;
+  }
+
+  aatree_wal_init(&bench->wal, fd, buffer, HALF_SIZE, sizeof(item_t),
+                  sizeof(uint64_t), delay, HALF_SIZE / 2);
+
+  start = now();
+
+  for (t = 0; t < threads; t++)
+  {
+    workers[t].bench = bench;
+    workers[t].id    = t;
+    pthread_create(&workers[t].tid, NULL, worker, &workers[t]);
+  }
+
+  for (t = 0; t < threads; t++)
+  {
+    pthread_join(workers[t].tid, NULL);
+  }
+
+  elapsed = now() - start;
+
+  printf("delay %5u us threads %3d: %10.0f commits/s %6.1f commits/sync\n",
+         delay, threads, threads * bench->commits / elapsed,
+         (double)bench->wal.commits / bench->wal.syncs);
+
+  aatree_wal_destroy(&bench->wal);
+  close(fd);
+  free(workers);
+
+  return bench->errors ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *path    = argc > 1 ? argv[1] : "aatree-bench.wal";
+  int         threads = argc > 2 ? atoi(argv[2]) : 16;
+  unsigned    delay   = argc > 4 ? (unsigned)atoi(argv[4]) : 500;
+  uint64_t   *buffer  = malloc(2 * HALF_SIZE);
+  bench_t     bench;
+  int         t;
+
+  bench.commits = argc > 3 ? strtoul(argv[3], NULL, 10) : 200;
+  bench.errors  = 0;
+
+  for (t = 1; t <= threads; t *= 2)
+  {
+    if (run(&bench, path, buffer, t, 0) || run(&bench, path, buffer, t, delay))
+    {
+      fprintf(stderr, "log write failed\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  unlink(path);
+  free(buffer);
+
+  return EXIT_SUCCESS;
+}
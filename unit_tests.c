@@ -19,8 +19,37 @@ IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
 CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "aatree.h"
+#include "aatree_bgsave.h"
+#include "aatree_cache.h"
+#include "aatree_check.h"
+#include "aatree_diff.h"
+#include "aatree_ckpt.h"
+#include "aatree_fc.h"
+#include "aatree_feed.h"
+#include "aatree_io.h"
+#include "aatree_lsm.h"
+#include "aatree_nr.h"
+#include "aatree_paged.h"
+#include "aatree_parallel.h"
+#include "aatree_persist.h"
+#include "aatree_rcu.h"
+#include "aatree_shard.h"
+#include "aatree_shm.h"
+#include "aatree_swap.h"
+#include "aatree_sync.h"
+#include "aatree_timer.h"
+#include "aatree_wal.h"
+#include "aatree_window.h"
 #include "utest.h"
 
 #define COUNT 127
@@ -495,4 +524,3801 @@ UTEST(aatree, search_backward)
   }
 }
 
+UTEST(aatree, pop_first)
+{
+  aatree_t tree;
+  number_t num[COUNT];
+  int      ix[COUNT];
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    ix[i]        = i;
+    num[i].value = i;
+    aatree_init_node(&num[i].node);
+  }
+
+  shuffle(ix, COUNT);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    aatree_insert(&tree, &num[ix[i]].node);
+  }
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    number_t *x = aatree_pop_first(&tree);
+
+    ASSERT_NE(x, NULL);
+    ASSERT_EQ(x->value, i);
+    ASSERT_EQ(x->node.level, 0);
+    ASSERT_EQ(x->node.parent, NULL);
+    ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+  }
+
+  ASSERT_EQ(aatree_pop_first(&tree), NULL);
+  ASSERT_EQ(tree.root, NULL);
+  ASSERT_EQ(tree.last, NULL);
+}
+
+UTEST(aatree, pop_last)
+{
+  aatree_t tree;
+  number_t num[COUNT];
+  int      ix[COUNT];
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    ix[i]        = i;
+    num[i].value = i;
+    aatree_init_node(&num[i].node);
+  }
+
+  shuffle(ix, COUNT);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    aatree_insert(&tree, &num[ix[i]].node);
+  }
+
+  for (int i = COUNT - 1; i >= 0; i--)
+  {
+    number_t *x = aatree_pop_last(&tree);
+
+    ASSERT_NE(x, NULL);
+    ASSERT_EQ(x->value, i);
+    ASSERT_EQ(x->node.level, 0);
+    ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+  }
+
+  ASSERT_EQ(aatree_pop_last(&tree), NULL);
+  ASSERT_EQ(tree.root, NULL);
+  ASSERT_EQ(tree.first, NULL);
+}
+
+UTEST(aatree, pop_mixed)
+{
+  aatree_t tree;
+  number_t num[COUNT * 8];
+  int      next = 0;
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+
+  /* Hold model: keep popping from both ends while feeding new random keys. */
+  for (int round = 0; round < COUNT * 8; round++)
+  {
+    number_t *x = &num[next++];
+
+    aatree_init_node(&x->node);
+    x->value = rand();
+
+    aatree_insert(&tree, &x->node);
+
+    if (round % 3 == 1)
+    {
+      number_t *first = aatree_first(&tree);
+      ASSERT_EQ(aatree_pop_first(&tree), first);
+    }
+    else if (round % 5 == 4)
+    {
+      number_t *last = aatree_last(&tree);
+      ASSERT_EQ(aatree_pop_last(&tree), last);
+    }
+
+    ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+  }
+}
+
+UTEST(aatree, reinsert)
+{
+  aatree_t tree;
+  number_t num[COUNT];
+  int      ix[COUNT];
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    ix[i]        = i;
+    num[i].value = i * 4;
+    aatree_init_node(&num[i].node);
+  }
+
+  shuffle(ix, COUNT);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    aatree_insert(&tree, &num[ix[i]].node);
+  }
+
+  /* Small move within the gap keeps the node in place. */
+  num[10].value = 41;
+  ASSERT_EQ(aatree_reinsert(&tree, &num[10].node), NULL);
+  ASSERT_EQ(aatree_next(&tree, &num[10].node), &num[11]);
+  ASSERT_EQ(aatree_prev(&tree, &num[10].node), &num[9]);
+
+  /* Decrease-key to the front and reschedule to the back. */
+  num[50].value = -1;
+  ASSERT_EQ(aatree_reinsert(&tree, &num[50].node), NULL);
+  ASSERT_EQ(aatree_first(&tree), &num[50]);
+
+  num[0].value = COUNT * 4;
+  ASSERT_EQ(aatree_reinsert(&tree, &num[0].node), NULL);
+  ASSERT_EQ(aatree_last(&tree), &num[0]);
+
+  ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+
+  /* Collision leaves the node unlinked. */
+  num[20].value = 44;
+  ASSERT_EQ(aatree_reinsert(&tree, &num[20].node), &num[11]);
+  ASSERT_EQ(num[20].node.level, 0);
+  ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+}
+
+UTEST(aatree, build_sorted)
+{
+  number_t      *numbers = malloc(COUNT * sizeof(number_t));
+  aatree_node_t *nodes[COUNT];
+  aatree_t       tree;
+
+  for (int n = 0; n <= COUNT; n++)
+  {
+    aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                     cmp_ints);
+
+    for (int i = 0; i < n; i++)
+    {
+      aatree_init_node(&numbers[i].node);
+      numbers[i].value = i * 2;
+      nodes[i]         = &numbers[i].node;
+    }
+
+    ASSERT_EQ(aatree_build_sorted(&tree, nodes, n), 0);
+    ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+
+    if (n)
+    {
+      ASSERT_EQ(aatree_first(&tree), &numbers[0]);
+      ASSERT_EQ(aatree_last(&tree), &numbers[n - 1]);
+      ASSERT_EQ(aatree_build_sorted(&tree, nodes, n), -1);
+
+      /* The tree is an ordinary one from now on. */
+      int key = n / 2 * 2 - 1;
+      ASSERT_EQ(aatree_search(&tree, &key, AATREE_KEY_GT), &numbers[n / 2]);
+      aatree_delete(&tree, nodes[n / 2]);
+      ASSERT_EQ(aatree_insert(&tree, nodes[n / 2]), NULL);
+      ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+    }
+  }
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+  numbers[1].value = numbers[0].value;
+  ASSERT_EQ(aatree_build_sorted(&tree, nodes, COUNT), -1);
+  ASSERT_EQ(tree.root, NULL);
+
+  free(numbers);
+}
+
+typedef struct conn
+{
+  aatree_timer_t timer;
+  int            id;
+  int            fired;
+} conn_t;
+
+static uint64_t fake_clock;
+static int      fire_log[COUNT];
+static int      fire_count;
+
+static uint64_t read_fake_clock(void *arg)
+{
+  (void)arg;
+  return fake_clock;
+}
+
+static void on_timer(aatree_timer_t *timer)
+{
+  conn_t *c = (conn_t *)((char *)timer - offsetof(conn_t, timer));
+
+  c->fired++;
+  fire_log[fire_count++] = c->id;
+}
+
+UTEST(timer, order)
+{
+  aatree_timers_t timers;
+  conn_t          c[COUNT];
+  int             ix[COUNT];
+  uint64_t        next;
+
+  fake_clock = 0;
+  fire_count = 0;
+
+  aatree_timers_init(&timers, read_fake_clock, NULL, 0);
+  ASSERT_FALSE(aatree_timers_next(&timers, &next));
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    ix[i]   = i;
+    c[i].id = i;
+    c[i].fired = 0;
+    aatree_timer_init(&c[i].timer, on_timer);
+  }
+
+  shuffle(ix, COUNT);
+
+  /* Pairs of timers share deadlines and must fire in arming order. */
+  for (int i = 0; i < COUNT; i++)
+  {
+    aatree_timer_arm(&timers, &c[ix[i]].timer, 100 + ix[i] / 2);
+  }
+
+  ASSERT_EQ(timers.count, COUNT);
+  ASSERT_TRUE(aatree_timers_next(&timers, &next));
+  ASSERT_EQ(next, 100);
+
+  fake_clock = 99;
+  ASSERT_EQ(aatree_timers_expire(&timers), 0);
+
+  fake_clock = 100 + COUNT / 4;
+  ASSERT_EQ(aatree_timers_expire(&timers), (COUNT / 4 + 1) * 2);
+
+  fake_clock = 1000;
+  ASSERT_EQ(aatree_timers_expire(&timers), COUNT - (COUNT / 4 + 1) * 2);
+  ASSERT_EQ(timers.count, 0);
+  ASSERT_EQ(fire_count, COUNT);
+
+  for (int i = 1; i < COUNT; i++)
+  {
+    int a = fire_log[i - 1];
+    int b = fire_log[i];
+
+    ASSERT_LE(a / 2, b / 2);
+
+    if (a / 2 == b / 2)
+    {
+      ASSERT_LT(c[a].timer.key.seq, c[b].timer.key.seq);
+    }
+  }
+}
+
+UTEST(timer, cancel_and_rearm)
+{
+  aatree_timers_t timers;
+  conn_t          c[COUNT];
+
+  fake_clock = 0;
+  fire_count = 0;
+
+  aatree_timers_init(&timers, read_fake_clock, NULL, 0);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    c[i].id    = i;
+    c[i].fired = 0;
+    aatree_timer_init(&c[i].timer, on_timer);
+    aatree_timer_arm_after(&timers, &c[i].timer, 10 + i);
+  }
+
+  /* Cancel the odd ones, push the ones divisible by four far away. */
+  for (int i = 0; i < COUNT; i++)
+  {
+    if (i % 2)
+    {
+      ASSERT_TRUE(aatree_timer_cancel(&timers, &c[i].timer));
+      ASSERT_FALSE(aatree_timer_pending(&c[i].timer));
+      ASSERT_FALSE(aatree_timer_cancel(&timers, &c[i].timer));
+    }
+    else if (i % 4 == 0)
+    {
+      aatree_timer_arm(&timers, &c[i].timer, 10000);
+    }
+  }
+
+  fake_clock = 5000;
+  aatree_timers_expire(&timers);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    ASSERT_EQ(c[i].fired, (i % 2 == 0 && i % 4 != 0) ? 1 : 0);
+  }
+
+  fake_clock = 10000;
+  aatree_timers_expire(&timers);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    ASSERT_EQ(c[i].fired, i % 2 == 0 ? 1 : 0);
+  }
+
+  ASSERT_EQ(timers.count, 0);
+  ASSERT_EQ(aatree_verify(&timers.tree), EXIT_SUCCESS);
+}
+
+static aatree_timers_t *rearm_timers;
+static conn_t          *rearm_victim;
+
+static void on_rearm(aatree_timer_t *timer)
+{
+  on_timer(timer);
+
+  /* Re-arm self as already due and cancel a timer fired in the same batch. */
+  aatree_timer_arm(rearm_timers, timer, 0);
+  aatree_timer_cancel(rearm_timers, &rearm_victim->timer);
+}
+
+UTEST(timer, callbacks)
+{
+  aatree_timers_t timers;
+  conn_t          a, b;
+
+  fake_clock = 0;
+  fire_count = 0;
+
+  aatree_timers_init(&timers, read_fake_clock, NULL, 0);
+
+  a.id = 1;
+  a.fired = 0;
+  b.id = 2;
+  b.fired = 0;
+
+  aatree_timer_init(&a.timer, on_rearm);
+  aatree_timer_init(&b.timer, on_timer);
+
+  rearm_timers = &timers;
+  rearm_victim = &b;
+
+  aatree_timer_arm(&timers, &a.timer, 5);
+  aatree_timer_arm(&timers, &b.timer, 5);
+
+  fake_clock = 5;
+
+  /* a re-arms itself and cancels b before it has a chance to fire. */
+  ASSERT_EQ(aatree_timers_expire(&timers), 1);
+  ASSERT_EQ(a.fired, 1);
+  ASSERT_EQ(b.fired, 0);
+  ASSERT_TRUE(aatree_timer_pending(&a.timer));
+
+  a.timer.fn = on_timer;
+  ASSERT_EQ(aatree_timers_expire(&timers), 1);
+  ASSERT_EQ(a.fired, 2);
+  ASSERT_EQ(timers.count, 0);
+}
+
+UTEST(timer, bucket)
+{
+  aatree_timers_t timers;
+  conn_t          c[4];
+  uint64_t        next;
+
+  fake_clock = 23;
+  fire_count = 0;
+
+  aatree_timers_init(&timers, read_fake_clock, NULL, 10);
+
+  for (int i = 0; i < 4; i++)
+  {
+    c[i].id    = i;
+    c[i].fired = 0;
+    aatree_timer_init(&c[i].timer, on_timer);
+  }
+
+  /* The current slot ends at 30: 25 and 29 go to the bucket. */
+  aatree_timer_arm(&timers, &c[0].timer, 29);
+  aatree_timer_arm(&timers, &c[1].timer, 25);
+  aatree_timer_arm(&timers, &c[2].timer, 31);
+  aatree_timer_arm(&timers, &c[3].timer, 30);
+
+  ASSERT_EQ(c[0].timer.state, AATREE_TIMER_BUCKET);
+  ASSERT_EQ(c[1].timer.state, AATREE_TIMER_BUCKET);
+  ASSERT_EQ(c[2].timer.state, AATREE_TIMER_TREE);
+  ASSERT_EQ(c[3].timer.state, AATREE_TIMER_TREE);
+
+  ASSERT_TRUE(aatree_timers_next(&timers, &next));
+  ASSERT_EQ(next, 30);
+
+  /* Bucket timers are never early. */
+  fake_clock = 29;
+  ASSERT_EQ(aatree_timers_expire(&timers), 0);
+
+  ASSERT_TRUE(aatree_timer_cancel(&timers, &c[0].timer));
+
+  fake_clock = 30;
+  ASSERT_EQ(aatree_timers_expire(&timers), 2);
+  ASSERT_EQ(fire_log[0], 1);
+  ASSERT_EQ(fire_log[1], 3);
+
+  fake_clock = 31;
+  ASSERT_EQ(aatree_timers_expire(&timers), 1);
+  ASSERT_EQ(fire_log[2], 2);
+  ASSERT_FALSE(aatree_timers_next(&timers, &next));
+}
+
+typedef struct object
+{
+  int                  key;
+  aatree_cache_entry_t entry;
+  int                  evicted;
+} object_t;
+
+static uint64_t hash_int(const void *key)
+{
+  /* Poor hash on purpose: long collision chains exercise the probing. */
+  return (uint64_t)(*(const int *)key % 7);
+}
+
+static int equal_ints(const void *a, const void *b)
+{
+  return *(const int *)a == *(const int *)b;
+}
+
+static void on_evict(void *obj, void *arg)
+{
+  ((object_t *)obj)->evicted++;
+  (*(int *)arg)++;
+}
+
+UTEST(cache, put_get_remove)
+{
+  aatree_cache_t        cache;
+  aatree_cache_entry_t *slots[256];
+  object_t              obj[COUNT];
+  int                   ix[COUNT];
+
+  ASSERT_EQ(aatree_cache_init(&cache, slots, 100, offsetof(object_t, entry),
+                              offsetof(object_t, key), hash_int, equal_ints),
+            -1);
+  ASSERT_EQ(aatree_cache_init(&cache, slots, 256, (size_t)UINT16_MAX,
+                              offsetof(object_t, key), hash_int, equal_ints),
+            -1);
+  ASSERT_EQ(aatree_cache_init(&cache, slots, 256, offsetof(object_t, entry),
+                              offsetof(object_t, key), hash_int, equal_ints),
+            0);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    void *old = &old;
+
+    ix[i]      = i;
+    obj[i].key = i;
+    ASSERT_EQ(aatree_cache_put(&cache, &obj[i], 1000 + i, &old), 0);
+    ASSERT_EQ(old, NULL);
+  }
+
+  ASSERT_EQ(aatree_cache_count(&cache), COUNT);
+
+  shuffle(ix, COUNT);
+
+  /* Remove half of the objects in random order, the rest must stay
+   * reachable across the backward shifts. */
+  for (int i = 0; i < COUNT / 2; i++)
+  {
+    aatree_cache_remove(&cache, &obj[ix[i]]);
+  }
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    int key = ix[i];
+
+    ASSERT_EQ(aatree_cache_get(&cache, &key), i < COUNT / 2 ? NULL : &obj[key]);
+  }
+
+  ASSERT_EQ(aatree_cache_count(&cache), COUNT - COUNT / 2);
+  ASSERT_EQ(aatree_verify(&cache.order), EXIT_SUCCESS);
+}
+
+UTEST(cache, replace)
+{
+  aatree_cache_t        cache;
+  aatree_cache_entry_t *slots[8];
+  object_t              a, b, c;
+  void                 *old = NULL;
+  int                   key = 5;
+
+  aatree_cache_init(&cache, slots, 8, offsetof(object_t, entry),
+                    offsetof(object_t, key), hash_int, equal_ints);
+
+  a.key = 5;
+  b.key = 5;
+  c.key = 6;
+
+  ASSERT_EQ(aatree_cache_put(&cache, &a, 10, &old), 0);
+  ASSERT_EQ(aatree_cache_put(&cache, &c, 20, &old), 0);
+  ASSERT_EQ(aatree_cache_put(&cache, &b, 30, &old), 0);
+  ASSERT_EQ(old, &a);
+  ASSERT_EQ(aatree_cache_get(&cache, &key), &b);
+  ASSERT_EQ(aatree_cache_count(&cache), 2);
+  ASSERT_EQ(aatree_first(&cache.order), &c);
+}
+
+UTEST(cache, full)
+{
+  aatree_cache_t        cache;
+  aatree_cache_entry_t *slots[16];
+  object_t              obj[16];
+
+  aatree_cache_init(&cache, slots, 16, offsetof(object_t, entry),
+                    offsetof(object_t, key), hash_int, equal_ints);
+
+  for (int i = 0; i < 16; i++)
+  {
+    obj[i].key = i;
+    ASSERT_EQ(aatree_cache_put(&cache, &obj[i], i, NULL), i < 14 ? 0 : -1);
+  }
+
+  ASSERT_EQ(aatree_cache_evict_first(&cache), &obj[0]);
+  ASSERT_EQ(aatree_cache_put(&cache, &obj[14], 14, NULL), 0);
+}
+
+UTEST(cache, lru_and_ttl)
+{
+  aatree_cache_t        cache;
+  aatree_cache_entry_t *slots[256];
+  object_t              obj[COUNT];
+  int                   evicted = 0;
+
+  aatree_cache_init(&cache, slots, 256, offsetof(object_t, entry),
+                    offsetof(object_t, key), hash_int, equal_ints);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    obj[i].key     = i;
+    obj[i].evicted = 0;
+    aatree_cache_put(&cache, &obj[i], 100, NULL);
+  }
+
+  /* Equal expiry times keep insertion order, touching moves to the back. */
+  aatree_cache_touch(&cache, &obj[0], 100);
+  ASSERT_EQ(aatree_first(&cache.order), &obj[1]);
+  ASSERT_EQ(aatree_last(&cache.order), &obj[0]);
+
+  for (int i = 0; i < COUNT; i += 2)
+  {
+    aatree_cache_touch(&cache, &obj[i], 200);
+  }
+
+  ASSERT_EQ(aatree_cache_evict_expired(&cache, 99, on_evict, &evicted), 0);
+  ASSERT_EQ(aatree_cache_evict_expired(&cache, 150, on_evict, &evicted),
+            COUNT / 2);
+  ASSERT_EQ(evicted, COUNT / 2);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    int key = i;
+
+    ASSERT_EQ(obj[i].evicted, i % 2);
+    ASSERT_EQ(aatree_cache_get(&cache, &key), i % 2 ? NULL : &obj[i]);
+  }
+
+  ASSERT_EQ(aatree_cache_count(&cache), COUNT - COUNT / 2);
+  ASSERT_EQ(aatree_verify(&cache.order), EXIT_SUCCESS);
+}
+
+static int cmp_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static uint64_t check_counts(aatree_node_t *node)
+{
+  aatree_window_node_t *w = (aatree_window_node_t *)node;
+
+  if (!node)
+    return 0;
+
+  if (w->count != w->mult + check_counts(node->left) + check_counts(node->right))
+    abort();
+
+  return w->count;
+}
+
+UTEST(window, quantiles)
+{
+  enum { CAP = 200 };
+
+  aatree_window_t      win;
+  double               samples[CAP];
+  aatree_window_node_t nodes[CAP];
+  double               history[CAP * 10];
+  double               sorted[CAP];
+
+  aatree_window_init(&win, samples, nodes, CAP);
+  ASSERT_EQ(aatree_window_quantile(&win, 0.5), 0.0);
+
+  for (int i = 0; i < CAP * 10; i++)
+  {
+    /* Few distinct values, so duplicates are common. */
+    history[i] = (double)(rand() % 50) / 4;
+    aatree_window_push(&win, history[i]);
+
+    int n     = i + 1 < CAP ? i + 1 : CAP;
+    int first = i + 1 - n;
+
+    ASSERT_EQ(aatree_window_size(&win), n);
+
+    if (i % 37)
+      continue;
+
+    memcpy(sorted, &history[first], n * sizeof(double));
+    qsort(sorted, n, sizeof(double), cmp_doubles);
+
+    for (int k = 0; k < n; k++)
+    {
+      ASSERT_EQ(aatree_window_rank(&win, k), sorted[k]);
+    }
+
+    ASSERT_EQ(aatree_window_quantile(&win, 0.0), sorted[0]);
+    ASSERT_EQ(aatree_window_quantile(&win, 1.0), sorted[n - 1]);
+
+    double pos = 0.99 * (n - 1);
+    int    lo  = (int)pos;
+    double p99 = lo + 1 < n ? sorted[lo] + (pos - lo) * (sorted[lo + 1] - sorted[lo])
+                            : sorted[lo];
+
+    ASSERT_NEAR(aatree_window_quantile(&win, 0.99), p99, 1e-9);
+    ASSERT_EQ(check_counts(win.tree.root), (uint64_t)n);
+    ASSERT_EQ(aatree_verify(&win.tree), EXIT_SUCCESS);
+  }
+}
+
+UTEST(window, advance_and_expire)
+{
+  enum { CAP = 64 };
+
+  aatree_window_t      win;
+  double               samples[CAP];
+  aatree_window_node_t nodes[CAP];
+  double               batch[CAP * 3];
+
+  aatree_window_init(&win, samples, nodes, CAP);
+
+  for (int i = 0; i < CAP * 3; i++)
+  {
+    batch[i] = i;
+  }
+
+  /* Only the last CAP samples of an oversized batch survive. */
+  aatree_window_advance(&win, batch, CAP * 3);
+  ASSERT_EQ(aatree_window_size(&win), CAP);
+  ASSERT_EQ(aatree_window_rank(&win, 0), CAP * 2);
+  ASSERT_EQ(aatree_window_rank(&win, CAP - 1), CAP * 3 - 1);
+
+  aatree_window_advance(&win, batch, 10);
+  ASSERT_EQ(aatree_window_rank(&win, 0), 0);
+  ASSERT_EQ(aatree_window_rank(&win, 10), CAP * 2 + 10);
+
+  ASSERT_EQ(aatree_window_expire(&win, CAP - 10), CAP - 10);
+  ASSERT_EQ(aatree_window_size(&win), 10);
+  ASSERT_EQ(aatree_window_quantile(&win, 0.5), 4.5);
+
+  ASSERT_EQ(aatree_window_expire(&win, CAP), 10);
+  ASSERT_EQ(win.tree.root, NULL);
+  check_counts(win.tree.root);
+}
+
+typedef enum
+{
+  SHARED_FREE,
+  SHARED_LINKED,
+  SHARED_RETIRED
+} shared_state;
+
+typedef struct shared
+{
+  aatree_node_t        node;
+  int                  value;
+  aatree_epoch_entry_t retire;
+  int                  state;
+} shared_t;
+
+static size_t reclaimed_count;
+
+static void on_reclaim(aatree_epoch_entry_t *link, void *arg)
+{
+  shared_t *entry =
+      (shared_t *)((uint8_t *)link - offsetof(shared_t, retire));
+
+  (void)arg;
+  __atomic_store_n(&entry->state, SHARED_FREE, __ATOMIC_RELAXED);
+  reclaimed_count++;
+}
+
+UTEST(rcu, search_and_reclaim)
+{
+  aatree_rcu_t          rcu;
+  aatree_t              plain;
+  aatree_epoch_record_t record;
+  shared_t              entries[COUNT];
+  number_t              numbers[COUNT];
+
+  reclaimed_count = 0;
+
+  ASSERT_EQ(aatree_rcu_init(&rcu, offsetof(shared_t, node),
+                            offsetof(shared_t, value), cmp_ints, on_reclaim,
+                            NULL),
+            0);
+  aatree_init_tree(&plain, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+  aatree_rcu_register(&rcu, &record);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    aatree_init_node(&entries[i].node);
+    entries[i].value = i * 2;
+    entries[i].state = SHARED_LINKED;
+    ASSERT_EQ(aatree_rcu_insert(&rcu, &entries[i].node), NULL);
+
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i * 2;
+    aatree_insert(&plain, &numbers[i].node);
+  }
+
+  ASSERT_EQ(aatree_rcu_insert(&rcu, &entries[0].node), &entries[0]);
+
+  /* Every search order agrees with the plain tree. */
+  aatree_rcu_read_lock(&rcu, &record);
+
+  for (int key = -1; key <= COUNT * 2; key++)
+  {
+    for (int order = AATREE_KEY_EQ; order <= AATREE_KEY_GE; order++)
+    {
+      shared_t *found  = aatree_rcu_search(&rcu, &key, order);
+      number_t *expect = aatree_search(&plain, &key, order);
+
+      ASSERT_EQ(found ? found->value : -100, expect ? expect->value : -100);
+    }
+  }
+
+  aatree_rcu_read_unlock(&record);
+
+  for (int i = 0; i < COUNT; i += 2)
+  {
+    aatree_rcu_delete(&rcu, &entries[i].node, &entries[i].retire);
+  }
+
+  ASSERT_EQ(aatree_verify(&rcu.tree), EXIT_SUCCESS);
+
+  aatree_rcu_synchronize(&rcu);
+  ASSERT_EQ(reclaimed_count, (size_t)(COUNT + 1) / 2);
+  ASSERT_EQ(rcu.epoch.pending, 0);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    int key = i * 2;
+
+    ASSERT_EQ(aatree_rcu_search(&rcu, &key, AATREE_KEY_EQ),
+              i % 2 ? &entries[i] : NULL);
+  }
+
+  aatree_rcu_unregister(&rcu, &record);
+  aatree_rcu_destroy(&rcu);
+}
+
+typedef struct rcu_test
+{
+  aatree_rcu_t rcu;
+  shared_t     entries[COUNT * 2];
+  int          done;
+  int          errors;
+} rcu_test_t;
+
+/* Search all the keys while the writer is changing the odd ones: even keys
+ * must always be found, odd ones may come and go, but no entry found can be
+ * reclaimed under the reader's feet. */
+static void *rcu_reader(void *arg)
+{
+  rcu_test_t           *test = arg;
+  aatree_epoch_record_t record;
+
+  aatree_rcu_register(&test->rcu, &record);
+
+  while (!__atomic_load_n(&test->done, __ATOMIC_ACQUIRE))
+  {
+    aatree_rcu_read_lock(&test->rcu, &record);
+
+    for (int key = 0; key < COUNT * 2; key++)
+    {
+      shared_t *entry = aatree_rcu_search(&test->rcu, &key, AATREE_KEY_EQ);
+      shared_t *next  = aatree_rcu_search(&test->rcu, &key, AATREE_KEY_GT);
+
+      if ((!entry && key % 2 == 0) || (entry && entry->value != key)
+          || (entry
+              && __atomic_load_n(&entry->state, __ATOMIC_RELAXED)
+                     == SHARED_FREE)
+          || (next && next->value <= key)
+          || (!next && key < COUNT * 2 - 2))
+      {
+        __atomic_add_fetch(&test->errors, 1, __ATOMIC_RELAXED);
+      }
+    }
+
+    aatree_rcu_read_unlock(&record);
+  }
+
+  aatree_rcu_unregister(&test->rcu, &record);
+
+  return NULL;
+}
+
+UTEST(rcu, concurrent_readers)
+{
+  rcu_test_t *test = calloc(1, sizeof(*test));
+  pthread_t   readers[3];
+
+  reclaimed_count = 0;
+
+  ASSERT_EQ(aatree_rcu_init(&test->rcu, offsetof(shared_t, node),
+                            offsetof(shared_t, value), cmp_ints, on_reclaim,
+                            NULL),
+            0);
+
+  for (int i = 0; i < COUNT * 2; i++)
+  {
+    aatree_init_node(&test->entries[i].node);
+    test->entries[i].value = i;
+    test->entries[i].state = SHARED_FREE;
+
+    if (i % 2 == 0)
+    {
+      test->entries[i].state = SHARED_LINKED;
+      aatree_rcu_insert(&test->rcu, &test->entries[i].node);
+    }
+  }
+
+  for (int i = 0; i < 3; i++)
+  {
+    ASSERT_EQ(pthread_create(&readers[i], NULL, rcu_reader, test), 0);
+  }
+
+  for (int n = 0; n < 20000; n++)
+  {
+    shared_t *entry = &test->entries[(rand() % COUNT) * 2 + 1];
+    int       state = __atomic_load_n(&entry->state, __ATOMIC_RELAXED);
+
+    if (state == SHARED_FREE)
+    {
+      aatree_init_node(&entry->node);
+      entry->state = SHARED_LINKED;
+      aatree_rcu_insert(&test->rcu, &entry->node);
+    }
+    else if (state == SHARED_LINKED)
+    {
+      entry->state = SHARED_RETIRED;
+      aatree_rcu_delete(&test->rcu, &entry->node, &entry->retire);
+    }
+
+    /* Let the readers run on a single core too. */
+    if (n % 64 == 0)
+      sched_yield();
+  }
+
+  __atomic_store_n(&test->done, 1, __ATOMIC_RELEASE);
+
+  for (int i = 0; i < 3; i++)
+  {
+    pthread_join(readers[i], NULL);
+  }
+
+  ASSERT_EQ(test->errors, 0);
+  ASSERT_EQ(aatree_verify(&test->rcu.tree), EXIT_SUCCESS);
+
+  aatree_rcu_destroy(&test->rcu);
+
+  for (int i = 1; i < COUNT * 2; i += 2)
+  {
+    ASSERT_NE(test->entries[i].state, SHARED_RETIRED);
+  }
+
+  free(test);
+}
+
+typedef struct record
+{
+  aatree_node_t node;
+  int           key;
+  int           payload;
+} record_t;
+
+UTEST(sync, search_scan_pool)
+{
+  aatree_sync_t       sync;
+  aatree_sync_stats_t stats = {0};
+  record_t            pool[COUNT];
+  record_t            out[8];
+  record_t           *entry;
+
+  ASSERT_EQ(aatree_sync_init(&sync, pool, sizeof(record_t), COUNT,
+                             offsetof(record_t, node), offsetof(record_t, key),
+                             cmp_ints),
+            0);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    entry          = aatree_sync_alloc(&sync);
+    entry->key     = i * 2;
+    entry->payload = -i;
+    ASSERT_EQ(aatree_sync_insert(&sync, entry), NULL);
+  }
+
+  ASSERT_EQ(aatree_sync_alloc(&sync), NULL);
+  ASSERT_EQ(aatree_verify(&sync.tree), EXIT_SUCCESS);
+
+  for (int key = -1; key <= COUNT * 2; key++)
+  {
+    for (int order = AATREE_KEY_EQ; order <= AATREE_KEY_GE; order++)
+    {
+      record_t *expect = aatree_search(&sync.tree, &key, order);
+      int       found  = aatree_sync_search(&sync, &key, order, out, &stats);
+
+      ASSERT_EQ(found, expect != NULL);
+
+      if (found)
+      {
+        ASSERT_EQ(out[0].key, expect->key);
+        ASSERT_EQ(out[0].payload, expect->payload);
+      }
+    }
+  }
+
+  ASSERT_EQ(stats.reads, (uint64_t)(COUNT * 2 + 2) * 5);
+  ASSERT_EQ(stats.retries, 0);
+
+  int from = 11;
+
+  ASSERT_EQ(aatree_sync_scan(&sync, &from, out, 5, NULL), 5);
+
+  for (int i = 0; i < 5; i++)
+  {
+    ASSERT_EQ(out[i].key, 12 + i * 2);
+  }
+
+  from = COUNT * 2 - 5;
+  ASSERT_EQ(aatree_sync_scan(&sync, &from, out, 8, NULL), 2);
+  ASSERT_EQ(out[1].key, COUNT * 2 - 2);
+
+  /* Deleted entries go back to the pool. */
+  for (int key = 0; key < COUNT * 2; key += 4)
+  {
+    ASSERT_TRUE(aatree_sync_delete(&sync, &key));
+    ASSERT_FALSE(aatree_sync_delete(&sync, &key));
+  }
+
+  ASSERT_EQ(aatree_verify(&sync.tree), EXIT_SUCCESS);
+
+  entry      = aatree_sync_alloc(&sync);
+  entry->key = 2;
+  ASSERT_EQ(aatree_sync_insert(&sync, entry), &pool[1]);
+  aatree_sync_free(&sync, entry);
+
+  from = 0;
+  ASSERT_FALSE(aatree_sync_search(&sync, &from, AATREE_KEY_EQ, out, NULL));
+  ASSERT_TRUE(aatree_sync_search(&sync, &from, AATREE_KEY_GT, out, NULL));
+  ASSERT_EQ(out[0].key, 2);
+
+  aatree_sync_destroy(&sync);
+}
+
+static int collect_numbers(void *entry, void *arg)
+{
+  int *keys = arg;
+
+  keys[++keys[0]] = ((number_t *)entry)->value;
+
+  return keys[0] == COUNT * 2;
+}
+
+/* Every shard is a valid tree holding keys of its own range only */
+static int check_shards(aatree_sharded_t *sh)
+{
+  aatree_shard_table_t *table = sh->table;
+  size_t                total = 0;
+
+  for (size_t pos = 0; pos < table->count; pos++)
+  {
+    aatree_shard_t *shard = &sh->shards[table->shard[pos]];
+    size_t          size  = 0;
+
+    if (aatree_verify(&shard->tree) != EXIT_SUCCESS || !shard->live)
+      return -1;
+
+    for (number_t *n = aatree_first(&shard->tree); n;
+         n = aatree_next(&shard->tree, &n->node), size++)
+    {
+      if ((shard->has_lo && n->value < *(int *)&shard->lo)
+          || (shard->has_hi && n->value >= *(int *)&shard->hi))
+        return -1;
+    }
+
+    total += size;
+  }
+
+  return (int)total;
+}
+
+UTEST(shard, routing_and_resize)
+{
+  static aatree_shard_t shards[8];
+  aatree_sharded_t      sh;
+  aatree_t              plain;
+  number_t              numbers[COUNT * 2];
+  number_t              copies[COUNT * 2];
+  int                   bounds[] = {50, 150};
+  int                   keys[COUNT * 2 + 1];
+
+  ASSERT_EQ(aatree_sharded_init(&sh, shards, 8, sizeof(int),
+                                offsetof(number_t, node),
+                                offsetof(number_t, value), cmp_ints, bounds, 2),
+            0);
+  aatree_init_tree(&plain, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+  ASSERT_EQ(aatree_sharded_count(&sh), 3);
+
+  for (int i = 0; i < COUNT * 2; i++)
+  {
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i * 3 % (COUNT * 2) * 2;
+    ASSERT_EQ(aatree_sharded_insert(&sh, &numbers[i].node), NULL);
+
+    aatree_init_node(&copies[i].node);
+    copies[i].value = numbers[i].value;
+    aatree_insert(&plain, &copies[i].node);
+  }
+
+  ASSERT_EQ(aatree_sharded_insert(&sh, &copies[0].node), &numbers[0]);
+  ASSERT_EQ(check_shards(&sh), COUNT * 2);
+
+  for (int round = 0; round < 3; round++)
+  {
+    /* Nearest keys are found across the range bounds. */
+    for (int key = -1; key <= COUNT * 4; key++)
+    {
+      for (int order = AATREE_KEY_EQ; order <= AATREE_KEY_GE; order++)
+      {
+        number_t *found  = aatree_sharded_search(&sh, &key, order);
+        number_t *expect = aatree_search(&plain, &key, order);
+
+        ASSERT_EQ(found ? found->value : -100, expect ? expect->value : -100);
+      }
+    }
+
+    int from = 41;
+
+    keys[0] = 0;
+    ASSERT_EQ(aatree_sharded_scan(&sh, &from, collect_numbers, keys),
+              (size_t)COUNT * 2 - 21);
+
+    for (int i = 1; i <= keys[0]; i++)
+    {
+      ASSERT_EQ(keys[i], 40 + i * 2);
+    }
+
+    if (round == 0)
+    {
+      /* Split every range in two. */
+      for (size_t pos = aatree_sharded_count(&sh); pos > 0; pos--)
+      {
+        ASSERT_EQ(aatree_sharded_split(&sh, pos - 1), 0);
+      }
+
+      ASSERT_EQ(aatree_sharded_count(&sh), 6);
+    }
+    else if (round == 1)
+    {
+      while (aatree_sharded_count(&sh) > 1)
+      {
+        ASSERT_EQ(aatree_sharded_merge(&sh, 0), 0);
+      }
+
+      ASSERT_EQ(aatree_sharded_merge(&sh, 0), -1);
+    }
+
+    ASSERT_EQ(check_shards(&sh), COUNT * 2);
+  }
+
+  ASSERT_EQ(aatree_sharded_split(&sh, 0), 0);
+  ASSERT_EQ(aatree_sharded_split(&sh, 1), 0);
+  aatree_sharded_balance(&sh);
+
+  /* The range taking all the updates gets split, the idle ones merged. */
+  for (int n = 0; n < 3; n++)
+  {
+    for (int i = 0; i < COUNT * 2; i++)
+    {
+      if (numbers[i].value >= 400)
+      {
+        aatree_sharded_delete(&sh, &numbers[i].node);
+        aatree_sharded_insert(&sh, &numbers[i].node);
+      }
+    }
+  }
+
+  ASSERT_EQ(aatree_sharded_balance(&sh), 2);
+  ASSERT_EQ(aatree_sharded_count(&sh), 3);
+  ASSERT_EQ(check_shards(&sh), COUNT * 2);
+
+  for (int i = 0; i < COUNT * 2; i++)
+  {
+    if (numbers[i].value < 100)
+      aatree_sharded_delete(&sh, &numbers[i].node);
+  }
+
+  ASSERT_EQ(check_shards(&sh), COUNT * 2 - 50);
+
+  aatree_sharded_destroy(&sh);
+}
+
+typedef struct shard_test
+{
+  aatree_sharded_t *sh;
+  number_t         *numbers;
+  int               ix;
+} shard_test_t;
+
+/* Flip a stripe of keys in and out while the ranges are being resized */
+static void *shard_writer(void *arg)
+{
+  shard_test_t *test = arg;
+
+  for (int round = 0; round < 21; round++)
+  {
+    for (int i = test->ix; i < COUNT * 16; i += 4)
+    {
+      if (round % 2 == 0)
+        aatree_sharded_insert(test->sh, &test->numbers[i].node);
+      else
+        aatree_sharded_delete(test->sh, &test->numbers[i].node);
+    }
+
+    sched_yield();
+  }
+
+  return NULL;
+}
+
+UTEST(shard, concurrent_writers)
+{
+  static aatree_shard_t shards[16];
+  aatree_sharded_t      sh;
+  shard_test_t          tests[4];
+  pthread_t             writers[4];
+  number_t             *numbers  = calloc(COUNT * 16, sizeof(number_t));
+  int                   bounds[] = {COUNT * 8};
+
+  ASSERT_EQ(aatree_sharded_init(&sh, shards, 16, sizeof(int),
+                                offsetof(number_t, node),
+                                offsetof(number_t, value), cmp_ints, bounds, 1),
+            0);
+
+  for (int i = 0; i < COUNT * 16; i++)
+  {
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i;
+  }
+
+  for (int t = 0; t < 4; t++)
+  {
+    tests[t].sh      = &sh;
+    tests[t].numbers = numbers;
+    tests[t].ix      = t;
+    ASSERT_EQ(pthread_create(&writers[t], NULL, shard_writer, &tests[t]), 0);
+  }
+
+  for (int n = 0; n < 50; n++)
+  {
+    aatree_sharded_split(&sh, n % aatree_sharded_count(&sh));
+
+    if (n % 3 == 0)
+      aatree_sharded_merge(&sh, 0);
+
+    sched_yield();
+  }
+
+  for (int t = 0; t < 4; t++)
+  {
+    pthread_join(writers[t], NULL);
+  }
+
+  ASSERT_EQ(check_shards(&sh), COUNT * 16);
+
+  aatree_sharded_destroy(&sh);
+  free(numbers);
+}
+
+typedef struct fc_test
+{
+  aatree_fc_t *fc;
+  number_t    *numbers;
+  int          ix;
+  int          errors;
+} fc_test_t;
+
+static void *fc_worker(void *arg)
+{
+  fc_test_t       *test = arg;
+  aatree_fc_slot_t slot;
+
+  aatree_fc_register(test->fc, &slot);
+
+  for (int round = 0; round < 5; round++)
+  {
+    for (int i = test->ix; i < COUNT * 8; i += 4)
+    {
+      number_t *n = &test->numbers[i];
+
+      if (round % 2 == 0)
+      {
+        aatree_init_node(&n->node);
+        test->errors += aatree_fc_insert(test->fc, &slot, &n->node) != NULL;
+      }
+      else
+      {
+        aatree_fc_delete(test->fc, &slot, &n->node);
+      }
+
+      test->errors +=
+          aatree_fc_search(test->fc, &slot, &n->value, AATREE_KEY_EQ)
+          != (round % 2 == 0 ? n : NULL);
+    }
+  }
+
+  aatree_fc_unregister(test->fc, &slot);
+
+  return NULL;
+}
+
+UTEST(fc, combining)
+{
+  aatree_fc_t      fc;
+  aatree_fc_slot_t slot;
+  fc_test_t        tests[4];
+  pthread_t        threads[4];
+  number_t        *numbers = calloc(COUNT * 8, sizeof(number_t));
+
+  ASSERT_EQ(aatree_fc_init(&fc, offsetof(number_t, node),
+                           offsetof(number_t, value), cmp_ints),
+            0);
+
+  for (int i = 0; i < COUNT * 8; i++)
+  {
+    numbers[i].value = i;
+  }
+
+  for (int t = 0; t < 4; t++)
+  {
+    tests[t].fc      = &fc;
+    tests[t].numbers = numbers;
+    tests[t].ix      = t;
+    tests[t].errors  = 0;
+    ASSERT_EQ(pthread_create(&threads[t], NULL, fc_worker, &tests[t]), 0);
+  }
+
+  for (int t = 0; t < 4; t++)
+  {
+    pthread_join(threads[t], NULL);
+    ASSERT_EQ(tests[t].errors, 0);
+  }
+
+  ASSERT_EQ(aatree_verify(&fc.tree), EXIT_SUCCESS);
+  ASSERT_EQ(fc.combined, (uint64_t)COUNT * 8 * 5 * 2);
+  ASSERT_TRUE(fc.passes <= fc.combined);
+
+  /* Every key has been left in the tree by the last round. */
+  aatree_fc_register(&fc, &slot);
+
+  int key = COUNT * 4;
+
+  ASSERT_EQ(aatree_fc_search(&fc, &slot, &key, AATREE_KEY_GT),
+            &numbers[key + 1]);
+  number_t dup = {.value = 0};
+
+  aatree_init_node(&dup.node);
+  ASSERT_EQ(aatree_fc_insert(&fc, &slot, &dup.node), &numbers[0]);
+
+  aatree_fc_unregister(&fc, &slot);
+  ASSERT_EQ(fc.slots, NULL);
+
+  aatree_fc_destroy(&fc);
+  free(numbers);
+}
+
+static int live_pnodes;
+
+static aatree_pnode_t *alloc_pnode(void *arg)
+{
+  (void)arg;
+  live_pnodes++;
+  return malloc(sizeof(aatree_pnode_t));
+}
+
+static void free_pnode(aatree_pnode_t *node, void *arg)
+{
+  (void)arg;
+  live_pnodes--;
+  free(node);
+}
+
+/* Check AA invariants of a version, returns the number of entries */
+static int check_version(const aatree_pnode_t *node)
+{
+  if (!node)
+    return 0;
+
+  if (node->refs < 1 || node->level < 1)
+    return -1;
+
+  if (!node->left && !node->right && node->level != 1)
+    return -1;
+
+  if ((node->left ? node->left->level : 0) != node->level - 1)
+    return -1;
+
+  if ((node->right ? node->right->level : 0) < node->level - 1
+      || (node->right ? node->right->level : 0) > node->level)
+    return -1;
+
+  if (node->right && node->right->right
+      && node->right->right->level >= node->level)
+    return -1;
+
+  int left  = check_version(node->left);
+  int right = check_version(node->right);
+
+  return left < 0 || right < 0 ? -1 : left + right + 1;
+}
+
+UTEST(persist, snapshots)
+{
+  aatree_persist_t      tree;
+  aatree_persist_iter_t iter;
+  aatree_pnode_t       *snap[4];
+  int                   values[COUNT];
+  int                  *entry;
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    values[i] = i;
+  }
+
+  shuffle(values, COUNT);
+  aatree_persist_init(&tree, 0, cmp_ints, alloc_pnode, free_pnode, NULL);
+
+  /* Snapshot the tree empty, half and fully built. */
+  snap[0] = aatree_persist_snapshot(&tree);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    if (i == COUNT / 2)
+      snap[1] = aatree_persist_snapshot(&tree);
+
+    ASSERT_EQ(aatree_persist_insert(&tree, &values[i]), NULL);
+    ASSERT_EQ(check_version(tree.root), i + 1);
+  }
+
+  snap[2] = aatree_persist_snapshot(&tree);
+
+  int dup = 7;
+  ASSERT_EQ(*(int *)aatree_persist_insert(&tree, &dup), 7);
+
+  /* Deleting every even key leaves the snapshots as they were. */
+  for (int key = 0; key < COUNT; key += 2)
+  {
+    ASSERT_EQ(*(int *)aatree_persist_delete(&tree, &key), key);
+    ASSERT_EQ(aatree_persist_delete(&tree, &key), NULL);
+    ASSERT_NE(check_version(tree.root), -1);
+  }
+
+  snap[3] = aatree_persist_snapshot(&tree);
+
+  ASSERT_EQ(snap[0], NULL);
+  ASSERT_EQ(check_version(snap[1]), COUNT / 2);
+  ASSERT_EQ(check_version(snap[2]), COUNT);
+  ASSERT_EQ(check_version(snap[3]), COUNT / 2);
+
+  for (int i = 0; i < COUNT / 2; i++)
+  {
+    ASSERT_NE(aatree_persist_search(&tree, snap[1], &values[i], AATREE_KEY_EQ),
+              NULL);
+  }
+
+  int n = 0;
+
+  for (entry = aatree_persist_seek(&tree, &iter, snap[2], NULL); entry;
+       entry = aatree_persist_next(&iter))
+  {
+    ASSERT_EQ(*entry, n++);
+  }
+
+  ASSERT_EQ(n, COUNT);
+
+  int key = 10;
+
+  ASSERT_EQ(*(int *)aatree_persist_seek(&tree, &iter, snap[3], &key), 11);
+  ASSERT_EQ(*(int *)aatree_persist_next(&iter), 13);
+  ASSERT_EQ(*(int *)aatree_persist_search(&tree, snap[3], &key, AATREE_KEY_LT),
+            9);
+  ASSERT_EQ(*(int *)aatree_persist_search(&tree, snap[2], &key, AATREE_KEY_GT),
+            11);
+  ASSERT_EQ(*(int *)aatree_persist_search(&tree, snap[2], &key, AATREE_KEY_LE),
+            10);
+
+  for (int i = 0; i < 4; i++)
+  {
+    aatree_persist_release(&tree, snap[i]);
+  }
+
+  ASSERT_EQ(live_pnodes, COUNT / 2);
+
+  /* An unshared version is updated in place. */
+  key = 1;
+  ASSERT_EQ(*(int *)aatree_persist_delete(&tree, &key), 1);
+  ASSERT_EQ(live_pnodes, COUNT / 2 - 1);
+
+  aatree_persist_clear(&tree);
+  ASSERT_EQ(live_pnodes, 0);
+}
+
+typedef struct versioned
+{
+  aatree_node_t node;
+  int           value;
+  int           generation;
+  int           torn;
+} versioned_t;
+
+#define GENERATIONS 50
+
+typedef struct swap_test
+{
+  aatree_swap_t swap;
+  versioned_t  *entries[GENERATIONS];
+  int           done;
+  int           errors;
+} swap_test_t;
+
+static void on_teardown(aatree_t *tree, void *arg)
+{
+  for (versioned_t *entry = aatree_first(tree); entry;
+       entry              = aatree_next(tree, &entry->node))
+  {
+    __atomic_store_n(&entry->torn, 1, __ATOMIC_RELAXED);
+  }
+
+  (*(int *)arg)++;
+}
+
+/* Walk the published tree: it must always be a whole generation, none of
+ * its entries torn down. */
+static void *swap_reader(void *arg)
+{
+  swap_test_t          *test = arg;
+  aatree_epoch_record_t record;
+
+  aatree_swap_register(&test->swap, &record);
+
+  while (!__atomic_load_n(&test->done, __ATOMIC_ACQUIRE))
+  {
+    const aatree_t *tree  = aatree_swap_read_lock(&test->swap, &record);
+    versioned_t    *entry = aatree_first(tree);
+    int             gen   = entry ? entry->generation : -1;
+    int             n     = 0;
+
+    for (; entry; entry = aatree_next(tree, &entry->node), n++)
+    {
+      if (entry->generation != gen || entry->value != n
+          || __atomic_load_n(&entry->torn, __ATOMIC_RELAXED))
+      {
+        __atomic_add_fetch(&test->errors, 1, __ATOMIC_RELAXED);
+      }
+
+      if (n % 32 == 0)
+        sched_yield();
+    }
+
+    if (n != 0 && n != COUNT)
+      __atomic_add_fetch(&test->errors, 1, __ATOMIC_RELAXED);
+
+    aatree_swap_read_unlock(&record);
+  }
+
+  aatree_swap_unregister(&test->swap, &record);
+
+  return NULL;
+}
+
+UTEST(swap, background_rebuild)
+{
+  swap_test_t   *test = calloc(1, sizeof(*test));
+  aatree_node_t *nodes[COUNT];
+  pthread_t      readers[3];
+  int            torn_trees = 0;
+
+  ASSERT_EQ(aatree_swap_init(&test->swap, offsetof(versioned_t, node),
+                             offsetof(versioned_t, value), cmp_ints,
+                             on_teardown, &torn_trees),
+            0);
+
+  for (int i = 0; i < 3; i++)
+  {
+    ASSERT_EQ(pthread_create(&readers[i], NULL, swap_reader, test), 0);
+  }
+
+  for (int g = 0; g < GENERATIONS; g++)
+  {
+    test->entries[g] = calloc(COUNT, sizeof(versioned_t));
+
+    for (int i = 0; i < COUNT; i++)
+    {
+      aatree_init_node(&test->entries[g][i].node);
+      test->entries[g][i].value      = i;
+      test->entries[g][i].generation = g;
+      nodes[i]                       = &test->entries[g][i].node;
+    }
+
+    ASSERT_EQ(aatree_swap_rebuild(&test->swap, nodes, COUNT), 0);
+    ASSERT_LE(torn_trees, g + 1);
+    sched_yield();
+  }
+
+  /* A failed rebuild leaves the published tree alone. */
+  nodes[0] = &test->entries[0][1].node;
+  ASSERT_EQ(aatree_swap_rebuild(&test->swap, nodes, COUNT), -1);
+
+  /* Every replaced tree and the cancelled back buffer are torn down. */
+  ASSERT_EQ(torn_trees, GENERATIONS + 1);
+
+  __atomic_store_n(&test->done, 1, __ATOMIC_RELEASE);
+
+  for (int i = 0; i < 3; i++)
+  {
+    pthread_join(readers[i], NULL);
+  }
+
+  ASSERT_EQ(test->errors, 0);
+  ASSERT_EQ(((versioned_t *)aatree_first(test->swap.current))->generation,
+            GENERATIONS - 1);
+
+  aatree_swap_destroy(&test->swap);
+  ASSERT_EQ(torn_trees, GENERATIONS + 2);
+
+  for (int g = 0; g < GENERATIONS; g++)
+  {
+    ASSERT_TRUE(test->entries[g][COUNT / 2].torn);
+    free(test->entries[g]);
+  }
+
+  free(test);
+}
+
+typedef struct kv
+{
+  int key;
+  int value;
+} kv_t;
+
+/* Insert the odd keys from another process, through its own mapping */
+static int shm_child(int fd, const aatree_shm_t *parent)
+{
+  aatree_shm_t shm;
+  kv_t         entry;
+  int          errors = 0;
+
+  if (aatree_shm_map(&shm, fd, cmp_ints) || shm.base == parent->base)
+    return 1;
+
+  for (int key = 1; key < COUNT * 2; key += 2)
+  {
+    entry.key   = key;
+    entry.value = -key;
+    errors += aatree_shm_insert(&shm, &entry) != 0;
+  }
+
+  for (int key = 0; key < COUNT * 2; key++)
+  {
+    errors += aatree_shm_search(&shm, &key, AATREE_KEY_EQ, &entry) != 0;
+    errors += entry.key != key || entry.value != -key;
+  }
+
+  aatree_shm_unmap(&shm);
+
+  return errors != 0;
+}
+
+UTEST(shm, processes)
+{
+  aatree_shm_t shm;
+  kv_t         entry;
+  char         name[64];
+  int          status;
+  pid_t        pid;
+
+  snprintf(name, sizeof(name), "/aatree-unit-tests-%d", (int)getpid());
+
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  ASSERT_NE(fd, -1);
+  shm_unlink(name);
+
+  ASSERT_EQ(aatree_shm_format(&shm, fd, sizeof(kv_t), offsetof(kv_t, key),
+                              COUNT * 2, cmp_ints),
+            0);
+
+  for (int key = 0; key < COUNT * 2; key += 2)
+  {
+    entry.key   = key;
+    entry.value = -key;
+    ASSERT_EQ(aatree_shm_insert(&shm, &entry), 0);
+  }
+
+  ASSERT_EQ(aatree_shm_insert(&shm, &entry), EEXIST);
+
+  if (!(pid = fork()))
+    _exit(shm_child(fd, &shm));
+
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(WEXITSTATUS(status), 0);
+
+  ASSERT_EQ(aatree_shm_count(&shm), COUNT * 2);
+
+  entry.key = COUNT * 2;
+  ASSERT_EQ(aatree_shm_insert(&shm, &entry), ENOMEM);
+
+  int key = COUNT;
+  ASSERT_EQ(aatree_shm_search(&shm, &key, AATREE_KEY_GT, &entry), 0);
+  ASSERT_EQ(entry.key, COUNT + 1);
+  ASSERT_EQ(aatree_shm_delete(&shm, &key, &entry), 0);
+  ASSERT_EQ(entry.value, -COUNT);
+  ASSERT_EQ(aatree_shm_delete(&shm, &key, NULL), ENOENT);
+  ASSERT_EQ(aatree_shm_search(&shm, &key, AATREE_KEY_EQ, &entry), ENOENT);
+
+  /* A writer dies in the middle of an update, links scrambled. */
+  if (!(pid = fork()))
+  {
+    pthread_mutex_lock(&shm.header->lock);
+    shm.header->seq++;
+    shm.header->root = shm.header->free;
+    _exit(0);
+  }
+
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+
+  entry.key = COUNT;
+  ASSERT_EQ(aatree_shm_insert(&shm, &entry), 0);
+  ASSERT_EQ(aatree_shm_count(&shm), COUNT * 2);
+  ASSERT_EQ(shm.header->seq % 2, 0);
+
+  for (key = 0; key < COUNT * 2; key++)
+  {
+    ASSERT_EQ(aatree_shm_search(&shm, &key, AATREE_KEY_EQ, &entry), 0);
+    ASSERT_EQ(entry.key, key);
+  }
+
+  aatree_shm_unmap(&shm);
+  close(fd);
+}
+
+typedef struct nr_test
+{
+  aatree_nr_t nr;
+  int         errors;
+} nr_test_t;
+
+typedef struct nr_worker
+{
+  nr_test_t           *test;
+  aatree_nr_replica_t *replica;
+  int                  first;
+} nr_worker_t;
+
+/* Insert and delete own keys through one replica, checking them through all
+ * of them */
+static void *nr_worker(void *arg)
+{
+  nr_worker_t *worker = arg;
+  aatree_nr_t *nr     = &worker->test->nr;
+  char         linked[COUNT] = {0};
+  record_t     entry;
+  unsigned     seed   = worker->first;
+  int          errors = 0;
+
+  for (int n = 0; n < 2000; n++)
+  {
+    int key = worker->first + (rand_r(&seed) % (COUNT / 4)) * 4;
+
+    if (key >= COUNT)
+      continue;
+
+    if (linked[key])
+    {
+      errors += aatree_nr_delete(nr, worker->replica, &key) != 0;
+    }
+    else
+    {
+      entry.key     = key;
+      entry.payload = -key;
+      errors += aatree_nr_insert(nr, worker->replica, &entry) != 0;
+    }
+
+    linked[key] = !linked[key];
+
+    for (size_t i = 0; i < nr->count; i++)
+    {
+      int found = aatree_nr_search(nr, nr->replicas[i], &key, AATREE_KEY_EQ,
+                                   &entry);
+
+      errors += found != linked[key] || (found && entry.payload != -key);
+    }
+
+    if (n % 64 == 0)
+      sched_yield();
+  }
+
+  __atomic_add_fetch(&worker->test->errors, errors, __ATOMIC_RELAXED);
+
+  return NULL;
+}
+
+UTEST(nr, replicas)
+{
+  nr_test_t           *test = calloc(1, sizeof(*test));
+  aatree_nr_replica_t *replicas = aligned_alloc(AATREE_CACHE_LINE,
+                                                2 * sizeof(*replicas));
+  record_t            *pools    = calloc(2 * COUNT, sizeof(record_t));
+  void                *log      = malloc(aatree_nr_log_size(sizeof(*pools), 8));
+  nr_worker_t          workers[4];
+  pthread_t            threads[4];
+  record_t             entry;
+
+  ASSERT_EQ(aatree_nr_init(&test->nr, log, 8, sizeof(record_t), sizeof(int),
+                           COUNT, offsetof(record_t, node),
+                           offsetof(record_t, key), cmp_ints),
+            0);
+
+  /* Two replicas as if there were two nodes. */
+  ASSERT_EQ(aatree_nr_add_replica(&test->nr, &replicas[0], pools), 0);
+  ASSERT_EQ(aatree_nr_add_replica(&test->nr, &replicas[1], pools + COUNT), 0);
+  ASSERT_NE(aatree_nr_local(&test->nr), NULL);
+
+  for (int i = 0; i < 4; i++)
+  {
+    workers[i].test    = test;
+    workers[i].replica = &replicas[i % 2];
+    workers[i].first   = i;
+    ASSERT_EQ(pthread_create(&threads[i], NULL, nr_worker, &workers[i]), 0);
+  }
+
+  for (int i = 0; i < 4; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  ASSERT_EQ(test->errors, 0);
+
+  /* Reads catch the replicas up, then they are the same. */
+  int key = 0;
+  aatree_nr_search(&test->nr, &replicas[0], &key, AATREE_KEY_GE, &entry);
+  aatree_nr_search(&test->nr, &replicas[1], &key, AATREE_KEY_GE, &entry);
+  ASSERT_EQ(replicas[0].applied, test->nr.tail);
+  ASSERT_EQ(replicas[1].applied, test->nr.tail);
+  ASSERT_EQ(aatree_verify(&replicas[0].tree), EXIT_SUCCESS);
+  ASSERT_EQ(aatree_verify(&replicas[1].tree), EXIT_SUCCESS);
+
+  record_t *a = aatree_first(&replicas[0].tree);
+  record_t *b = aatree_first(&replicas[1].tree);
+
+  for (; a && b; a = aatree_next(&replicas[0].tree, &a->node),
+                 b = aatree_next(&replicas[1].tree, &b->node))
+  {
+    ASSERT_EQ(a->key, b->key);
+    ASSERT_NE(a, b);
+  }
+
+  ASSERT_EQ(a, b);
+
+  /* The pools overflow at the same time. */
+  for (key = 0; key < COUNT; key++)
+  {
+    entry.key = key;
+    aatree_nr_insert(&test->nr, &replicas[key % 2], &entry);
+  }
+
+  entry.key = COUNT;
+  ASSERT_EQ(aatree_nr_insert(&test->nr, &replicas[0], &entry), ENOMEM);
+  ASSERT_EQ(aatree_nr_insert(&test->nr, &replicas[1], &entry), ENOMEM);
+  ASSERT_EQ(aatree_nr_delete(&test->nr, &replicas[1], &key), ENOENT);
+  ASSERT_EQ(aatree_nr_insert(&test->nr, &replicas[0], &pools[3]), EEXIST);
+
+  aatree_nr_destroy(&test->nr);
+  free(log);
+  free(pools);
+  free(replicas);
+  free(test);
+}
+
+#define BULK (AATREE_PARALLEL_GRAIN * 5 + 3)
+
+UTEST(parallel, build)
+{
+  number_t       *numbers = malloc(BULK * sizeof(number_t));
+  aatree_node_t **nodes   = malloc(BULK * sizeof(aatree_node_t *));
+  aatree_node_t **scratch = malloc(BULK * sizeof(aatree_node_t *));
+  aatree_t        tree;
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+
+  for (int i = 0; i < BULK; i++)
+  {
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i;
+    nodes[i]         = &numbers[i].node;
+  }
+
+  /* The tree is the one the sequential loader builds. */
+  ASSERT_EQ(aatree_build_sorted_parallel(&tree, nodes, BULK, 4), 0);
+  ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+  ASSERT_EQ(tree.root, nodes[(BULK - 1) / 2]);
+  ASSERT_EQ(aatree_first(&tree), &numbers[0]);
+  ASSERT_EQ(aatree_last(&tree), &numbers[BULK - 1]);
+  ASSERT_EQ(aatree_build_sorted_parallel(&tree, nodes, BULK, 4), -1);
+
+  /* Disorder at a split point fails the whole build. */
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+  numbers[BULK / 4].value = -1;
+  ASSERT_EQ(aatree_build_sorted_parallel(&tree, nodes, BULK, 4), -1);
+  ASSERT_EQ(tree.root, NULL);
+
+  /* Unsorted input with every key twice, the first one of each is kept. */
+  for (int i = 0; i < BULK; i++)
+  {
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i / 2;
+    nodes[i]         = &numbers[i].node;
+  }
+
+  for (int i = BULK - 1; i > 0; i--)
+  {
+    int            j = rand() % (i + 1);
+    aatree_node_t *t = nodes[i];
+
+    nodes[i] = nodes[j];
+    nodes[j] = t;
+  }
+
+  int *position = malloc(BULK * sizeof(int));
+
+  for (int i = 0; i < BULK; i++)
+  {
+    position[(number_t *)aatree_node_entry(&tree, nodes[i]) - numbers] = i;
+  }
+
+  size_t linked = 0;
+
+  ASSERT_EQ(aatree_build_parallel(&tree, nodes, scratch, BULK, 3, &linked), 0);
+  ASSERT_EQ(linked, (size_t)(BULK + 1) / 2);
+  ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+
+  size_t none = 1;
+
+  ASSERT_EQ(aatree_build_parallel(&tree, nodes, scratch, 0, 3, &none), EINVAL);
+  ASSERT_EQ(none, 0u);
+
+  for (size_t i = 0; i < linked; i++)
+  {
+    ASSERT_EQ(((number_t *)aatree_node_entry(&tree, nodes[i]))->value, (int)i);
+    ASSERT_NE(nodes[i]->level, 0);
+  }
+
+  for (size_t i = linked; i < BULK; i++)
+  {
+    number_t *dup  = aatree_node_entry(&tree, nodes[i]);
+    number_t *kept = aatree_search(&tree, &dup->value, AATREE_KEY_EQ);
+
+    ASSERT_LT(position[kept - numbers], position[dup - numbers]);
+    ASSERT_EQ(dup->node.level, 0);
+  }
+
+  free(position);
+  free(scratch);
+  free(nodes);
+  free(numbers);
+}
+
+UTEST(aatree, join_split)
+{
+  number_t numbers[COUNT];
+  aatree_t tree, left, right;
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i;
+    aatree_insert(&tree, &numbers[i].node);
+  }
+
+  /* Split at every key in turn, then join the halves back. */
+  for (int key = -1; key <= COUNT; key++)
+  {
+    number_t *found = aatree_split(&tree, &key, &left, &right);
+
+    ASSERT_EQ(tree.root, NULL);
+    ASSERT_EQ(aatree_verify(&left), EXIT_SUCCESS);
+    ASSERT_EQ(aatree_verify(&right), EXIT_SUCCESS);
+    ASSERT_EQ(aatree_first(&left), key > 0 ? &numbers[0] : NULL);
+    ASSERT_EQ(aatree_last(&left),
+              key > 0 ? &numbers[key < COUNT ? key - 1 : COUNT - 1] : NULL);
+    ASSERT_EQ(aatree_first(&right),
+              key < COUNT - 1 ? &numbers[key < 0 ? 0 : key + 1] : NULL);
+    ASSERT_EQ(aatree_last(&right),
+              key < COUNT - 1 ? &numbers[COUNT - 1] : NULL);
+
+    if (key < 0 || key == COUNT)
+    {
+      ASSERT_EQ(found, NULL);
+      tree = key < 0 ? right : left;
+      aatree_init_tree(&left, offsetof(number_t, node),
+                       offsetof(number_t, value), cmp_ints);
+      aatree_init_tree(&right, offsetof(number_t, node),
+                       offsetof(number_t, value), cmp_ints);
+    }
+    else
+    {
+      ASSERT_EQ(found, &numbers[key]);
+      ASSERT_EQ(found->node.level, 0);
+      aatree_join(&tree, &left, &found->node, &right);
+    }
+
+    ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+    ASSERT_EQ(left.root, NULL);
+    ASSERT_EQ(right.root, NULL);
+
+    int expected = 0;
+
+    for (number_t *n = aatree_first(&tree); n; n = aatree_next(&tree, &n->node))
+    {
+      ASSERT_EQ(n->value, expected++);
+    }
+
+    ASSERT_EQ(expected, COUNT);
+  }
+}
+
+#define SET_SIZE (AATREE_PARALLEL_GRAIN * 3)
+
+/* Keep the node of the other tree and count the calls */
+static aatree_node_t *resolve_other(const aatree_t *tree,
+                                    aatree_node_t  *node,
+                                    aatree_node_t  *other,
+                                    void           *arg)
+{
+  (void)tree;
+  (void)node;
+  (*(int *)arg)++;
+
+  return other;
+}
+
+/* Fill the trees with the multiples of two and three below SET_SIZE */
+static void set_trees(aatree_t *a, number_t *as, aatree_t *b, number_t *bs)
+{
+  aatree_init_tree(a, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+  aatree_init_tree(b, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+
+  for (int i = 0; i < SET_SIZE; i++)
+  {
+    aatree_init_node(&as[i].node);
+    aatree_init_node(&bs[i].node);
+    as[i].value = i;
+    bs[i].value = i;
+
+    if (i % 2 == 0)
+      aatree_insert(a, &as[i].node);
+
+    if (i % 3 == 0)
+      aatree_insert(b, &bs[i].node);
+  }
+}
+
+UTEST(parallel, set_operations)
+{
+  number_t *as = malloc(SET_SIZE * sizeof(number_t));
+  number_t *bs = malloc(SET_SIZE * sizeof(number_t));
+  aatree_t  a, b;
+
+  for (unsigned nthreads = 1; nthreads <= 4; nthreads *= 4)
+  {
+    int resolved = 0;
+    int expected = 0;
+
+    set_trees(&a, as, &b, bs);
+    aatree_union(&a, &b, resolve_other, &resolved, nthreads);
+
+    ASSERT_EQ(aatree_verify(&a), EXIT_SUCCESS);
+    ASSERT_EQ(b.root, NULL);
+    ASSERT_EQ(resolved, SET_SIZE / 6);
+
+    for (number_t *n = aatree_first(&a); n; n = aatree_next(&a, &n->node))
+    {
+      while (expected % 2 && expected % 3)
+        expected++;
+
+      ASSERT_EQ(n, expected % 3 ? &as[expected] : &bs[expected]);
+      expected++;
+    }
+
+    ASSERT_EQ(expected, SET_SIZE - 1);
+
+    /* Nodes of a key found in both trees are those of the first one. */
+    set_trees(&a, as, &b, bs);
+    aatree_intersection(&a, &b, NULL, NULL, nthreads);
+
+    ASSERT_EQ(aatree_verify(&a), EXIT_SUCCESS);
+    ASSERT_EQ(b.root, NULL);
+    ASSERT_EQ(bs[6].node.level, 0);
+
+    expected = 0;
+
+    for (number_t *n = aatree_first(&a); n; n = aatree_next(&a, &n->node))
+    {
+      ASSERT_EQ(n, &as[expected]);
+      expected += 6;
+    }
+
+    ASSERT_EQ(expected, SET_SIZE);
+
+    set_trees(&a, as, &b, bs);
+    aatree_difference(&a, &b, nthreads);
+
+    ASSERT_EQ(aatree_verify(&a), EXIT_SUCCESS);
+    ASSERT_EQ(b.root, NULL);
+    ASSERT_EQ(as[6].node.level, 0);
+
+    expected = 2;
+
+    for (number_t *n = aatree_first(&a); n; n = aatree_next(&a, &n->node))
+    {
+      ASSERT_EQ(n, &as[expected]);
+      expected += expected % 6 == 4 ? 4 : 2;
+    }
+
+    ASSERT_EQ(expected, SET_SIZE + 2);
+    ASSERT_EQ(aatree_last(&a), &as[SET_SIZE - 2]);
+  }
+
+  /* An empty tree on either side */
+  set_trees(&a, as, &b, bs);
+  aatree_init_tree(&b, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+  aatree_union(&b, &a, NULL, NULL, 2);
+  ASSERT_EQ(aatree_first(&b), &as[0]);
+  ASSERT_EQ(a.root, NULL);
+  aatree_intersection(&b, &a, NULL, NULL, 2);
+  ASSERT_EQ(b.root, NULL);
+  ASSERT_EQ(b.first, NULL);
+
+  free(bs);
+  free(as);
+}
+
+/* Polynomial hash of a sequence and the power of its length, the hash of a
+ * concatenation depends on the order of the parts */
+typedef struct sequence_hash
+{
+  uint64_t hash;
+  uint64_t power;
+} sequence_hash_t;
+
+static void fold_hash(void *acc, void *entry, void *arg)
+{
+  sequence_hash_t *h = acc;
+
+  h->hash   = h->hash * 31 + ((number_t *)entry)->value;
+  h->power *= 31;
+  __atomic_fetch_add((int *)arg, 1, __ATOMIC_RELAXED);
+}
+
+static void combine_hash(void *acc, const void *next, void *arg)
+{
+  sequence_hash_t       *h = acc;
+  const sequence_hash_t *n = next;
+
+  (void)arg;
+  h->hash   = h->hash * n->power + n->hash;
+  h->power *= n->power;
+}
+
+static void sum_values(void *entry, void *arg)
+{
+  __atomic_fetch_add((long *)arg, ((number_t *)entry)->value, __ATOMIC_RELAXED);
+}
+
+UTEST(parallel, reduce)
+{
+  number_t       *numbers = malloc(BULK * sizeof(number_t));
+  aatree_node_t **nodes   = malloc(BULK * sizeof(aatree_node_t *));
+  sequence_hash_t scratch[AATREE_PARALLEL_CHUNKS];
+  aatree_t        tree;
+  int             bounds[][2] = {{0, BULK}, {-5, BULK * 2}, {100, 20000},
+                                 {BULK / 2, BULK / 2}, {10, 5}};
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+
+  for (int i = 0; i < BULK; i++)
+  {
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i;
+    nodes[i]         = &numbers[i].node;
+  }
+
+  aatree_build_sorted(&tree, nodes, BULK);
+
+  for (unsigned nthreads = 1; nthreads <= 64; nthreads *= 4)
+  {
+    for (size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++)
+    {
+      int             lo = bounds[b][0], hi = bounds[b][1];
+      sequence_hash_t expected = {0, 1}, result = {0, 1};
+      long            sum = 0, expected_sum = 0;
+      int             visited = 0, count = 0;
+
+      for (int i = lo < 0 ? 0 : lo; i <= hi && i < BULK; i++, count++)
+      {
+        fold_hash(&expected, &numbers[i], &visited);
+        expected_sum += i;
+      }
+
+      visited = 0;
+      aatree_parallel_reduce(&tree, &lo, &hi, fold_hash, combine_hash,
+                             &result, sizeof(result), scratch, &visited,
+                             nthreads);
+
+      ASSERT_EQ(visited, count);
+      ASSERT_EQ(result.hash, expected.hash);
+      ASSERT_EQ(result.power, expected.power);
+
+      aatree_parallel_foreach(&tree, &lo, &hi, sum_values, &sum, nthreads);
+      ASSERT_EQ(sum, expected_sum);
+    }
+
+    /* Open bounds scan the whole tree. */
+    long sum = 0;
+
+    aatree_parallel_foreach(&tree, NULL, NULL, sum_values, &sum, nthreads);
+    ASSERT_EQ(sum, (long)BULK * (BULK - 1) / 2);
+  }
+
+  free(nodes);
+  free(numbers);
+}
+
+UTEST(check, report)
+{
+  number_t             *numbers = malloc(BULK * sizeof(number_t));
+  aatree_node_t       **nodes   = malloc(BULK * sizeof(aatree_node_t *));
+  aatree_check_report_t report;
+  aatree_t              tree;
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+  ASSERT_EQ(aatree_check(&tree, &report, 1), 0);
+  ASSERT_EQ(report.nodes, 0);
+
+  for (int i = 0; i < BULK; i++)
+  {
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i;
+    nodes[i]         = &numbers[i].node;
+  }
+
+  aatree_build_sorted(&tree, nodes, BULK);
+
+  for (unsigned nthreads = 1; nthreads <= 4; nthreads *= 2)
+  {
+    ASSERT_EQ(aatree_check(&tree, &report, nthreads), 0);
+    ASSERT_EQ(report.error, AATREE_CHECK_OK);
+    ASSERT_EQ(report.nodes, (size_t)BULK);
+    ASSERT_EQ(report.compares, (size_t)BULK - 1);
+    ASSERT_GE(report.height, tree.root->level);
+
+    /* Keys swapped in two places, the first one is reported. */
+    numbers[100].value = 101;
+    numbers[101].value = 100;
+    numbers[BULK - 3].value = BULK;
+
+    ASSERT_EQ(aatree_check(&tree, &report, nthreads), -1);
+    ASSERT_EQ(report.error, AATREE_CHECK_ORDER);
+    ASSERT_EQ(report.node, &numbers[101].node);
+
+    numbers[100].value = 100;
+    numbers[101].value = 101;
+
+    ASSERT_EQ(aatree_check(&tree, &report, nthreads), -1);
+    ASSERT_EQ(report.node, &numbers[BULK - 2].node);
+
+    numbers[BULK - 3].value = BULK - 3;
+
+    /* A cycle is caught at its first node. */
+    aatree_node_t *leaf = &numbers[BULK / 3].node;
+
+    while (leaf->left)
+      leaf = leaf->left;
+
+    leaf->right = leaf;
+    ASSERT_EQ(aatree_check(&tree, &report, nthreads), -1);
+    ASSERT_EQ(report.error, AATREE_CHECK_HORIZONTAL);
+    ASSERT_EQ(report.node, leaf);
+    leaf->right = NULL;
+
+    leaf->level = 2;
+    ASSERT_EQ(aatree_check(&tree, &report, nthreads), -1);
+    ASSERT_EQ(report.error, AATREE_CHECK_LEVEL_LEFT);
+    leaf->level = 1;
+
+    aatree_node_t *parent = leaf->parent;
+
+    leaf->parent = NULL;
+    ASSERT_EQ(aatree_check(&tree, &report, nthreads), -1);
+    ASSERT_EQ(report.error, AATREE_CHECK_PARENT);
+    ASSERT_EQ(report.node, leaf);
+    leaf->parent = parent;
+
+    tree.last = tree.root;
+    ASSERT_EQ(aatree_check(&tree, &report, nthreads), -1);
+    ASSERT_EQ(report.error, AATREE_CHECK_LAST);
+    tree.last = &numbers[BULK - 1].node;
+  }
+
+  ASSERT_EQ(aatree_check(&tree, &report, 2), 0);
+  ASSERT_STREQ(aatree_check_message(report.error), "valid tree");
+
+  free(nodes);
+  free(numbers);
+}
+
+UTEST(aatree, append)
+{
+  number_t numbers[COUNT];
+  aatree_t tree;
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+
+  for (int i = 0; i < COUNT; i++)
+  {
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i;
+    aatree_append(&tree, &numbers[i].node);
+
+    ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+    ASSERT_EQ(aatree_first(&tree), &numbers[0]);
+    ASSERT_EQ(aatree_last(&tree), &numbers[i]);
+  }
+
+  int key = COUNT / 2;
+
+  ASSERT_EQ(aatree_search(&tree, &key, AATREE_KEY_EQ), &numbers[key]);
+}
+
+/* Entry of a snapshot with a 64-bit key */
+typedef struct stored
+{
+  aatree_node_t node;
+  uint64_t      key;
+  char          name[16];
+} stored_t;
+
+/* Memory file of a snapshot and the entries it is loaded into */
+typedef struct memory_file
+{
+  uint8_t  *data;
+  size_t    size;
+  size_t    pos;
+  stored_t *entries;
+  size_t    used;
+  size_t    capacity;
+  size_t    writes;
+} memory_file_t;
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static int file_write(const void *data, size_t size, void *arg)
+{
+  memory_file_t *file = arg;
+
+  file->data = realloc(file->data, file->size + size);
+  memcpy(file->data + file->size, data, size);
+  file->size += size;
+  file->writes++;
+
+  return 0;
+}
+
+static int file_read(void *data, size_t size, void *arg)
+{
+  memory_file_t *file = arg;
+
+  if (file->size - file->pos < size)
+    return ENODATA;
+
+  memcpy(data, file->data + file->pos, size);
+  file->pos += size;
+
+  return 0;
+}
+
+/* The name goes as its length and bytes, the key only without the flag */
+static size_t stored_serialize(const void *entry, void *data, size_t size,
+                               void *arg)
+{
+  const stored_t *s      = entry;
+  size_t          length = strlen(s->name);
+  uint8_t        *out    = data;
+  size_t          key    = ((memory_file_t *)arg)->capacity ? 0 : 8;
+
+  if (size < 1 + length + key)
+    return AATREE_IO_NO_ROOM;
+
+  memcpy(out, &s->key, key);
+  out[key] = (uint8_t)length;
+  memcpy(out + key + 1, s->name, length);
+
+  return key + 1 + length;
+}
+
+static int stored_deserialize(void *entry, const void *data, size_t size,
+                              void *arg)
+{
+  stored_t      *s    = entry;
+  const uint8_t *in   = data;
+  memory_file_t *file = arg;
+
+  if (file->data[6] & AATREE_IO_INT_KEYS)
+  {
+    s->key = UINT64_MAX;
+  }
+  else
+  {
+    memcpy(&s->key, in, 8);
+    in += 8;
+    size -= 8;
+  }
+
+  if (size != 1u + in[0] || in[0] >= sizeof(s->name))
+    return EINVAL;
+
+  memcpy(s->name, in + 1, in[0]);
+  s->name[in[0]] = '\0';
+
+  return 0;
+}
+
+static void *stored_alloc(void *arg)
+{
+  memory_file_t *file = arg;
+
+  return file->used < file->capacity ? &file->entries[file->used++] : NULL;
+}
+
+/* Only the last entry taken is ever handed back */
+static void stored_release(void *entry, void *arg)
+{
+  memory_file_t *file = arg;
+
+  if (entry == &file->entries[file->used - 1])
+    file->used--;
+}
+
+static int stored_reject(void *entry, const void *data, size_t size,
+                         void *arg)
+{
+  (void)entry;
+  (void)data;
+  (void)size;
+  (void)arg;
+
+  return EIO;
+}
+
+UTEST(io, dump_load)
+{
+  stored_t     *entries = calloc(BULK, sizeof(stored_t));
+  stored_t     *loaded  = calloc(BULK, sizeof(stored_t));
+  uint8_t       buffer[4096];
+  memory_file_t file;
+  aatree_t      tree, copy;
+  size_t        plain = 0;
+
+  aatree_init_tree(&tree, offsetof(stored_t, node), offsetof(stored_t, key),
+                   cmp_u64);
+
+  for (int i = 0; i < BULK; i++)
+  {
+    aatree_init_node(&entries[i].node);
+    entries[i].key = (uint64_t)i * 3 + (i > BULK / 2 ? UINT64_C(1) << 40 : 0);
+    snprintf(entries[i].name, sizeof(entries[i].name), "entry %d", i);
+    aatree_insert(&tree, &entries[i].node);
+  }
+
+  for (unsigned flags = 0; flags <= AATREE_IO_INT_KEYS; flags++)
+  {
+    memset(&file, 0, sizeof(file));
+    file.capacity = flags ? BULK : 0;
+
+    ASSERT_EQ(aatree_dump(&tree, file_write, stored_serialize, &file, buffer,
+                          sizeof(buffer), flags),
+              0);
+    ASSERT_GT(file.writes, 1);
+
+    /* Delta coded keys take a byte instead of eight. */
+    if (flags)
+      ASSERT_LE(file.size + BULK * 6, plain);
+
+    plain = file.size;
+
+    file.entries  = loaded;
+    file.capacity = BULK;
+
+    aatree_init_tree(&copy, offsetof(stored_t, node), offsetof(stored_t, key),
+                     cmp_u64);
+    ASSERT_EQ(aatree_load(&copy, file_read, stored_deserialize, stored_alloc,
+                          stored_release, &file, buffer, sizeof(buffer)),
+              0);
+    ASSERT_EQ(file.used, (size_t)BULK);
+    ASSERT_EQ(file.pos, file.size);
+    ASSERT_EQ(aatree_verify(&copy), EXIT_SUCCESS);
+
+    stored_t *a = aatree_first(&tree), *b = aatree_first(&copy);
+
+    for (; a && b;
+         a = aatree_next(&tree, &a->node), b = aatree_next(&copy, &b->node))
+    {
+      ASSERT_EQ(a->key, b->key);
+      ASSERT_STREQ(a->name, b->name);
+    }
+
+    ASSERT_EQ(a, b);
+
+    /* A flipped bit is caught by the checksum, a cut file by the reader. */
+    file.data[file.size / 2] ^= 0x10;
+    file.pos  = 0;
+    file.used = 0;
+    aatree_init_tree(&copy, offsetof(stored_t, node), offsetof(stored_t, key),
+                     cmp_u64);
+    ASSERT_EQ(aatree_load(&copy, file_read, stored_deserialize, stored_alloc,
+                          stored_release, &file, buffer, sizeof(buffer)),
+              EBADMSG);
+    ASSERT_EQ(aatree_verify(&copy), EXIT_SUCCESS);
+    ASSERT_GT(file.used, 0);
+
+    /* An entry failing to deserialize goes back to its owner. */
+    file.data[file.size / 2] ^= 0x10;
+    file.pos  = 0;
+    file.used = 0;
+    aatree_init_tree(&copy, offsetof(stored_t, node), offsetof(stored_t, key),
+                     cmp_u64);
+    ASSERT_EQ(aatree_load(&copy, file_read, stored_reject, stored_alloc,
+                          stored_release, &file, buffer, sizeof(buffer)),
+              EIO);
+    ASSERT_EQ(file.used, 0u);
+
+    file.size -= AATREE_IO_BLOCK_HEADER;
+    file.pos   = 0;
+    file.used  = 0;
+    aatree_init_tree(&copy, offsetof(stored_t, node), offsetof(stored_t, key),
+                     cmp_u64);
+    ASSERT_EQ(aatree_load(&copy, file_read, stored_deserialize, stored_alloc,
+                          stored_release, &file, buffer, sizeof(buffer)),
+              ENODATA);
+    ASSERT_EQ(aatree_load(&copy, file_read, stored_deserialize, stored_alloc,
+                          stored_release, &file, buffer, sizeof(buffer)),
+              EINVAL);
+
+    free(file.data);
+  }
+
+  /* Entries larger than a block */
+  memset(&file, 0, sizeof(file));
+  ASSERT_EQ(aatree_dump(&tree, file_write, stored_serialize, &file, buffer, 24,
+                        0),
+            EMSGSIZE);
+  free(file.data);
+
+  free(loaded);
+  free(entries);
+}
+
+UTEST(aatree, insert_hint)
+{
+  number_t numbers[COUNT];
+  aatree_t tree;
+
+  aatree_init_tree(&tree, offsetof(number_t, node), offsetof(number_t, value),
+                   cmp_ints);
+
+  /* Even keys ascending after each other, then odd ones with hints on
+   * either side of them or none at all. */
+  aatree_node_t *hint = NULL;
+
+  for (int i = 0; i < COUNT; i += 2)
+  {
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i;
+    ASSERT_EQ(aatree_insert_hint(&tree, &numbers[i].node, hint), NULL);
+    ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+    hint = &numbers[i].node;
+  }
+
+  for (int i = 1; i < COUNT; i += 2)
+  {
+    aatree_init_node(&numbers[i].node);
+    numbers[i].value = i;
+    hint = i % 3 == 0 ? &numbers[i - 1].node
+         : i % 3 == 1 ? &numbers[i + 1 < COUNT ? i + 1 : 0].node
+                      : NULL;
+    ASSERT_EQ(aatree_insert_hint(&tree, &numbers[i].node, hint), NULL);
+    ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+  }
+
+  ASSERT_EQ(aatree_last(&tree), &numbers[COUNT - 1]);
+
+  number_t dup = {.value = 10};
+
+  aatree_init_node(&dup.node);
+  ASSERT_EQ(aatree_insert_hint(&tree, &dup.node, &numbers[10].node),
+            &numbers[10]);
+  ASSERT_EQ(aatree_insert_hint(&tree, &dup.node, &numbers[9].node),
+            &numbers[10]);
+}
+
+#define WAL_THREADS 4
+#define WAL_KEYS 200
+
+typedef struct wal_test
+{
+  aatree_wal_t wal;
+  stored_t     entries[WAL_THREADS][WAL_KEYS];
+  int          errors;
+} wal_test_t;
+
+typedef struct wal_worker
+{
+  wal_test_t *test;
+  int         id;
+} wal_worker_t;
+
+/* Insert the keys of the thread committing each one, delete every third */
+static void *wal_writer(void *arg)
+{
+  wal_worker_t *worker = arg;
+  wal_test_t   *test   = worker->test;
+  uint64_t      lsn    = 0;
+
+  for (int i = 0; i < WAL_KEYS; i++)
+  {
+    stored_t *entry = &test->entries[worker->id][i];
+
+    if (aatree_wal_insert(&test->wal, entry, &lsn)
+        || aatree_wal_commit(&test->wal, lsn))
+      __atomic_fetch_add(&test->errors, 1, __ATOMIC_RELAXED);
+
+    if (i % 3 == 2
+        && (aatree_wal_delete(&test->wal, &entry->key, &lsn)
+            || aatree_wal_commit(&test->wal, lsn)))
+      __atomic_fetch_add(&test->errors, 1, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
+static void *replay_alloc(void *arg)
+{
+  (void)arg;
+
+  return calloc(1, sizeof(stored_t));
+}
+
+static void replay_release(void *entry, void *arg)
+{
+  free(entry);
+  (*(int *)arg)++;
+}
+
+UTEST(wal, group_commit)
+{
+  wal_test_t  *test = calloc(1, sizeof(wal_test_t));
+  uint64_t     buffer[2 * 256];
+  char         path[] = "/tmp/aatree-wal-XXXXXX";
+  int          fd     = mkstemp(path);
+  wal_worker_t workers[WAL_THREADS];
+  pthread_t    threads[WAL_THREADS];
+  aatree_t     tree;
+  uint64_t     end      = 0;
+  int          released = 0;
+  struct stat  st;
+
+  ASSERT_GE(fd, 0);
+  unlink(path);
+
+  for (int t = 0; t < WAL_THREADS; t++)
+  {
+    for (int i = 0; i < WAL_KEYS; i++)
+    {
+      test->entries[t][i].key = (uint64_t)i * WAL_THREADS + t;
+      snprintf(test->entries[t][i].name, sizeof(test->entries[t][i].name),
+               "key %d", i * WAL_THREADS + t);
+    }
+  }
+
+  ASSERT_EQ(aatree_wal_init(&test->wal, fd, buffer, sizeof(buffer) / 2,
+                            sizeof(stored_t), sizeof(uint64_t), 2000, 1024),
+            0);
+
+  for (int t = 0; t < WAL_THREADS; t++)
+  {
+    workers[t].test = test;
+    workers[t].id   = t;
+    pthread_create(&threads[t], NULL, wal_writer, &workers[t]);
+  }
+
+  for (int t = 0; t < WAL_THREADS; t++)
+  {
+    pthread_join(threads[t], NULL);
+  }
+
+  ASSERT_EQ(test->errors, 0);
+  ASSERT_EQ(test->wal.durable, test->wal.appended);
+  ASSERT_LT(test->wal.syncs, test->wal.commits);
+  ASSERT_EQ(fstat(fd, &st), 0);
+  ASSERT_EQ((uint64_t)st.st_size, test->wal.appended);
+
+  /* Recovery into an empty tree, the survivors are the keys not deleted. */
+  aatree_init_tree(&tree, offsetof(stored_t, node), offsetof(stored_t, key),
+                   cmp_u64);
+  ASSERT_EQ(aatree_wal_replay(&tree, fd, sizeof(stored_t), sizeof(uint64_t),
+                              replay_alloc, replay_release, &released, buffer,
+                              sizeof(buffer), &end),
+            0);
+  ASSERT_EQ(end, (uint64_t)st.st_size);
+  ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+  ASSERT_EQ(released, WAL_THREADS * (WAL_KEYS / 3));
+
+  uint64_t key = 0;
+
+  for (stored_t *s = aatree_first(&tree); s; s = aatree_next(&tree, &s->node))
+  {
+    while (key / WAL_THREADS % 3 == 2)
+      key++;
+
+    ASSERT_EQ(s->key, key);
+    ASSERT_EQ(strcmp(s->name, test->entries[key % WAL_THREADS]
+                                  [key / WAL_THREADS].name), 0);
+    key++;
+  }
+
+  ASSERT_EQ(key, (uint64_t)WAL_THREADS * WAL_KEYS);
+
+  /* A torn tail is cut off, a second replay finds everything in place. */
+  ASSERT_EQ(pwrite(fd, "\x01\x02\x03", 3, st.st_size), 3);
+  released = 0;
+  ASSERT_EQ(aatree_wal_replay(&tree, fd, sizeof(stored_t), sizeof(uint64_t),
+                              replay_alloc, replay_release, &released, buffer,
+                              sizeof(buffer), &end),
+            0);
+  ASSERT_EQ(end, (uint64_t)st.st_size);
+  ASSERT_EQ(aatree_verify(&tree), EXIT_SUCCESS);
+  ASSERT_EQ(released, WAL_THREADS * WAL_KEYS);
+
+  /* A corrupted record stops the replay right before it. */
+  uint8_t byte;
+
+  ASSERT_EQ(pread(fd, &byte, 1, 1000), 1);
+  byte ^= 0x40;
+  ASSERT_EQ(pwrite(fd, &byte, 1, 1000), 1);
+  ASSERT_EQ(aatree_wal_replay(&tree, fd, sizeof(stored_t), sizeof(uint64_t),
+                              replay_alloc, replay_release, &released, buffer,
+                              sizeof(buffer), &end),
+            0);
+  ASSERT_LT(end, 1000u);
+  ASSERT_GT(end + 2 * sizeof(stored_t), 1000u);
+
+  /* A record appended before the reset is dropped, not synced later. */
+  uint64_t syncs = test->wal.syncs;
+  uint64_t lsn;
+
+  key = 0;
+  ASSERT_EQ(aatree_wal_delete(&test->wal, &key, &lsn), 0);
+  ASSERT_EQ(aatree_wal_reset(&test->wal), 0);
+  ASSERT_EQ(aatree_wal_commit(&test->wal, lsn), 0);
+  ASSERT_EQ(test->wal.syncs, syncs);
+  ASSERT_EQ(fstat(fd, &st), 0);
+  ASSERT_EQ(st.st_size, 0);
+
+  while (tree.root)
+    free(aatree_pop_first(&tree));
+
+  aatree_wal_destroy(&test->wal);
+  close(fd);
+  free(test);
+}
+
+/* Entry of a checkpointed tree */
+typedef struct tracked
+{
+  aatree_ckpt_node_t node;
+  uint64_t           key;
+  uint64_t           value;
+} tracked_t;
+
+typedef struct tracked_pool
+{
+  tracked_t *entries;
+  size_t     used;
+  size_t     capacity;
+  size_t     released;
+} tracked_pool_t;
+
+static void *tracked_alloc(void *arg)
+{
+  tracked_pool_t *pool = arg;
+
+  return pool->used < pool->capacity ? &pool->entries[pool->used++] : NULL;
+}
+
+static void tracked_release(void *entry, void *arg)
+{
+  (void)entry;
+  ((tracked_pool_t *)arg)->released++;
+}
+
+static void tracked_init(aatree_ckpt_t *ckpt)
+{
+  aatree_ckpt_init(ckpt, offsetof(tracked_t, node), offsetof(tracked_t, key),
+                   cmp_u64, sizeof(tracked_t), sizeof(uint64_t));
+}
+
+UTEST(ckpt, incremental)
+{
+  tracked_t     *entries = calloc(2 * BULK, sizeof(tracked_t));
+  tracked_pool_t pool    = {calloc(2 * BULK, sizeof(tracked_t)), 0, 2 * BULK};
+  memory_file_t  full, delta, empty, merged, next;
+  uint64_t       scratch[(sizeof(tracked_t) + 16) / 8];
+  uint8_t        buffer[1024];
+  aatree_ckpt_t  ckpt, copy;
+  size_t         i;
+
+  memset(&full, 0, sizeof(full));
+  memset(&delta, 0, sizeof(delta));
+  memset(&empty, 0, sizeof(empty));
+  memset(&merged, 0, sizeof(merged));
+  memset(&next, 0, sizeof(next));
+
+  tracked_init(&ckpt);
+
+  for (i = 0; i < BULK; i++)
+  {
+    tracked_t *e = &entries[(i * 7919) % BULK];
+
+    e->key   = (uint64_t)((i * 7919) % BULK) * 2;
+    e->value = e->key;
+    aatree_init_node(&e->node.node);
+    ASSERT_EQ(aatree_insert(&ckpt.tree, &e->node.node), NULL);
+  }
+
+  ASSERT_EQ(aatree_ckpt_write(&ckpt, 1, file_write, &full, buffer,
+                              sizeof(buffer)),
+            0);
+  ASSERT_EQ(ckpt.generation, 1u);
+  ASSERT_GT(full.size, BULK * sizeof(tracked_t));
+
+  /* Nothing changed, nothing but an empty file. */
+  ASSERT_EQ(aatree_ckpt_write(&ckpt, 0, file_write, &empty, buffer,
+                              sizeof(buffer)),
+            0);
+  ASSERT_EQ(empty.size,
+            (size_t)AATREE_CKPT_HEADER + AATREE_CKPT_RECORD + 2 * 8);
+  ckpt.generation = 1;
+
+  /* Deletes, inserts between the keys and changes in place. */
+  for (i = 0; i < 8; i++)
+  {
+    tracked_t *e = &entries[BULK + i];
+
+    aatree_delete(&ckpt.tree, &entries[i * 97].node.node);
+
+    e->key = (uint64_t)i * 422 + 1;
+    aatree_init_node(&e->node.node);
+    ASSERT_EQ(aatree_insert(&ckpt.tree, &e->node.node), NULL);
+
+    entries[i * 131 + 1].value = 0;
+    aatree_ckpt_touch(&ckpt, &entries[i * 131 + 1]);
+  }
+
+  ASSERT_EQ(aatree_ckpt_write(&ckpt, 0, file_write, &delta, buffer,
+                              sizeof(buffer)),
+            0);
+  ASSERT_EQ(ckpt.generation, 2u);
+  ASSERT_LT(delta.size, full.size / 4);
+
+  /* The increment follows the full checkpoint only. */
+  ASSERT_EQ(aatree_ckpt_compact(&ckpt, file_read, &empty, file_read, &delta,
+                                file_write, &next, buffer, sizeof(buffer),
+                                scratch),
+            EINVAL);
+
+  delta.pos = 0;
+  ASSERT_EQ(aatree_ckpt_compact(&ckpt, file_read, &full, file_read, &delta,
+                                file_write, &merged, buffer, sizeof(buffer),
+                                scratch),
+            0);
+
+  tracked_init(&copy);
+  ASSERT_EQ(aatree_ckpt_load(&copy, file_read, &merged, tracked_alloc,
+                             tracked_release, &pool),
+            0);
+  ASSERT_EQ(aatree_verify(&copy.tree), EXIT_SUCCESS);
+  ASSERT_EQ(copy.generation, 2u);
+  ASSERT_EQ(pool.used, BULK);
+
+  {
+    tracked_t *a = aatree_first(&ckpt.tree), *b = aatree_first(&copy.tree);
+
+    for (; a && b; a = aatree_next(&ckpt.tree, &a->node.node),
+                   b = aatree_next(&copy.tree, &b->node.node))
+    {
+      ASSERT_EQ(a->key, b->key);
+      ASSERT_EQ(a->value, b->value);
+      ASSERT_FALSE(b->node.dirty);
+    }
+
+    ASSERT_EQ(a, b);
+  }
+
+  /* The merged checkpoint is framed the same as a full one. */
+  ASSERT_EQ(aatree_ckpt_write(&ckpt, 1, file_write, &next, buffer,
+                              sizeof(buffer)),
+            0);
+  ASSERT_EQ(next.size, merged.size);
+  ASSERT_EQ(next.writes, merged.writes);
+
+  /* Increments are not loaded, corruption is detected. */
+  tracked_init(&copy);
+  delta.pos = 0;
+  ASSERT_EQ(aatree_ckpt_load(&copy, file_read, &delta, tracked_alloc,
+                             tracked_release, &pool),
+            EINVAL);
+
+  merged.pos = 0;
+  merged.data[merged.size / 2] ^= 0x10;
+  pool.used = 0;
+  ASSERT_EQ(aatree_ckpt_load(&copy, file_read, &merged, tracked_alloc,
+                             tracked_release, &pool),
+            EBADMSG);
+
+  /* Only the records before the corrupted one are linked, the entries of
+   * that one come back, and the tree is not taken for the checkpoint. */
+  {
+    size_t linked = 0;
+
+    for (tracked_t *e = aatree_first(&copy.tree); e;
+         e = aatree_next(&copy.tree, &e->node.node))
+    {
+      linked++;
+    }
+
+    ASSERT_EQ(aatree_verify(&copy.tree), EXIT_SUCCESS);
+    ASSERT_GT(linked, 0u);
+    ASSERT_LT(linked, (size_t)BULK);
+    ASSERT_GT(pool.released, 0u);
+    ASSERT_EQ(linked + pool.released, pool.used);
+    ASSERT_EQ(copy.generation, 0u);
+  }
+
+  free(full.data);
+  free(delta.data);
+  free(empty.data);
+  free(merged.data);
+  free(next.data);
+  free(pool.entries);
+  free(entries);
+}
+
+/* A node with two sons high in the tree gives its place to the successor,
+ * the range of its left subtree now reaching up to the successor. */
+UTEST(ckpt, delete_inner)
+{
+  tracked_t     *entries = calloc(4096, sizeof(tracked_t));
+  tracked_pool_t pool    = {calloc(4096, sizeof(tracked_t)), 0, 4096};
+  memory_file_t  full, delta, merged;
+  uint64_t       scratch[(sizeof(tracked_t) + 16) / 8];
+  uint8_t        buffer[1024];
+  aatree_ckpt_t  ckpt, copy;
+  tracked_t     *root;
+  uint64_t       key;
+  size_t         i;
+
+  memset(&full, 0, sizeof(full));
+  memset(&delta, 0, sizeof(delta));
+  memset(&merged, 0, sizeof(merged));
+
+  tracked_init(&ckpt);
+
+  for (i = 0; i < 4096; i++)
+  {
+    entries[i].key = i;
+    aatree_init_node(&entries[i].node.node);
+    ASSERT_EQ(aatree_insert(&ckpt.tree, &entries[i].node.node), NULL);
+  }
+
+  ASSERT_EQ(aatree_ckpt_write(&ckpt, 1, file_write, &full, buffer,
+                              sizeof(buffer)),
+            0);
+
+  root = aatree_node_entry(&ckpt.tree, ckpt.tree.root);
+  key  = root->key;
+  ASSERT_GT(ckpt.tree.root->level, AATREE_CKPT_GRAIN_LEVEL);
+  aatree_delete(&ckpt.tree, &root->node.node);
+
+  ASSERT_EQ(aatree_ckpt_write(&ckpt, 0, file_write, &delta, buffer,
+                              sizeof(buffer)),
+            0);
+  ASSERT_EQ(aatree_ckpt_compact(&ckpt, file_read, &full, file_read, &delta,
+                                file_write, &merged, buffer, sizeof(buffer),
+                                scratch),
+            0);
+
+  tracked_init(&copy);
+  ASSERT_EQ(aatree_ckpt_load(&copy, file_read, &merged, tracked_alloc,
+                             tracked_release, &pool),
+            0);
+  ASSERT_EQ(aatree_verify(&copy.tree), EXIT_SUCCESS);
+  ASSERT_EQ(aatree_search(&copy.tree, &key, AATREE_KEY_EQ), NULL);
+  ASSERT_EQ(pool.used, 4095u);
+
+  free(full.data);
+  free(delta.data);
+  free(merged.data);
+  free(pool.entries);
+  free(entries);
+}
+
+UTEST(bgsave, fork_dump)
+{
+  stored_t       *entries = calloc(BULK, sizeof(stored_t));
+  stored_t       *loaded  = calloc(BULK, sizeof(stored_t));
+  char            path[]  = "/tmp/aatree-bgsave-XXXXXX";
+  int             fd      = mkstemp(path);
+  uint8_t         buffer[4096];
+  memory_file_t   file;
+  aatree_bgsave_t save;
+  aatree_t        tree, copy;
+  struct stat     st;
+  size_t          i;
+
+  ASSERT_GE(fd, 0);
+  unlink(path);
+
+  memset(&file, 0, sizeof(file));
+  aatree_init_tree(&tree, offsetof(stored_t, node), offsetof(stored_t, key),
+                   cmp_u64);
+
+  for (i = 0; i < BULK; i++)
+  {
+    entries[i].key = i;
+    snprintf(entries[i].name, sizeof(entries[i].name), "n%zu", i);
+    aatree_init_node(&entries[i].node);
+    aatree_append(&tree, &entries[i].node);
+  }
+
+  /* Some 200 KB at 2 MB/s take the child about 0.1 s. */
+  ASSERT_EQ(aatree_snapshot_async(&save, &tree, fd, stored_serialize, &file,
+                                  buffer, sizeof(buffer), 0, 2000000),
+            0);
+  ASSERT_EQ(aatree_snapshot_poll(&save), EAGAIN);
+
+  /* The parent empties the tree and scribbles over the entries. */
+  while (tree.root)
+    aatree_pop_first(&tree);
+
+  memset(entries, 0xa5, BULK * sizeof(stored_t));
+
+  ASSERT_EQ(aatree_snapshot_wait(&save), 0);
+  ASSERT_EQ(aatree_snapshot_poll(&save), 0);
+  ASSERT_EQ(fstat(fd, &st), 0);
+  ASSERT_EQ((uint64_t)st.st_size, save.written);
+
+  file.data = malloc(st.st_size);
+  file.size = st.st_size;
+  ASSERT_EQ(pread(fd, file.data, st.st_size, 0), st.st_size);
+
+  /* The file holds the tree as of the fork. */
+  file.entries  = loaded;
+  file.capacity = BULK;
+  aatree_init_tree(&copy, offsetof(stored_t, node), offsetof(stored_t, key),
+                   cmp_u64);
+  ASSERT_EQ(aatree_load(&copy, file_read, stored_deserialize, stored_alloc,
+                        stored_release, &file, buffer, sizeof(buffer)),
+            0);
+  ASSERT_EQ(file.used, BULK);
+
+  for (i = 0; i < BULK; i++)
+  {
+    char name[16];
+
+    snprintf(name, sizeof(name), "n%zu", i);
+    ASSERT_EQ(loaded[i].key, i);
+    ASSERT_STREQ(loaded[i].name, name);
+  }
+
+  /* A failing child reports its error. */
+  close(fd);
+  file.capacity = 0;
+  ASSERT_EQ(aatree_snapshot_async(&save, &copy, fd, stored_serialize, &file,
+                                  buffer, sizeof(buffer), 0, 0),
+            0);
+  ASSERT_EQ(aatree_snapshot_wait(&save), EBADF);
+
+  free(file.data);
+  free(loaded);
+  free(entries);
+}
+
+/* Entry of a paged tree */
+typedef struct paged_entry
+{
+  uint64_t key;
+  uint64_t value;
+} paged_entry_t;
+
+typedef struct paged_scan
+{
+  uint64_t next;
+  uint64_t last;
+  size_t   count;
+} paged_scan_t;
+
+static int paged_visit(const void *entry, void *arg)
+{
+  const paged_entry_t *e    = entry;
+  paged_scan_t        *scan = arg;
+
+  if (e->key < scan->next || e->value != e->key * 3)
+    return -1;
+
+  scan->next = e->key + 1;
+  scan->count++;
+
+  return e->key == scan->last;
+}
+
+UTEST(paged, buffer_pool)
+{
+  size_t         size = aatree_paged_memory_size(512, AATREE_PAGED_MIN_FRAMES);
+  char           path[] = "/tmp/aatree-paged-XXXXXX";
+  int            fd     = mkstemp(path);
+  void          *memory = malloc(size);
+  aatree_paged_t tree;
+  paged_entry_t  entry, out;
+  paged_scan_t   scan;
+  uint64_t       key;
+  size_t         i;
+
+  ASSERT_GE(fd, 0);
+  unlink(path);
+
+  ASSERT_EQ(aatree_paged_open(&tree, fd, 512, sizeof(paged_entry_t), 0,
+                              cmp_u64, memory, size - 1),
+            EINVAL);
+  ASSERT_EQ(aatree_paged_open(&tree, fd, 512, sizeof(paged_entry_t), 0,
+                              cmp_u64, memory, size),
+            0);
+
+  /* Even keys in random order, many more pages than frames. */
+  for (i = 0; i < BULK; i++)
+  {
+    entry.key   = (i * 7919) % BULK * 2;
+    entry.value = entry.key * 3;
+    ASSERT_EQ(aatree_paged_insert(&tree, &entry), 0);
+  }
+
+  ASSERT_EQ(aatree_paged_insert(&tree, &entry), EEXIST);
+  ASSERT_EQ(aatree_paged_count(&tree), (uint64_t)BULK);
+  ASSERT_GT(tree.header.pages, (uint64_t)AATREE_PAGED_MIN_FRAMES);
+  ASSERT_GT(tree.writes, 0u);
+
+  /* Odd keys are missing. */
+  key = 2 * 1000 + 1;
+  ASSERT_FALSE(aatree_paged_search(&tree, &key, AATREE_KEY_EQ, &out));
+  ASSERT_TRUE(aatree_paged_search(&tree, &key, AATREE_KEY_LT, &out));
+  ASSERT_EQ(out.key, 2000u);
+  ASSERT_TRUE(aatree_paged_search(&tree, &key, AATREE_KEY_GE, &out));
+  ASSERT_EQ(out.key, 2002u);
+  key = 2000;
+  ASSERT_TRUE(aatree_paged_search(&tree, &key, AATREE_KEY_GT, &out));
+  ASSERT_EQ(out.key, 2002u);
+  ASSERT_TRUE(aatree_paged_search(&tree, &key, AATREE_KEY_LE, &out));
+  ASSERT_EQ(out.value, 6000u);
+
+  /* Every fourth key goes away. */
+  for (key = 0; key < 2 * BULK; key += 4)
+  {
+    ASSERT_EQ(aatree_paged_delete(&tree, &key, &out), 0);
+    ASSERT_EQ(out.key, key);
+  }
+
+  key = 0;
+  ASSERT_EQ(aatree_paged_delete(&tree, &key, NULL), ENOENT);
+  ASSERT_EQ(aatree_paged_count(&tree), (uint64_t)BULK / 2);
+
+  /* A range scan stops at hi, or where the visitor says. */
+  memset(&scan, 0, sizeof(scan));
+  scan.last = UINT64_MAX;
+  key       = 1001;
+  ASSERT_EQ(aatree_paged_scan(&tree, &key, NULL, paged_visit, &scan), 0);
+  ASSERT_EQ(scan.count, (size_t)(BULK - 501) / 2);
+
+  memset(&scan, 0, sizeof(scan));
+  scan.last = 3002;
+  ASSERT_EQ(aatree_paged_scan(&tree, NULL, NULL, paged_visit, &scan), 1);
+  ASSERT_EQ(scan.count, 751u);
+
+  ASSERT_EQ(aatree_paged_sync(&tree), 0);
+
+  /* The synced file opens with the same layout only. */
+  ASSERT_EQ(aatree_paged_open(&tree, fd, 512, sizeof(paged_entry_t), 8,
+                              cmp_u64, memory, size),
+            EINVAL);
+  ASSERT_EQ(aatree_paged_open(&tree, fd, 512, sizeof(paged_entry_t), 0,
+                              cmp_u64, memory, size),
+            0);
+  ASSERT_EQ(aatree_paged_count(&tree), (uint64_t)BULK / 2);
+
+  for (key = 0; key < 2 * BULK; key++)
+  {
+    int found = aatree_paged_search(&tree, &key, AATREE_KEY_EQ, &out);
+
+    ASSERT_EQ(found, key % 4 == 2);
+    ASSERT_TRUE(!found || out.value == key * 3);
+  }
+
+  /* Freed slots are reused before the file grows. */
+  key = tree.header.pages;
+
+  for (i = 0; i < BULK / 2; i++)
+  {
+    entry.key   = i * 4;
+    entry.value = entry.key * 3;
+    ASSERT_EQ(aatree_paged_insert(&tree, &entry), 0);
+  }
+
+  ASSERT_EQ(tree.header.pages, key);
+
+  memset(&scan, 0, sizeof(scan));
+  scan.last = UINT64_MAX;
+  ASSERT_EQ(aatree_paged_scan(&tree, NULL, NULL, paged_visit, &scan), 0);
+  ASSERT_EQ(scan.count, (size_t)BULK - 1);
+
+  close(fd);
+  free(memory);
+}
+
+/* Entry of a buffered tree */
+typedef struct buffered
+{
+  aatree_lsm_node_t node;
+  int               key;
+  int               value;
+} buffered_t;
+
+#define LSM_KEYS 1000
+#define LSM_OPS 20000
+
+typedef struct lsm_model
+{
+  int values[LSM_KEYS];
+  int released;
+  int next;
+} lsm_model_t;
+
+static void lsm_release(void *entry, void *arg)
+{
+  (void)entry;
+  ((lsm_model_t *)arg)->released++;
+}
+
+static int lsm_visit(void *entry, void *arg)
+{
+  buffered_t  *b     = entry;
+  lsm_model_t *model = arg;
+
+  /* Entries come in order and match the model. */
+  for (; model->next < b->key; model->next++)
+    if (model->values[model->next] >= 0)
+      return -1;
+
+  if (model->values[b->key] != b->value)
+    return -1;
+
+  model->next = b->key + 1;
+
+  return 0;
+}
+
+static int lsm_stop(void *entry, void *arg)
+{
+  (void)entry;
+  (void)arg;
+
+  return 7;
+}
+
+UTEST(lsm, write_buffer)
+{
+  buffered_t  *entries = calloc(LSM_OPS, sizeof(buffered_t));
+  lsm_model_t  model;
+  aatree_lsm_t lsm;
+  uint64_t     state = 0x2545f4914f6cdd1d;
+  int          i, key;
+
+  memset(&model, 0xff, sizeof(model.values));
+  model.released = 0;
+
+  aatree_lsm_init(&lsm, offsetof(buffered_t, node), offsetof(buffered_t, key),
+                  cmp_ints, 64, lsm_release, &model);
+
+  for (i = 0; i < LSM_OPS; i++)
+  {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    entries[i].key   = (int)(state % LSM_KEYS);
+    entries[i].value = i;
+
+    /* A third of the updates are deletes, of keys there or not. */
+    if (state % 3)
+    {
+      aatree_lsm_insert(&lsm, &entries[i]);
+      model.values[entries[i].key] = i;
+    }
+    else
+    {
+      aatree_lsm_delete(&lsm, &entries[i]);
+      model.values[entries[i].key] = -1;
+    }
+
+    if (i % 97)
+      continue;
+
+    for (key = 0; key < LSM_KEYS; key++)
+    {
+      buffered_t *b = aatree_lsm_search(&lsm, &key, AATREE_KEY_EQ);
+
+      ASSERT_EQ(b ? b->value : -1, model.values[key]);
+    }
+
+    /* The nearest live keys on both sides. */
+    key = entries[i].key;
+    {
+      buffered_t *lt = aatree_lsm_search(&lsm, &key, AATREE_KEY_LT);
+      buffered_t *ge = aatree_lsm_search(&lsm, &key, AATREE_KEY_GE);
+      int         k;
+
+      for (k = key - 1; k >= 0 && model.values[k] < 0; k--)
+      {
+      }
+
+      ASSERT_EQ(lt ? lt->key : -1, k);
+
+      for (k = key; k < LSM_KEYS && model.values[k] < 0; k++)
+      {
+      }
+
+      ASSERT_EQ(ge ? ge->key : LSM_KEYS, k);
+    }
+
+    /* The keys after the last one visited are not there. */
+    {
+      int lo = 100, hi = LSM_KEYS / 2;
+
+      model.next = lo;
+      ASSERT_EQ(aatree_lsm_scan(&lsm, &lo, &hi, lsm_visit, &model), 0);
+
+      for (; model.next <= hi; model.next++)
+        ASSERT_LT(model.values[model.next], 0);
+    }
+  }
+
+  ASSERT_GT(lsm.merges, 0u);
+
+  aatree_lsm_merge(&lsm);
+  ASSERT_EQ(lsm.buffer.root, NULL);
+  ASSERT_EQ(aatree_verify(&lsm.tree), EXIT_SUCCESS);
+
+  /* Every entry is either in the tree or released. */
+  for (key = 0, i = 0; key < LSM_KEYS; key++)
+  {
+    buffered_t *b = aatree_lsm_search(&lsm, &key, AATREE_KEY_EQ);
+
+    ASSERT_EQ(b ? b->value : -1, model.values[key]);
+    i += b != NULL;
+  }
+
+  ASSERT_EQ(i + model.released, LSM_OPS);
+  ASSERT_EQ(aatree_lsm_scan(&lsm, NULL, NULL, lsm_stop, NULL), 7);
+
+  free(entries);
+}
+
+#define FEED_KEYS 2000
+#define FEED_OPS 20000
+
+/* Feed read by a follower, its entries and the changes seen */
+typedef struct follower
+{
+  memory_file_t *file;
+  stored_t      *entries;
+  size_t         used;
+  size_t         released;
+  size_t         changes;
+  int            misplaced;
+} follower_t;
+
+static int feed_read(void *data, size_t size, void *arg)
+{
+  return file_read(data, size, ((follower_t *)arg)->file);
+}
+
+/* The name goes as its length and bytes, the key is kept apart */
+static size_t feed_serialize(const void *entry, void *data, size_t size,
+                             void *arg)
+{
+  const stored_t *s      = entry;
+  size_t          length = strlen(s->name);
+  uint8_t        *out    = data;
+
+  (void)arg;
+
+  if (size < 1 + length)
+    return AATREE_IO_NO_ROOM;
+
+  out[0] = (uint8_t)length;
+  memcpy(out + 1, s->name, length);
+
+  return 1 + length;
+}
+
+static int feed_deserialize(void *entry, const void *data, size_t size,
+                            void *arg)
+{
+  stored_t      *s  = entry;
+  const uint8_t *in = data;
+
+  (void)arg;
+
+  if (!size || size != 1u + in[0] || in[0] >= sizeof(s->name))
+    return EINVAL;
+
+  memcpy(s->name, in + 1, in[0]);
+  s->name[in[0]] = '\0';
+  s->key         = UINT64_MAX;
+
+  return 0;
+}
+
+static void *feed_alloc(void *arg)
+{
+  follower_t *f = arg;
+
+  return &f->entries[f->used++];
+}
+
+static void feed_release(void *entry, void *arg)
+{
+  (void)entry;
+  ((follower_t *)arg)->released++;
+}
+
+/* The neighbours are the ones around the entry in the tree */
+static void feed_check(const aatree_change_t *change, void *arg)
+{
+  follower_t     *f     = arg;
+  const stored_t *entry = change->entry;
+  const stored_t *prev  = change->prev;
+  const stored_t *next  = change->next;
+
+  f->changes++;
+
+  if ((prev && prev->key >= entry->key) || (next && next->key <= entry->key))
+    f->misplaced++;
+
+  if (change->op == AATREE_FEED_DELETE)
+  {
+    if ((prev ? aatree_next(change->tree, (aatree_node_t *)&prev->node)
+              : aatree_first(change->tree)) != change->next)
+      f->misplaced++;
+  }
+  else if (aatree_prev(change->tree, (aatree_node_t *)&entry->node) != prev
+           || aatree_next(change->tree, (aatree_node_t *)&entry->node) != next)
+  {
+    f->misplaced++;
+  }
+
+  if ((change->op == AATREE_FEED_REPLACE) != (change->old != NULL))
+    f->misplaced++;
+}
+
+static void feed_ignore(const aatree_change_t *change, void *arg)
+{
+  (void)change;
+  (void)arg;
+}
+
+UTEST(feed, replication)
+{
+  stored_t            *entries = calloc(FEED_OPS, sizeof(stored_t));
+  uint8_t              buffer[512], scratch[512];
+  memory_file_t        file;
+  follower_t           follower;
+  aatree_feed_t        feed;
+  aatree_feed_writer_t writer;
+  aatree_t             replica;
+  aatree_node_t       *a, *b;
+  uint64_t             state = 0x9e3779b97f4a7c15;
+  uint64_t             seq   = 0;
+  size_t               released;
+  int                  i;
+
+  memset(&file, 0, sizeof(file));
+  memset(&follower, 0, sizeof(follower));
+  follower.file    = &file;
+  follower.entries = calloc(FEED_OPS, sizeof(stored_t));
+
+  aatree_feed_init(&feed, offsetof(stored_t, node), offsetof(stored_t, key),
+                   cmp_u64);
+  aatree_init_tree(&replica, offsetof(stored_t, node),
+                   offsetof(stored_t, key), cmp_u64);
+  aatree_feed_writer_init(&writer, file_write, feed_serialize, &file, buffer,
+                          sizeof(buffer), AATREE_IO_INT_KEYS, 0);
+
+  ASSERT_EQ(aatree_feed_observe(&feed, feed_check, &follower), 0);
+  ASSERT_EQ(aatree_feed_observe(&feed, aatree_feed_record, &writer), 0);
+
+  /* The observers are limited, a removed one is not called. */
+  ASSERT_EQ(aatree_feed_observe(&feed, feed_ignore, NULL), 0);
+  ASSERT_EQ(aatree_feed_observe(&feed, feed_ignore, &file), 0);
+  ASSERT_EQ(aatree_feed_observe(&feed, feed_ignore, &seq), ENOSPC);
+  aatree_feed_unobserve(&feed, feed_ignore, NULL);
+  aatree_feed_unobserve(&feed, feed_ignore, &file);
+  ASSERT_EQ(feed.count, 2u);
+
+  for (i = 0; i < FEED_OPS; i++)
+  {
+    stored_t *found = NULL;
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    entries[i].key = state % FEED_KEYS * 7919;
+    sprintf(entries[i].name, "v%d", i);
+    aatree_init_node(&entries[i].node);
+
+    if (!(found = aatree_search(&feed.tree, &entries[i].key, AATREE_KEY_EQ)))
+      ASSERT_EQ(aatree_feed_insert(&feed, &entries[i].node), NULL);
+    else if (state >> 32 & 1)
+      aatree_feed_delete(&feed, &found->node);
+    else
+      aatree_feed_replace(&feed, &found->node, &entries[i].node);
+  }
+
+  ASSERT_EQ(aatree_feed_flush(&writer), 0);
+  ASSERT_EQ(follower.changes, (size_t)FEED_OPS);
+  ASSERT_EQ(follower.misplaced, 0);
+  ASSERT_EQ(writer.seq, (uint64_t)FEED_OPS);
+  ASSERT_GT(file.writes, 1u);
+
+  /* The follower applies block after block up to the end of the feed. */
+  while (aatree_feed_apply(&replica, feed_read, feed_deserialize, feed_alloc,
+                           feed_release, &follower, scratch, sizeof(scratch),
+                           AATREE_IO_INT_KEYS, &seq)
+         == 0)
+  {
+  }
+
+  ASSERT_EQ(seq, (uint64_t)FEED_OPS);
+  ASSERT_EQ(aatree_verify(&replica), EXIT_SUCCESS);
+
+  for (a = feed.tree.first, b = replica.first; a && b;
+       a = aatree_next_node(a), b = aatree_next_node(b))
+  {
+    stored_t *x = aatree_node_entry(&feed.tree, a);
+    stored_t *y = aatree_node_entry(&replica, b);
+
+    ASSERT_EQ(x->key, y->key);
+    ASSERT_STREQ(x->name, y->name);
+  }
+
+  ASSERT_EQ(a, NULL);
+  ASSERT_EQ(b, NULL);
+
+  /* Blocks delivered again change nothing. */
+  file.pos = 0;
+  released = follower.released;
+
+  while (aatree_feed_apply(&replica, feed_read, feed_deserialize, feed_alloc,
+                           feed_release, &follower, scratch, sizeof(scratch),
+                           AATREE_IO_INT_KEYS, &seq)
+         == 0)
+  {
+  }
+
+  ASSERT_EQ(follower.released, released);
+  ASSERT_EQ(seq, (uint64_t)FEED_OPS);
+
+  /* A follower missing the first block cannot go on. */
+  seq      = 0;
+  file.pos = AATREE_FEED_BLOCK_HEADER + (file.data[4] | file.data[5] << 8);
+  ASSERT_EQ(aatree_feed_apply(&replica, feed_read, feed_deserialize,
+                              feed_alloc, feed_release, &follower, scratch,
+                              sizeof(scratch), AATREE_IO_INT_KEYS, &seq),
+            ERANGE);
+
+  /* A corrupted block is rejected as a whole. */
+  file.pos = 0;
+  file.data[AATREE_FEED_BLOCK_HEADER + 3] ^= 0x10;
+  ASSERT_EQ(aatree_feed_apply(&replica, feed_read, feed_deserialize,
+                              feed_alloc, feed_release, &follower, scratch,
+                              sizeof(scratch), AATREE_IO_INT_KEYS, &seq),
+            EBADMSG);
+  ASSERT_EQ(seq, 0u);
+
+  /* So is one with the record count corrupted. */
+  file.pos = 0;
+  file.data[AATREE_FEED_BLOCK_HEADER + 3] ^= 0x10;
+  file.data[8] ^= 0x01;
+  ASSERT_EQ(aatree_feed_apply(&replica, feed_read, feed_deserialize,
+                              feed_alloc, feed_release, &follower, scratch,
+                              sizeof(scratch), AATREE_IO_INT_KEYS, &seq),
+            EBADMSG);
+  ASSERT_EQ(seq, 0u);
+
+  /* A record larger than a block stops the writer. */
+  aatree_feed_writer_init(&writer, file_write, feed_serialize, &file, buffer,
+                          AATREE_FEED_BLOCK_HEADER + 8, 0, 0);
+  aatree_feed_unobserve(&feed, feed_check, &follower);
+  aatree_feed_delete(&feed, feed.tree.first);
+  ASSERT_EQ(writer.error, EMSGSIZE);
+
+  free(follower.entries);
+  free(file.data);
+  free(entries);
+}
+
+/* Keys reported by a diff, which must come in order */
+typedef struct diff_log
+{
+  uint64_t last;
+  int      added;
+  int      removed;
+  int      changed;
+  int      unordered;
+} diff_log_t;
+
+static size_t diff_compares;
+
+static int cmp_counted(const void *a, const void *b)
+{
+  diff_compares++;
+  return cmp_u64(a, b);
+}
+
+static void diff_seen(diff_log_t *log, uint64_t key)
+{
+  if (key <= log->last && (log->added || log->removed || log->changed))
+    log->unordered++;
+
+  log->last = key;
+}
+
+static int diff_added(void *entry, void *arg)
+{
+  diff_seen(arg, ((stored_t *)entry)->key);
+  ((diff_log_t *)arg)->added++;
+  return 0;
+}
+
+static int diff_removed(void *entry, void *arg)
+{
+  diff_seen(arg, ((stored_t *)entry)->key);
+  ((diff_log_t *)arg)->removed++;
+  return 0;
+}
+
+static int diff_changed(void *old, void *entry, void *arg)
+{
+  if (strcmp(((stored_t *)old)->name, ((stored_t *)entry)->name))
+  {
+    diff_seen(arg, ((stored_t *)entry)->key);
+    ((diff_log_t *)arg)->changed++;
+  }
+
+  return 0;
+}
+
+static int diff_stop(void *entry, void *arg)
+{
+  (void)entry;
+  (void)arg;
+
+  return 5;
+}
+
+UTEST(diff, trees_and_versions)
+{
+  stored_t        *old     = calloc(BULK, sizeof(stored_t));
+  stored_t        *new     = calloc(BULK, sizeof(stored_t));
+  uint64_t         lo      = 1000;
+  uint64_t         hi      = 2000;
+  aatree_t         a, b;
+  aatree_persist_t tree;
+  aatree_pnode_t  *snap;
+  diff_log_t       log;
+  int              i;
+
+  aatree_init_tree(&a, offsetof(stored_t, node), offsetof(stored_t, key),
+                   cmp_u64);
+  aatree_init_tree(&b, offsetof(stored_t, node), offsetof(stored_t, key),
+                   cmp_u64);
+
+  /* The second tree lacks multiples of 5, has multiples of 7 the first one
+   * lacks, and renames multiples of 11. */
+  for (i = 0; i < BULK; i++)
+  {
+    old[i].key = new[i].key = i;
+    sprintf(old[i].name, "%d", i);
+    sprintf(new[i].name, i % 11 ? "%d" : "x%d", i);
+
+    if (i % 7)
+      ASSERT_EQ(aatree_insert(&a, &old[i].node), NULL);
+
+    if (i % 5)
+      ASSERT_EQ(aatree_insert(&b, &new[i].node), NULL);
+  }
+
+  memset(&log, 0, sizeof(log));
+  ASSERT_EQ(aatree_diff(&a, &b, NULL, NULL, diff_added, diff_removed,
+                        diff_changed, &log),
+            0);
+
+  for (i = 0; i < BULK; i++)
+  {
+    log.added   -= !(i % 7) && i % 5;
+    log.removed -= i % 7 && !(i % 5);
+    log.changed -= i % 7 && i % 5 && !(i % 11);
+  }
+
+  ASSERT_EQ(log.added, 0);
+  ASSERT_EQ(log.removed, 0);
+  ASSERT_EQ(log.changed, 0);
+  ASSERT_EQ(log.unordered, 0);
+
+  /* The keys out of the range are not looked at. */
+  memset(&log, 0, sizeof(log));
+  ASSERT_EQ(aatree_diff(&a, &b, &lo, &hi, diff_added, diff_removed,
+                        diff_changed, &log),
+            0);
+  ASSERT_EQ(log.unordered, 0);
+
+  for (i = lo; i <= (int)hi; i++)
+    log.added -= (i % 7 == 0) != (i % 5 == 0);
+
+  ASSERT_EQ(log.added + log.removed, 0);
+  ASSERT_LE(log.last, hi);
+  ASSERT_EQ(aatree_diff(&a, &b, NULL, NULL, diff_stop, NULL, NULL, NULL), 5);
+  ASSERT_EQ(aatree_diff(&a, &a, NULL, NULL, diff_stop, diff_stop, NULL, NULL),
+            0);
+
+  /* Versions of a persistent tree differ by a few updates. */
+  aatree_persist_init(&tree, offsetof(stored_t, key), cmp_counted,
+                      alloc_pnode, free_pnode, NULL);
+
+  for (i = 0; i < BULK; i++)
+    ASSERT_EQ(aatree_persist_insert(&tree, &old[i]), NULL);
+
+  snap = aatree_persist_snapshot(&tree);
+
+  for (i = 1; i < BULK - 2; i += BULK / 10)
+  {
+    ASSERT_EQ(aatree_persist_delete(&tree, &old[i].key), &old[i]);
+    ASSERT_EQ(aatree_persist_delete(&tree, &old[i + 1].key), &old[i + 1]);
+    ASSERT_EQ(aatree_persist_insert(&tree, &new[i + 1]), NULL);
+  }
+
+  new[BULK - 1].key = BULK;
+  ASSERT_EQ(aatree_persist_insert(&tree, &new[BULK - 1]), NULL);
+
+  memset(&log, 0, sizeof(log));
+  diff_compares = 0;
+  ASSERT_EQ(aatree_persist_diff(&tree, snap, tree.root, NULL, NULL,
+                                diff_added, diff_removed, diff_changed, &log),
+            0);
+  ASSERT_EQ(log.added, 1);
+  ASSERT_EQ(log.removed, 10);
+  ASSERT_EQ(log.unordered, 0);
+  ASSERT_LT(diff_compares, (size_t)BULK / 10);
+
+  /* Entries of the same key are renamed where the key is a multiple of 11. */
+  for (i = 1, lo = 0; i < BULK - 2; i += BULK / 10)
+    lo += !((i + 1) % 11);
+
+  ASSERT_EQ(log.changed, (int)lo);
+
+  lo = BULK / 2;
+  hi = BULK;
+  memset(&log, 0, sizeof(log));
+  ASSERT_EQ(aatree_persist_diff(&tree, tree.root, snap, &lo, &hi, diff_added,
+                                diff_removed, NULL, &log),
+            0);
+  ASSERT_EQ(log.added, 5);
+  ASSERT_EQ(log.removed, 1);
+  ASSERT_EQ(aatree_persist_diff(&tree, snap, tree.root, NULL, NULL, NULL,
+                                diff_stop, NULL, NULL),
+            5);
+
+  diff_compares = 0;
+  ASSERT_EQ(aatree_persist_diff(&tree, snap, snap, NULL, NULL, diff_stop,
+                                diff_stop, NULL, NULL),
+            0);
+  ASSERT_EQ(diff_compares, 0u);
+
+  aatree_persist_release(&tree, snap);
+  aatree_persist_clear(&tree);
+  ASSERT_EQ(live_pnodes, 0);
+
+  free(new);
+  free(old);
+}
+
 UTEST_MAIN();